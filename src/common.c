@@ -1,4 +1,5 @@
 #include "common.h"
+#include "rowops.h"
 
 /* Matrix row operations */
 
@@ -27,53 +28,35 @@ void flip_bit (uint64_t *m, int pos){
 }
 
 /* This will take two rows, and xor the second one into the first. 'len' is the number of 64-bit
- * ints in a row. There are assembly routines that take advantage of SSE instructions to do this
- * slightly more efficiently than this code, so this routine is only included in C if USE_ASM hasn't
- * been defined.
+ * ints in a row. This and the other row operations below go through the kernels in rowops.c, which use
+ * the widest vector instructions the CPU has.
 */
-void xor_row (uint64_t *res, uint64_t *op, int len){
-#ifdef USE_ASM_XOR
-	_asm_xor_row (res, op, len);
-#else
-	for (int i=0; i<len; i++){
-		res[i] = res[i] ^ op[i];
-	}
-#endif
+void xor_row (uint64_t *res, const uint64_t *op, int len){
+	rowops.xor_row (res, op, len);
+}
+
+/* Xor nops rows into res. One pass over res instead of nops of them. */
+void xor_rows (uint64_t *res, const uint64_t **ops, int nops, int len){
+	rowops.xor_rows (res, ops, nops, len);
 }
 
 /* Find the rightmost set bit in a row of the matrix, starting at column max_i. A value smaller than
  * the length for max_i is specified in some places in the matrix solving code when it is already 
- * known that the rightmost 1 must be to the left of a certain place. */
+ * known that the rightmost 1 must be to the left of a certain place. (The rest of the 64-bit block that
+ * max_i is in must be 0, too.) Returns -1 for the zero row. */
 int rightmost_1 (uint64_t *m, int max_i){
-	int block = max_i / 64;
-	// first skip over all of the leading 0 blocks.
-	while (block > 0 && m[block] == 0)  block--;
-	if (m[block] == 0) return -1;
-
-	// now we need to determine the rightmost 1 in m[block].
-#ifdef USE_ASM_BITSCAN	// then we can use our bitscan() function. 
-	return ( _bitscan(m[block])) + 64 * block;
-#else
-	// if we don't have asm, we do it ourselves in C.
-	uint64_t x = m[block];
-	
-	int pos = 0;
-	while ((x & (1ull << 63)) == 0){
-		pos++;
-		x = x << 1;
-	}
-	int res =  (63 - pos) + 64 * block;
-	return res;
-#endif
+	return rowops.highest_bit (m, max_i / 64 + 1);
 }
 
 /* Tests whether this row is the zero vector. This will alert us to the presence of a linear dependency
  * in the matrix, and hence a congruence of squares */
 int is_zero_vec (uint64_t *m, int len){
-	for (int i=0; i<len; i++){
-		if (m[i] != 0) return 0;
-	}
-	return 1;
+	return rowops.is_zero (m, len);
+}
+
+/* The number of set bits in the row */
+int row_popcount (uint64_t *m, int len){
+	return rowops.popcount (m, len);
 }
 
 /* Debugging routine for printing out a matrix row in binary */
@@ -88,6 +71,50 @@ void print_row (uint64_t *m, int max_i){
 	fprintf(stderr, "\n");
 }
 
+/* Sparse matrix rows. Building, filtering and merging the matrix all work on rows stored as sorted lists of
+ * the columns with an odd exponent, so they only ever need memory in proportion to the number of nonzeros;
+ * a dense row for every relation would take fb_len^2 / 8 bytes. */
+
+static int by_col (const void *a, const void *b){
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return x < y ? -1 : (x > y);
+}
+
+/* Sort a list of columns and drop the ones that occur an even number of times (we only care about
+ * exponents mod 2). Returns the new length. */
+uint32_t sparse_row_normalize (uint32_t *cols, uint32_t n){
+	qsort (cols, n, sizeof (uint32_t), by_col);
+	uint32_t w = 0;
+	for (uint32_t i=0; i < n; i++){
+		if (w > 0 && cols[w-1] == cols[i]){
+			w--;
+		} else {
+			cols[w++] = cols[i];
+		}
+	}
+	return w;
+}
+
+/* The sparse equivalent of xor_row: the symmetric difference of two sorted lists, written to res (which
+ * must have room for na + nb). Returns the length of the result. */
+uint32_t sparse_row_xor (uint32_t *res, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb){
+	uint32_t i = 0, j = 0, n = 0;
+	while (i < na && j < nb){
+		if (a[i] < b[j]){
+			res[n++] = a[i++];
+		} else if (a[i] > b[j]){
+			res[n++] = b[j++];
+		} else {
+			i++;
+			j++;
+		}
+	}
+	while (i < na) res[n++] = a[i++];
+	while (j < nb) res[n++] = b[j++];
+	return n;
+}
+
 /* Hashtable functions */
 
 /* A hashtable is used to store the partial relations. Partials are hashed based on their cofactor,
@@ -178,65 +205,153 @@ uint32_t ht_count (hashtable_t *ht){
 	return res;
 }
 
+/* The set of relations for catching duplicates. It starts with room for nexpected relations at half load, and
+ * doubles whenever it gets half full, so the linear probing stays short and the memory follows the relations
+ * actually found rather than a guess at how many partials there will be. If it can't grow, it keeps taking
+ * relations until it is all but full, and lets the rest through unchecked; the sieve stops on the error
+ * anyway (see ns_error). */
+int relset_init (relset_t *s, uint32_t nexpected){
+	uint64_t nslots = 1 << 12;
+	while (nslots < 2 * (uint64_t) nexpected){
+		nslots <<= 1;
+	}
+	s->mask = nslots - 1;
+	s->count = 0;
+	s->hashes = (uint64_t *) malloc (nslots * sizeof (uint64_t));
+	s->rels = (rel_t **) calloc (nslots, sizeof (rel_t *));
+	if (s->hashes == NULL || s->rels == NULL){
+		relset_free (s);
+		return 0;
+	}
+	return 1;
+}
+
+void relset_free (relset_t *s){
+	free (s->hashes);
+	free (s->rels);
+	s->hashes = NULL;
+	s->rels = NULL;
+	s->count = 0;
+}
+
+static void relset_grow (relset_t *s, nsieve_t *ns){
+	uint64_t oldmask = s->mask;
+	uint64_t *hashes = s->hashes;
+	rel_t **rels = s->rels;
+	uint64_t *newhashes = (uint64_t *) malloc ((2 * oldmask + 2) * sizeof (uint64_t));
+	rel_t **newrels = (rel_t **) calloc (2 * oldmask + 2, sizeof (rel_t *));
+	if (newhashes == NULL || newrels == NULL){
+		free (newhashes);
+		free (newrels);
+		ns_error_locked (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	s->mask = 2 * oldmask + 1;
+	s->hashes = newhashes;
+	s->rels = newrels;
+	for (uint64_t i=0; i <= oldmask; i++){
+		if (rels[i] == NULL) continue;
+		uint64_t slot = hashes[i] & s->mask;
+		while (s->rels[slot] != NULL){
+			slot = (slot + 1) & s->mask;
+		}
+		s->hashes[slot] = hashes[i];
+		s->rels[slot] = rels[i];
+	}
+	free (hashes);
+	free (rels);
+}
+
+/* Caller holds ns->lock. */
+int relset_add (relset_t *s, rel_t *rel, nsieve_t *ns){
+	if (s->rels == NULL || s->count >= s->mask) return 0;	// it couldn't be allocated (or grown), and ns->error says so.
+	rel_id_t id, other;
+	rel_get_id (rel, &id, ns);
+	uint64_t hash = rel_id_hash (&id);
+	uint64_t slot = hash & s->mask;
+	while (s->rels[slot] != NULL){
+		if (s->hashes[slot] == hash){
+			rel_get_id (s->rels[slot], &other, ns);
+			if (rel_id_equal (&id, &other)) return 1;
+		}
+		slot = (slot + 1) & s->mask;
+	}
+	s->hashes[slot] = hash;
+	s->rels[slot] = rel;
+	if (++ s->count > s->mask / 2 && ns->error == 0) relset_grow (s, ns);
+	return 0;
+}
+
 /* Generic auxillary functions */
 
 #define POCKLINGTON
 #define TONELLI_SHANKS
 
-/* Finds the modular square root of k (mod p). This will use either Pocklington's algorithm, if
- * p is congruent to 3 (mod 4) or 5 (mod 8), and the Tonelli-Shanks algorithm otherwise. What 
+/* a * b (mod p) and b^e (mod p), for p < 2^32 */
+static inline uint32_t mulmod32 (uint32_t a, uint32_t b, uint32_t p){
+	return (uint32_t) (((uint64_t) a * b) % p);
+}
+
+uint32_t powmod32 (uint32_t b, uint32_t e, uint32_t p){
+	uint32_t res = 1 % p;
+	b %= p;
+	while (e > 0){
+		if (e & 1) res = mulmod32 (res, b, p);
+		b = mulmod32 (b, b, p);
+		e >>= 1;
+	}
+	return res;
+}
+
+/* The Jacobi symbol (a/n) for odd n, by the binary algorithm; for prime n this is the Legendre symbol. */
+int jacobi32 (uint32_t a, uint32_t n){
+	int res = 1;
+	a %= n;
+	while (a != 0){
+		while ((a & 1) == 0){
+			a >>= 1;
+			if ((n & 7) == 3 || (n & 7) == 5) res = -res;
+		}
+		uint32_t t = a;
+		a = n;
+		n = t;
+		if ((a & 3) == 3 && (n & 3) == 3) res = -res;
+		a %= n;
+	}
+	return n == 1 ? res : 0;
+}
+
+/* Finds the modular square root of a (mod p), for prime p. This will use either Pocklington's algorithm,
+ * if p is congruent to 3 (mod 4) or 5 (mod 8), and the Tonelli-Shanks algorithm otherwise. What 
  * algorithms are used can be changed by the #defines above; if one of those symbols is not defined,
  * that algorithm is not used. There is a brute-force basecase implemented, so something that
- * produces a correct result (eventually) will always be there.
+ * produces a correct result (eventually) will always be there. Everything is done in 64-bit arithmetic;
+ * this gets called for every prime in the factor base, and used to be most of the startup time when it
+ * was done with GMP.
 */
-uint32_t find_root (mpz_t k, uint32_t p){	// finds modular square root of k (mod p)
-	mpz_t pol, temp, temp2;	// the only reason the names are like this is because that's how they 
-				// were in the place I stole this from (my old QS code).
-	mpz_inits (pol, temp, temp2, NULL);
-
-	mpz_mod_ui (temp, k, p);
-	uint32_t a = mpz_get_ui (temp);
-	if (p == 2){
+uint32_t sqrt_mod (uint32_t a, uint32_t p){
+	a %= p;
+	if (p == 2 || a == 0){
 		return a;
 	}
-	uint32_t res = 0;
 #ifdef POCKLINGTON
-	// This Pocklington code is stolen from my previous quadratic sieve implementation.
 	if (p % 4 == 3){	// use Case 1 of Pocklington's algorithm.
-		uint32_t m = p/4;
-		mpz_set_ui(pol, p);
-		mpz_powm_ui (temp, temp, m+1, pol);
-		return mpz_get_ui (temp);
+		return powmod32 (a, p/4 + 1, p);
 	} else if (p % 8 == 5){	// Case 2
 		uint32_t m = p/8;
-		mpz_set_ui (pol, p);
-		mpz_powm_ui (temp2, temp, 2*m+1, pol);
-		if (mpz_cmp_ui(temp2, 1) == 0){
-			mpz_powm_ui(temp2, temp, m+1, pol);
-			res = mpz_get_ui (temp2);
-			mpz_clears (pol, temp, temp2, NULL);
-			return res;
+		if (powmod32 (a, 2*m+1, p) == 1){
+			return powmod32 (a, m+1, p);
 		} else {
-			mpz_mul_ui(temp, temp, 4);
-			mpz_powm_ui(temp2, temp, m+1, pol);
-			if (mpz_divisible_ui_p(temp2, 2)){
-				res = mpz_get_ui(temp2)/2;
-				mpz_clears (pol, temp, temp2, NULL);
-				return res;
-			} else {
-				res = (mpz_get_ui(temp2)+p)/2;
-				mpz_clears (pol, temp, temp2, NULL);
-				return res;
-			}
+			uint32_t t = powmod32 (mulmod32 (a, 4, p), m+1, p);
+			return t % 2 == 0 ? t/2 : (uint32_t) (((uint64_t) t + p)/2);
 		}
 	}
-
 #endif
 
 #ifdef TONELLI_SHANKS
 	/* Based on algorithm description on programmingpraxis.com/2012/11/23/tonelli-shanks-algorithm/ */
 	/* Write p as s * 2^e + 1, for the largest possible such e. We seek sqrt(a) (mod p). 
-	 * Find n such that n^((p-1)/2) ~= -1 (mod p)	(do this by trial and error until one is found, starting with n=2)
+	 * Find n such that n^((p-1)/2) ~= -1 (mod p)	(a quadratic nonresidue; we try n=2, 3, ... in turn)
 	 * Then set x = a^((s+1)/2) % p,
 	 * 	    b = a^s % p
 	 * 	    g = n^s % p
@@ -255,70 +370,51 @@ uint32_t find_root (mpz_t k, uint32_t p){	// finds modular square root of k (mod
 		s /= 2;
 		e ++;
 	}
-	mpz_set_ui (pol, p);	// this will just hold a mpz version of p.
-	// find a suitable n...
-	mpz_set_ui(temp2, 2);
-	mpz_powm_ui (temp, temp2, (p-1)/2, pol);
-	while (mpz_cmp_ui (temp, p-1) != 0){
-		mpz_add_ui (temp2, temp2, 1);
-		mpz_powm_ui (temp, temp2, (p-1)/2, pol);
-	}
-	// temp2 now contains a suitable n.
-	
-	mpz_t x, b, g;
-	mpz_inits (x, b, g, NULL);
-	mpz_set_ui (temp, a);
-	mpz_powm_ui (x, temp, (s+1)/2, pol);	// x = a^((s+1)/2) mod p
-	mpz_powm_ui (b, temp, s, pol);		// b = a^s mod p
-	mpz_powm_ui (g, temp2, s, pol);		// g = n^s mod p
+	uint32_t n = 2;
+	while (jacobi32 (n, p) != -1){
+		n++;
+	}
+	uint32_t x = powmod32 (a, (s+1)/2, p);
+	uint32_t b = powmod32 (a, s, p);
+	uint32_t g = powmod32 (n, s, p);
 	uint32_t r = e;
-	
-	// now the main loop begins. We will use temp2 to hold b^2^m, since we don't need n anymore.
-	uint32_t m;
-tshanks_mainloop:
-	m = 0;
-	mpz_set (temp, b);	// temp = b^2^0 = b^1 = b
-	while (mpz_cmp_ui (temp, 1) != 0){
-		mpz_mul (temp, temp, temp);
-		mpz_mod (temp, temp, pol);
-		m++;
-	}
-	if (m == 0){
-		// we're done; output x.
-		uint32_t res = mpz_get_ui (x);
-		mpz_clears (x, b, g, pol, temp, temp2, NULL);
-		return res;
-	} else {
-		// x *= g^2^(r-m-1)
-		// b *= g^2^(r-m)
-		// g  = g^2^(r-m)
-		// r  = m
-		mpz_ui_pow_ui (temp, 2, r-m-1);
-		mpz_powm (temp, g, temp, pol);	// temp = g^2^(r-m-1)
-		mpz_mul (x, x, temp);		// multiply in to x
-		mpz_mod (x, x, pol);
-		mpz_mul (temp, temp, temp);	// temp now = g^2^(r-m)
-		mpz_mod (temp, temp, pol);	// reduce mod p
-		mpz_mul (b, b, temp);		// multiply in to b
-		mpz_mod (b, b, pol);
-		mpz_set (g, temp);		// set g
+	while (1){
+		uint32_t m = 0;
+		uint32_t t = b;		// b^2^m
+		while (t != 1){
+			t = mulmod32 (t, t, p);
+			m++;
+			if (m == r) return -1;	// a is not a square; this should not happen.
+		}
+		if (m == 0){
+			return x;
+		}
+		t = g;
+		for (uint32_t i=0; i < r-m-1; i++){
+			t = mulmod32 (t, t, p);	// t = g^2^(r-m-1)
+		}
+		x = mulmod32 (x, t, p);
+		g = mulmod32 (t, t, p);		// g^2^(r-m)
+		b = mulmod32 (b, g, p);
 		r = m;
 	}
-	goto tshanks_mainloop;
-
 #endif
-	mpz_clears (pol, temp, temp2, NULL);
 
 /* If we're here, none of the other algorithms were applicable / enabled for this value of p, so 
  * we proceed with the brute force method: try each t < p/2; if t*t == a (mod p), output t. */
 	uint32_t t = 0;
-	while ( t*t % p != a && t < p/2 + 1 ){
+	while (mulmod32 (t, t, p) != a && t < p/2 + 1){
 		t ++;
 	}
-	if (t*t%p == a) return t;
+	if (mulmod32 (t, t, p) == a) return t;
 	return -1;	// this should not happen, since we should only be calling this once we've confirmed (a/p) = 1.
 }
 
+/* The square root of k (mod p) */
+uint32_t find_root (mpz_t k, uint32_t p){
+	return sqrt_mod (mpz_fdiv_ui (k, p), p);
+}
+
 // compute x (mod p), according to the mathematical definition.
 inline uint32_t mod (int32_t x, uint32_t p){	
 	if (x > 0){
@@ -396,16 +492,22 @@ int fl_check (rel_t *rel, nsieve_t *ns){
  * in the list. This is used to build the matrix from the relations. Note that it clears the row 
  * first, so multiplying in additional rows should be done via xors.
 */
-void fl_fillrow (rel_t *rel, uint64_t *row, nsieve_t *ns){
-	clear_row (row, ns);
-	fl_entry_t *entry = rel->factors;
-	while (entry != NULL){
+/* Make the sparse matrix row for a relation: *cols is allocated and filled with the sorted columns that
+ * have an odd exponent. Returns the number of them. */
+uint32_t fl_fillcols (rel_t *rel, uint32_t **cols, nsieve_t *ns){
+	uint32_t n = 0;
+	for (fl_entry_t *entry = rel->factors; entry != NULL; entry = entry->next){
+		n++;
+	}
+	*cols = (uint32_t *) malloc ((n + 1) * sizeof (uint32_t));
+	n = 0;
+	for (fl_entry_t *entry = rel->factors; entry != NULL; entry = entry->next){
 		if (entry->fac > ns->fb_len+1){	// the same check as in fl_check, repeated here.
-			printf ("WARNING - bad factor: %d\n", entry->fac);
+			ns_printf (ns, "WARNING - bad factor: %d\n", entry->fac);
 		}
-		flip_bit (row, entry->fac);
-		entry = entry->next;
+		(*cols)[n++] = entry->fac;
 	}
+	return sparse_row_normalize (*cols, n);
 }
 
 /* Concatenate two factor lists. Very useful for multiplying relations by victims: we can just stick
@@ -428,6 +530,34 @@ void rel_free (rel_t *rel){
 	free (rel);
 }
 
+/* Relation identity, for duplicate detection */
+
+void rel_get_id (rel_t *rel, rel_id_t *id, nsieve_t *ns){
+	id->gvals = rel->poly->group->gvals;
+	id->k = ns->k;
+	id->bmask = rel->poly->group->bmasks[rel->poly->bidx];
+	id->x = rel->x;
+}
+
+/* A 64-bit hash of a relation's identity. The gvals are multiplied together (so this starts out as A mod 2^64)
+ * and then mixed with the b mask and x. */
+uint64_t rel_id_hash (rel_id_t *id){
+	uint64_t h = 1;
+	for (int i=0; i < id->k; i++){
+		h *= id->gvals[i];
+	}
+	h ^= ((uint64_t) id->bmask << 32) | (uint32_t) id->x;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+int rel_id_equal (rel_id_t *a, rel_id_t *b){
+	if (a->x != b->x || a->bmask != b->bmask || a->k != b->k) return 0;
+	return memcmp (a->gvals, b->gvals, a->k * sizeof(uint32_t)) == 0;
+}
+
 /* Do a binary search on the factor base for the prime 'p.' The index returned is 1 more than the
  * index of the prime in the factor base - it is actually returning a matrix row position. Since
  * -1 occupies the first position, everything is shifted.
@@ -460,3 +590,61 @@ int fb_lookup (uint32_t p, nsieve_t *ns){
 	return -p;	// this is so we have some info about what went wrong.
 }
 
+
+/* Output and errors. Messages are formatted with gmp_vsnprintf, into a buffer on the stack unless they're
+ * too long for it, and either printed or handed to the log function whole, with the output's lock held so
+ * that messages from different threads (compute_shares has several) don't run into each other. */
+
+static pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t *out_lock (const ns_output_t *out){
+	return out->lock != NULL ? out->lock : &stdout_lock;
+}
+
+void out_printf (const ns_output_t *out, const char *fmt, ...){
+	va_list ap;
+	va_start (ap, fmt);
+	if (out->log == NULL){
+		pthread_mutex_lock (&stdout_lock);
+		gmp_vprintf (fmt, ap);
+		fflush (stdout);	// not every message ends a line
+		pthread_mutex_unlock (&stdout_lock);
+		va_end (ap);
+		return;
+	}
+	char buf[512];
+	va_list ap2;
+	va_copy (ap2, ap);
+	int len = gmp_vsnprintf (buf, sizeof (buf), fmt, ap);
+	char *msg = buf;
+	if (len >= (int) sizeof (buf)){
+		msg = (char *) malloc (len + 1);
+		if (msg != NULL) gmp_vsnprintf (msg, len + 1, fmt, ap2);
+	}
+	if (msg != NULL){
+		pthread_mutex_lock (out_lock (out));
+		out->log (out->arg, msg);
+		pthread_mutex_unlock (out_lock (out));
+		if (msg != buf) free (msg);
+	}
+	va_end (ap2);
+	va_end (ap);
+}
+
+void out_progress (const ns_output_t *out, int phase, double done){
+	if (out->progress == NULL) return;
+	pthread_mutex_lock (out_lock (out));
+	out->progress (out->arg, phase, done);
+	pthread_mutex_unlock (out_lock (out));
+}
+
+void ns_error (nsieve_t *ns, int code){
+	pthread_mutex_lock (&ns->lock);
+	ns_error_locked (ns, code);
+	pthread_mutex_unlock (&ns->lock);
+}
+
+void ns_error_locked (nsieve_t *ns, int code){
+	if (ns->error == 0) ns->error = code;
+	ns->stop_sieving = 1;
+}
@@ -8,26 +8,27 @@
 #include <math.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>	// before gmp.h, for gmp_vsnprintf
 #include <pthread.h>
 #include <gmp.h>
+#include "libnsieve.h"	// the error codes and the progress phases
+#include "prime.h"
 
 #define KMAX 12			// the maximum allowable value for k. 
 #define BLOCKSIZE 131072	// the size of a sieve block. Entries are 1 byte.
 
-#ifdef USE_ASM
-#  define USE_ASM_XOR
-#  if USE_ASM == 64
-#    define USE_ASM_BITSCAN
-#  endif
-#endif
-
 struct relation;	// this is going to be a rel_t. We have to forward-declare it here; there was a
 			// cyclical dependency between poly_t, poly_group_t, and rel_t.
+struct dist_worker;	// per-process state for distributed sieving; defined in dist.h.
+struct relref;		// a relation inside a mapped relation file; defined in postproc.h.
+struct online;		// the matrix being built while sieving; defined in online.h.
 
 /* This struct defines a group of polynomials that share a common 'A' value. */
 typedef struct {
 	mpz_t a;		// the value of 'A'
 	mpz_t *bvals;		// a list of all possible values of 'b' for this group.
+	uint16_t *bmasks;	// for each b value, which square root of N (mod g_i) was used for each g_i (bit i set
+				// for the second root). This identifies a b value without storing it (see relfile.h).
 	uint32_t gvals[KMAX];	// a list of the primes g_i that were used to produce 'A'
 	uint32_t *ainverses;	// the values of a^-1 (mod p) for each p in the factor base. This stays 
 				// the same for the whole group. Precomputing these saves a lot of time 
@@ -56,6 +57,7 @@ typedef struct {
 				// (and should) be freed after the polynomial is sieved.
 
 	uint32_t M;		// the number of blocks to sieve for this polynomial. 
+	int bidx;		// which of the group's b values this polynomial uses.
 } poly_t;
 
 /* This struct defines state for selecting the values of 'g' that are multiplied together to produce the 
@@ -108,15 +110,30 @@ typedef struct relation {
 	*/
 } rel_t;
 
+/* What makes a relation unique: its polynomial (A through the gvals, B through the b mask) and x. Used to
+ * spot the same relation turning up twice. */
+typedef struct {
+	const uint32_t *gvals;
+	uint32_t k;
+	uint32_t bmask;
+	int32_t x;
+} rel_id_t;
+
 /* One of these structs gets associated with each row of the matrix. There are two pointers to rel_t's;
- * r2 is only non-NULL if this is a partial relation. 'row' contains the actual bits of this row of the
- * matrix, packed into 64-bit ints. If we ever implemented double large primes, this struct would have
- * to be modified to use an arbitrary-sized list of relations.
+ * r2 is only non-NULL if this is a partial relation. 'cols' contains the row of the matrix in sparse form:
+ * the sorted list of the columns with an odd exponent. The dense solver packs these into bits itself. If we
+ * ever implemented double large primes, this struct would have to be modified to use an arbitrary-sized
+ * list of relations.
 */
 typedef struct {
 	rel_t *r1;
 	rel_t *r2;
-	uint64_t *row;
+	uint32_t *cols;
+	uint32_t weight;	// the length of cols
+	const struct relref *f1;	// when post-processing straight from relation files (see postproc.c), these
+	const struct relref *f2;	// take the place of r1 and r2, which are then NULL.
+	uint32_t *hist;		// after merging (see merge.c), the row is the xor of these rows of ns->base,
+	uint32_t nhist;		// and r1, r2, f1 and f2 are unused. NULL before merging.
 } matrel_t;
 
 /* Now we have some structs that define a separate-chaining hashtable for storing the partial relations. */
@@ -132,6 +149,26 @@ typedef struct {
 	ht_entry_t **buckets;
 } hashtable_t;
 
+/* The set of every relation added while sieving, fulls and partials alike, for spotting duplicates: an open
+ * addressing table of the relations, keyed by rel_id_hash, which is kept alongside so that most probes
+ * don't have to look at the relation itself. The relations belong to their poly groups, not to this. */
+typedef struct {
+	uint64_t *hashes;
+	rel_t **rels;		// NULL for an empty slot
+	uint64_t mask;		// the number of slots, minus 1; always a power of 2.
+	uint32_t count;
+} relset_t;
+
+
+/* Where the messages and progress reports go. With no log function, messages go to standard output (as they
+ * do for bin/nsieve); libnsieve.c points both at the caller's callbacks. Any thread may report, so each
+ * message and progress report is made with the lock held. */
+typedef struct {
+	void (*log) (void *arg, const char *msg);
+	void (*progress) (void *arg, int phase, double done);
+	void *arg;
+	pthread_mutex_t *lock;	// NULL for the one lock shared by everything that prints to standard output
+} ns_output_t;
 
 /* Organizes storage of timing data into one place */
 typedef struct {
@@ -154,6 +191,7 @@ typedef struct {
 	unsigned short bvals;	// the number of distinct values for 'B' - given by 2^(k-1).
 	unsigned int  M;	// the sieve length. 
 	float T;		// The sieve threshold will be T * log(lp_bound).
+	int sieve_start;	// the index of the first factor base prime to sieve with; the ones below are skipped (see sieve_block)
 
 	unsigned int  fb_bound;	// upper bound for the primes in the factor base
 	unsigned int  fb_len;	// number of primes in the factor base
@@ -164,6 +202,8 @@ typedef struct {
 	uint32_t *roots;	// the values of sqrt(n) mod p   for each p in the factor base. 
 				// Computed once and for all at the beginning.
 	
+	uint32_t mult_bound;	// select_multiplier tries the multipliers up to this
+	int mult_trials;	// and trial sieves with this many of the best (0 or 1 to go by the score alone)
 	uint32_t multiplier;	// instead of factoring N, factor kN, for a small squarefree k. This enables 
 				// us to pick a factor base that's nicer (more small p s.t. (N/p) = 1).
 
@@ -173,14 +213,37 @@ typedef struct {
 
 	uint32_t row_len;	// number of 64-bit chunks in a row of the matrix.
 	matrel_t *relns;	// this is the list of relations, and also constitutes the matrix. 
+	uint32_t nrows;		// number of rows (relns) in the matrix, once built; filtering will lower this
+	uint32_t ncols;		// number of columns in the matrix; fb_len + 1 until filtering removes the empty ones
+	int target_excess;	// filtering removes rows until there are only this many more rows than columns
+	float merge_density;	// merging stops once the rows have this many nonzeros on average (0 turns it off)
+	matrel_t *base;		// once merged, the filtered matrix relations that the rows of relns are made of
+	uint32_t nbase;
+	int solver;		// SOLVER_AUTO, SOLVER_GAUSS, SOLVER_M4RI or SOLVER_LANCZOS (see matrix.c)
+	int verify;		// re-check the relations and dependencies during the factor deduction
+	mpz_t *factors;		// what deduce_factors split N into: primes, and a composite if it couldn't split that (see factor.c)
+	int nfactors;
 
 	uint32_t lp_bound;	// large prime bound. Only relations whose large prime cofactors are smaller
 				// than this bound are admitted into the hashtable. 
 	hashtable_t partials;	// hashtable for storing partial relations.
+	relset_t seen;		// every relation added so far, for catching duplicates (see add_polygroup_relations)
+	uint32_t ndups;		// number of duplicate relations rejected while sieving
+	poly_group_t **groups;	// every poly group whose relations were added; they own the relations (see nsieve_free)
+	uint32_t ngroups;
+	uint32_t groupcap;
 
 	int nthreads;		// number of sieving threads to use.
+	int gpool_stride;	// how many times to advance the gpool per poly group; the total number of sieving
+				// threads across all processes working on this number (see dist.c).
 	pthread_t *threads;	// pointers to the sieving threads
 	pthread_mutex_t lock;	// mutex to coordinate updates of global state (mostly adding things to the matrix)
+	time_t deadline;	// if nonzero, the sieve threads stop at this time whether or not there are enough relations (see tune.c)
+	struct dist_worker *worker;	// non-NULL only in a worker process that ships its relations to a coordinator.
+	struct online *online;	// non-NULL while the relations are being made into matrix rows as they come in (see online.c).
+	ns_output_t out;	// set by the caller, like nthreads; nsieve_init leaves it alone.
+	int error;		// one of the NSIEVE_E* codes, once something has gone wrong (see ns_error)
+	int stop_sieving;	// set under the lock once there are enough relations (or an error); the sieve threads stop on it.
 
 
 	/* These fields keep track of various properties of the sieving/timing, for informational purposes */
@@ -194,6 +257,11 @@ typedef struct {
 
 } nsieve_t;
 
+#define SOLVER_AUTO    0	// values for ns->solver
+#define SOLVER_GAUSS   1
+#define SOLVER_LANCZOS 2
+#define SOLVER_M4RI    3
+
 /* Each thread needs its own gpool; see nsieve.c for comments on how this works */
 typedef struct {
 	poly_gpool_t gpool;
@@ -204,13 +272,17 @@ typedef struct {
 void clear_row (uint64_t *, nsieve_t *);
 void flip_bit (uint64_t *, int);
 int  get_bit  (uint64_t *, int);
-extern void _asm_xor_row (uint64_t *res, uint64_t *op, int len);
-extern int  _bitscan (uint64_t);
-void xor_row  (uint64_t *res, uint64_t *op, int len);
+void xor_row  (uint64_t *res, const uint64_t *op, int len);
+void xor_rows (uint64_t *res, const uint64_t **ops, int nops, int len);	// xor several rows into res at once
 int  rightmost_1 (uint64_t *, int max_i);
 int  is_zero_vec (uint64_t *, int len);
+int  row_popcount (uint64_t *, int len);
 void print_row (uint64_t *, int max_i);
 
+/* Sparse matrix row functions */
+uint32_t sparse_row_normalize (uint32_t *cols, uint32_t n);	// sorts, and cancels repeated columns in pairs
+uint32_t sparse_row_xor (uint32_t *res, const uint32_t *a, uint32_t na, const uint32_t *b, uint32_t nb);
+
 /* Hashtable functions */
 
 void ht_init (nsieve_t *);
@@ -218,9 +290,24 @@ uint32_t hash_partial (uint32_t cofactor);
 void ht_add (hashtable_t *ht, rel_t *rel);
 uint32_t ht_count (hashtable_t *ht);
 
+/* Relation set functions */
+int  relset_init (relset_t *, uint32_t nexpected);	// 0 if there isn't enough memory
+void relset_free (relset_t *);
+int  relset_add (relset_t *, rel_t *rel, nsieve_t *);	// returns 1 (and leaves the set alone) if an identical relation is there
+
+/* Output and errors */
+void out_printf (const ns_output_t *, const char *fmt, ...);	// printf, with gmp_printf's %Z too
+void out_progress (const ns_output_t *, int phase, double done);
+#define ns_printf(ns, ...) out_printf (&(ns)->out, __VA_ARGS__)
+void ns_error (nsieve_t *, int code);	// records the first error; the sieve threads stop when they see it
+void ns_error_locked (nsieve_t *, int code);	// the same, for a caller that already holds ns->lock
+
 /* Generic auxillary functions */ 
 
 uint32_t find_root (mpz_t a, uint32_t p);	// finds modular square root of a (mod p)
+uint32_t sqrt_mod (uint32_t a, uint32_t p);	// the same, for a single word
+uint32_t powmod32 (uint32_t b, uint32_t e, uint32_t p);
+int jacobi32 (uint32_t a, uint32_t n);	// the Jacobi symbol (a/n), for odd n
 uint32_t mod (int x, uint32_t p);
 uint64_t mpz_get_64 (mpz_t a);
 int mpz_fits_64 (mpz_t a);
@@ -229,10 +316,13 @@ int mpz_fits_64 (mpz_t a);
 void fl_add (rel_t *, uint32_t);
 void fl_free (rel_t *);
 int  fl_check (rel_t *, nsieve_t *);
-void fl_fillrow (rel_t *, uint64_t *row, nsieve_t *ns);
+uint32_t fl_fillcols (rel_t *, uint32_t **cols, nsieve_t *ns);
 void fl_concat (rel_t *res, rel_t *victim);	// appends victim's list to res's list
 void rel_free (rel_t *);
 int  rel_check (rel_t *, nsieve_t *);
+void rel_get_id (rel_t *, rel_id_t *, nsieve_t *);
+uint64_t rel_id_hash (rel_id_t *);
+int  rel_id_equal (rel_id_t *, rel_id_t *);
 
 int  fb_lookup (uint32_t p, nsieve_t *);
 #endif
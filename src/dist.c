@@ -0,0 +1,307 @@
+#define _POSIX_C_SOURCE 200809L	// for mkdir, nanosleep and friends under -std=c99
+#include <sys/stat.h>
+#include <errno.h>
+#include "nsieve.h"
+
+/* Distributed sieving through a shared directory. The directory holds:
+ *
+ * 	job		written by the coordinator: N, the multiplier and the sieve parameters, the number of
+ * 			workers and the number of sieving threads each worker should run.
+ * 	rels.W.S	relation files (see relfile.h) shipped by worker W, numbered S = 0, 1, 2, ... Workers
+ * 			write them as rels.W.S.tmp and rename them when complete, so the coordinator never sees
+ * 			a partial file.
+ * 	done		created by the coordinator once it has enough relations. Workers stop when it appears.
+ *
+ * The A values are split up exactly like they are between threads in a single process: with W workers
+ * of T threads each, there are W*T slots, thread t of worker w starts at slot w*T + t, and every poly group
+ * advances the gpool W*T times. No two threads anywhere ever sieve the same A. Since the relation files
+ * only identify a group by its gvals, the coordinator can rebuild A, B and C for any relation without ever
+ * having sieved it.
+ *
+ * Everything can be tried on one box:
+ * 	nsieve -coordinator /tmp/job -workers 3 N &
+ * 	for w in 0 1 2; do nsieve -worker /tmp/job -wid $w & done
+*/
+
+static void dist_path (char *buf, size_t len, const char *dir, const char *name){
+	snprintf (buf, len, "%s/%s", dir, name);
+}
+
+static int file_exists (const char *path){
+	struct stat st;
+	return stat (path, &st) == 0;
+}
+
+static void nap (long ms){
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep (&ts, NULL);
+}
+
+/* Coordinator side */
+
+/* Write the job file. Workers may already be waiting for it, so it is written to a temporary name first. */
+static void write_job (nsieve_t *ns, const char *dir, int nworkers, int nthreads){
+	char path[4096], tmp[4096];
+	dist_path (path, sizeof(path), dir, "job");
+	dist_path (tmp, sizeof(tmp), dir, "job.tmp");
+
+	mpz_t n;
+	mpz_init (n);
+	mpz_divexact_ui (n, ns->N, ns->multiplier);
+	FILE *f = fopen (tmp, "w");
+	if (f == NULL){
+		printf ("Fatal error: could not write %s.\n", tmp);
+		exit (1);
+	}
+	gmp_fprintf (f, "N %Zd\n", n);
+	fprintf (f, "multiplier %u\nfb_bound %u\nlp_bound %u\nM %u\nT %f\nsmallp %d\nworkers %d\nthreads %d\n", ns->multiplier, ns->fb_bound, ns->lp_bound, ns->M, ns->T, ns->sieve_start, nworkers, nthreads);
+	fclose (f);
+	rename (tmp, path);
+	mpz_clear (n);
+}
+
+/* Add every polygroup batch in one shipped relation file to the nsieve_t. Returns the number of
+ * relations read. */
+static uint32_t consume_file (const char *path, nsieve_t *ns){
+	FILE *f = fopen (path, "rb");
+	if (f == NULL) return 0;
+
+	relfile_header_t h;
+	mpz_t n;
+	mpz_init (n);
+	if (!relfile_read_header (f, &h, n) || h.multiplier != ns->multiplier || h.fb_bound != ns->fb_bound){
+		printf ("\nIgnoring %s: it is not a relation file for this job.\n", path);
+		mpz_clear (n);
+		fclose (f);
+		return 0;
+	}
+	mpz_clear (n);
+
+	uint32_t count = 0;
+	while (1){
+		poly_group_t *pg = (poly_group_t *) malloc (sizeof (poly_group_t));
+		polygroup_init (pg, ns);
+		free (pg->ainverses);	// we never sieve with this group, so we don't need these.
+		pg->ainverses = NULL;
+		if (!relfile_read_batch (f, pg, ns)){
+			polygroup_free (pg, ns);
+			free (pg);
+			break;
+		}
+		count += pg->nrels;
+		add_polygroup_relations (pg, ns);
+	}
+	fclose (f);
+	return count;
+}
+
+/* Hand out the job, then collect relation files until we have enough relations. nsieve_init must
+ * already have been called. The matrix phases then run here, just as in multithreaded_factor. */
+void dist_coordinator (nsieve_t *ns, const char *dir, int nworkers, int nthreads){
+	long start = clock();
+	char path[4096];
+
+	if (mkdir (dir, 0777) != 0 && errno != EEXIST){
+		printf ("Fatal error: could not create directory %s.\n", dir);
+		exit (1);
+	}
+	dist_path (path, sizeof(path), dir, "job");
+	if (file_exists (path)){
+		printf ("Fatal error: %s already contains a job.\n", dir);
+		exit (1);
+	}
+	write_job (ns, dir, nworkers, nthreads);
+
+	poly_gpool_t gpool;	// we won't sieve, but this is what picks k (and so the number of b values).
+	gpool_init (&gpool, ns);
+	free (gpool.gpool);
+	free (gpool.frogs);
+	printf ("Waiting for relations from %d workers (%d threads each) in %s\n", nworkers, nthreads, dir);
+
+	long sievestart = clock();
+	uint32_t next[nworkers];	// the sequence number of the next file we expect from each worker
+	memset (next, 0, sizeof(next));
+	uint32_t received = 0;
+	int nfiles = 0;
+	time_t last_file = time (NULL);
+	while (ns->nfull + ns->npartial < ns->rels_needed){
+		int found = 0;
+		for (int w=0; w < nworkers; w++){
+			snprintf (path, sizeof(path), "%s/rels.%d.%u", dir, w, next[w]);
+			if (!file_exists (path)) continue;
+			received += consume_file (path, ns);
+			next[w] ++;
+			nfiles ++;
+			found = 1;
+		}
+		if (!found){
+			if (time (NULL) - last_file >= DIST_IDLE_SECS){
+				printf ("\nFatal error: no relations have arrived in %s for %d seconds; are any workers running?\n", dir, DIST_IDLE_SECS);
+				exit (1);
+			}
+			nap (100);
+			continue;
+		}
+		last_file = time (NULL);
+		ns->npartial = ht_count (&ns->partials);
+		printf("Have %d of %d relations (%d full + %d combined from %d partial); received %u relations in %d files. \r", ns->nfull + ns->npartial, ns->rels_needed, ns->nfull, ns->npartial, ns->partials.nentries, received, nfiles);
+		fflush(stdout);
+	}
+	dist_path (path, sizeof(path), dir, "done");
+	FILE *f = fopen (path, "w");
+	if (f != NULL) fclose (f);
+	ns->timing.sieve_time = clock() - sievestart;
+	printf("\n");
+
+	build_matrix (ns);
+	filter (ns);
+	merge (ns);
+	ns->nthreads = nthreads;	// the coordinator's own threads are free again for the elimination
+	solve_matrix (ns);
+	ns->timing.total_time = clock() - start;
+}
+
+/* Worker side */
+
+/* Close the current relation file and make it visible to the coordinator. Caller holds ns->lock. */
+static void ship_file (dist_worker_t *w){
+	char tmp[4096], path[4096];
+	snprintf (path, sizeof(path), "%s/rels.%d.%u", w->dir, w->wid, w->seq);
+	snprintf (tmp, sizeof(tmp), "%s/rels.%d.%u.tmp", w->dir, w->wid, w->seq);
+	fclose (w->out);
+	rename (tmp, path);
+	w->out = NULL;
+	w->nrels = 0;
+	w->seq ++;
+}
+
+/* Append a freshly sieved polygroup to the current relation file, opening a new one if needed. */
+static void ship_polygroup (poly_group_t *pg, nsieve_t *ns){
+	dist_worker_t *w = ns->worker;
+	pthread_mutex_lock (&ns->lock);
+	if (w->out == NULL){
+		char tmp[4096];
+		snprintf (tmp, sizeof(tmp), "%s/rels.%d.%u.tmp", w->dir, w->wid, w->seq);
+		w->out = fopen (tmp, "wb");
+		if (w->out == NULL){
+			printf ("Fatal error: could not write %s.\n", tmp);
+			exit (1);
+		}
+		relfile_write_header (w->out, ns);
+		w->opened = time (NULL);
+	}
+	relfile_write_batch (w->out, pg, ns);
+	w->nrels += pg->nrels;
+	w->shipped += pg->nrels;
+	if (w->nrels >= DIST_FILE_RELS || time (NULL) - w->opened >= DIST_FILE_SECS){
+		ship_file (w);
+	}
+	ns->info_npg ++;
+	ns->info_npoly += ns->bvals;
+	printf ("Worker %d: shipped %u relations in %u files; sieved %d polynomials from %d groups. \r", w->wid, w->shipped, w->seq, ns->info_npoly, ns->info_npg);
+	fflush (stdout);
+	pthread_mutex_unlock (&ns->lock);
+}
+
+static int job_done (dist_worker_t *w){
+	char path[4096];
+	dist_path (path, sizeof(path), w->dir, "done");
+	return file_exists (path);
+}
+
+/* The worker's version of run_sieve_thread. Instead of adding the relations to the nsieve_t, each group
+ * is shipped to the coordinator and then freed; a worker holds on to nothing. */
+void *run_worker_thread (void *args){
+	thread_data_t *td = (thread_data_t *) args;
+	nsieve_t *ns = td->ns;
+
+	block_data_t sievedata;
+	while (!job_done (ns->worker)){
+		poly_group_t *curr_polygroup = (poly_group_t *) malloc (sizeof (poly_group_t));
+		polygroup_init (curr_polygroup, ns);
+		if (!generate_polygroup (&td->gpool, curr_polygroup, ns)){
+			printf ("Fatal error: Out of polynomials!!!\n");
+			exit (1);
+		}
+
+		poly_t *polys[ns->bvals];
+		for (int i=0; i < ns->bvals; i++){
+			polys[i] = (poly_t *) malloc (sizeof (poly_t));
+			poly_init (polys[i]);
+			generate_poly (polys[i], curr_polygroup, ns, i);
+			sieve_poly (&sievedata, curr_polygroup, polys[i], ns);
+		}
+		ship_polygroup (curr_polygroup, ns);
+
+		for (int i=0; i < curr_polygroup->nrels; i++){
+			rel_free (curr_polygroup->relns[i]);
+		}
+		for (int i=0; i < ns->bvals; i++){
+			poly_free (polys[i]);
+			free (polys[i]);
+		}
+		polygroup_free (curr_polygroup, ns);
+		free (curr_polygroup);
+	}
+	return NULL;
+}
+
+/* Read the job file (waiting for it to appear if the coordinator hasn't started yet), set up the same
+ * factor base as the coordinator, and sieve our slots until the coordinator says it has enough. */
+void dist_worker (const char *dir, int wid){
+	char path[4096];
+	dist_path (path, sizeof(path), dir, "job");
+	while (!file_exists (path)){
+		nap (200);
+	}
+	FILE *f = fopen (path, "r");
+	mpz_t n;
+	mpz_init (n);
+	nsieve_t ns;
+	memset (&ns, 0, sizeof (ns));	// whatever the job file doesn't give is left to the defaults (or to nsieve_init).
+	uint32_t lp_bound;
+	int nworkers, nthreads;
+	if (f == NULL || gmp_fscanf (f, "N %Zd multiplier %u fb_bound %u lp_bound %u M %u T %f smallp %d workers %d threads %d", n, &ns.multiplier, &ns.fb_bound, &lp_bound, &ns.M, &ns.T, &ns.sieve_start, &nworkers, &nthreads) != 9){
+		printf ("Fatal error: could not parse %s.\n", path);
+		exit (1);
+	}
+	fclose (f);
+	if (wid < 0 || wid >= nworkers){
+		printf ("Fatal error: worker id %d is out of range; the job has %d workers.\n", wid, nworkers);
+		exit (1);
+	}
+	ns.lp_bound = lp_bound / ns.fb_bound;	// set_params expects the multiple of fb_bound, as given with -lpb.
+	ns.merge_density = -1;
+	ns.mult_bound = MULT_BOUND;
+	ns.mult_trials = MULT_TRIALS;
+	ns.solver = SOLVER_AUTO;
+	ns.verify = 1;
+	ns.nthreads = nthreads;
+	ns.out = (ns_output_t) {NULL, NULL, NULL, NULL};
+
+	nsieve_init (&ns, n);
+	dist_worker_t w;
+	w.dir = dir;
+	w.wid = wid;
+	w.seq = 0;
+	w.out = NULL;
+	w.nrels = 0;
+	w.shipped = 0;
+	ns.worker = &w;
+
+	ns.gpool_stride = nworkers * nthreads;
+	thread_data_t *td = init_thread_data (&ns, nthreads, wid * nthreads);
+	for (int i=0; i<nthreads; i++){
+		pthread_create (&ns.threads[i], NULL, run_worker_thread, &td[i]);
+	}
+	for (int i=0; i<nthreads; i++){
+		pthread_join (ns.threads[i], NULL);
+	}
+	if (w.out != NULL){	// no harm in shipping the leftovers; the coordinator just won't read them.
+		ship_file (&w);
+	}
+	printf ("\nWorker %d finished.\n", wid);
+	mpz_clear (n);
+}
@@ -0,0 +1,35 @@
+#ifndef DIST_H
+#define DIST_H
+
+#include "common.h"
+#include "sieve.h"
+#include "poly.h"
+#include "filter.h"
+#include "matrix.h"
+#include "relfile.h"
+
+/* Distributed sieving. One coordinator process and any number of worker processes share a directory. The
+ * coordinator writes a job file there describing N and the parameters; each worker reads it, builds the same
+ * factor base, sieves its own slots of the gpool, and ships relation files back through the directory. Once
+ * the coordinator has enough relations, it creates a 'done' file (the workers exit when they see it) and
+ * goes on to build and solve the matrix by itself. See the comment in dist.c for the file names. */
+
+#define DIST_FILE_RELS  2000	// a worker ships its current relation file once it holds this many relations...
+#define DIST_FILE_SECS  2	// ...or once it has been open this many seconds.
+#define DIST_IDLE_SECS  600	// the coordinator gives up if no relation file arrives for this long (the workers all died)
+
+typedef struct dist_worker {
+	const char *dir;
+	int wid;		// this worker's number, 0 .. nworkers-1
+	uint32_t seq;		// sequence number of the relation file currently being written
+	FILE *out;		// the file currently being written (NULL if none is open)
+	uint32_t nrels;		// relations in that file
+	time_t opened;		// when it was opened
+	uint32_t shipped;	// total relations shipped, for the status line
+} dist_worker_t;
+
+void dist_coordinator (nsieve_t *, const char *dir, int nworkers, int nthreads);
+void dist_worker (const char *dir, int wid);
+void *run_worker_thread (void *);
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ecm.h"
+#include "rho.h"
+
+int main (int argc, const char *argv[]){
+	mpz_t n;
+	mpz_init (n);
+	int nspecd = 0;
+	int nthreads = 1;
+	uint32_t B1 = 50000;	// good for factors of about 25 digits ...
+	int curves = 300;	// ... with this many curves
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-threads") && pos+1 < argc){
+			nthreads = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-B1") && pos+1 < argc){
+			B1 = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-curves") && pos+1 < argc){
+			curves = atoi (argv[++pos]);
+		} else {
+			mpz_set_str (n, argv[pos], 10);
+			nspecd = 1;
+		}
+	}
+	if (!nspecd){
+		mpz_inp_str (n, stdin, 10);
+	}
+	tdiv (n, 5000);
+	if (bpsw_prime_p (n)){
+		mpz_out_str (stdout, 10, n);
+		printf("\n");
+		return 0;
+	}
+	ecm (n, B1, curves, 1, nthreads);
+	mpz_clear (n);
+}
@@ -0,0 +1,18 @@
+#ifndef ECM_H
+#define ECM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <gmp.h>
+#include "prime.h"
+
+/* Lenstra's elliptic curve method. See ecmfuncs.c. */
+
+#define ECM_B2_FACTOR 100	// stage 2 goes up to B2 = 100 * B1
+#define ECM_MIN_B1    210	// the smallest B1 that stage 2 can start from
+
+void ecm (mpz_t, uint32_t B1, int curves, int printrem, int nthreads);	// curves are shared out over nthreads threads
+int  ecm_find (mpz_t factor, mpz_t n, uint32_t B1, int curves, int nthreads);	// one factor of the odd composite n, without printing; 0 if none
+int  ecm_select (int bits, uint32_t *B1);	// how many curves (and with what B1) to run on N of this size before the sieve; 0 for none
+
+#endif
@@ -0,0 +1,392 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "ecm.h"
+
+/* The elliptic curve method. Like p-1, this computes a point's multiple by every prime power up to B1
+ * (stage 1), hoping that the order of the group it lives in is B1-smooth mod one of the factors p of n, so
+ * that the point becomes the identity mod p without doing so mod n. Unlike p-1, where that order is always
+ * p-1, every curve gives a different group (of order somewhere in p+1 +/- 2 sqrt(p)), so if one curve fails,
+ * the next one may well not. How big a factor ECM finds depends on B1 and on the number of curves tried,
+ * and hardly at all on the size of n, which is why it's worth running before the quadratic sieve on big
+ * numbers: a 25 digit factor takes a few hundred curves with B1 = 50000, seconds instead of a whole sieve.
+ *
+ * The curves are Montgomery's, By^2 = x^3 + Ax^2 + x, picked with Suyama's parametrization from a number
+ * sigma (so that the group order is a multiple of 12), and only x and z are ever computed, in projective
+ * coordinates: doubling takes 5 multiplications and adding two points whose difference is known takes 6,
+ * which is all the Montgomery ladder needs to compute kP. The identity has z = 0, so at the end of stage 1,
+ * gcd (z, n) is the factor.
+ *
+ * Stage 2 catches the orders that are B1-smooth except for one prime q up to B2 = ECM_B2_FACTOR * B1, with
+ * baby steps and giant steps: we compute jP for the odd j < D/2 prime to D (normalized to z = 1), and walk
+ * Q = mDP along by D at a time. If q = mD +/- j, then qP = 0 mod p means that Q and jP have the same x
+ * coordinate mod p, so we multiply X(Q) - x(jP) Z(Q) into an accumulator for every such pair, which is two
+ * multiplications per prime (or less, when mD - j and mD + j are both prime), and take one gcd at the end.
+ *
+ * The curves are handed out to nthreads threads; the first factor found stops all of them.
+*/
+
+#define ECM_FIRST_SIGMA 6	// sigma for the first curve; the ith one uses ECM_FIRST_SIGMA + i.
+#define ECM_D_SMALL 210		// the giant step length, for B1 below ECM_D_LARGE ...
+#define ECM_D_LARGE 2310	// ... and above
+#define ECM_MAX_THREADS 64
+#define ECM_STOP_CHECK 64	// how often (in primes or giant steps) to check whether another thread is done
+
+/* How hard to try before the sieve, by the size of N in bits: about a quarter as many digits as N has, in
+ * the factor sizes GMP-ECM's tables give these B1 and curve counts for, which keeps the curves to a few
+ * percent of the sieve's time. Below the first size, the sieve is so quick that this isn't worth it (25
+ * curves at B1 = 2000 take about as long as sieving a 160 bit N). */
+static const uint32_t ecm_table[][3] = {
+	// bits	B1	curves
+	{200,	2000,	25},	// 15 digit factors
+	{250,	11000,	90},	// 20 digits
+	{300,	50000,	300},	// 25 digits
+	{350,	250000,	700}	// 30 digits
+};
+#define ECM_TABLE_LEN (sizeof (ecm_table) / sizeof (ecm_table[0]))
+
+typedef struct {
+	mpz_t x;
+	mpz_t z;
+} ec_point_t;
+
+/* Everything one thread needs for one curve */
+typedef struct {
+	mpz_srcptr n;
+	mpz_t a24;		// (A + 2) / 4
+	mpz_t t1, t2, t3, t4;	// scratch
+	ec_point_t l0, l1;	// for the ladder
+} ec_curve_t;
+
+/* Shared between the threads */
+typedef struct {
+	mpz_srcptr n;
+	uint32_t B1;
+	uint64_t B2;
+	uint32_t D;
+	const uint8_t *composite;	// bit i is set if 2i + 1 is composite, up to B2
+	int curves;		// how many curves may be started, in all
+	int next_curve;		// how many have been
+	pthread_mutex_t lock;
+	volatile int stop;	// set once a factor is found
+	mpz_t factor;
+} ecm_job_t;
+
+#define ISCOMPOSITE(c, p) ((c)[(p) >> 4] & (1 << (((p) >> 1) & 7)))
+
+/* A bitmap of the odd composites up to limit */
+static uint8_t *ecm_sieve (uint64_t limit){
+	uint8_t *c = (uint8_t *) calloc (limit / 16 + 1, 1);
+	c[0] |= 1;	// 1 isn't prime either
+	for (uint64_t i=3; i*i <= limit; i += 2){
+		if (ISCOMPOSITE (c, i)) continue;
+		for (uint64_t j = i*i; j <= limit; j += 2*i){
+			c[j >> 4] |= 1 << ((j >> 1) & 7);
+		}
+	}
+	return c;
+}
+
+static uint32_t gcd32 (uint32_t a, uint32_t b){
+	while (b != 0){
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static inline void ec_mulmod (mpz_t r, mpz_t a, mpz_t b, mpz_srcptr n){
+	mpz_mul (r, a, b);
+	mpz_mod (r, r, n);
+}
+
+static void ec_set (ec_point_t *r, ec_point_t *p){
+	mpz_set (r->x, p->x);
+	mpz_set (r->z, p->z);
+}
+
+/* r = 2p; r may be p */
+static void ec_dbl (ec_point_t *r, ec_point_t *p, ec_curve_t *c){
+	mpz_add (c->t3, p->x, p->z);
+	ec_mulmod (c->t1, c->t3, c->t3, c->n);	// (x + z)^2
+	mpz_sub (c->t3, p->x, p->z);
+	ec_mulmod (c->t2, c->t3, c->t3, c->n);	// (x - z)^2
+	ec_mulmod (r->x, c->t1, c->t2, c->n);
+	mpz_sub (c->t3, c->t1, c->t2);		// 4xz
+	ec_mulmod (c->t4, c->a24, c->t3, c->n);
+	mpz_add (c->t4, c->t4, c->t2);
+	ec_mulmod (r->z, c->t3, c->t4, c->n);
+}
+
+/* r = p + q, given d = p - q; r may be any of them. */
+static void ec_add (ec_point_t *r, ec_point_t *p, ec_point_t *q, ec_point_t *d, ec_curve_t *c){
+	mpz_sub (c->t3, p->x, p->z);
+	mpz_add (c->t4, q->x, q->z);
+	ec_mulmod (c->t1, c->t3, c->t4, c->n);
+	mpz_add (c->t3, p->x, p->z);
+	mpz_sub (c->t4, q->x, q->z);
+	ec_mulmod (c->t2, c->t3, c->t4, c->n);
+	mpz_add (c->t3, c->t1, c->t2);
+	mpz_sub (c->t4, c->t1, c->t2);
+	ec_mulmod (c->t1, c->t3, c->t3, c->n);
+	ec_mulmod (c->t2, c->t4, c->t4, c->n);
+	ec_mulmod (c->t3, d->z, c->t1, c->n);
+	ec_mulmod (r->z, d->x, c->t2, c->n);
+	mpz_swap (r->x, c->t3);
+}
+
+/* r = kp, k > 0, by the Montgomery ladder (l0 and l1 always differ by p); r may be p. */
+static void ec_mul (ec_point_t *r, ec_point_t *p, uint64_t k, ec_curve_t *c){
+	if (k == 1){
+		ec_set (r, p);
+		return;
+	}
+	ec_set (&c->l0, p);
+	ec_dbl (&c->l1, p, c);
+	int bit = 63 - __builtin_clzll (k);
+	for (bit--; bit >= 0; bit--){
+		if ((k >> bit) & 1){
+			ec_add (&c->l0, &c->l1, &c->l0, p, c);
+			ec_dbl (&c->l1, &c->l1, c);
+		} else {
+			ec_add (&c->l1, &c->l1, &c->l0, p, c);
+			ec_dbl (&c->l0, &c->l0, c);
+		}
+	}
+	ec_set (r, &c->l0);
+}
+
+/* A factor turned up as gcd (a, n); keep it if it is a proper one, and the first. Returns 1 if it is. */
+static int ecm_found (ecm_job_t *job, mpz_t a, mpz_t g){
+	mpz_gcd (g, a, job->n);
+	if (mpz_cmp_ui (g, 1) == 0 || mpz_cmp (g, job->n) == 0) return 0;
+	pthread_mutex_lock (&job->lock);
+	if (!job->stop){
+		mpz_set (job->factor, g);
+		job->stop = 1;
+	}
+	pthread_mutex_unlock (&job->lock);
+	return 1;
+}
+
+/* The curve for sigma, and its starting point; returns 0 if it can't be set up (which may also be
+ * because it found a factor). */
+static int ecm_curve (ecm_job_t *job, ec_curve_t *c, ec_point_t *p, uint32_t sigma){
+	mpz_t u, v, t;
+	mpz_inits (u, v, t, NULL);
+	mpz_set_ui (u, sigma);
+	mpz_mul (u, u, u);
+	mpz_sub_ui (u, u, 5);		// u = sigma^2 - 5
+	mpz_set_ui (v, sigma);
+	mpz_mul_ui (v, v, 4);		// v = 4 sigma
+	mpz_powm_ui (p->x, u, 3, job->n);	// the point is (u^3 : v^3)
+	mpz_powm_ui (p->z, v, 3, job->n);
+
+	mpz_sub (t, v, u);		// (A + 2) / 4 = (v - u)^3 (3u + v) / (16 u^3 v)
+	mpz_powm_ui (c->a24, t, 3, job->n);
+	mpz_mul_ui (t, u, 3);
+	mpz_add (t, t, v);
+	ec_mulmod (c->a24, c->a24, t, job->n);
+	mpz_mul (t, p->x, v);
+	mpz_mul_ui (t, t, 16);
+	mpz_mod (t, t, job->n);
+	int ok = mpz_invert (u, t, job->n);
+	if (ok){
+		ec_mulmod (c->a24, c->a24, u, job->n);
+	} else {
+		ecm_found (job, t, v);
+	}
+	mpz_clears (u, v, t, NULL);
+	return ok;
+}
+
+static void ecm_run_curve (ecm_job_t *job, ec_curve_t *c, uint32_t sigma){
+	ec_point_t p, q, qprev, dp;
+	mpz_inits (p.x, p.z, q.x, q.z, qprev.x, qprev.z, dp.x, dp.z, NULL);
+	mpz_t g, acc;
+	mpz_inits (g, acc, NULL);
+	if (!ecm_curve (job, c, &p, sigma)) goto done;
+
+	/* Stage 1: multiply by every prime power up to B1 */
+	uint32_t count = 0;
+	for (uint64_t q = 2; q <= job->B1; q = q == 2 ? 3 : q + 2){
+		if (q > 2 && ISCOMPOSITE (job->composite, q)) continue;
+		uint64_t pk = q;
+		while (pk * q <= job->B1){
+			pk *= q;
+		}
+		ec_mul (&p, &p, pk, c);
+		if (++count % ECM_STOP_CHECK == 0 && job->stop) goto done;
+	}
+	if (ecm_found (job, p.z, g) || mpz_cmp_ui (g, 1) != 0) goto done;	// found a factor, or all of them at once.
+
+	/* Stage 2: the baby steps jP, for the odd j < D/2 that are prime to D, with z = 1 */
+	uint32_t D = job->D;
+	uint32_t nbaby = 0;
+	uint32_t *js = (uint32_t *) malloc (D / 2 * sizeof (uint32_t));
+	mpz_t *xs = (mpz_t *) malloc (D / 2 * sizeof (mpz_t));
+	ec_point_t p2, cur, prev;
+	mpz_inits (p2.x, p2.z, cur.x, cur.z, prev.x, prev.z, NULL);
+	ec_dbl (&p2, &p, c);
+	ec_set (&cur, &p);
+	ec_set (&prev, &p);
+	int ok = 1;
+	for (uint32_t j = 1; j < D / 2; j += 2){
+		if (j == 3){
+			ec_add (&cur, &p2, &p, &p, c);		// 3P = 2P + P
+		} else if (j > 3){
+			ec_add (&q, &cur, &p2, &prev, c);	// (j+2)P = jP + 2P, and jP - 2P is known.
+			ec_set (&prev, &cur);
+			ec_set (&cur, &q);
+		}
+		if (gcd32 (j, D) != 1) continue;
+		if (!mpz_invert (g, cur.z, job->n)){
+			ecm_found (job, cur.z, g);
+			ok = 0;
+			break;
+		}
+		js[nbaby] = j;
+		mpz_init (xs[nbaby]);
+		ec_mulmod (xs[nbaby], cur.x, g, job->n);
+		nbaby ++;
+	}
+	mpz_clears (p2.x, p2.z, cur.x, cur.z, prev.x, prev.z, NULL);
+
+	if (ok && !job->stop){
+		/* and the giant steps: Q = mDP, for every m with a prime mD +/- j in (B1, B2]. B1 >= D, so m > 0. */
+		uint64_t m = job->B1 / D;
+		ec_mul (&dp, &p, D, c);
+		ec_mul (&qprev, &p, m * D, c);
+		ec_mul (&q, &p, (m + 1) * D, c);
+		ec_point_t *qs[2] = {&qprev, &q};	// qs[0] = mDP, qs[1] = (m+1)DP
+		mpz_set_ui (acc, 1);
+		for (; m * D <= job->B2 + D / 2; m++){
+			ec_point_t *Q = qs[0];
+			for (uint32_t i=0; i < nbaby; i++){
+				uint64_t lo = m * D - js[i];
+				uint64_t hi = m * D + js[i];
+				if ((lo > job->B1 && lo <= job->B2 && !ISCOMPOSITE (job->composite, lo)) || (hi > job->B1 && hi <= job->B2 && !ISCOMPOSITE (job->composite, hi))){
+					ec_mulmod (g, xs[i], Q->z, job->n);
+					mpz_sub (g, Q->x, g);
+					ec_mulmod (acc, acc, g, job->n);
+				}
+			}
+			ec_add (qs[0], qs[1], &dp, qs[0], c);	// (m+2)DP = (m+1)DP + DP, with the difference mDP
+			ec_point_t *t = qs[0];
+			qs[0] = qs[1];
+			qs[1] = t;
+			if ((m + 1) % ECM_STOP_CHECK == 0 && job->stop) break;
+		}
+		if (!job->stop) ecm_found (job, acc, g);
+	}
+	for (uint32_t i=0; i < nbaby; i++){
+		mpz_clear (xs[i]);
+	}
+	free (xs);
+	free (js);
+
+done:
+	mpz_clears (p.x, p.z, q.x, q.z, qprev.x, qprev.z, dp.x, dp.z, NULL);
+	mpz_clears (g, acc, NULL);
+}
+
+static void *ecm_thread (void *args){
+	ecm_job_t *job = (ecm_job_t *) args;
+	ec_curve_t c;
+	c.n = job->n;
+	mpz_inits (c.a24, c.t1, c.t2, c.t3, c.t4, c.l0.x, c.l0.z, c.l1.x, c.l1.z, NULL);
+	while (!job->stop){
+		pthread_mutex_lock (&job->lock);
+		int i = job->next_curve < job->curves ? job->next_curve ++ : -1;
+		pthread_mutex_unlock (&job->lock);
+		if (i < 0) break;
+		ecm_run_curve (job, &c, ECM_FIRST_SIGMA + i);
+	}
+	mpz_clears (c.a24, c.t1, c.t2, c.t3, c.t4, c.l0.x, c.l0.z, c.l1.x, c.l1.z, NULL);
+	return NULL;
+}
+
+/* Look for a factor of the odd composite n with up to *curves curves, nthreads at once; *curves is left
+ * with the number that weren't started. Returns 0 if no factor was found. */
+static int ecm_factor (mpz_t factor, mpz_t n, uint32_t B1, int *curves, const uint8_t *composite, int nthreads){
+	ecm_job_t job;
+	job.n = n;
+	job.B1 = B1;
+	job.B2 = (uint64_t) B1 * ECM_B2_FACTOR;
+	job.D = B1 >= ECM_D_LARGE ? ECM_D_LARGE : ECM_D_SMALL;
+	job.composite = composite;
+	job.curves = *curves;
+	job.next_curve = 0;
+	job.stop = 0;
+	pthread_mutex_init (&job.lock, NULL);
+	mpz_init (job.factor);
+	pthread_t threads[nthreads];
+	for (int i=1; i < nthreads; i++){
+		pthread_create (&threads[i], NULL, ecm_thread, &job);
+	}
+	ecm_thread (&job);
+	for (int i=1; i < nthreads; i++){
+		pthread_join (threads[i], NULL);
+	}
+	int found = job.stop;
+	if (found) mpz_set (factor, job.factor);
+	*curves -= job.next_curve;
+	mpz_clear (job.factor);
+	pthread_mutex_destroy (&job.lock);
+	return found;
+}
+
+void ecm (mpz_t n, uint32_t B1, int curves, int printrem, int nthreads){	// printrem controls whether a composite cofactor is printed.
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > ECM_MAX_THREADS) nthreads = ECM_MAX_THREADS;
+	if (B1 < ECM_MIN_B1) B1 = ECM_MIN_B1;
+	uint8_t *composite = ecm_sieve ((uint64_t) B1 * ECM_B2_FACTOR);
+	mpz_t g;
+	mpz_init (g);
+	int found = 0;
+	while (curves > 0 && mpz_cmp_ui (n, 1) > 0 && mpz_odd_p (n) && !bpsw_prime_p (n)){
+		if (!ecm_factor (g, n, B1, &curves, composite, nthreads)) break;
+		found = 1;
+		// found a factor
+		mpz_out_str (stdout, 10, g);
+		if (bpsw_prime_p (g)){	// a prime one!
+			printf("\n");
+		} else {
+			printf (" (composite)\n");
+		}
+		mpz_divexact (n, n, g);
+	}
+	if (mpz_cmp_ui (n, 1) > 0){
+		if (found && bpsw_prime_p (n)){	// what's left after the factors we found
+			mpz_out_str (stdout, 10, n);
+			printf ("\n");
+		} else if (printrem){
+			mpz_out_str (stdout, 10, n);
+			printf (" (composite)\n");
+		}
+	}
+	mpz_clear (g);
+	free (composite);
+}
+
+int ecm_find (mpz_t factor, mpz_t n, uint32_t B1, int curves, int nthreads){
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > ECM_MAX_THREADS) nthreads = ECM_MAX_THREADS;
+	if (B1 < ECM_MIN_B1) B1 = ECM_MIN_B1;
+	uint8_t *composite = ecm_sieve ((uint64_t) B1 * ECM_B2_FACTOR);
+	int found = ecm_factor (factor, n, B1, &curves, composite, nthreads);
+	free (composite);
+	return found;
+}
+
+int ecm_select (int bits, uint32_t *B1){
+	int curves = 0;
+	*B1 = ecm_table[0][1];	// in case curves are asked for anyway
+	for (int i=0; i < ECM_TABLE_LEN; i++){
+		if (bits >= ecm_table[i][0]){
+			*B1 = ecm_table[i][1];
+			curves = ecm_table[i][2];
+		}
+	}
+	return curves;
+}
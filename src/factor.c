@@ -0,0 +1,406 @@
+#define _POSIX_C_SOURCE 200809L	// for clock_gettime and strdup under -std=c99
+#include "nsieve.h"
+
+/* Factoring N completely. Each method only ever splits a number in two (or, for the quadratic sieve, into
+ * its primes and perhaps a composite it couldn't split), so we keep a queue of the composite pieces still to
+ * be split, and work through the methods on each one from the cheapest up, by its size: for pieces of up to
+ * SMALL_MAX_BITS bits, the native integer ones of small.c (rho on a word, or a small quadratic sieve), which
+ * almost always succeed; then rho (until it succeeds, for pieces below FACTOR_RHO_ONLY bits), then p-1 and
+ * ECM with bounds chosen as before the sieve (see pm1funcs.c and ecmfuncs.c), then the quadratic sieve. Once a method splits a piece, both halves go
+ * back on the queue, to start with the same method again, since the ones before it have already failed on
+ * them. Primes, and pieces that nothing could split, are the results.
+ *
+ * There are opts->nthreads worker threads, each of which takes a piece off the queue and works on it. A
+ * piece gets a share of the threads not already in use for its methods to use, depending on how many pieces
+ * there are to work on when it is taken, so a single piece gets all of them, and several independent ones
+ * are worked on at once. A worker doesn't take a piece while all of the threads are in use.
+ *
+ * The pieces can belong to more than one number: in batch mode (factor_batch), the numbers are read a line
+ * at a time, and whenever a worker is idle with nothing on the queue, it reads as many more as there are
+ * threads free, trial divides them together (see tdiv_batch), and puts what's left of them on the queue.
+ * That way a stream of small numbers keeps every thread busy with one number each, and a big number that
+ * comes along when the others are done gets several. As soon as the last piece of a number is done, its
+ * line of results is written out.
+*/
+
+enum {STAGE_SMALL, STAGE_RHO, STAGE_PM1, STAGE_ECM, STAGE_SIQS, STAGE_FAILED};
+
+typedef struct {
+	long line;		// where it was in the input
+	char *text;		// as it was given
+	int pending;		// its pieces that are queued or being worked on
+	mpz_t *done;		// primes, and pieces that couldn't be split
+	int ndone;
+	int donecap;
+	double start;
+} factor_input_t;
+
+typedef struct {
+	mpz_t n;
+	int stage;		// the next method to try on it
+	factor_input_t *in;	// the number it's a piece of
+} piece_t;
+
+typedef struct {
+	factor_opts_t *opts;
+	int nthreads;
+	pthread_mutex_t lock;	// protects everything below
+	pthread_cond_t wake;
+	piece_t **queue;
+	int qlen;
+	int qcap;
+	int busy;		// pieces being worked on
+	int threads_used;	// the threads they were given
+	FILE *in;		// the rest of the batch; NULL once it's all been read, or for a single N
+	FILE *out;		// where the batch results go
+	int reading;		// a worker is reading more of the batch
+	long nlines;
+	int error;		// the first error from the sieve (see run_siqs)
+} factor_job_t;
+
+static double now (void){
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_done (factor_input_t *in, mpz_t n){
+	if (in->ndone == in->donecap){
+		in->donecap = in->donecap == 0 ? 16 : 2 * in->donecap;
+		in->done = (mpz_t *) realloc (in->done, in->donecap * sizeof (mpz_t));
+	}
+	mpz_init_set (in->done[in->ndone ++], n);
+}
+
+/* A new piece: a prime is done, a perfect power is split into its root, and the rest go on the queue. The
+ * caller holds the lock. */
+static void add_piece (factor_job_t *job, factor_input_t *in, mpz_t n, int stage){
+	if (mpz_cmp_ui (n, 1) <= 0) return;
+	if (bpsw_prime_p (n)){
+		add_done (in, n);
+		return;
+	}
+	if (mpz_perfect_power_p (n)){	// none of the methods can split p^k.
+		mpz_t r;
+		mpz_init (r);
+		for (unsigned long k = 2; ; k++){
+			if (mpz_root (r, n, k)){
+				for (unsigned long i=0; i < k; i++){
+					add_piece (job, in, r, stage);
+				}
+				break;
+			}
+		}
+		mpz_clear (r);
+		return;
+	}
+	if (job->qlen == job->qcap){
+		job->qcap = job->qcap == 0 ? 16 : 2 * job->qcap;
+		job->queue = (piece_t **) realloc (job->queue, job->qcap * sizeof (piece_t *));
+	}
+	piece_t *p = (piece_t *) malloc (sizeof (piece_t));
+	mpz_init_set (p->n, n);
+	p->stage = stage;
+	p->in = in;
+	in->pending ++;
+	job->queue[job->qlen ++] = p;
+	pthread_cond_broadcast (&job->wake);
+}
+
+static int mpz_compare (const void *a, const void *b){
+	return mpz_cmp (*(const mpz_t *) a, *(const mpz_t *) b);
+}
+
+/* Once a batch number has no pieces left, write out its line of results: where it was in the input, the
+ * number, ok (or partial, if some piece couldn't be split), the milliseconds it took, and its factors in
+ * increasing order, each composite one marked with a '*'. The caller holds the lock. */
+static void finish_input (factor_job_t *job, factor_input_t *in){
+	if (job->out == NULL) return;	// factor_fully collects them itself.
+	qsort (in->done, in->ndone, sizeof (mpz_t), mpz_compare);
+	char prime[in->ndone + 1];
+	int ok = 1;
+	for (int i=0; i < in->ndone; i++){
+		prime[i] = bpsw_prime_p (in->done[i]) != 0;
+		ok &= prime[i];
+	}
+	fprintf (job->out, "%ld %s %s %.3f", in->line, in->text, ok ? "ok" : "partial", 1000 * (now () - in->start));
+	for (int i=0; i < in->ndone; i++){
+		fputc (' ', job->out);
+		mpz_out_str (job->out, 10, in->done[i]);
+		if (!prime[i]) fputc ('*', job->out);
+		mpz_clear (in->done[i]);
+	}
+	fputc ('\n', job->out);
+	fflush (job->out);
+	free (in->done);
+	free (in->text);
+	free (in);
+}
+
+/* Read up to 'count' more numbers of the batch, trial divide them, and queue what's left. Called with the
+ * lock held, which is dropped while reading. Blank lines are skipped (but counted), and anything else that
+ * isn't a positive number gets a line of its own saying 'bad'. */
+static void read_inputs (factor_job_t *job, int count){
+	job->reading = 1;
+	pthread_mutex_unlock (&job->lock);
+
+	factor_input_t *ins[count];
+	mpz_t m[count];
+	int nin = 0;
+	int eof = 0;
+	char buf[FACTOR_LINE_MAX];
+	while (nin < count){
+		if (fgets (buf, sizeof (buf), job->in) == NULL){
+			eof = 1;
+			break;
+		}
+		long line = ++ job->nlines;
+		size_t len = strlen (buf);
+		int toolong = len > 0 && buf[len-1] != '\n' && !feof (job->in);
+		if (toolong){	// no number that long is going to get factored anyway.
+			int c;
+			while ((c = fgetc (job->in)) != EOF && c != '\n');
+		}
+		while (len > 0 && isspace ((unsigned char) buf[len-1])){
+			buf[--len] = '\0';
+		}
+		char *s = buf;
+		while (isspace ((unsigned char) *s)) s++;
+		if (*s == '\0') continue;
+
+		mpz_init (m[nin]);
+		if (toolong || mpz_set_str (m[nin], s, 10) != 0 || mpz_sgn (m[nin]) <= 0){
+			mpz_clear (m[nin]);
+			pthread_mutex_lock (&job->lock);
+			fprintf (job->out, "%ld %s bad\n", line, toolong ? "-" : s);
+			fflush (job->out);
+			pthread_mutex_unlock (&job->lock);
+			continue;
+		}
+		factor_input_t *in = (factor_input_t *) malloc (sizeof (factor_input_t));
+		in->line = line;
+		in->text = strdup (s);
+		in->pending = 0;
+		in->done = NULL;
+		in->ndone = in->donecap = 0;
+		in->start = now ();
+		ins[nin++] = in;
+	}
+	unsigned long *small[count];
+	int nsmall[count];
+	tdiv_batch (m, nin, FACTOR_TDIV_BOUND, small, nsmall);
+
+	pthread_mutex_lock (&job->lock);
+	mpz_t f;
+	mpz_init (f);
+	for (int i=0; i < nin; i++){
+		for (int j=0; j < nsmall[i]; j++){
+			mpz_set_ui (f, small[i][j]);
+			add_done (ins[i], f);
+		}
+		free (small[i]);
+		add_piece (job, ins[i], m[i], STAGE_SMALL);
+		mpz_clear (m[i]);
+		if (ins[i]->pending == 0) finish_input (job, ins[i]);	// it was prime, or smooth.
+	}
+	mpz_clear (f);
+	if (eof) job->in = NULL;
+	job->reading = 0;
+	pthread_cond_broadcast (&job->wake);
+}
+
+/* The quadratic sieve, on a copy of the options; its factors go straight back on the queue. Returns 0 if
+ * it couldn't split the piece at all, and keeps the error if that was because something went wrong. */
+static int run_siqs (factor_job_t *job, piece_t *p, int nthreads){
+	nsieve_t ns = job->opts->siqs;
+	ns.nthreads = nthreads;
+	ns.out = job->opts->out;
+	out_printf (&ns.out, "Starting the quadratic sieve on a %d bit piece... \n", (int) mpz_sizeinbase (p->n, 2));
+	out_progress (&ns.out, NSIEVE_PHASE_SIEVE, 0);
+	nsieve_init (&ns, p->n);
+	multithreaded_factor (&ns, nthreads);
+	print_timing (&ns);
+	int split = ns.nfactors > 1;
+	pthread_mutex_lock (&job->lock);
+	job->opts->relations += ns.nfull + ns.npartial;
+	if (ns.error != 0 && job->error == 0) job->error = ns.error;
+	for (int i=0; i < ns.nfactors; i++){
+		if (split) add_piece (job, p->in, ns.factors[i], STAGE_SIQS);
+		mpz_clear (ns.factors[i]);
+	}
+	pthread_mutex_unlock (&job->lock);
+	free (ns.factors);
+	nsieve_free (&ns);
+	return split;
+}
+
+/* Try the methods on p from p->stage on, until one of them splits it. */
+static void work_piece (factor_job_t *job, piece_t *p, int nthreads){
+	factor_opts_t *opts = job->opts;
+	ns_output_t *out = &opts->out;
+	int bits = mpz_sizeinbase (p->n, 2);
+	mpz_t g;
+	mpz_init (g);
+	for (; p->stage < STAGE_FAILED; p->stage++){
+		int found = 0;
+		uint32_t B1;
+		if (p->stage == STAGE_SMALL){
+			if (bits > SMALL_MAX_BITS) continue;
+			out_progress (out, NSIEVE_PHASE_SMALL, -1);
+			found = small_find (g, p->n);
+		} else if (p->stage == STAGE_RHO){
+			out_progress (out, NSIEVE_PHASE_RHO, -1);
+			found = rho_find (g, p->n, bits < FACTOR_RHO_ONLY ? 0xffffffff : FACTOR_RHO_STEPS, nthreads);
+		} else if (p->stage == STAGE_PM1){
+			if (opts->pm1_B1 >= 0){
+				B1 = opts->pm1_B1;
+			} else {
+				pm1_select (bits, &B1);
+			}
+			if (B1 == 0) continue;
+			out_printf (out, "Running p-1 with B1 = %u on a %d bit piece... \n", B1, bits);
+			out_progress (out, NSIEVE_PHASE_PM1, -1);
+			found = pm1_find (g, p->n, B1, (uint64_t) B1 * PM1_B2_FACTOR, nthreads);
+		} else if (p->stage == STAGE_ECM){
+			int curves = ecm_select (bits, &B1);
+			if (opts->ecm_curves >= 0) curves = opts->ecm_curves;
+			if (opts->ecm_B1 > 0) B1 = opts->ecm_B1;
+			if (curves == 0) continue;
+			out_printf (out, "Running up to %d ECM curves with B1 = %u on a %d bit piece... \n", curves, B1, bits);
+			out_progress (out, NSIEVE_PHASE_ECM, -1);
+			found = ecm_find (g, p->n, B1, curves, nthreads);
+		} else if (p->stage == STAGE_SIQS){
+			if (run_siqs (job, p, nthreads)) break;
+		}
+		if (found){
+			pthread_mutex_lock (&job->lock);
+			add_piece (job, p->in, g, p->stage);
+			mpz_divexact (g, p->n, g);
+			add_piece (job, p->in, g, p->stage);
+			pthread_mutex_unlock (&job->lock);
+			break;
+		}
+	}
+	if (p->stage == STAGE_FAILED){
+		out_printf (out, "Could not split %Zd\n", p->n);
+		pthread_mutex_lock (&job->lock);
+		add_done (p->in, p->n);
+		pthread_mutex_unlock (&job->lock);
+	}
+	mpz_clear (g);
+}
+
+static void *factor_thread (void *args){
+	factor_job_t *job = (factor_job_t *) args;
+	pthread_mutex_lock (&job->lock);
+	while (1){
+		int free_threads = job->nthreads - job->threads_used;
+		if (job->qlen == 0 && job->in != NULL && !job->reading && free_threads > 0){
+			read_inputs (job, free_threads < FACTOR_BATCH_CHUNK ? free_threads : FACTOR_BATCH_CHUNK);
+			continue;
+		}
+		if (job->qlen > 0 && free_threads > 0){
+			piece_t *p = job->queue[-- job->qlen];
+			int nthreads = free_threads / (job->qlen + 1);
+			if (nthreads < 1 || ((job->qlen > 0 || job->in != NULL) && mpz_sizeinbase (p->n, 2) < FACTOR_SMALL_BITS)){
+				nthreads = 1;	// not worth sharing out while there's other work to do.
+			}
+			job->busy ++;
+			job->threads_used += nthreads;
+			pthread_mutex_unlock (&job->lock);
+
+			work_piece (job, p, nthreads);
+
+			pthread_mutex_lock (&job->lock);
+			job->busy --;
+			job->threads_used -= nthreads;
+			if (-- p->in->pending == 0) finish_input (job, p->in);
+			mpz_clear (p->n);
+			free (p);
+			pthread_cond_broadcast (&job->wake);
+			continue;
+		}
+		if (job->qlen == 0 && job->busy == 0 && job->in == NULL && !job->reading) break;	// nothing left that could add to the queue: we're done.
+		pthread_cond_wait (&job->wake, &job->lock);
+	}
+	pthread_mutex_unlock (&job->lock);
+	return NULL;
+}
+
+static void job_init (factor_job_t *job, factor_opts_t *opts){
+	job->opts = opts;
+	opts->relations = 0;
+	job->nthreads = opts->nthreads > 0 ? opts->nthreads : 1;
+	pthread_mutex_init (&job->lock, NULL);
+	pthread_cond_init (&job->wake, NULL);
+	job->queue = NULL;
+	job->qlen = job->qcap = 0;
+	job->busy = 0;
+	job->threads_used = 0;
+	job->in = NULL;
+	job->out = NULL;
+	job->reading = 0;
+	job->nlines = 0;
+	job->error = 0;
+}
+
+/* Start the workers, with this thread as one of them, and wait for them all to finish */
+static void job_run (factor_job_t *job){
+	pthread_t threads[job->nthreads];
+	for (int i=1; i < job->nthreads; i++){
+		pthread_create (&threads[i], NULL, factor_thread, job);
+	}
+	factor_thread (job);
+	for (int i=1; i < job->nthreads; i++){
+		pthread_join (threads[i], NULL);
+	}
+	free (job->queue);
+	pthread_mutex_destroy (&job->lock);
+	pthread_cond_destroy (&job->wake);
+}
+
+int factor_fully (mpz_t n, factor_opts_t *opts, mpz_t **factors, int *nfactors){
+	factor_job_t job;
+	job_init (&job, opts);
+	factor_input_t in;
+	in.line = 1;
+	in.text = NULL;
+	in.pending = 0;
+	in.done = NULL;
+	in.ndone = in.donecap = 0;
+
+	/* Trial division first, on N itself */
+	mpz_t m[1];
+	mpz_init (m[0]);
+	mpz_abs (m[0], n);
+	unsigned long *small;
+	int nsmall;
+	out_printf (&opts->out, "Removing small factors of N by trial division... \n");
+	out_progress (&opts->out, NSIEVE_PHASE_TDIV, -1);
+	tdiv_batch (m, 1, FACTOR_TDIV_BOUND, &small, &nsmall);
+	mpz_t f;
+	mpz_init (f);
+	for (int i=0; i < nsmall; i++){
+		mpz_set_ui (f, small[i]);
+		add_done (&in, f);
+	}
+	free (small);
+	mpz_clear (f);
+	add_piece (&job, &in, m[0], STAGE_SMALL);
+	mpz_clear (m[0]);
+
+	job_run (&job);
+
+	qsort (in.done, in.ndone, sizeof (mpz_t), mpz_compare);
+	*factors = in.done;
+	*nfactors = in.ndone;
+	return job.error;
+}
+
+void factor_batch (FILE *in, FILE *out, factor_opts_t *opts){
+	factor_job_t job;
+	job_init (&job, opts);
+	job.in = in;
+	job.out = out;
+	job_run (&job);
+}
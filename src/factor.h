@@ -0,0 +1,34 @@
+#ifndef FACTOR_H
+#define FACTOR_H
+
+#include "common.h"
+
+/* Factoring N completely, by whatever method suits each piece of it. See factor.c. */
+
+#define FACTOR_TDIV_BOUND  32768	// trial division bound for N itself
+#define FACTOR_RHO_STEPS   65536	// rho steps on pieces of FACTOR_RHO_ONLY bits or more ...
+#define FACTOR_RHO_ONLY    64	// ... and below that, rho until it splits them
+#define FACTOR_SMALL_BITS  100	// with other work waiting, pieces smaller than this only get one thread
+#define FACTOR_BATCH_CHUNK 64	// the most batch lines read at once
+#define FACTOR_LINE_MAX    4096	// the longest batch line
+
+typedef struct {
+	int nthreads;
+	int ecm_curves;		// ECM curves per piece; -1 to go by its size
+	uint32_t ecm_B1;	// 0 to go by the size
+	int64_t pm1_B1;		// -1 to go by the size, 0 to skip p-1
+	nsieve_t siqs;		// the SIQS parameters given on the command line (-1 for the defaults); copied for each run
+	ns_output_t out;	// where the messages go, from here and from the sieve
+	uint64_t relations;	// set by factor_fully: how many relations the sieve collected, over all of the pieces
+} factor_opts_t;
+
+/* Puts the prime factors of n (with repeats, in increasing order) in a malloc'd *factors, and how many there
+ * are in *nfactors. Anything that couldn't be split is in there too, so check for primality before calling
+ * a factor prime. Returns 0, or the first error (NSIEVE_E*) that kept a piece from being split. */
+int factor_fully (mpz_t n, factor_opts_t *opts, mpz_t **factors, int *nfactors);
+
+/* Factors each number (one per line) of 'in', with a pool of opts->nthreads threads shared between them,
+ * and writes a line to 'out' for each as soon as it's done: see finish_input in factor.c for the format. */
+void factor_batch (FILE *in, FILE *out, factor_opts_t *opts);
+
+#endif
@@ -1,13 +1,22 @@
 #include "filter.h"
 
-/* Allocates the actual matrix rows, and fills them in. Also makes a call to combine_partials, which,
- * predictably, combines the partials and adds them into the matrix */
+/* Fills in the (sparse) matrix rows. Also makes a call to combine_partials, which, predictably, combines
+ * the partials and adds them into the matrix */
 void build_matrix (nsieve_t * ns){
+	ns_printf (ns, "Rejected %u duplicate relations while sieving.\n", ns->ndups);
+	relset_free (&ns->seen);
+	if (ns->online != NULL){	// the rows were built while sieving; all that's left is to collect them.
+		long start = clock();
+		online_finish (ns);
+		ns->timing.filter_time = clock() - start;
+		return;
+	}
 	for (int i=0; i < ns->nfull; i++){
-		ns->relns[i].row = (uint64_t *) calloc (ns->row_len, 8);
-		fl_fillrow (ns->relns[i].r1, ns->relns[i].row, ns);
+		ns->relns[i].weight = fl_fillcols (ns->relns[i].r1, &ns->relns[i].cols, ns);
 	}
 	combine_partials (ns);
+	ns->nrows = ns->nfull;
+	ns->ncols = ns->fb_len + 1;
 }
 
 /* Whenever D partial relations share a cofactor, we can build D-1 full relations from them by picking
@@ -26,9 +35,9 @@ void combine_bucket (ht_entry_t *h, nsieve_t *ns){
 			continue;
 		}
 		rel_t *base_rel = h->rel;
-		uint64_t base_factors[ns->row_len];
+		uint32_t *base_cols;
 		fl_concat (base_rel, base_rel->poly->group->victim);
-		fl_fillrow (base_rel, &base_factors[0], ns);
+		uint32_t base_weight = fl_fillcols (base_rel, &base_cols, ns);
 
 		h = h->next;	// skip past the base rel.
 		while (h != NULL && base_rel->cofactor == h->rel->cofactor){
@@ -41,19 +50,23 @@ void combine_bucket (ht_entry_t *h, nsieve_t *ns){
 						// would probably segfault later if one somehow crept in.
 			}
 			matrel_t *m = &ns->relns[ns->nfull];
-			m->row = (uint64_t *) calloc (ns->row_len, 8);
 			m -> r1 = h -> rel;
 			m -> r2 = base_rel;
 			fl_concat (h->rel, h->rel->poly->group->victim);
-			fl_fillrow (h->rel, m->row, ns);
-			xor_row (m->row, &base_factors[0], ns->row_len);	// multiply the factorizations together.
+			uint32_t *cols;
+			uint32_t weight = fl_fillcols (h->rel, &cols, ns);
+			m->cols = (uint32_t *) malloc ((weight + base_weight + 1) * sizeof (uint32_t));
+			m->weight = sparse_row_xor (m->cols, cols, weight, base_cols, base_weight);	// multiply the factorizations together.
+			free (cols);
 			ns->nfull ++;
 			if (ns -> nfull >= ns -> rels_needed){
+				free (base_cols);
 				return;
 			}
 
 			h = h->next;
 		}
+		free (base_cols);
 		if (h == NULL){
 		       return;
 		}
@@ -66,8 +79,7 @@ void combine_partials (nsieve_t *ns){
 	long start = clock();
 	for (int i=0; i < ns->partials.nbuckets; i++){
 		if (i % 100 == 0){
-			printf("Combining bucket %d\r", i);
-			fflush(stdout);
+			ns_printf (ns, "Combining bucket %d\r", i);
 		}
 		if (ns->nfull >= ns->rels_needed){
 			ns->timing.filter_time = clock() - start;
@@ -78,6 +90,364 @@ void combine_partials (nsieve_t *ns){
 	ns->timing.filter_time = clock() - start;
 }
 
-/* Filtering goes here */
+/* Filtering. Once the matrix is built, a lot of it is dead weight. Many columns (mostly large primes) are
+ * empty. A relation with the only odd exponent of some prime (a singleton) can never be part of a dependency,
+ * and removing it may make other relations singletons in turn. The same relation found twice gives a useless
+ * dependency. And we usually have more excess rows than we need: the solver only needs a few dozen more
+ * rows than columns, so the surplus can be spent on removing whole 'cliques' - groups of relations tied
+ * together by primes that occur exactly twice - which takes out about as many columns as rows.
+ *
+ * All of this runs over a copy of the matrix with an index of which rows each column occurs in. At the end
+ * the surviving rows are moved to the front of ns->relns and renumbered to use only the surviving columns,
+ * which become the new ns->nrows and ns->ncols.
+*/
+
+typedef struct {
+	uint32_t nrows;
+	uint32_t ncols;
+	uint32_t *row_start;	// the columns of row i are cols[row_start[i] .. row_start[i+1])
+	uint32_t *cols;
+	uint32_t *col_start;	// the rows of column j are rows[col_start[j] .. col_start[j+1])
+	uint32_t *rows;
+	uint32_t *weight;	// number of live rows in each column
+	uint8_t  *alive;
+	uint32_t nalive;	// live rows
+	uint32_t nactive;	// columns with nonzero weight
+	uint32_t *stack;	// columns that have just dropped to weight 1, for singleton removal
+	uint32_t nstack;
+} filter_t;
+
+static void filter_free (filter_t *f);
+
+/* Returns 0 (with nothing left allocated) if there isn't enough memory. */
+static int filter_build (filter_t *f, nsieve_t *ns){
+	f->nrows = ns->nrows;
+	f->ncols = ns->ncols;
+	uint32_t nnz = 0;
+	for (uint32_t i=0; i < f->nrows; i++){
+		nnz += ns->relns[i].weight;
+	}
+	f->row_start = (uint32_t *) malloc ((f->nrows + 1) * sizeof (uint32_t));
+	f->weight = (uint32_t *) calloc (f->ncols, sizeof (uint32_t));
+	f->alive = (uint8_t *) malloc (f->nrows + 1);
+	f->cols = (uint32_t *) malloc ((nnz + 1) * sizeof (uint32_t));
+	f->col_start = (uint32_t *) malloc ((f->ncols + 1) * sizeof (uint32_t));
+	f->rows = (uint32_t *) malloc ((nnz + 1) * sizeof (uint32_t));
+	f->stack = (uint32_t *) malloc ((f->ncols + 1) * sizeof (uint32_t));
+	uint32_t *fill = (uint32_t *) malloc ((f->ncols + 1) * sizeof (uint32_t));	// there can be hundreds of thousands of columns, too many for the stack
+	if (f->row_start == NULL || f->weight == NULL || f->alive == NULL || f->cols == NULL || f->col_start == NULL || f->rows == NULL || f->stack == NULL || fill == NULL){
+		filter_free (f);
+		free (fill);
+		return 0;
+	}
+	memset (f->alive, 1, f->nrows);
+
+	// gather the rows into one array
+	uint32_t w = 0;
+	for (uint32_t i=0; i < f->nrows; i++){
+		f->row_start[i] = w;
+		for (uint32_t j=0; j < ns->relns[i].weight; j++){
+			uint32_t c = ns->relns[i].cols[j];
+			f->cols[w++] = c;
+			f->weight[c] ++;
+		}
+	}
+	f->row_start[f->nrows] = w;
+
+	// now the column index
+	uint32_t pos = 0;
+	for (uint32_t j=0; j < f->ncols; j++){
+		f->col_start[j] = pos;
+		pos += f->weight[j];
+	}
+	f->col_start[f->ncols] = pos;
+	memcpy (fill, f->col_start, f->ncols * sizeof (uint32_t));
+	for (uint32_t i=0; i < f->nrows; i++){
+		for (uint32_t e = f->row_start[i]; e < f->row_start[i+1]; e++){
+			f->rows[fill[f->cols[e]] ++] = i;
+		}
+	}
+	free (fill);
+
+	f->nalive = f->nrows;
+	f->nactive = 0;
+	for (uint32_t j=0; j < f->ncols; j++){
+		if (f->weight[j] > 0) f->nactive ++;
+	}
+	f->nstack = 0;
+	return 1;
+}
+
+static void filter_free (filter_t *f){
+	free (f->row_start);
+	free (f->cols);
+	free (f->col_start);
+	free (f->rows);
+	free (f->weight);
+	free (f->alive);
+	free (f->stack);
+}
+
+static inline int32_t excess (filter_t *f){
+	return (int32_t) f->nalive - (int32_t) f->nactive;
+}
+
+static void kill_row (filter_t *f, uint32_t r){
+	if (!f->alive[r]) return;
+	f->alive[r] = 0;
+	f->nalive --;
+	for (uint32_t e = f->row_start[r]; e < f->row_start[r+1]; e++){
+		uint32_t c = f->cols[e];
+		f->weight[c] --;
+		if (f->weight[c] == 0){
+			f->nactive --;
+		} else if (f->weight[c] == 1){
+			f->stack[f->nstack ++] = c;
+		}
+	}
+}
+
+/* Remove singletons until there are none left. Every column drops to weight 1 at most once, so the stack
+ * can never hold more than ncols entries. */
+static uint32_t remove_singletons (filter_t *f){
+	uint32_t removed = 0;
+	f->nstack = 0;
+	for (uint32_t j=0; j < f->ncols; j++){
+		if (f->weight[j] == 1) f->stack[f->nstack ++] = j;
+	}
+	while (f->nstack > 0){
+		uint32_t c = f->stack[-- f->nstack];
+		if (f->weight[c] != 1) continue;
+		for (uint32_t e = f->col_start[c]; e < f->col_start[c+1]; e++){
+			if (f->alive[f->rows[e]]){
+				kill_row (f, f->rows[e]);
+				removed ++;
+				break;
+			}
+		}
+	}
+	return removed;
+}
+
+static void matrel_get_id (matrel_t *m, int second, rel_id_t *id, nsieve_t *ns){
+	if (m->r1 != NULL){
+		rel_get_id (second ? m->r2 : m->r1, id, ns);
+	} else {
+		relref_get_id (second ? m->f2 : m->f1, id, ns);
+	}
+}
+
+static int has_second (matrel_t *m){
+	return m->r1 != NULL ? m->r2 != NULL : m->f2 != NULL;
+}
+
+typedef struct {
+	uint64_t key;
+	uint32_t row;
+} keyed_row_t;
+
+static int by_key (const void *a, const void *b){
+	const keyed_row_t *ka = (const keyed_row_t *) a;
+	const keyed_row_t *kb = (const keyed_row_t *) b;
+	if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->row < kb->row ? -1 : (ka->row > kb->row);
+}
+
+static int same_matrel (matrel_t *a, matrel_t *b, nsieve_t *ns){
+	if (has_second (a) != has_second (b)) return 0;
+	rel_id_t ia, ib;
+	matrel_get_id (a, 0, &ia, ns);
+	matrel_get_id (b, 0, &ib, ns);
+	if (!rel_id_equal (&ia, &ib)) return 0;
+	if (!has_second (a)) return 1;
+	matrel_get_id (a, 1, &ia, ns);
+	matrel_get_id (b, 1, &ib, ns);
+	return rel_id_equal (&ia, &ib);
+}
+
+/* Remove matrix relations made from exactly the same relations as an earlier one, and combined partials whose
+ * two halves are the same relation (those rows are zero, and their dependency is trivial). */
+static uint32_t remove_duplicates (filter_t *f, nsieve_t *ns){
+	uint32_t removed = 0;
+	keyed_row_t *keys = (keyed_row_t *) malloc ((f->nrows + 1) * sizeof (keyed_row_t));
+	if (keys == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return 0;
+	}
+	for (uint32_t i=0; i < f->nrows; i++){
+		matrel_t *m = &ns->relns[i];
+		rel_id_t id;
+		matrel_get_id (m, 0, &id, ns);
+		keys[i].key = rel_id_hash (&id);
+		keys[i].row = i;
+		if (has_second (m)){
+			rel_id_t id2;
+			matrel_get_id (m, 1, &id2, ns);
+			if (rel_id_equal (&id, &id2)){
+				kill_row (f, i);
+				removed ++;
+				continue;
+			}
+			keys[i].key = keys[i].key * 31 + rel_id_hash (&id2);
+		}
+	}
+	qsort (keys, f->nrows, sizeof (keyed_row_t), by_key);
+	for (uint32_t i=1; i < f->nrows; i++){
+		uint32_t r = keys[i].row;
+		if (!f->alive[r]) continue;
+		// compare against every earlier row with the same key
+		for (uint32_t j = i; j > 0 && keys[j-1].key == keys[i].key; j--){
+			uint32_t q = keys[j-1].row;
+			if (f->alive[q] && same_matrel (&ns->relns[r], &ns->relns[q], ns)){
+				kill_row (f, r);
+				removed ++;
+				break;
+			}
+		}
+	}
+	free (keys);
+	return removed;
+}
+
+/* Union-find over the rows, for finding cliques */
+static uint32_t uf_find (uint32_t *parent, uint32_t x){
+	while (parent[x] != x){
+		parent[x] = parent[parent[x]];
+		x = parent[x];
+	}
+	return x;
+}
+
+typedef struct {
+	uint32_t size;
+	uint32_t root;
+} clique_t;
+
+static int by_size_desc (const void *a, const void *b){
+	const clique_t *ca = (const clique_t *) a;
+	const clique_t *cb = (const clique_t *) b;
+	if (ca->size != cb->size) return ca->size > cb->size ? -1 : 1;
+	return ca->root < cb->root ? -1 : (ca->root > cb->root);
+}
+
+/* Remove cliques, biggest first, until the excess is down to 'target'. Taking out a clique of r rows also
+ * takes out at least the r-1 columns of weight 2 that held it together, so each one lowers the excess by at
+ * most 1, and removing (excess - target) of them in a pass can never overshoot. */
+static uint32_t remove_cliques (filter_t *f, int32_t target){
+	uint32_t removed = 0;
+	uint32_t *parent = (uint32_t *) malloc (f->nrows * sizeof (uint32_t));
+	uint32_t *size = (uint32_t *) malloc (f->nrows * sizeof (uint32_t));
+	clique_t *cliques = (clique_t *) malloc (f->nrows * sizeof (clique_t));
+	uint8_t *doomed = (uint8_t *) malloc (f->nrows + 1);
+	if (parent == NULL || size == NULL || cliques == NULL || doomed == NULL) target = excess (f);	// the cliques can stay; the solver copes.
+
+	while (excess (f) > target){
+		for (uint32_t i=0; i < f->nrows; i++){
+			parent[i] = i;
+			size[i] = 0;
+		}
+		for (uint32_t j=0; j < f->ncols; j++){
+			if (f->weight[j] != 2) continue;
+			uint32_t pair[2];
+			int n = 0;
+			for (uint32_t e = f->col_start[j]; e < f->col_start[j+1] && n < 2; e++){
+				if (f->alive[f->rows[e]]) pair[n++] = f->rows[e];
+			}
+			uint32_t a = uf_find (parent, pair[0]);
+			uint32_t b = uf_find (parent, pair[1]);
+			if (a != b) parent[a] = b;
+		}
+		uint32_t ncliques = 0;
+		for (uint32_t i=0; i < f->nrows; i++){
+			if (f->alive[i]) size[uf_find (parent, i)] ++;
+		}
+		for (uint32_t i=0; i < f->nrows; i++){
+			if (size[i] > 0){
+				cliques[ncliques].size = size[i];
+				cliques[ncliques].root = i;
+				ncliques ++;
+			}
+		}
+		qsort (cliques, ncliques, sizeof (clique_t), by_size_desc);
+
+		uint32_t want = excess (f) - target;
+		if (want > ncliques) want = ncliques;
+		memset (doomed, 0, f->nrows);
+		for (uint32_t i=0; i < want; i++){
+			doomed[cliques[i].root] = 1;
+		}
+		uint32_t before = f->nalive;
+		for (uint32_t i=0; i < f->nrows; i++){
+			if (f->alive[i] && doomed[uf_find (parent, i)]){
+				kill_row (f, i);
+			}
+		}
+		remove_singletons (f);
+		if (f->nalive == before) break;
+		removed += before - f->nalive;
+	}
+	free (parent);
+	free (size);
+	free (cliques);
+	free (doomed);
+	return removed;
+}
+
+/* Move the live rows to the front of ns->relns and renumber their columns to skip the empty ones. */
+static void filter_compact (filter_t *f, nsieve_t *ns){
+	uint32_t *colmap = (uint32_t *) malloc ((f->ncols + 1) * sizeof (uint32_t));
+	if (colmap == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	uint32_t ncols = 0;
+	for (uint32_t j=0; j < f->ncols; j++){
+		colmap[j] = ncols;
+		if (f->weight[j] > 0) ncols ++;
+	}
+	ns->ncols = ncols;
+
+	uint32_t w = 0;
+	for (uint32_t i=0; i < f->nrows; i++){
+		if (!f->alive[i]){
+			free (ns->relns[i].cols);
+			continue;
+		}
+		ns->relns[w] = ns->relns[i];
+		for (uint32_t j=0; j < ns->relns[w].weight; j++){	// the map is increasing, so the rows stay sorted.
+			ns->relns[w].cols[j] = colmap[ns->relns[w].cols[j]];
+		}
+		w ++;
+	}
+	ns->nrows = w;
+	free (colmap);
+}
+
+/* Run the whole filter: duplicates, then singletons, then cliques down to the target excess. */
 void filter (nsieve_t *ns){
+	if (ns->error != 0) return;
+	long start = clock();
+	filter_t f;
+	if (!filter_build (&f, ns)){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	uint32_t rows0 = f.nalive;
+	uint32_t cols0 = f.nactive;
+
+	uint32_t ndup = remove_duplicates (&f, ns);
+	if (ns->error != 0){
+		filter_free (&f);
+		return;
+	}
+	uint32_t nsingle = remove_singletons (&f);
+	uint32_t nclique = remove_cliques (&f, ns->target_excess);
+
+	ns_printf (ns, "Filtering: %u x %u matrix (%u nonempty columns) down to %u x %u; removed %u duplicates, %u singletons and %u rows in cliques.\n", rows0, f.ncols, cols0, f.nalive, f.nactive, ndup, nsingle, nclique);
+	if (excess (&f) <= 0){
+		ns_printf (ns, "Warning: no excess rows left after filtering; the matrix may not have any dependencies.\n");
+	}
+	filter_compact (&f, ns);
+	filter_free (&f);
+	ns->timing.filter_time += clock() - start;
 }
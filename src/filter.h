@@ -3,9 +3,12 @@
 
 #include "common.h"
 #include "sieve.h"
+#include "postproc.h"
 
 /* This section of the program will do the matrix building and filtering */
 
+#define FILTER_TARGET_EXCESS 64	// default for ns->target_excess
+
 void build_matrix (nsieve_t *);
 void combine_partials (nsieve_t *);
 void filter (nsieve_t *);
@@ -0,0 +1,469 @@
+#include "lanczos.h"
+
+/* Block Lanczos, after Montgomery ("A Block Lanczos Algorithm for Finding Dependencies over GF(2)", 1995).
+ *
+ * Let M be the matrix with one column per matrix relation (row of ns->relns) and one row per prime; we want
+ * vectors x with Mx = 0. A = M^T M is symmetric, and Lanczos finds solutions of Ax = Ay for a random y, so
+ * that x - y is in the nullspace of A. It works on 64 vectors at once, packed into one uint64_t per matrix
+ * relation, so an 'n x 64' matrix below is just an array of n words, and a 64 x 64 matrix is 64 words
+ * (word i is row i). Each iteration needs one multiplication by A, which is done straight from the sparse
+ * rows as M^T (M v), plus a handful of passes over n-word arrays; there are about n/63 iterations. Memory is
+ * the sparse rows plus a dozen n-word arrays, instead of the n^2/4 bits gaussian elimination needs.
+ *
+ * The iteration, with S_i the set of columns of V_i that are kept and W_i^inv = S_i (S_i^T V_i^T A V_i S_i)^-1 S_i^T:
+ *
+ * 	V_0     = Ay
+ * 	V_{i+1} = A V_i S_i S_i^T + V_i D_{i+1} + V_{i-1} E_{i+1} + V_{i-2} F_{i+1}
+ * 	D_{i+1} = I + W_i^inv (V_i^T A^2 V_i S_i S_i^T + V_i^T A V_i)
+ * 	E_{i+1} = W_{i-1}^inv V_i^T A V_i S_i S_i^T
+ * 	F_{i+1} = W_{i-2}^inv (I + V_{i-1}^T A V_{i-1} W_{i-1}^inv) (V_{i-1}^T A^2 V_{i-1} S_{i-1} S_{i-1}^T + V_{i-1}^T A V_{i-1}) S_i S_i^T
+ * 	x       = SUM_i V_i W_i^inv V_i^T V_0
+ *
+ * (everything is mod 2, so all of the minus signs in the paper are plus signs), and it stops when
+ * V_m^T A V_m = 0. At that point M(x - y) and M V_m are usually not quite zero, but some combinations of
+ * their 128 columns are, and those combinations of x - y and V_m are the dependencies we want.
+*/
+
+static uint64_t xorshift (uint64_t *state){
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dull;
+}
+
+/* out = M x: for each relation, xor its word of x into the words for its columns. out has ncols words. */
+static void mul_M (nsieve_t *ns, const uint64_t *x, uint64_t *out){
+	memset (out, 0, ns->ncols * sizeof (uint64_t));
+	for (uint32_t i=0; i < ns->nrows; i++){
+		const uint64_t xi = x[i];
+		const uint32_t *cols = ns->relns[i].cols;
+		for (uint32_t j=0; j < ns->relns[i].weight; j++){
+			out[cols[j]] ^= xi;
+		}
+	}
+}
+
+/* y = A x = M^T (M x). tmp must have ncols words. */
+static void mul_A (nsieve_t *ns, const uint64_t *x, uint64_t *y, uint64_t *tmp){
+	mul_M (ns, x, tmp);
+	for (uint32_t i=0; i < ns->nrows; i++){
+		uint64_t acc = 0;
+		const uint32_t *cols = ns->relns[i].cols;
+		for (uint32_t j=0; j < ns->relns[i].weight; j++){
+			acc ^= tmp[cols[j]];
+		}
+		y[i] = acc;
+	}
+}
+
+/* c = a b, for 64 x 64 matrices. c may be a or b. */
+static void mul_64x64 (const uint64_t *a, const uint64_t *b, uint64_t *c){
+	uint64_t res[64];
+	for (int i=0; i < 64; i++){
+		uint64_t x = a[i];
+		uint64_t r = 0;
+		while (x != 0){
+			r ^= b[__builtin_ctzll (x)];
+			x &= x - 1;
+		}
+		res[i] = r;
+	}
+	memcpy (c, res, sizeof (res));
+}
+
+/* y ^= x m, for an n x 64 matrix x and a 64 x 64 matrix m. Precomputing the sums of rows of m for every value
+ * of each byte of x turns each row into 8 lookups. */
+static void mul_Nx64_64x64_acc (const uint64_t *x, const uint64_t *m, uint64_t *y, uint32_t n){
+	uint64_t (*tab)[256] = (uint64_t (*)[256]) malloc (8 * 256 * sizeof (uint64_t));
+	for (int b=0; b < 8; b++){
+		tab[b][0] = 0;
+		for (int v=1; v < 256; v++){
+			tab[b][v] = tab[b][v & (v-1)] ^ m[8*b + __builtin_ctz (v)];
+		}
+	}
+	for (uint32_t k=0; k < n; k++){
+		uint64_t xk = x[k];
+		uint64_t r = 0;
+		for (int b=0; b < 8; b++){
+			r ^= tab[b][(xk >> (8*b)) & 255];
+		}
+		y[k] ^= r;
+	}
+	free (tab);
+}
+
+/* c = x^T y, for n x 64 matrices x and y. Row j of the result is the xor of the y[k] for which bit j of x[k]
+ * is set; the y[k] are first bucketed by each byte of x[k], then the buckets are summed. */
+static void mul_64xN_Nx64 (const uint64_t *x, const uint64_t *y, uint64_t *c, uint32_t n){
+	uint64_t (*tab)[256] = (uint64_t (*)[256]) calloc (8 * 256, sizeof (uint64_t));
+	for (uint32_t k=0; k < n; k++){
+		uint64_t xk = x[k];
+		for (int b=0; b < 8; b++){
+			tab[b][(xk >> (8*b)) & 255] ^= y[k];
+		}
+	}
+	for (int b=0; b < 8; b++){
+		for (int j=0; j < 8; j++){
+			uint64_t acc = 0;
+			for (int v=0; v < 256; v++){
+				if ((v >> j) & 1) acc ^= tab[b][v];
+			}
+			c[8*b + j] = acc;
+		}
+	}
+	free (tab);
+}
+
+static int is_zero_64 (const uint64_t *m, uint32_t n){
+	for (uint32_t i=0; i < n; i++){
+		if (m[i] != 0) return 0;
+	}
+	return 1;
+}
+
+/* Choose S_i and compute W_i^inv from T = V_i^T A V_i, as in section 8 of Montgomery's paper: gauss-jordan on
+ * [T | I], taking the columns that were not in S_{i-1} first (so that no column is left out twice in a row).
+ * Whenever a column has no pivot it is dropped from S_i, and the identity half is used to fix things up
+ * instead. On return s[0..dim) are the columns of S_i, and winv is W_i^inv. Returns dim (0 on failure). */
+static int choose_s (const uint64_t *t, int *s, const int *last_s, int last_dim, uint64_t *winv){
+	uint64_t m[64][2];
+	for (int i=0; i < 64; i++){
+		m[i][0] = t[i];
+		m[i][1] = 1ull << i;
+	}
+	uint64_t last = 0;
+	for (int i=0; i < last_dim; i++){
+		last |= 1ull << last_s[i];
+	}
+	int j = 0;
+	for (int i=0; i < 64; i++){
+		if (!(last & (1ull << i))) s[j++] = i;
+	}
+	for (int i=0; i < last_dim; i++){
+		s[j++] = last_s[i];
+	}
+
+	int dim = 0;
+	for (int i=0; i < 64; i++){
+		uint64_t bit = 1ull << s[i];
+		uint64_t *row_i = m[s[i]];
+
+		// look for a pivot for this column in the T half
+		for (j = i; j < 64; j++){
+			uint64_t *row_j = m[s[j]];
+			if (row_j[0] & bit){
+				uint64_t t0 = row_j[0], t1 = row_j[1];
+				row_j[0] = row_i[0];
+				row_j[1] = row_i[1];
+				row_i[0] = t0;
+				row_i[1] = t1;
+				break;
+			}
+		}
+		if (j < 64){
+			for (j = 0; j < 64; j++){
+				uint64_t *row_j = m[s[j]];
+				if (row_j != row_i && (row_j[0] & bit)){
+					row_j[0] ^= row_i[0];
+					row_j[1] ^= row_i[1];
+				}
+			}
+			s[dim++] = s[i];
+			continue;
+		}
+
+		// no pivot, so this column is not in S_i; use the identity half instead.
+		for (j = i; j < 64; j++){
+			uint64_t *row_j = m[s[j]];
+			if (row_j[1] & bit){
+				uint64_t t0 = row_j[0], t1 = row_j[1];
+				row_j[0] = row_i[0];
+				row_j[1] = row_i[1];
+				row_i[0] = t0;
+				row_i[1] = t1;
+				break;
+			}
+		}
+		if (j == 64){
+			return 0;	// not invertible; this happens when the iteration has broken down.
+		}
+		for (j = 0; j < 64; j++){
+			uint64_t *row_j = m[s[j]];
+			if (row_j != row_i && (row_j[1] & bit)){
+				row_j[0] ^= row_i[0];
+				row_j[1] ^= row_i[1];
+			}
+		}
+		row_i[0] = row_i[1] = 0;
+	}
+	for (int i=0; i < 64; i++){
+		winv[i] = m[i][1];
+	}
+	return dim;
+}
+
+static inline int parity64 (uint64_t x){
+	return __builtin_parityll (x);
+}
+
+/* Gaussian elimination on a set of nvec bit vectors of 'words' words each. Each vector is reduced by the
+ * pivots before it; vectors that become zero are reported through 'hist' (which records the combination of
+ * the original vectors each one now is, one bit per vector, two words per vector). The nonzero reduced vectors
+ * are left in place and flagged in 'pivot'. */
+static void reduce_vectors (uint64_t *vecs, uint32_t words, int nvec, uint64_t (*hist)[2], int *pivot_col){
+	for (int i=0; i < nvec; i++){
+		uint64_t *vi = vecs + (size_t) i * words;
+		for (int p=0; p < i; p++){
+			if (pivot_col[p] < 0) continue;
+			if (vi[pivot_col[p] / 64] & (1ull << (pivot_col[p] % 64))){
+				xor_row (vi, vecs + (size_t) p * words, words);
+				if (hist != NULL){
+					hist[i][0] ^= hist[p][0];
+					hist[i][1] ^= hist[p][1];
+				}
+			}
+		}
+		pivot_col[i] = -1;
+		for (uint32_t w=0; w < words; w++){
+			if (vi[w] != 0){
+				pivot_col[i] = 64 * w + __builtin_ctzll (vi[w]);
+				break;
+			}
+		}
+	}
+}
+
+/* Find the combinations of the columns of Z = [x | v] that M maps to zero, and pack up to 64 independent
+ * nonzero ones into deps. Returns how many. */
+static int combine_solutions (nsieve_t *ns, const uint64_t *x, const uint64_t *v, uint64_t *deps){
+	const uint32_t n = ns->nrows;
+	const uint32_t cwords = ns->ncols / 64 + 1;
+	const uint32_t rwords = n / 64 + 1;
+
+	/* The 128 columns of MZ, each as a vector of ncols bits */
+	uint64_t *mz = (uint64_t *) malloc (ns->ncols * sizeof (uint64_t));
+	uint64_t *vecs = (uint64_t *) calloc ((size_t) 128 * cwords, sizeof (uint64_t));
+	if (mz == NULL || vecs == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		free (mz);
+		free (vecs);
+		return 0;
+	}
+	for (int half=0; half < 2; half++){
+		mul_M (ns, half == 0 ? x : v, mz);
+		for (uint32_t c=0; c < ns->ncols; c++){
+			uint64_t bits = mz[c];
+			while (bits != 0){
+				int j = __builtin_ctzll (bits) + 64 * half;
+				vecs[(size_t) j * cwords + c / 64] |= 1ull << (c % 64);
+				bits &= bits - 1;
+			}
+		}
+	}
+	free (mz);
+
+	uint64_t hist[128][2];
+	int pivot_col[128];
+	for (int i=0; i < 128; i++){
+		hist[i][0] = i < 64 ? 1ull << i : 0;
+		hist[i][1] = i < 64 ? 0 : 1ull << (i - 64);
+	}
+	reduce_vectors (vecs, cwords, 128, hist, pivot_col);
+	free (vecs);
+
+	/* Each combination that came out zero gives a vector in the nullspace of M. Some of these will be zero
+	 * or repeats, so reduce them too, and keep what is left. */
+	int ncand = 0;
+	uint64_t *cands = (uint64_t *) calloc ((size_t) 128 * rwords, sizeof (uint64_t));
+	if (cands == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return 0;
+	}
+	for (int i=0; i < 128; i++){
+		if (pivot_col[i] >= 0) continue;
+		uint64_t *cv = cands + (size_t) ncand * rwords;
+		for (uint32_t k=0; k < n; k++){
+			if (parity64 (x[k] & hist[i][0]) ^ parity64 (v[k] & hist[i][1])){
+				cv[k / 64] |= 1ull << (k % 64);
+			}
+		}
+		ncand ++;
+	}
+	int cand_pivot[128];
+	reduce_vectors (cands, rwords, ncand, NULL, cand_pivot);
+
+	int ndeps = 0;
+	for (int i=0; i < ncand && ndeps < 64; i++){
+		if (cand_pivot[i] < 0) continue;
+		uint64_t *cv = cands + (size_t) i * rwords;
+		for (uint32_t k=0; k < n; k++){
+			if (cv[k / 64] & (1ull << (k % 64))){
+				deps[k] |= 1ull << ndeps;
+			}
+		}
+		ndeps ++;
+	}
+	free (cands);
+	return ndeps;
+}
+
+/* One attempt from a random starting point. Returns the number of dependencies found, 0 on failure. */
+static int lanczos_try (nsieve_t *ns, uint64_t *deps, uint64_t seed){
+	const uint32_t n = ns->nrows;
+	uint64_t *x     = (uint64_t *) calloc (n, sizeof (uint64_t));
+	uint64_t *y     = (uint64_t *) malloc (n * sizeof (uint64_t));
+	uint64_t *v0    = (uint64_t *) malloc (n * sizeof (uint64_t));
+	uint64_t *v     = (uint64_t *) malloc (n * sizeof (uint64_t));	// V_i
+	uint64_t *v1    = (uint64_t *) calloc (n, sizeof (uint64_t));	// V_{i-1}
+	uint64_t *v2    = (uint64_t *) calloc (n, sizeof (uint64_t));	// V_{i-2}
+	uint64_t *vnext = (uint64_t *) malloc (n * sizeof (uint64_t));
+	uint64_t *av    = (uint64_t *) malloc (n * sizeof (uint64_t));
+	uint64_t *tmp   = (uint64_t *) malloc ((ns->ncols + 1) * sizeof (uint64_t));
+	if (x == NULL || y == NULL || v0 == NULL || v == NULL || v1 == NULL || v2 == NULL || vnext == NULL || av == NULL || tmp == NULL){
+		ns_printf (ns, "Could not allocate the Lanczos vectors.\n");
+		ns_error (ns, NSIEVE_ENOMEM);
+		free (x);
+		free (y);
+		free (v0);
+		free (v);
+		free (v1);
+		free (v2);
+		free (vnext);
+		free (av);
+		free (tmp);
+		return 0;
+	}
+
+	for (uint32_t i=0; i < n; i++){
+		y[i] = xorshift (&seed);
+	}
+	mul_A (ns, y, v, tmp);
+	memcpy (v0, v, n * sizeof (uint64_t));
+
+	uint64_t winv[64], winv1[64], winv2[64];	// W_i^inv, W_{i-1}^inv, W_{i-2}^inv
+	uint64_t vav[64], va2v[64], vav1[64], va2v1[64];	// V^T A V and V^T A^2 V, for i and i-1
+	uint64_t mask = ~0ull, mask1 = ~0ull;	// S_i and S_{i-1}, as bit masks
+	memset (winv1, 0, sizeof (winv1));
+	memset (winv2, 0, sizeof (winv2));
+	memset (vav1, 0, sizeof (vav1));
+	memset (va2v1, 0, sizeof (va2v1));
+	int s[64], last_s[64];
+	int last_dim = 64;
+	for (int i=0; i < 64; i++){
+		last_s[i] = i;
+	}
+
+	const uint32_t max_iter = n / 60 + 100;	// each iteration should take out about 63 dimensions
+	uint32_t iter = 0;
+	int ok = 1;
+	while (1){
+		if (iter % 10 == 0){
+			ns_printf (ns, "Lanczos iteration %u (of about %u)\r", iter, n / 63);
+		}
+		mul_A (ns, v, av, tmp);
+		mul_64xN_Nx64 (v, av, vav, n);
+		if (is_zero_64 (vav, 64)){
+			break;	// done; hopefully v is zero too, but combine_solutions copes if it isn't.
+		}
+		mul_64xN_Nx64 (av, av, va2v, n);
+		int dim = choose_s (vav, s, last_s, last_dim, winv);
+		if (dim == 0 || ++iter > max_iter){
+			ok = 0;
+			break;
+		}
+		mask = 0;
+		for (int i=0; i < dim; i++){
+			mask |= 1ull << s[i];
+		}
+
+		// x += V_i W_i^inv V_i^T V_0
+		uint64_t d[64], e[64], f[64], t1[64], t2[64];
+		mul_64xN_Nx64 (v, v0, t1, n);
+		mul_64x64 (winv, t1, t1);
+		mul_Nx64_64x64_acc (v, t1, x, n);
+
+		// D_{i+1}
+		for (int i=0; i < 64; i++){
+			t1[i] = (va2v[i] & mask) ^ vav[i];
+		}
+		mul_64x64 (winv, t1, d);
+		for (int i=0; i < 64; i++){
+			d[i] ^= 1ull << i;
+		}
+
+		// E_{i+1}
+		for (int i=0; i < 64; i++){
+			t1[i] = vav[i] & mask;
+		}
+		mul_64x64 (winv1, t1, e);
+
+		// F_{i+1}
+		mul_64x64 (vav1, winv1, t1);
+		for (int i=0; i < 64; i++){
+			t1[i] ^= 1ull << i;
+			t2[i] = (va2v1[i] & mask1) ^ vav1[i];
+		}
+		mul_64x64 (t1, t2, t1);
+		mul_64x64 (winv2, t1, f);
+		for (int i=0; i < 64; i++){
+			f[i] &= mask;
+		}
+
+		// V_{i+1}
+		for (uint32_t k=0; k < n; k++){
+			vnext[k] = av[k] & mask;
+		}
+		mul_Nx64_64x64_acc (v, d, vnext, n);
+		mul_Nx64_64x64_acc (v1, e, vnext, n);
+		mul_Nx64_64x64_acc (v2, f, vnext, n);
+
+		// and shift everything down by one
+		uint64_t *recycle = v2;
+		v2 = v1;
+		v1 = v;
+		v = vnext;
+		vnext = recycle;
+		memcpy (winv2, winv1, sizeof (winv));
+		memcpy (winv1, winv, sizeof (winv));
+		memcpy (vav1, vav, sizeof (vav));
+		memcpy (va2v1, va2v, sizeof (va2v));
+		mask1 = mask;
+		memcpy (last_s, s, dim * sizeof (int));
+		last_dim = dim;
+	}
+	ns_printf (ns, "\n");
+
+	int ndeps = 0;
+	if (ok){
+		for (uint32_t i=0; i < n; i++){
+			x[i] ^= y[i];
+		}
+		ndeps = combine_solutions (ns, x, v, deps);
+		ns_printf (ns, "Block Lanczos finished after %u iterations and found %d dependencies.\n", iter, ndeps);
+	} else {
+		ns_printf (ns, "Block Lanczos broke down after %u iterations.\n", iter);
+	}
+	free (x);
+	free (y);
+	free (v0);
+	free (v);
+	free (v1);
+	free (v2);
+	free (vnext);
+	free (av);
+	free (tmp);
+	return ndeps;
+}
+
+int block_lanczos (nsieve_t *ns, uint64_t *deps){
+	ns_printf (ns, "\nStarting block Lanczos on a %u x %u matrix...\n", ns->nrows, ns->ncols);
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	for (int t=0; t < LANCZOS_TRIES; t++){
+		memset (deps, 0, ns->nrows * sizeof (uint64_t));
+		int ndeps = lanczos_try (ns, deps, seed + t);
+		if (ndeps > 0 || ns->error != 0) return ndeps;	// no point in retrying without the memory
+	}
+	return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef LANCZOS_H
+#define LANCZOS_H
+
+#include "common.h"
+
+/* Block Lanczos over GF(2), for matrices too big for dense gaussian elimination. See lanczos.c. */
+
+#define LANCZOS_TRIES 3		// how many random starting points to try before giving up
+
+int block_lanczos (nsieve_t *, uint64_t *deps);	// fills in deps like gauss_solve; returns the number found (0 on failure)
+
+#endif
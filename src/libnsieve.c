@@ -0,0 +1,144 @@
+#include "nsieve.h"
+
+/* The library interface (see libnsieve.h). A context is little more than the options and a lock: everything
+ * a factorization needs is made by factor_fully and the nsieve_t of each SIQS run, and freed again before
+ * nsieve_factor returns, so contexts don't share anything but the read-only tables (the parameter table in
+ * nsieve.c, the row kernels picked by rowops_init). The messages and progress of a run are routed through
+ * the ns_output_t in factor_opts_t and nsieve_t; here they go to the user's callbacks, one at a time.
+ *
+ * The parameter table can be extended with add_params, but only before any context starts factoring; the
+ * tuned parameter file (see tune.c) is left to bin/nsieve.
+*/
+
+struct nsieve_context {
+	nsieve_opts_t opts;
+	pthread_mutex_t cb_lock;	// held while one of the user's callbacks runs
+	pthread_mutex_t busy_lock;
+	int busy;		// 1 while nsieve_factor is running on this context
+};
+
+/* Both run with cb_lock held: it's the lock of the context's ns_output_t. */
+static void ctx_log (void *arg, const char *msg){
+	nsieve_ctx_t *ctx = (nsieve_ctx_t *) arg;
+	if (ctx->opts.log == NULL) return;	// nothing is printed without a callback
+	ctx->opts.log (ctx->opts.arg, msg);
+}
+
+static void ctx_progress (void *arg, int phase, double done){
+	nsieve_ctx_t *ctx = (nsieve_ctx_t *) arg;
+	ctx->opts.progress (ctx->opts.arg, phase, done);
+}
+
+void nsieve_default_opts (nsieve_opts_t *opts){
+	opts->nthreads = 1;
+	opts->ecm_curves = -1;
+	opts->ecm_B1 = 0;
+	opts->pm1_B1 = -1;
+	opts->fb_bound = -1;
+	opts->lp_bound = -1;
+	opts->M = -1;
+	opts->T = -1;
+	opts->multiplier = -1;
+	opts->sieve_start = -1;
+	opts->verify = 1;
+	opts->log = NULL;
+	opts->progress = NULL;
+	opts->arg = NULL;
+}
+
+nsieve_ctx_t *nsieve_create (const nsieve_opts_t *opts){
+	nsieve_ctx_t *ctx = (nsieve_ctx_t *) malloc (sizeof (nsieve_ctx_t));
+	if (ctx == NULL) return NULL;
+	ctx->opts = *opts;
+	if (ctx->opts.nthreads < 1) ctx->opts.nthreads = 1;
+	pthread_mutex_init (&ctx->cb_lock, NULL);
+	pthread_mutex_init (&ctx->busy_lock, NULL);
+	ctx->busy = 0;
+	return ctx;
+}
+
+void nsieve_destroy (nsieve_ctx_t *ctx){
+	if (ctx == NULL) return;
+	pthread_mutex_destroy (&ctx->cb_lock);
+	pthread_mutex_destroy (&ctx->busy_lock);
+	free (ctx);
+}
+
+/* The same as bin/nsieve N, with the options in the context, except that factor_fully's output goes to
+ * the callbacks, and its result comes back instead of being printed. */
+int nsieve_factor (nsieve_ctx_t *ctx, const mpz_t n, mpz_t **factors, int *nfactors){
+	*factors = NULL;
+	*nfactors = 0;
+	if (mpz_sgn (n) <= 0) return NSIEVE_EINPUT;
+
+	pthread_mutex_lock (&ctx->busy_lock);
+	int busy = ctx->busy;
+	ctx->busy = 1;
+	pthread_mutex_unlock (&ctx->busy_lock);
+	if (busy) return NSIEVE_EBUSY;
+
+	const nsieve_opts_t *o = &ctx->opts;
+	factor_opts_t opts;
+	opts.nthreads = o->nthreads;
+	opts.ecm_curves = o->ecm_curves;
+	opts.ecm_B1 = o->ecm_B1;
+	opts.pm1_B1 = o->pm1_B1;
+	opts.siqs.T = o->T;
+	opts.siqs.fb_bound = o->fb_bound;
+	opts.siqs.lp_bound = o->lp_bound;
+	opts.siqs.M = o->M;
+	opts.siqs.multiplier = o->multiplier;
+	opts.siqs.merge_density = -1;
+	opts.siqs.sieve_start = o->sieve_start;
+	opts.siqs.mult_bound = MULT_BOUND;
+	opts.siqs.mult_trials = MULT_TRIALS;
+	opts.siqs.solver = SOLVER_AUTO;
+	opts.siqs.verify = o->verify;
+	opts.siqs.nthreads = o->nthreads;
+	opts.out.log = ctx_log;		// even without a callback, so that out_printf doesn't go to stdout
+	opts.out.progress = o->progress != NULL ? ctx_progress : NULL;
+	opts.out.arg = ctx;
+	opts.out.lock = &ctx->cb_lock;
+
+	mpz_t ncopy;
+	mpz_init_set (ncopy, n);
+	int err = factor_fully (ncopy, &opts, factors, nfactors);
+	mpz_clear (ncopy);
+
+	int res = NSIEVE_OK;
+	if (err != 0){
+		nsieve_free_factors (*factors, *nfactors);
+		*factors = NULL;
+		*nfactors = 0;
+		res = err;
+	} else {
+		for (int i=0; i < *nfactors; i++){
+			if (!bpsw_prime_p ((*factors)[i])) res = NSIEVE_PARTIAL;
+		}
+	}
+
+	pthread_mutex_lock (&ctx->busy_lock);
+	ctx->busy = 0;
+	pthread_mutex_unlock (&ctx->busy_lock);
+	return res;
+}
+
+void nsieve_free_factors (mpz_t *factors, int nfactors){
+	if (factors == NULL) return;
+	for (int i=0; i < nfactors; i++){
+		mpz_clear (factors[i]);
+	}
+	free (factors);
+}
+
+const char *nsieve_strerror (int code){
+	switch (code){
+		case NSIEVE_OK:      return "completely factored";
+		case NSIEVE_PARTIAL: return "some factors could not be split";
+		case NSIEVE_EINPUT:  return "not a positive number";
+		case NSIEVE_ENOMEM:  return "out of memory";
+		case NSIEVE_EPOLYS:  return "ran out of polynomials";
+		case NSIEVE_EBUSY:   return "the context is already factoring";
+	}
+	return "unknown error";
+}
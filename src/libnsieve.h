@@ -0,0 +1,71 @@
+#ifndef LIBNSIEVE_H
+#define LIBNSIEVE_H
+
+#include <stdint.h>
+#include <gmp.h>
+
+/* The interface for using nsieve as a library (build/libnsieve.a, linked with -lgmp -lm -lpthread). A context
+ * holds a set of options; nsieve_factor factors a number with them, the way bin/nsieve does, and hands back
+ * its prime factors. Nothing is printed: the messages bin/nsieve would print go to the log callback, if there
+ * is one, and the phases of the work are reported to the progress callback. Failures are returned as one of
+ * the error codes below rather than ending the process. Each context runs one factorization at a time, but
+ * any number of contexts can be used at once, from different threads. See libnsieve.c. */
+
+/* Return values of nsieve_factor */
+#define NSIEVE_OK        0	// n is completely factored
+#define NSIEVE_PARTIAL   1	// some of the factors are composites that couldn't be split (see nsieve_factor)
+#define NSIEVE_EINPUT   -1	// n isn't a positive number
+#define NSIEVE_ENOMEM   -2	// one of the big tables (sieve, relation set, matrix, solver, square root) couldn't be allocated
+#define NSIEVE_EPOLYS   -3	// the sieve ran out of polynomials before it had enough relations
+#define NSIEVE_EBUSY    -4	// the context is already factoring something
+
+/* The phases reported to the progress callback */
+#define NSIEVE_PHASE_TDIV   0	// trial division
+#define NSIEVE_PHASE_RHO    1	// pollard rho
+#define NSIEVE_PHASE_PM1    2	// pollard p-1
+#define NSIEVE_PHASE_ECM    3	// the elliptic curve method
+#define NSIEVE_PHASE_SIEVE  4	// the quadratic sieve: collecting relations
+#define NSIEVE_PHASE_MATRIX 5	// building, filtering and solving the matrix
+#define NSIEVE_PHASE_SQRT   6	// finding the factors from the dependencies
+#define NSIEVE_PHASE_SMALL  7	// splitting a piece of up to 128 bits in native integers (rho, or a small sieve)
+#define NSIEVE_NPHASES      8
+
+typedef struct {
+	int nthreads;		// threads to use (1)
+	int ecm_curves;		// ECM curves per piece (-1: by its size)
+	uint32_t ecm_B1;	// the ECM stage 1 bound (0: by the size)
+	int64_t pm1_B1;		// the p-1 stage 1 bound (-1: by the size; 0 skips p-1)
+
+	/* The sieve parameters, as on the command line; -1 picks each by the size of the piece */
+	int64_t fb_bound;
+	int64_t lp_bound;	// as a multiple of fb_bound
+	int M;
+	double T;
+	int64_t multiplier;
+	int sieve_start;
+	int verify;		// check the relations and dependencies before the square root (1)
+
+	/* Callbacks, both optional. They are called from whichever of the context's threads has something to
+	 * report, but never two at a time for one context. msg is one message as bin/nsieve would print it,
+	 * newline (or carriage return, for a status line that is about to be updated) and all. done is how
+	 * far through the phase the factorization is, from 0 to 1, where that is known, and -1 where not. */
+	void (*log) (void *arg, const char *msg);
+	void (*progress) (void *arg, int phase, double done);
+	void *arg;		// passed to both
+} nsieve_opts_t;
+
+typedef struct nsieve_context nsieve_ctx_t;
+
+void nsieve_default_opts (nsieve_opts_t *opts);
+nsieve_ctx_t *nsieve_create (const nsieve_opts_t *opts);	// NULL if there isn't enough memory
+void nsieve_destroy (nsieve_ctx_t *ctx);
+
+/* Factor n. On success (NSIEVE_OK or NSIEVE_PARTIAL) *factors is a malloc'd array of the *nfactors factors
+ * of n in increasing order, with repeats; those that aren't prime (only with NSIEVE_PARTIAL) fail
+ * the BPSW test. Free it with nsieve_free_factors. On an error, *factors is NULL. */
+int  nsieve_factor (nsieve_ctx_t *ctx, const mpz_t n, mpz_t **factors, int *nfactors);
+void nsieve_free_factors (mpz_t *factors, int nfactors);
+
+const char *nsieve_strerror (int code);
+
+#endif
@@ -0,0 +1,162 @@
+#define _POSIX_C_SOURCE 200112L	// for posix_memalign under -std=c99
+#include "m4ri.h"
+#include "rowops.h"
+
+/* Gaussian elimination with the 'Method of Four Russians' (M4RI). The plain elimination in matrix.c xors one
+ * pivot row at a time into every row that needs it, so each row gets about ncols/2 xors. Here the columns
+ * are taken M4RI_K = 8 at a time instead: we find up to 8 pivot rows for those columns, make a table of all
+ * 256 combinations of them, and then clear those 8 columns from every other row with a single xor of the
+ * right table row. That's ncols/8 xors per row, plus 256 to build each table, which pays for itself as soon
+ * as there are more than a few hundred rows.
+ *
+ * The table is built in Gray code order, so that each of its rows is one xor away from one built earlier.
+ * The pivot rows are first reduced against each other so that each has a 1 in its own pivot column and 0
+ * in the others. The combination to apply to a row is then just its bits in the pivot columns, which we
+ * read off through a 256 entry lookup from the byte of the row that holds the 8 columns.
+ *
+ * The whole matrix lives in one aligned block, one row after another, with each row's history (which rows
+ * of the original matrix it is the sum of) packed right after its exponent bits. A row op then is a single
+ * xor over one stretch of memory, and the rows that are already known to be 0 up to the current column
+ * don't need their leading words touched at all. Rows are reordered through an index rather than moved.
+ * Once every column is done, the rows past the last pivot are 0, and their histories are the dependencies.
+*/
+
+typedef struct {
+	uint64_t *block;	// the rows, stride words apart
+	int stride;
+	int row_words;		// words of exponent bits at the start of each row; the history follows
+	uint32_t nrows;
+	uint32_t *perm;		// the rows in their current order
+} m4ri_t;
+
+static inline uint64_t *m4ri_row (m4ri_t *m, uint32_t i){
+	return m->block + (size_t) m->perm[i] * m->stride;
+}
+
+static inline void xor_from (uint64_t *res, const uint64_t *op, int from, int to){
+	xor_row (res + from, op + from, to - from);
+}
+
+static void *aligned_calloc (size_t bytes){	// NULL if there isn't enough memory
+	void *p;
+	if (posix_memalign (&p, M4RI_ALIGN, bytes) != 0) return NULL;
+	memset (p, 0, bytes);
+	return p;
+}
+
+/* Find pivots for columns c to c+M4RI_K-1 among rows r0 and up, moving them to r0, r0+1, ... and reducing
+ * them against each other. Rows that get looked at on the way are reduced against the pivots found so far.
+ * Returns the number of pivots, and their columns (relative to c) in pcols. */
+static int find_pivots (m4ri_t *m, uint32_t r0, int c, int ncols, int *pcols){
+	int p = 0;
+	int w = c / 64;
+	for (int j=0; j < M4RI_K && c + j < ncols; j++){
+		int col = c + j;
+		for (uint32_t i = r0 + p; i < m->nrows; i++){
+			uint64_t *row = m4ri_row (m, i);
+			const uint64_t *ops[M4RI_K];	// the pivots are reduced, so the ones to add are known up front
+			int nops = 0;
+			for (int q=0; q < p; q++){
+				if (get_bit (row, c + pcols[q])) ops[nops++] = m4ri_row (m, r0 + q) + w;
+			}
+			if (nops > 0) xor_rows (row + w, ops, nops, m->stride - w);
+			if (!get_bit (row, col)) continue;
+
+			uint32_t t = m->perm[r0 + p];	// move it into place...
+			m->perm[r0 + p] = m->perm[i];
+			m->perm[i] = t;
+			for (int q=0; q < p; q++){	// ... and clear its column from the other pivots
+				uint64_t *prow = m4ri_row (m, r0 + q);
+				if (get_bit (prow, col)) xor_from (prow, row, w, m->stride);
+			}
+			pcols[p++] = j;
+			break;
+		}
+	}
+	return p;
+}
+
+int m4ri_solve (nsieve_t *ns, uint64_t *deps){
+	ns_printf (ns, "\nStarting M4RI gaussian elimination... \n");
+	m4ri_t m;
+	const int ncols = ns->ncols;
+	const int words_per_line = M4RI_ALIGN / sizeof (uint64_t);
+	m.nrows = ns->nrows;
+	m.row_words = ncols / 64 + 1;
+	m.stride = m.row_words + (m.nrows - 1) / 64 + 1;
+	m.stride = (m.stride + words_per_line - 1) / words_per_line * words_per_line;
+	m.block = (uint64_t *) aligned_calloc ((size_t) m.nrows * m.stride * sizeof (uint64_t));
+	uint64_t *table = (uint64_t *) aligned_calloc (((size_t) 1 << M4RI_K) * m.stride * sizeof (uint64_t));
+	m.perm = (uint32_t *) malloc ((m.nrows + 1) * sizeof (uint32_t));
+	if (m.block == NULL || table == NULL || m.perm == NULL){
+		ns_printf (ns, "Could not allocate %lu bytes for the matrix.\n", (unsigned long) ((size_t) m.nrows * m.stride * sizeof (uint64_t)));
+		ns_error (ns, NSIEVE_ENOMEM);
+		free (m.block);
+		free (table);
+		free (m.perm);
+		return 0;
+	}
+	for (uint32_t i=0; i < m.nrows; i++){
+		m.perm[i] = i;
+		uint64_t *row = m4ri_row (&m, i);
+		for (uint32_t j=0; j < ns->relns[i].weight; j++){
+			flip_bit (row, ns->relns[i].cols[j]);
+		}
+		flip_bit (row + m.row_words, i);
+	}
+	uint8_t lookup[256];
+
+	uint32_t r0 = 0;	// the rank so far; rows from r0 on are 0 in every column done so far
+	for (int c=0; c < ncols && r0 < m.nrows; c += M4RI_K){
+		if (c % 256 == 0){	// print progress report
+			ns_printf (ns, "Column %d of %d\r", c, ncols);
+			out_progress (&ns->out, NSIEVE_PHASE_MATRIX, (double) c / ncols);
+		}
+		int pcols[M4RI_K];
+		int p = find_pivots (&m, r0, c, ncols, pcols);
+		if (p == 0) continue;
+		int w = c / 64;
+
+		/* Table row g is the sum of the pivots whose bits are set in g. Rows are only filled in from
+		 * word w on, since everything before that is 0 in all of the pivots. */
+		for (uint32_t i=1; i < (1u << p); i++){
+			uint32_t g = i ^ (i >> 1);
+			uint32_t prev = (i-1) ^ ((i-1) >> 1);
+			int b = __builtin_ctz (g ^ prev);
+			uint64_t *dst = table + (size_t) g * m.stride;
+			uint64_t *src = table + (size_t) prev * m.stride;
+			uint64_t *piv = m4ri_row (&m, r0 + b);
+			memcpy (dst + w, src + w, (m.stride - w) * sizeof (uint64_t));
+			xor_from (dst, piv, w, m.stride);
+		}
+		for (int v=0; v < 256; v++){
+			lookup[v] = 0;
+			for (int q=0; q < p; q++){
+				if (v & (1 << pcols[q])) lookup[v] |= 1 << q;
+			}
+		}
+
+		/* The 8 columns start at bit c % 64 of word w, and c is a multiple of 8, so they are one byte. */
+		int shift = c % 64;
+		for (uint32_t i = r0 + p; i < m.nrows; i++){
+			uint64_t *row = m4ri_row (&m, i);
+			uint8_t g = lookup[(row[w] >> shift) & 0xff];
+			if (g != 0) xor_from (row, table + (size_t) g * m.stride, w, m.stride);
+		}
+		r0 += p;
+	}
+
+	int ndeps = 0;
+	for (uint32_t i=r0; i < m.nrows && ndeps < 64; i++){
+		uint64_t *hist = m4ri_row (&m, i) + m.row_words;
+		for (uint32_t j=0; j < m.nrows; j++){
+			if (get_bit (hist, j)) deps[j] |= 1ull << ndeps;
+		}
+		ndeps ++;
+	}
+	ns_printf (ns, "Column %d of %d; the matrix has rank %u.\n", ncols, ncols, r0);
+	free (m.block);
+	free (table);
+	free (m.perm);
+	return ndeps;
+}
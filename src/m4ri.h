@@ -0,0 +1,13 @@
+#ifndef M4RI_H
+#define M4RI_H
+
+#include "common.h"
+
+/* Dense gaussian elimination with the Method of Four Russians. See m4ri.c. */
+
+#define M4RI_K 8		// pivot rows per table; the table has 2^M4RI_K rows
+#define M4RI_ALIGN 64		// byte alignment of the matrix rows (and of the whole block); a multiple of ROWOPS_PAD words
+
+int m4ri_solve (nsieve_t *, uint64_t *deps);	// fills in deps like gauss_solve; returns the number found
+
+#endif
@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200809L	// for dup and fdopen under -std=c99
+#include <unistd.h>
+#include <sys/resource.h>
+#include "nsieve.h"
+
+/* The command line program: reading the options, and handing N (or the batch, or the relation files) to
+ * whichever part of the library deals with it. */
+
+/* -stats: the wall time of each phase, taken from the progress reports. Everything from one report to the
+ * next is put down to the phase of the first, which is only roughly right while several pieces are being
+ * worked on at once, but the phases add up to the total either way. */
+typedef struct {
+	pthread_mutex_t lock;
+	int phase;		// the phase last reported; -1 before the first report
+	double last;		// when that was
+	double time[NSIEVE_NPHASES];
+} phase_clock_t;
+
+static const char *phase_names[NSIEVE_NPHASES] = {"tdiv", "rho", "pm1", "ecm", "sieve", "matrix", "sqrt", "small"};
+
+static double wall_time (void){
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void clock_progress (void *arg, int phase, double done){
+	phase_clock_t *pc = (phase_clock_t *) arg;
+	pthread_mutex_lock (&pc->lock);
+	double t = wall_time ();
+	if (pc->phase >= 0) pc->time[pc->phase] += t - pc->last;
+	pc->phase = phase;
+	pc->last = t;
+	pthread_mutex_unlock (&pc->lock);
+}
+
+/* Append a line of CSV about the factorization of n to 'file' (with a header line first, if it's new):
+ * n, its size, the threads, how many factors and whether they're all prime, the total and per phase wall
+ * times in seconds, the relations collected and how many per second of sieving, and the peak RSS in KB. */
+static void write_stats (const char *file, mpz_t n, int nthreads, mpz_t *factors, int nfactors, double total, phase_clock_t *pc, uint64_t relations){
+	FILE *f = fopen (file, "a");
+	if (f == NULL){
+		printf ("Could not open %s.\n", file);
+		return;
+	}
+	if (ftell (f) == 0){
+		fprintf (f, "n,bits,threads,factors,ok,total");
+		for (int i=0; i < NSIEVE_NPHASES; i++){
+			fprintf (f, ",%s", phase_names[i]);
+		}
+		fprintf (f, ",relations,rels_per_sec,peak_rss_kb\n");
+	}
+	int ok = 1;
+	for (int i=0; i < nfactors; i++){
+		ok &= bpsw_prime_p (factors[i]) != 0;
+	}
+	struct rusage ru;
+	getrusage (RUSAGE_SELF, &ru);
+	double sieve = pc->time[NSIEVE_PHASE_SIEVE];
+	gmp_fprintf (f, "%Zd,%d,%d,%d,%d,%.3f", n, (int) mpz_sizeinbase (n, 2), nthreads, nfactors, ok, total);
+	for (int i=0; i < NSIEVE_NPHASES; i++){
+		fprintf (f, ",%.3f", pc->time[i]);
+	}
+	fprintf (f, ",%lu,%.0f,%ld\n", (unsigned long) relations, sieve > 0 ? relations / sieve : 0, ru.ru_maxrss);
+	fclose (f);
+}
+
+/* Behold - the main method. You knew it was here somewhere. */
+int main (int argc, const char *argv[]){
+	nsieve_t ns;
+	memset (&ns, 0, sizeof (ns));	// anything not set below is set by nsieve_init, if it runs at all
+	mpz_t n;
+	mpz_init (n);
+
+	int pos = 1;
+	int nspecd = 0;
+
+	ns.T = -1;
+	ns.fb_bound = -1;
+	ns.lp_bound = -1;
+	ns.M = -1;
+	ns.multiplier = -1;
+	ns.merge_density = -1;
+	ns.sieve_start = -1;
+	ns.mult_bound = MULT_BOUND;
+	ns.mult_trials = MULT_TRIALS;
+	ns.solver = SOLVER_AUTO;
+	ns.verify = 1;
+	ns.out = (ns_output_t) {NULL, NULL, NULL, NULL};	// everything goes to standard output
+	int nthreads = 1;
+	const char *coord_dir = NULL;	// distributed sieving; see dist.c
+	const char *worker_dir = NULL;
+	int nworkers = 1;
+	int wid = 0;
+	const char **relfiles = NULL;	// post-processing from relation files; see postproc.c
+	int nrelfiles = 0;
+	const char *export_to = NULL;	// writing out the matrix, and reading dependencies back; see matfile.h
+	const char *import_from = NULL;
+	const char *param_file = NULL;	// parameter tuning, and the file the results go in; see tune.c
+	int tune_bits = 0;
+	int tune_time = TUNE_TRIAL_TIME;
+	int ecm_curves = -1;	// how many ECM curves to run before the sieve; -1 to go by the size of N
+	uint32_t ecm_B1 = 0;
+	int64_t pm1_B1 = -1;	// the p-1 bound; -1 to go by the size of N, 0 to skip it
+	const char *batch = NULL;	// a file of numbers to factor, one per line ("-" for stdin); see factor.c
+	const char *stats = NULL;	// a CSV file to add a line of timings to; see write_stats
+	/* Parse command line arguments that override parameters or specify N */
+	while (pos < argc){
+		if (!strcmp(argv[pos], "-T")){
+			ns.T = atof (argv[pos+1]);
+			pos ++;
+		} else if (!strcmp(argv[pos], "-fbb")){
+			ns.fb_bound = atoi (argv[pos+1]);
+			pos ++;
+		} else if (!strcmp(argv[pos], "-lpb")){
+			ns.lp_bound = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-M")){
+			ns.M = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-smallp")){
+			ns.sieve_start = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-params")){
+			param_file = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-tune")){
+			tune_bits = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-tunetime")){
+			tune_time = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-ecm")){
+			ecm_curves = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-pm1")){
+			pm1_B1 = atoll (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-B1")){
+			ecm_B1 = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-np")){
+			ns.lp_bound = 1;
+		} else if (!strcmp(argv[pos], "-noverify")){
+			ns.verify = 0;
+		} else if (!strcmp(argv[pos], "-mult")){
+			ns.multiplier = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-multbound")){
+			ns.mult_bound = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-multtrials")){
+			ns.mult_trials = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-density")){
+			ns.merge_density = atof (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-solver")){
+			if (!strcmp(argv[pos+1], "gauss")){
+				ns.solver = SOLVER_GAUSS;
+			} else if (!strcmp(argv[pos+1], "m4ri")){
+				ns.solver = SOLVER_M4RI;
+			} else if (!strcmp(argv[pos+1], "lanczos")){
+				ns.solver = SOLVER_LANCZOS;
+			} else {
+				printf ("Unknown solver %s; use gauss, m4ri or lanczos.\n", argv[pos+1]);
+				return 1;
+			}
+			pos++;
+		} else if (!strcmp(argv[pos], "-batch")){
+			batch = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-stats")){
+			stats = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-threads")){
+			nthreads = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-coordinator")){
+			coord_dir = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-workers")){
+			nworkers = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-worker")){
+			worker_dir = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-wid")){
+			wid = atoi (argv[pos+1]);
+			pos++;
+		} else if (!strcmp(argv[pos], "-export")){
+			export_to = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-import")){
+			import_from = argv[pos+1];
+			pos++;
+		} else if (!strcmp(argv[pos], "-postproc")){	// everything after this is a relation file
+			relfiles = &argv[pos+1];
+			nrelfiles = argc - pos - 1;
+			break;
+		} else {
+			mpz_set_str (n, argv[pos], 10);
+			nspecd = 1;
+		}
+		pos ++;
+	}
+	ns.nthreads = nthreads;
+
+	/* Parameters tuned for this machine, if there are any. An explicitly given file has to be there,
+	 * unless we're about to write it. */
+	double rows[PARAMS_MAX][NPARAMS];
+	int nrows = read_param_file (param_file != NULL ? param_file : TUNE_PARAM_FILE, rows, PARAMS_MAX);
+	if (nrows < 0 && param_file != NULL && tune_bits == 0){
+		printf ("Could not read the parameter file %s.\n", param_file);
+		return 1;
+	}
+	for (int i=0; i < nrows; i++){
+		if (!add_params (rows[i])){
+			printf ("The parameter table is full; ignoring the row for %d bits.\n", (int) rows[i][0]);
+		}
+	}
+	if (nrows > 0){
+		printf ("Read parameters for %d sizes from %s.\n", nrows, param_file != NULL ? param_file : TUNE_PARAM_FILE);
+	}
+	if (tune_bits > 0){
+		tune (tune_bits, nthreads, tune_time, param_file != NULL ? param_file : TUNE_PARAM_FILE);
+		return 0;
+	}
+
+	if (worker_dir != NULL){	// workers get N and everything else from the coordinator's job file.
+		dist_worker (worker_dir, wid);
+		return 0;
+	}
+	if ((export_to != NULL || import_from != NULL) && relfiles == NULL){
+		printf ("-export and -import only work with -postproc.\n");
+		return 1;
+	}
+	if (relfiles != NULL){		// so does the post-processing, from the relation files.
+		if (postprocess_files (&ns, relfiles, nrelfiles, nthreads, export_to, import_from)){
+			print_timing (&ns);
+		}
+		return 0;
+	}
+	factor_opts_t opts;
+	opts.nthreads = nthreads;
+	opts.ecm_curves = ecm_curves;
+	opts.ecm_B1 = ecm_B1;
+	opts.pm1_B1 = pm1_B1;
+	opts.siqs = ns;
+	opts.out = ns.out;
+	if (batch != NULL){	// only the result lines go to standard output; the progress messages are dropped.
+		FILE *in = strcmp (batch, "-") ? fopen (batch, "r") : stdin;
+		if (in == NULL){
+			printf ("Could not open %s.\n", batch);
+			return 1;
+		}
+		fflush (stdout);
+		int fd = dup (fileno (stdout));
+		FILE *out = fd < 0 ? NULL : fdopen (fd, "w");
+		if (out == NULL || freopen ("/dev/null", "w", stdout) == NULL){
+			fprintf (stderr, "Could not set up the output for -batch.\n");
+			return 1;
+		}
+		factor_batch (in, out, &opts);
+		fclose (out);
+		if (in != stdin) fclose (in);
+		return 0;
+	}
+	if (!nspecd){
+		mpz_inp_str (n, stdin, 10);
+	}
+
+	/* Factor N completely, by whichever methods suit each piece of it (see factor.c) */
+	if (coord_dir == NULL){
+		mpz_t *factors;
+		int nfactors;
+		phase_clock_t pc;
+		pthread_mutex_init (&pc.lock, NULL);
+		pc.phase = -1;
+		memset (pc.time, 0, sizeof (pc.time));
+		if (stats != NULL){
+			opts.out.progress = clock_progress;
+			opts.out.arg = &pc;
+		}
+		double start = wall_time ();
+		factor_fully (n, &opts, &factors, &nfactors);
+		clock_progress (&pc, -1, -1);	// the end of the last phase
+		double total = wall_time () - start;
+		printf ("\nFactors of N:\n");
+		for (int i=0; i < nfactors; i++){
+			mpz_out_str (stdout, 10, factors[i]);
+			printf (bpsw_prime_p (factors[i]) ? " (prp)\n" : " (c)\n");
+		}
+		if (stats != NULL) write_stats (stats, n, nthreads, factors, nfactors, total, &pc, opts.relations);
+		for (int i=0; i < nfactors; i++){
+			mpz_clear (factors[i]);
+		}
+		free (factors);
+		mpz_clear (n);
+		return 0;
+	}
+
+	/* Distributed sieving is only for N itself, after the cheaper methods have had a go at it. */
+	printf ("Removing small factors of N by trial division and pollard rho... \n");
+	tdiv (n, 32768);
+	rho  (n, 65536, 0, nthreads);
+
+	/* p-1, which only finds some factors, but costs about as much as one ECM curve */
+	uint32_t B1;
+	if (pm1_B1 >= 0){
+		B1 = pm1_B1;
+	} else {
+		pm1_select (mpz_sizeinbase (n, 2), &B1);
+	}
+	if (B1 > 0 && mpz_cmp_ui (n, 1) > 0 && !bpsw_prime_p (n)){
+		printf ("Running p-1 with B1 = %u... \n", B1);
+		pm1 (n, B1, (uint64_t) B1 * PM1_B2_FACTOR, 0, nthreads);
+	}
+
+	/* ECM for factors too big for rho, but small enough that it's quicker than the sieve */
+	int curves = ecm_select (mpz_sizeinbase (n, 2), &B1);
+	if (ecm_curves >= 0) curves = ecm_curves;
+	if (ecm_B1 > 0) B1 = ecm_B1;
+	if (curves > 0 && mpz_cmp_ui (n, 1) > 0 && !bpsw_prime_p (n)){
+		printf ("Running up to %d ECM curves with B1 = %u... \n", curves, B1);
+		ecm (n, B1, curves, 0, nthreads);
+	}
+	
+	/* If we found all of the factors by trial division or rho, or the cofactor after doing that
+	 * is prime, then we're done and we don't need to start the quadratic sieve. */
+	printf("Will factor N = ");
+	mpz_out_str (stdout, 10, n);
+	printf("\n");
+	if (mpz_cmp_ui (n, 1) == 0){
+		return 0;
+	} else if (bpsw_prime_p (n)){
+		mpz_out_str(stdout, 10, n);
+		printf("\n");
+		return 0;
+	}
+
+	/* Otherwise, start the sieving */
+	printf ("Starting the quadratic sieve... \n");
+	long start = clock();
+	nsieve_init (&ns, n);
+
+	dist_coordinator (&ns, coord_dir, nworkers, nthreads);
+
+	ns.timing.total_time = clock() - start;
+
+	print_timing (&ns);
+}
@@ -0,0 +1,192 @@
+#include "matfile.h"
+
+/* See matfile.h for the formats. */
+
+static FILE *open_with_suffix (const char *prefix, const char *suffix, const char *mode){
+	char path[strlen (prefix) + strlen (suffix) + 1];
+	sprintf (path, "%s%s", prefix, suffix);
+	FILE *f = fopen (path, mode);
+	if (f == NULL) printf ("Could not open %s.\n", path);
+	return f;
+}
+
+/* Which file p is in, and its offset there in words; -1 if it isn't in any of them. */
+static int locate (const matfile_maps_t *maps, const uint32_t *p, uint32_t *offset){
+	for (int i=0; i < maps->nfiles; i++){
+		if (p >= maps->bases[i] && p < maps->bases[i] + maps->lens[i] / 4){
+			*offset = p - maps->bases[i];
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int write_ref (FILE *f, const relref_t *r, const matfile_maps_t *maps){
+	uint32_t w[4];
+	int file = locate (maps, r->rec, &w[1]);
+	if (file < 0 || locate (maps, r->batch, &w[2]) != file || locate (maps, r->victim, &w[3]) != file) return 0;
+	w[0] = file;
+	return fwrite (w, sizeof (uint32_t), 4, f) == 4;
+}
+
+/* Write the matrix (as it is now, so call this after filtering) and its index. */
+int matfile_export (nsieve_t *ns, const char *prefix, const matfile_maps_t *maps){
+	FILE *mat = open_with_suffix (prefix, ".mat", "wb");
+	if (mat == NULL) return 0;
+	FILE *idx = open_with_suffix (prefix, ".idx", "wb");
+	if (idx == NULL){
+		fclose (mat);
+		return 0;
+	}
+	int ok = 1;
+	uint32_t h[4] = {MATFILE_MAGIC, MATFILE_VERSION, ns->nrows, ns->ncols};
+	ok &= fwrite (h, sizeof (uint32_t), 4, mat) == 4;
+	uint32_t hi[4] = {MATFILE_INDEX_MAGIC, MATFILE_VERSION, ns->nrows, maps->nfiles};
+	ok &= fwrite (hi, sizeof (uint32_t), 4, idx) == 4;
+	for (int i=0; i < maps->nfiles; i++){
+		uint32_t len[2] = {(uint32_t) maps->lens[i], (uint32_t) ((uint64_t) maps->lens[i] >> 32)};
+		ok &= fwrite (len, sizeof (uint32_t), 2, idx) == 2;
+	}
+
+	uint64_t nnz = 0;
+	for (uint32_t i=0; i < ns->nrows && ok; i++){
+		matrel_t *m = &ns->relns[i];
+		ok &= fwrite (&m->weight, sizeof (uint32_t), 1, mat) == 1;
+		ok &= fwrite (m->cols, sizeof (uint32_t), m->weight, mat) == m->weight;
+		nnz += m->weight;
+
+		uint32_t nrels = m->f2 == NULL ? 1 : 2;
+		ok &= fwrite (&nrels, sizeof (uint32_t), 1, idx) == 1;
+		ok &= write_ref (idx, m->f1, maps);
+		if (m->f2 != NULL) ok &= write_ref (idx, m->f2, maps);
+	}
+	ok &= fclose (mat) == 0;
+	ok &= fclose (idx) == 0;
+	if (!ok){
+		printf ("Could not write the matrix to %s.mat and %s.idx.\n", prefix, prefix);
+		return 0;
+	}
+	printf ("Wrote a %u x %u matrix with %lu nonzeros to %s.mat, and its index to %s.idx.\n", ns->nrows, ns->ncols, (unsigned long) nnz, prefix, prefix);
+	return 1;
+}
+
+static int read_ref (FILE *f, relref_t *r, const matfile_maps_t *maps){
+	uint32_t w[4];
+	if (fread (w, sizeof (uint32_t), 4, f) != 4 || w[0] >= maps->nfiles) return 0;
+	size_t words = maps->lens[w[0]] / 4;
+	if (w[1] >= words || w[2] >= words || w[3] >= words) return 0;
+	r->rec = maps->bases[w[0]] + w[1];
+	r->batch = maps->bases[w[0]] + w[2];
+	r->victim = maps->bases[w[0]] + w[3];
+	return 1;
+}
+
+/* Read the index back, and make the matrix relations point at the relations in it. The rows are filled in
+ * again too, so that the dependencies can be checked. *refs is allocated here (two per row). */
+int matfile_import_index (nsieve_t *ns, const char *prefix, const matfile_maps_t *maps, relref_t **refs){
+	FILE *idx = open_with_suffix (prefix, ".idx", "rb");
+	if (idx == NULL) return 0;
+	uint32_t h[4];
+	if (fread (h, sizeof (uint32_t), 4, idx) != 4 || h[0] != MATFILE_INDEX_MAGIC || h[1] != MATFILE_VERSION){
+		printf ("%s.idx is not a matrix index.\n", prefix);
+		fclose (idx);
+		return 0;
+	}
+	if (h[3] != maps->nfiles || h[2] > ns->fb_len + ns->extra_rels){
+		printf ("%s.idx was made from %u relation files, and there are %d; or it is from a different factorization.\n", prefix, h[3], maps->nfiles);
+		fclose (idx);
+		return 0;
+	}
+	for (int i=0; i < maps->nfiles; i++){
+		uint32_t len[2];
+		if (fread (len, sizeof (uint32_t), 2, idx) != 2 || (((uint64_t) len[1] << 32) | len[0]) != maps->lens[i]){
+			printf ("Relation file %d is not the one %s.idx was made from.\n", i, prefix);
+			fclose (idx);
+			return 0;
+		}
+	}
+
+	uint32_t nrows = h[2];
+	*refs = (relref_t *) malloc (2 * (nrows + 1) * sizeof (relref_t));
+	int ok = 1;
+	for (uint32_t i=0; i < nrows && ok; i++){
+		matrel_t *m = &ns->relns[i];
+		uint32_t nrels;
+		ok = fread (&nrels, sizeof (uint32_t), 1, idx) == 1 && (nrels == 1 || nrels == 2);
+		ok = ok && read_ref (idx, &(*refs)[2*i], maps);
+		ok = ok && (nrels == 1 || read_ref (idx, &(*refs)[2*i+1], maps));
+		if (!ok) break;
+		m->r1 = m->r2 = NULL;
+		m->f1 = &(*refs)[2*i];
+		m->f2 = nrels == 2 ? &(*refs)[2*i+1] : NULL;
+	}
+	fclose (idx);
+	if (!ok){
+		printf ("%s.idx is truncated or damaged.\n", prefix);
+		free (*refs);
+		*refs = NULL;
+		return 0;
+	}
+	ns->nrows = nrows;
+	ns->nfull = nrows;
+	ns->ncols = ns->fb_len + 1;	// the rows come back in the original columns; that's all the check needs.
+	for (uint32_t i=0; i < nrows; i++){
+		matrel_t *m = &ns->relns[i];
+		m->weight = relref_fillcols (m->f1, &m->cols);
+		if (m->f2 != NULL){
+			uint32_t *c1 = m->cols;
+			uint32_t *c2;
+			uint32_t w2 = relref_fillcols (m->f2, &c2);
+			m->cols = (uint32_t *) malloc ((m->weight + w2 + 1) * sizeof (uint32_t));
+			m->weight = sparse_row_xor (m->cols, c1, m->weight, c2, w2);
+			free (c1);
+			free (c2);
+		}
+	}
+	printf ("Read the index of a %u row matrix from %s.idx.\n", nrows, prefix);
+	return 1;
+}
+
+/* Read up to 64 dependencies into deps, in the same form the solvers return them. */
+int matfile_import_deps (nsieve_t *ns, const char *prefix, uint64_t *deps){
+	FILE *f = open_with_suffix (prefix, ".deps", "r");
+	if (f == NULL) return -1;
+	int ndeps = 0;
+	int skipped = 0;
+	int c;
+	while ((c = fgetc (f)) != EOF){
+		if (isspace (c)) continue;
+		if (c == '#'){
+			while (c != EOF && c != '\n') c = fgetc (f);
+			continue;
+		}
+		ungetc (c, f);
+
+		/* a dependency: numbers up to the end of the line */
+		int empty = 1;
+		while (1){
+			c = fgetc (f);
+			while (c == ' ' || c == '\t' || c == '\r') c = fgetc (f);
+			if (c == '\n' || c == EOF) break;
+			ungetc (c, f);
+			unsigned long row;
+			if (fscanf (f, "%lu", &row) != 1 || row >= ns->nrows){
+				printf ("Bad row number in %s.deps (there are %u rows).\n", prefix, ns->nrows);
+				fclose (f);
+				return -1;
+			}
+			if (ndeps < 64) deps[row] ^= 1ull << ndeps;
+			empty = 0;
+		}
+		if (empty) continue;
+		if (ndeps < 64){
+			ndeps ++;
+		} else {
+			skipped ++;
+		}
+	}
+	fclose (f);
+	if (skipped > 0) printf ("Only using the first 64 dependencies in %s.deps; skipped %d.\n", prefix, skipped);
+	printf ("Read %d dependencies from %s.deps.\n", ndeps, prefix);
+	return ndeps;
+}
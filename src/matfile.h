@@ -0,0 +1,42 @@
+#ifndef MATFILE_H
+#define MATFILE_H
+
+#include "common.h"
+#include "postproc.h"
+
+/* Writing the filtered matrix out for another program (or machine) to solve, and reading its dependencies
+ * back in. Only works on top of relation files (-postproc), since the index has to point at the relations.
+ * Three files, all sharing a prefix:
+ *
+ * 	PREFIX.mat:	uint32 magic ("NSMX"), uint32 version, uint32 nrows, uint32 ncols, then for each row:
+ * 			uint32 weight, uint32 cols[weight]. The columns of a row are sorted and distinct; they are
+ * 			the primes (and -1) with an odd exponent, renumbered 0 .. ncols-1 with the empty ones left out.
+ * 	PREFIX.idx:	uint32 magic ("NSIX"), uint32 version, uint32 nrows, uint32 nfiles, then for each
+ * 			relation file its length in bytes (as uint32 low, uint32 high), then for each row:
+ * 			uint32 nrels (1 for a full relation, 2 for two partials), and for each of those relations
+ * 			uint32 file, rec, batch, victim: the number of the file (in the order they were given
+ * 			to -postproc, not counting any that were skipped) and the offsets in 4-byte words of
+ * 			the relation's record, its batch and the batch's victim in that file (see relfile.h).
+ * 	PREFIX.deps:	text, written by the solver: one dependency per line, as the numbers of the rows in it
+ * 			(counting from 0) separated by white space. Lines starting with '#' are skipped.
+ *
+ * The binary files are in host byte order. The relation files have to be given in the same order when the
+ * dependencies are read back.
+*/
+
+#define MATFILE_MAGIC       0x584d534e	// "NSMX"
+#define MATFILE_INDEX_MAGIC 0x5849534e	// "NSIX"
+#define MATFILE_VERSION     1
+
+/* The mapped relation files, as postproc.c has them */
+typedef struct {
+	const uint32_t **bases;
+	const size_t *lens;
+	int nfiles;
+} matfile_maps_t;
+
+int matfile_export (nsieve_t *, const char *prefix, const matfile_maps_t *);	// returns 0 on failure
+int matfile_import_index (nsieve_t *, const char *prefix, const matfile_maps_t *, relref_t **refs);	// fills in ns->relns; returns 0 on failure
+int matfile_import_deps (nsieve_t *, const char *prefix, uint64_t *deps);	// returns the number of dependencies, or -1
+
+#endif
@@ -1,73 +1,514 @@
+#define _POSIX_C_SOURCE 200809L	// for pthread barriers under -std=c99
 #include "matrix.h"
 
+/* The matrix step is split in two. A solver finds up to 64 dependencies among the rows of the matrix, and
+ * returns them packed into one word per row: bit d of deps[i] is set when row i is part of dependency d.
+ * The factor deduction then turns each dependency into a congruence of squares until N is factored. Each
+ * dependency has (at least) a 50% chance of giving a factor, so 64 of them are plenty.
+ *
+ * Small matrices go to dense Gaussian elimination, which is simple and quick when the matrix fits in memory
+ * as bits, together with a history matrix of the same size. By default that is the Method of Four Russians
+ * version in m4ri.c; the plain one below is still there with -solver gauss. Everything bigger goes to block
+ * Lanczos (see lanczos.c), which only ever touches the sparse rows.
+*/
+
 /* The Gaussian Elimination code is modeled on a post on Programming Praxis. It proceeds basically as follows:
  *
  * Construct a square history matrix, with dimension equal to the # of rows in the exponent matrix. Initialize it
  * to the identity matrix. This records which exponent vectors have been combined together. Now:
  *
  * for each column in the matrix, working right to left:
- * 	find the 'pivot' vector closest to the top with rightmost 1 in the current column. If none exists, go to the next column.
+ * 	find the 'pivot' vector with rightmost 1 in the current column. If none exists, go to the next column.
  * 		for each other vector (Yolanda) with rightmost 1 in the current column:
  * 			Yolanda = Yolanda XOR pivot	(for both the exponent and history matricies)
  *
  * Any zero row-vectors in the exponent matrix represent dependencies that can be converted into a congruence of squares. 
+ *
+ * Rather than scanning every row for each column, the rows are kept in one list per column, by the position of
+ * their rightmost 1. Since xoring with the pivot only ever moves a row's rightmost 1 to the left, each row just
+ * gets pushed onto the list for a column we haven't reached yet. The xors for one column are all independent,
+ * so when there are enough of them they are split between ns->nthreads threads.
 */
 
-void solve_matrix (nsieve_t *ns){
-	printf ("\nStarting gaussian elimination... \n");
-	long start = clock();
+#define GAUSS_PARALLEL_MIN 4096	// don't bother waking the other threads for fewer words of xoring than this
 
-	const int hmlen = (ns->rels_needed -1)/64 + 1;
-	const int hmsize = ns->rels_needed;
-	uint64_t *history[hmsize];
-	uint32_t rmos[hmsize];	// for keeping track of the position of the rightmost 1 in each exponent vector.
-				// caching these values greatly accelerates the matrix solving, since they are
-				// used often but change rarely.
-	for (int i=0; i < hmsize; i++){
-		history[i] = (uint64_t *) calloc (hmlen, sizeof(uint64_t));
-		flip_bit (history[i], i);
-		rmos[i] = rightmost_1 (ns->relns[i].row, ns->fb_len);
+typedef struct {
+	uint64_t **rows;
+	uint64_t **history;
+	int32_t *rmos;		// the position of the rightmost 1 in each exponent vector. Caching these values greatly
+				// accelerates the matrix solving, since they are used often but change rarely.
+	int row_len;
+	int hmlen;
+
+	/* the work for the current column */
+	uint32_t *todo;
+	uint32_t ntodo;
+	uint32_t pivot;
+	int col;
+
+	int nthreads;
+	int quit;
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+} gauss_t;
+
+typedef struct {
+	gauss_t *g;
+	int id;
+} gauss_thread_t;
+
+/* Xor the pivot into every nthreads'th row of the current column's list, starting at 'id'. */
+static void gauss_xor_rows (gauss_t *g, int id, int step){
+	for (uint32_t k = id; k < g->ntodo; k += step){
+		uint32_t yolanda = g->todo[k];
+		xor_row (g->rows[yolanda], g->rows[g->pivot], g->row_len);
+		xor_row (g->history[yolanda], g->history[g->pivot], g->hmlen);
+
+		/* update the cached value of the rightmost 1. We know the rightmost 1 of the 
+		 * xor'ed result has to be to the left of 'col', since that was the position
+		 * of the rightmost 1 of both yolanda and pivot, and the xor sets that to 0. */
+		g->rmos[yolanda] = rightmost_1 (g->rows[yolanda], g->col);
+	}
+}
+
+static void *gauss_thread (void *args){
+	gauss_thread_t *t = (gauss_thread_t *) args;
+	gauss_t *g = t->g;
+	while (1){
+		pthread_barrier_wait (&g->start);
+		if (g->quit) break;
+		gauss_xor_rows (g, t->id, g->nthreads);
+		pthread_barrier_wait (&g->done);
+	}
+	return NULL;
+}
+
+int gauss_solve (nsieve_t *ns, uint64_t *deps){
+	ns_printf (ns, "\nStarting gaussian elimination... \n");
+
+	/* Pack the sparse rows into bits */
+	ns->row_len = ns->ncols/64 + 1;
+	ns->row_len = (ns->row_len + ROWOPS_PAD - 1) / ROWOPS_PAD * ROWOPS_PAD;	// whole vectors for the row kernels
+	const int hmsize = ns->nrows;
+	gauss_t g;
+	g.row_len = ns->row_len;
+	g.hmlen = ((ns->nrows -1)/64 + ROWOPS_PAD) / ROWOPS_PAD * ROWOPS_PAD;
+	g.rows = (uint64_t **) malloc (hmsize * sizeof (uint64_t *));
+	g.history = (uint64_t **) malloc (hmsize * sizeof (uint64_t *));
+	g.rmos = (int32_t *) malloc (hmsize * sizeof (int32_t));
+	g.todo = (uint32_t *) malloc ((hmsize + 1) * sizeof (uint32_t));
+
+	/* The rows whose rightmost 1 is in column c are head[c], next[head[c]], next[next[head[c]]], ... */
+	const int expm_cols = ns->ncols;
+	int32_t *head = (int32_t *) malloc ((expm_cols + 1) * sizeof (int32_t));
+	int32_t *next = (int32_t *) malloc ((hmsize + 1) * sizeof (int32_t));
+	int ok = g.rows != NULL && g.history != NULL && g.rmos != NULL && g.todo != NULL && head != NULL && next != NULL;
+	for (int i=0; i < hmsize && ok; i++){
+		g.rows[i] = (uint64_t *) calloc (g.row_len, sizeof(uint64_t));
+		g.history[i] = (uint64_t *) calloc (g.hmlen, sizeof(uint64_t));
+		if (g.rows[i] == NULL || g.history[i] == NULL){
+			for (int j=0; j <= i; j++){
+				free (g.rows[j]);
+				free (g.history[j]);
+			}
+			ok = 0;
+		}
+	}
+	if (!ok){
+		ns_printf (ns, "Could not allocate the matrix for gaussian elimination.\n");
+		ns_error (ns, NSIEVE_ENOMEM);
+		free (g.rows);
+		free (g.history);
+		free (g.rmos);
+		free (g.todo);
+		free (head);
+		free (next);
+		return 0;
+	}
+	for (int c=0; c < expm_cols; c++){
+		head[c] = -1;
 	}
-#define MAT_CHECK	// enables a couple of self-checks on the matrix solving. However, it requires making a 
-#ifdef MAT_CHECK	// copy of the exponent side of the matrix, so should be turned off for 'release' versions.
-	uint64_t *expm[ns->rels_needed];
 	for (int i=0; i < hmsize; i++){
-		expm[i] = (uint64_t *) malloc (ns->row_len * sizeof(uint64_t));
-		for (int j=0; j<ns->row_len; j++){
-			expm[i][j] = ns->relns[i].row[j];
+		for (uint32_t j=0; j < ns->relns[i].weight; j++){
+			flip_bit (g.rows[i], ns->relns[i].cols[j]);
+		}
+		flip_bit (g.history[i], i);
+		g.rmos[i] = rightmost_1 (g.rows[i], expm_cols - 1);
+		if (g.rmos[i] >= 0){
+			next[i] = head[g.rmos[i]];
+			head[g.rmos[i]] = i;
+		}
+	}
+
+	/* Start the helper threads; they wait at the start barrier until a column has enough work for them. */
+	g.nthreads = ns->nthreads > 1 ? ns->nthreads : 1;
+	g.quit = 0;
+	pthread_t threads[g.nthreads];
+	gauss_thread_t targs[g.nthreads];
+	if (g.nthreads > 1){
+		pthread_barrier_init (&g.start, NULL, g.nthreads);
+		pthread_barrier_init (&g.done, NULL, g.nthreads);
+		for (int t=1; t < g.nthreads; t++){
+			targs[t].g = &g;
+			targs[t].id = t;
+			pthread_create (&threads[t], NULL, gauss_thread, &targs[t]);
 		}
-//		print_row(expm[i], 64 * ns->row_len);
 	}
-#endif
-	const int expm_rows = ns->rels_needed;
-	const int expm_cols = ns->fb_len + 1;
 
 	// this is the main loop of the Gaussian Elimination
-	// col starts at fb_len because there are fb_len + 1 columns in the matrix.
+	// col starts at ncols - 1 (fb_len, before filtering, since -1 has a column too).
 	for (int col = expm_cols-1; col >= 0; col --){	
 		if ((expm_cols - col) % 50 == 0){	// print progress report
-			printf("Column %d of %d\r", expm_cols - col, expm_cols);
-			fflush(stdout);
+			ns_printf (ns, "Column %d of %d\r", expm_cols - col, expm_cols);
 		}
-		int pivot = 0;
-		while (pivot < expm_rows && rmos[pivot] != col){
-			pivot ++;
+		if (head[col] < 0) continue;
+		g.col = col;
+		g.pivot = head[col];
+		g.ntodo = 0;
+		for (int32_t r = next[g.pivot]; r >= 0; r = next[r]){
+			g.todo[g.ntodo ++] = r;
+		}
+		if (g.nthreads > 1 && (uint64_t) g.ntodo * (g.row_len + g.hmlen) >= GAUSS_PARALLEL_MIN){
+			pthread_barrier_wait (&g.start);
+			gauss_xor_rows (&g, 0, g.nthreads);
+			pthread_barrier_wait (&g.done);
+		} else {
+			gauss_xor_rows (&g, 0, 1);
+		}
+		head[col] = g.pivot;	// the pivot stays where it is; everything else moves left.
+		next[g.pivot] = -1;
+		for (uint32_t k=0; k < g.ntodo; k++){
+			uint32_t r = g.todo[k];
+			if (g.rmos[r] >= 0){
+				next[r] = head[g.rmos[r]];
+				head[g.rmos[r]] = r;
+			}
+		}
+	}
+	if (g.nthreads > 1){
+		g.quit = 1;
+		pthread_barrier_wait (&g.start);
+		for (int t=1; t < g.nthreads; t++){
+			pthread_join (threads[t], NULL);
 		}
-		for (int yolanda = pivot + 1; yolanda < expm_rows; yolanda++){
-			if (rmos[yolanda] == col){
-				xor_row (ns->relns[yolanda].row, ns->relns[pivot].row, ns->row_len);
-				xor_row (history[yolanda], history[pivot], hmlen);
-
-				/* update the cached value of the rightmost 1. We know the rightmost 1 of the 
-				 * xor'ed result has to be to the left of 'col', since that was the position
-				 * of the rightmost 1 of both yolanda and pivot, and the xor sets that to 0. */
-				rmos[yolanda] = rightmost_1 (ns->relns[yolanda].row, col);	
+		pthread_barrier_destroy (&g.start);
+		pthread_barrier_destroy (&g.done);
+	}
+
+	/* Any zero rows are dependencies; their history rows say which rows of the matrix they are made of. */
+	int ndeps = 0;
+	for (int row = 0; row < hmsize && ndeps < 64; row ++){
+		if (g.rmos[row] < 0){
+			for (int i=0; i < hmsize; i++){
+				if (get_bit (g.history[row], i) == 1){
+					deps[i] |= 1ull << ndeps;
+				}
 			}
+			ndeps ++;
+		}
+	}
+	for (int i=0; i < hmsize; i++){
+		free (g.rows[i]);
+		free (g.history[i]);
+	}
+	free (g.rows);
+	free (g.history);
+	free (g.rmos);
+	free (g.todo);
+	free (head);
+	free (next);
+	return ndeps;
+}
+
+/* Find dependencies with whichever solver fits the matrix, and deduce the factors from them. */
+void solve_matrix (nsieve_t *ns){
+	if (ns->error != 0) return;
+	long start = clock();
+	uint64_t *deps = (uint64_t *) calloc (ns->nrows + 1, sizeof (uint64_t));
+	if (deps == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	int ndeps = 0;
+	out_progress (&ns->out, NSIEVE_PHASE_MATRIX, -1);
+	int use_lanczos = ns->solver == SOLVER_LANCZOS || (ns->solver == SOLVER_AUTO && ns->ncols > MATRIX_DENSE_MAX);
+	if (use_lanczos){
+		ndeps = block_lanczos (ns, deps);
+		if (ndeps == 0 && ns->error == 0 && ns->ncols <= LANCZOS_GAUSS_FALLBACK){
+			ns_printf (ns, "Block Lanczos failed; falling back to gaussian elimination.\n");
+			memset (deps, 0, (ns->nrows + 1) * sizeof (uint64_t));
+			ndeps = m4ri_solve (ns, deps);
 		}
+	} else if (ns->solver == SOLVER_GAUSS){
+		ndeps = gauss_solve (ns, deps);
+	} else {
+		ndeps = m4ri_solve (ns, deps);
 	}
-	printf("\nMatrix solved; deducing factors...\n");
 	ns->timing.matsolve_time = clock() - start;
-	start = clock();
+	if (ns->error != 0){	// a solver ran out of memory
+		free (deps);
+		return;
+	}
+	ns_printf (ns, "\nMatrix solved (%d dependencies); deducing factors...\n", ndeps);
+
+	deduce_factors (ns, deps, ndeps);
+	free (deps);
+}
+
+/* The factor deduction does the same work for a relation in every dependency it is part of, so it is done
+ * once up front: the relation's share of the left hand side (see below) is computed mod N for every relation
+ * that is in any dependency, together with the self-checks. That needs A^-1 mod N for the relation's
+ * polygroup, which is the same for the hundreds of relations from that group, so it is computed once per
+ * group and kept in a small hashtable (keyed by the group, or by the batch for mapped relations). The
+ * dependencies themselves are then handled ns->nthreads at a time, one per thread, and each multiplies
+ * its relations' shares together with a product tree, which lets GMP multiply big numbers together
+ * instead of doing thousands of small products, each followed by a reduction mod N.
+*/
+
+typedef struct {
+	const void **keys;	// NULL for an empty slot
+	mpz_t *vals;
+	uint32_t mask;
+} ainv_cache_t;
+
+static int ainv_cache_init (ainv_cache_t *c, uint32_t nexpected){	// 0 if there isn't enough memory
+	uint32_t size = 16;
+	while (size < 2 * nexpected) size *= 2;
+	c->keys = (const void **) calloc (size, sizeof (void *));
+	c->vals = (mpz_t *) malloc (size * sizeof (mpz_t));
+	c->mask = size - 1;
+	return c->keys != NULL && c->vals != NULL;
+}
+
+static void ainv_cache_free (ainv_cache_t *c){
+	for (uint32_t i=0; c->keys != NULL && i <= c->mask; i++){
+		if (c->keys[i] != NULL) mpz_clear (c->vals[i]);
+	}
+	free (c->keys);
+	free (c->vals);
+}
+
+/* The slot for key; *isnew is set if it wasn't there before (and the value then still has to be filled in) */
+static mpz_t *ainv_slot (ainv_cache_t *c, const void *key, int *isnew){
+	uint32_t h = (uint32_t) (((uintptr_t) key >> 4) * 0x9e3779b1u) & c->mask;
+	while (c->keys[h] != NULL && c->keys[h] != key){
+		h = (h + 1) & c->mask;
+	}
+	*isnew = c->keys[h] == NULL;
+	if (*isnew){
+		c->keys[h] = key;
+		mpz_init (c->vals[h]);
+	}
+	return &c->vals[h];
+}
+
+static mpz_t *rel_ainv (ainv_cache_t *c, rel_t *rel, nsieve_t *ns){
+	int isnew;
+	mpz_t *v = ainv_slot (c, rel->poly->group, &isnew);
+	if (isnew) mpz_invert (*v, rel->poly->group->victim->poly->a, ns->N);
+	return v;
+}
+
+static mpz_t *relref_ainv (ainv_cache_t *c, const relref_t *r, nsieve_t *ns){
+	int isnew;
+	mpz_t *v = ainv_slot (c, r->batch, &isnew);
+	if (isnew){
+		relref_get_a (*v, r, ns);
+		mpz_invert (*v, *v, ns->N);
+	}
+	return v;
+}
+
+/* Everything the deduction threads share. */
+typedef struct {
+	nsieve_t *ns;
+	uint64_t *deps;		// the solver's dependencies, by row of the (merged) matrix
+	matrel_t *base;		// the matrix relations the rows are made of
+	uint32_t nbase;
+	uint64_t *used;		// for each relation in base, the dependencies it is in (bit d for dependency d)
+	uint32_t nused;		// how many relations are in any of them
+	mpz_t *shares;		// for each used relation, its share of the left hand side
+	ainv_cache_t ainv;
+	mpz_t n;		// N without the multiplier
+
+	int nthreads;
+	int first;		// the dependencies first, first+1, ... are being done, one per thread
+	int count;
+	mpz_t *results;		// gcd (rhs - lhs, n) for each of them, or 0 if the dependency was bad
+} deduce_t;
+
+typedef struct {
+	deduce_t *d;
+	int id;
+} deduce_thread_t;
+
+/* Compute the left hand side shares of every nthreads'th used relation, starting at id. */
+static void *compute_shares (void *args){
+	deduce_thread_t *t = (deduce_thread_t *) args;
+	deduce_t *d = t->d;
+	nsieve_t *ns = d->ns;
+	int k = 0;
+	for (uint32_t j=0; j < d->nbase; j++){
+		if (d->used[j] == 0) continue;
+		if (k++ % d->nthreads != t->id) continue;
+		matrel_t *m = &d->base[j];
+		mpz_set_ui (d->shares[j], 1);
+		if (m->r1 == NULL){	// the relations are in a mapped relation file
+			relref_multiply_in (d->shares[j], m->f1, *relref_ainv (&d->ainv, m->f1, ns), ns);
+			if (m->f2 != NULL) relref_multiply_in (d->shares[j], m->f2, *relref_ainv (&d->ainv, m->f2, ns), ns);
+			continue;
+		}
+		if (ns->verify && !rel_check (m->r1, ns)){	// one can never have too much checking.
+			ns_printf (ns, "relation failed check. [%s]\n", m->r2==NULL?"full":"partial, r1");
+		}
+		multiply_in_lhs (d->shares[j], m->r1, *rel_ainv (&d->ainv, m->r1, ns), ns);
+		if (m->r2 != NULL){	// partial
+			if (m->r1->cofactor != m->r2->cofactor){
+				ns_printf (ns, "AAAH - cofactors disagree! (%d and %d)\n", m->r1->cofactor, m->r2->cofactor);
+			}
+			if (ns->verify && !rel_check (m->r2, ns)){
+				ns_printf (ns, "relation failed check. [partial, r2]\n");
+			}
+			multiply_in_lhs (d->shares[j], m->r2, *rel_ainv (&d->ainv, m->r2, ns), ns);
+		}
+	}
+	return NULL;
+}
+
+/* Multiply v[0] ... v[n-1] together with a product tree, destroying v, and reduce the result mod N. */
+static void product_tree_mod (mpz_t res, mpz_t *v, uint32_t n, const mpz_t N){
+	if (n == 0){
+		mpz_set_ui (res, 1);
+		return;
+	}
+	while (n > 1){
+		uint32_t half = 0;
+		for (uint32_t i=0; i + 1 < n; i += 2){
+			mpz_mul (v[half++], v[i], v[i+1]);
+		}
+		if (n % 2 == 1) mpz_swap (v[half++], v[n-1]);
+		n = half;
+	}
+	mpz_mod (res, v[0], N);
+}
+
+/* Turn one dependency into a congruence of squares, and leave gcd (rhs - lhs, n) in res (0 if something
+ * was wrong with it). tree has room for all of the used relations. */
+static void deduce_dep (deduce_t *d, int dep, mpz_t res, uint16_t *factor_counts, mpz_t *tree){
+	nsieve_t *ns = d->ns;
+	const uint64_t bit = 1ull << dep;
+#ifdef MAT_CHECK
+	// This code will verify that the matrix solving worked; that is, it will xor together all of the rows
+	// in the dependency, and verify that every column comes out even. It only needs the sparse rows.
+	if (ns->verify){
+		const int parity_len = (ns->ncols/64 + ROWOPS_PAD) / ROWOPS_PAD * ROWOPS_PAD;
+		uint64_t *parity = (uint64_t *) calloc (parity_len, sizeof (uint64_t));
+		for (uint32_t i=0; i < ns->nrows; i++){
+			if (d->deps[i] & bit){
+				for (uint32_t j=0; j < ns->relns[i].weight; j++){
+					flip_bit (parity, ns->relns[i].cols[j]);
+				}
+			}
+		}
+		if (!is_zero_vec (parity, parity_len)){
+			ns_printf (ns, "Check FAILED for dependency %d (%d odd columns)\n", dep, row_popcount (parity, parity_len));
+		}
+		free (parity);
+	}
+#endif
+	// yay! we have a dependency. Now the ugly math begins.
+	mpz_t lhs, rhs;	// we will end up with lhs^2 ~= rhs^2 (mod N)
+			// the left hand side is the H_p,i and the right side is the y_p,i.
+	mpz_inits (lhs, rhs, NULL);
+	mpz_set_ui(rhs, 1);
+	memset (factor_counts, 0, 2 * (ns->fb_len + 1));	// clear the factor_counts table
+	uint32_t nshares = 0;
+	for (uint32_t j = 0; j < d->nbase; j ++){
+		if ((d->used[j] & bit) == 0) continue;	// the relation numbered 'j' isn't in the dependency
+		matrel_t *m = &d->base[j];
+		mpz_set (tree[nshares++], d->shares[j]);
+		if (m->r1 == NULL){
+			relref_add_factors (factor_counts, m->f1);
+			if (m->f2 != NULL){
+				relref_add_factors (factor_counts, m->f2);
+				mpz_mul_ui (rhs, rhs, relref_cofactor (m->f1));
+			}
+			continue;
+		}
+		add_factors_to_table (factor_counts, m->r1);
+		if (m->r2 != NULL){
+			add_factors_to_table (factor_counts, m->r2);
+			mpz_mul_ui (rhs, rhs, m->r1->cofactor);	// the cofactors aren't stored
+						// in the lists, so we have to do them separately.
+		}
+	}
+	product_tree_mod (lhs, tree, nshares, ns->N);
+	mpz_set_ui (res, 0);
+	if (construct_rhs (factor_counts, rhs, ns)){
+		mpz_mod (rhs, rhs, ns->N);
+		mpz_sub (res, rhs, lhs);
+		mpz_gcd (res, res, d->n);
+	} else {	// more self-checks.
+		ns_printf (ns, "construct_rhs check failed.\n");
+	}
+	mpz_clears (lhs, rhs, NULL);
+}
+
+static void *deduce_thread (void *args){
+	deduce_thread_t *t = (deduce_thread_t *) args;
+	deduce_t *d = t->d;
+	const uint32_t nused = d->nused;
+	uint16_t *factor_counts = (uint16_t *) malloc ((d->ns->fb_len + 1) * sizeof (uint16_t));	// see the comments in deduce_factors.
+	mpz_t *tree = (mpz_t *) malloc ((nused + 1) * sizeof (mpz_t));
+	if (factor_counts == NULL || tree == NULL){
+		for (int k = t->id; k < d->count; k += d->nthreads){
+			mpz_set_ui (d->results[k], 0);	// nothing found
+		}
+		ns_error (d->ns, NSIEVE_ENOMEM);
+		free (factor_counts);
+		free (tree);
+		return NULL;
+	}
+	for (uint32_t i=0; i < nused; i++){
+		mpz_init (tree[i]);
+	}
+	for (int k = t->id; k < d->count; k += d->nthreads){
+		deduce_dep (d, d->first + k, d->results[k], factor_counts, tree);
+	}
+	for (uint32_t i=0; i < nused; i++){
+		mpz_clear (tree[i]);
+	}
+	free (tree);
+	free (factor_counts);
+	return NULL;
+}
+
+/* Run f on the main thread and nthreads-1 others, and wait for all of them. */
+static void run_deduce_threads (deduce_t *d, void *(*f) (void *)){
+	pthread_t threads[d->nthreads];
+	deduce_thread_t targs[d->nthreads];
+	for (int i=0; i < d->nthreads; i++){
+		targs[i].d = d;
+		targs[i].id = i;
+		if (i > 0) pthread_create (&threads[i], NULL, f, &targs[i]);
+	}
+	f (&targs[0]);
+	for (int i=1; i < d->nthreads; i++){
+		pthread_join (threads[i], NULL);
+	}
+}
+
+/* Turn the dependencies into congruences of squares, and those into factors. Stops as soon as N is factored
+ * completely (or the dependencies run out). */
+/* Keep a factor in ns->factors, for whoever asked for the factorization (besides printing it) */
+static void keep_factor (nsieve_t *ns, mpz_t f){
+	ns->factors = (mpz_t *) realloc (ns->factors, (ns->nfactors + 1) * sizeof (mpz_t));
+	mpz_init_set (ns->factors[ns->nfactors ++], f);
+}
+
+void deduce_factors (nsieve_t *ns, uint64_t *deps, int ndeps){
+	long start = clock();
+	out_progress (&ns->out, NSIEVE_PHASE_SQRT, 0);
 
 /* Factor deduction and dealing with multiple polynomials, etc.
  *
@@ -116,114 +557,124 @@ void solve_matrix (nsieve_t *ns){
  * produce the value of rhs^2. Looping over the values, and multiplying rhs by fb[i-1]^(table[i]/2) (and reducing mod
  * N - this is very important that we can do this now!) will result in the correct computation of rhs.
 */
-	mpz_divexact_ui (ns->N, ns->N, ns->multiplier);	// otherwise we will uncover the multiplier as a factor.
-	mpz_t ncopy, temp;
-	mpz_init_set (ncopy, ns->N);
-	mpz_inits (temp, NULL);
-	uint16_t factor_counts[ns->fb_len+1];	// this is the table we mentioned in the above comment.
-	for (int row = 0; row < expm_rows; row ++){
-		if (is_zero_vec (ns->relns[row].row, ns->row_len)){	// we found a dependency
-			memset (factor_counts, 0, 2 * (ns->fb_len + 1));	// clear the factor_counts table
-			int relct = 0;
-			int partialct = 0;
-#ifdef MAT_CHECK
-			// This code will verify that the matrix solving worked; that is, it will xor together all of the rows
-			// specified in the history matrix, and verify that it is indeed the zero vector.
-			uint64_t check [ns->row_len];
-			clear_row (check, ns);
-			for (int i=0; i < hmsize; i++){
-				if (get_bit (history[row], i) == 1){
-					xor_row (check, expm[i], ns->row_len);
-				}
-			}
-			if (is_zero_vec (check, ns->row_len)){
-//				printf("Check succeeded.\n");
-			} else {
-				printf("Check FAILED for row = %d\n", row);
-			}
-#endif
-			// yay! we have a dependency. Now the ugly math begins.
-			mpz_t lhs, rhs;	// we will end up with lhs^2 ~= rhs^2 (mod N)
-					// the left hand side is the H_p,i and the right side is the y_p,i.
-			mpz_inits (lhs, rhs, NULL);
-			mpz_set_ui(lhs, 1);
-			mpz_set_ui(rhs, 1);
-			for (int relnum = 0; relnum < hmsize; relnum ++){
-				if (get_bit (history[row], relnum) == 1){	// the relation numbered 'relnum' is included in the dependency
-					matrel_t *m = &ns->relns[relnum];
-
-					if (!rel_check (m->r1, ns)){		// one can never have too much checking.
-						printf ("relation failed check. [%s]\n", m->r2==NULL?"full":"partial, r1");
-					} else {
-					//	printf ("relation passed check.\n");
-					}
-					multiply_in_lhs (lhs, m->r1, ns);
-					add_factors_to_table (factor_counts, m->r1);
-					relct ++;
-					if (m->r2 != NULL){	// partial
-						partialct ++;
-						if (m->r1->cofactor != m->r2->cofactor){
-							printf("AAAH - cofactors disagree! (%d and %d)\n", m->r1->cofactor, m->r2->cofactor);
-						}
-						if (!rel_check (m->r2, ns)){
-							printf ("relation failed check. [partial, r2]\n");
-						}
-						multiply_in_lhs (lhs,  m->r2, ns);
-						add_factors_to_table (factor_counts, m->r2);
+	/* Both sides are computed mod kN (that is what the polynomials were built for), but the gcds are taken with
+	 * N itself; otherwise we will uncover the multiplier as a factor. */
+	deduce_t d;
+	d.ns = ns;
+	d.deps = deps;
+	mpz_init (d.n);
+	mpz_divexact_ui (d.n, ns->N, ns->multiplier);
+	mpz_t ncopy;
+	mpz_init_set (ncopy, d.n);
 
-						mpz_mul_ui (rhs, rhs, m->r1->cofactor);	// the cofactors aren't stored
-									// in the lists, so we have to do them separately.
-					}
-				}
-			}
-			int is_good = construct_rhs (factor_counts, rhs, ns);
-//			printf ("multiplied together %d relations, %d of which were from partials\n", relct, partialct);
-			if ( ! is_good ) {	// more self-checks.
-				printf ("construct_rhs check failed.\n");
-				continue;
+	/* If the matrix was merged (see merge.c), each row is the xor of some of the filtered matrix relations in
+	 * ns->base, and a dependency has to be expanded into those before we can multiply anything in. All 64 of
+	 * them are expanded at once, a word per relation. */
+	d.base = ns->base != NULL ? ns->base : ns->relns;
+	d.nbase = ns->base != NULL ? ns->nbase : ns->nrows;
+	d.nthreads = ns->nthreads > 1 ? ns->nthreads : 1;
+	d.used = (uint64_t *) calloc (d.nbase + 1, sizeof (uint64_t));
+	d.shares = (mpz_t *) malloc ((d.nbase + 1) * sizeof (mpz_t));
+	d.results = (mpz_t *) malloc (d.nthreads * sizeof (mpz_t));
+	if (d.used == NULL || d.shares == NULL || d.results == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		free (d.used);
+		free (d.shares);
+		free (d.results);
+		mpz_clears (ncopy, d.n, NULL);
+		return;
+	}
+	for (int i=0; i < d.nthreads; i++){
+		mpz_init (d.results[i]);
+	}
+	for (uint32_t i=0; i < ns->nrows; i++){
+		if (deps[i] == 0) continue;
+		if (ns->relns[i].hist == NULL){
+			d.used[i] ^= deps[i];
+		} else {
+			for (uint32_t j=0; j < ns->relns[i].nhist; j++){
+				d.used[ns->relns[i].hist[j]] ^= deps[i];
 			}
-			mpz_mod (lhs, lhs, ns->N);
-			mpz_mod (rhs, rhs, ns->N);
+		}
+	}
+	d.nused = 0;
+	for (uint32_t j=0; j < d.nbase; j++){
+		if (d.used[j] == 0) continue;
+		mpz_init (d.shares[j]);
+		d.nused ++;
+	}
 
-			mpz_sub (temp, rhs, lhs);
-			mpz_gcd (temp, temp, ncopy);	// take the gcd with ncopy instead of N, to avoid reprinting already found factors.
-			mpz_abs (temp, temp);	// probably unneceesary
+	/* Fill in the A^-1 cache before the threads start reading it */
+	if (!ainv_cache_init (&d.ainv, 2 * d.nused)){
+		ns_error (ns, NSIEVE_ENOMEM);
+		ndeps = 0;	// nothing can be deduced; straight on to cleaning up.
+	}
+	for (uint32_t j=0; j < d.nbase && ndeps > 0; j++){
+		if (d.used[j] == 0) continue;
+		matrel_t *m = &d.base[j];
+		if (m->r1 == NULL){
+			relref_ainv (&d.ainv, m->f1, ns);
+			if (m->f2 != NULL) relref_ainv (&d.ainv, m->f2, ns);
+		} else {
+			rel_ainv (&d.ainv, m->r1, ns);
+			if (m->r2 != NULL) rel_ainv (&d.ainv, m->r2, ns);
+		}
+	}
+	if (ndeps > 0) run_deduce_threads (&d, compute_shares);
+
+	/* Now the dependencies, a batch of nthreads at a time, until N is factored */
+	int done = 0;
+	for (d.first = 0; d.first < ndeps && !done; d.first += d.nthreads){
+		out_progress (&ns->out, NSIEVE_PHASE_SQRT, (double) d.first / ndeps);
+		d.count = ndeps - d.first < d.nthreads ? ndeps - d.first : d.nthreads;
+		run_deduce_threads (&d, deduce_thread);
+		if (ns->error != 0) break;	// one of them ran out of memory
+
+		for (int k=0; k < d.count && !done; k++){
+			mpz_ptr temp = d.results[k];
 			/* Now we check to see if the factor we found was nontrivial (1 or n) */
 			if (mpz_cmp_ui (temp, 1) > 0){
-				if (mpz_cmp (temp, ns->N) != 0){	// then it's a nontrivial factor!!!
-					if (mpz_divisible_p(ncopy, temp)){	// then we haven't found it before.
-						if (mpz_probab_prime_p (temp, 10)){	// verify its primality
-							mpz_out_str (stdout, 10, temp);
-							printf (" (prp)\n");
-							mpz_divexact(ncopy, ncopy, temp);
-							/* If the cofactor is prime, print it out too */
-							if (mpz_probab_prime_p (ncopy, 10)){
-								mpz_out_str(stdout, 10, ncopy);
-								printf (" (prp)\n");
-								mpz_set_ui(ncopy, 1);
-							}
-							if (mpz_cmp_ui(ncopy, 1) == 0){	// we're done!
-								mpz_clears(lhs, rhs, temp, ncopy, NULL);
-								ns->timing.facdeduct_time = clock() - start;
-								return;
-							}
+				if (mpz_cmp (temp, d.n) != 0){	// then it's a nontrivial factor!!!
+					mpz_gcd (temp, temp, ncopy);	// take the gcd with ncopy, to avoid reprinting already found factors.
+					if (mpz_cmp_ui (temp, 1) > 0 && bpsw_prime_p (temp)){	// verify its primality
+						ns_printf (ns, "%Zd (prp)\n", temp);
+						keep_factor (ns, temp);
+						mpz_divexact(ncopy, ncopy, temp);
+						/* If the cofactor is prime, print it out too */
+						if (bpsw_prime_p (ncopy)){
+							ns_printf (ns, "%Zd (prp)\n", ncopy);
+							keep_factor (ns, ncopy);
+							mpz_set_ui(ncopy, 1);
+						}
+						if (mpz_cmp_ui(ncopy, 1) == 0){	// we're done!
+							done = 1;
 						}
 					}
 				}
 			}
-			mpz_clears(lhs, rhs, NULL);
 		}
 	}
 
-	if (mpz_cmp_ui(ncopy, 1) != 0){
-		mpz_out_str (stdout, 10, ncopy);
-		if (mpz_probab_prime_p (ncopy, 10)){
-			printf (" (prp)\n");
+	if (ns->error == 0 && mpz_cmp_ui(ncopy, 1) != 0){
+		keep_factor (ns, ncopy);
+		if (bpsw_prime_p (ncopy)){
+			ns_printf (ns, "%Zd (prp)\n", ncopy);
 		} else {
 			/* It is a sad day. Most likely there is a bug. */
-			printf (" (c)\n");
+			ns_printf (ns, "%Zd (c)\n", ncopy);
 		}
 	}
+	for (int i=0; i < d.nthreads; i++){
+		mpz_clear (d.results[i]);
+	}
+	for (uint32_t j=0; j < d.nbase; j++){
+		if (d.used[j] != 0) mpz_clear (d.shares[j]);
+	}
+	free (d.results);
+	free (d.shares);
+	free (d.used);
+	ainv_cache_free (&d.ainv);
+	mpz_clears (ncopy, d.n, NULL);
 	ns->timing.facdeduct_time = clock() - start; 
 }
 
@@ -240,7 +691,7 @@ void add_factors_to_table (uint16_t *table, rel_t *rel){
 /* Given a filled out table, construct the right hand side of our fancy congruence */
 int construct_rhs (uint16_t *table, mpz_t rhs, nsieve_t *ns){	// returns nonzero on success, zero on failure.
 	if (table[0] % 2 != 0){
-		printf("Error: table[%d] is not even (=%d)\n", 0, table[0]);
+		ns_printf (ns, "Error: table[%d] is not even (=%d)\n", 0, table[0]);
 		return 0;
 	}
 	if ((table[0]/2) % 2 == 1){	// then we need to negate rhs
@@ -250,7 +701,7 @@ int construct_rhs (uint16_t *table, mpz_t rhs, nsieve_t *ns){	// returns nonzero
 	mpz_init (temp);
 	for (int i=1; i < ns->fb_len + 1; i++){
 		if (table[i] % 2 != 0){
-			printf("Error: table[%d] is not even (=%d)\n", i, table[i]);
+			ns_printf (ns, "Error: table[%d] is not even (=%d)\n", i, table[i]);
 			mpz_clear (temp);
 			return 0;
 		}
@@ -265,8 +716,8 @@ int construct_rhs (uint16_t *table, mpz_t rhs, nsieve_t *ns){	// returns nonzero
 }
 
 /* Take care of what needs to be done to the LHS for this relation. This is called once for each
- * component of the partial. */
-void multiply_in_lhs (mpz_t lhs, rel_t *rel, nsieve_t *ns) {	// this should work just as well for partials as for fulls.
+ * component of the partial. ainv is A^-1 (mod N) for the relation's polygroup. */
+void multiply_in_lhs (mpz_t lhs, rel_t *rel, const mpz_t ainv, nsieve_t *ns) {	// this should work just as well for partials as for fulls.
 	mpz_t temp;
 	mpz_init (temp);
 
@@ -286,9 +737,8 @@ void multiply_in_lhs (mpz_t lhs, rel_t *rel, nsieve_t *ns) {	// this should work
 
 	// It's easier to deal with the A^2 factor here in the LHS, since we're actually looping over
 	// the relations here already. We multiply by the modular multiplicative inverse A^-1 (mod N)
-	// on the left.
-	mpz_invert (temp, victim->poly->a, ns->N);
-	mpz_mul (lhs, lhs, temp);
+	// on the left; that is the same for the whole group, so the caller keeps it.
+	mpz_mul (lhs, lhs, ainv);
 
 	mpz_mod (lhs, lhs, ns->N);	// reduce mod N to keep things small.
 
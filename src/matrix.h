@@ -3,10 +3,21 @@
 
 #include "common.h"
 #include "poly.h"
+#include "postproc.h"
+#include "lanczos.h"
+#include "m4ri.h"
+#include "rowops.h"
+
+#define MAT_CHECK		// check every dependency against the sparse rows before using it. This is cheap now
+				// that it doesn't need a dense copy of the matrix, so it stays on.
+#define MATRIX_DENSE_MAX 2000	// matrices with more columns than this are solved with block Lanczos
+#define LANCZOS_GAUSS_FALLBACK 20000	// if block Lanczos fails on a matrix this small, try M4RI
 
 void solve_matrix (nsieve_t *);	// the entire matrix solving and square root step. Will print out the factors (with very high probability).
+int  gauss_solve  (nsieve_t *, uint64_t *deps);	// dense solver; fills in deps (see matrix.c) and returns how many there are
+void deduce_factors (nsieve_t *, uint64_t *deps, int ndeps);
 
-void multiply_in_lhs (mpz_t, rel_t *, nsieve_t *);	// subroutine in the factor determination, for multiplying in a single relation.
+void multiply_in_lhs (mpz_t, rel_t *, const mpz_t ainv, nsieve_t *);	// subroutine in the factor determination, for multiplying in a single relation.
 int  construct_rhs   (uint16_t *, mpz_t, nsieve_t *);
 void add_factors_to_table (uint16_t *, rel_t *);
 
@@ -0,0 +1,265 @@
+#include "merge.h"
+
+/* Merging, or structured Gaussian elimination. After filtering, most columns still occur in only a handful
+ * of rows. A column that occurs in w rows can be eliminated by picking one of them (the pivot, the shortest
+ * one) and xoring it into the other w-1; the pivot row is then dropped, along with the column, which is now
+ * empty. That takes out one row and one column, so the excess is unchanged, but the rows that the pivot was
+ * added into get heavier. Doing this for the lightest columns first keeps the fill-in down, and we stop
+ * once the average row has ns->merge_density nonzeros (or there is nothing light enough left to merge).
+ * The dense Gaussian elimination in matrix.c costs about rows^2 * cols / 64 no matter how dense the rows
+ * are, so every merge is a win there.
+ *
+ * Each merged row records which of the filtered matrix relations it is the xor of (its 'history'), so that
+ * the factor deduction can expand a dependency among merged rows back into the relations it is made of.
+ * The filtered matrix relations are kept in ns->base, and ns->relns is replaced with the merged rows.
+*/
+
+typedef struct {
+	uint32_t *cols;		// sorted
+	uint32_t ncols;
+	uint32_t *hist;		// sorted indices into ns->base
+	uint32_t nhist;
+	int alive;
+} mrow_t;
+
+typedef struct {
+	mrow_t *rows;
+	uint32_t nrows;
+	uint32_t ncols;
+	uint32_t *weight;	// number of live rows containing each column
+	uint32_t **colrows;	// for each column, rows that have contained it; entries may be stale
+	uint32_t *collen;
+	uint32_t *colcap;
+	uint32_t nalive;
+	uint64_t nnz;		// total nonzeros in the live rows
+} merger_t;
+
+static void col_add_row (merger_t *mg, uint32_t c, uint32_t r){
+	if (mg->collen[c] == mg->colcap[c]){
+		mg->colcap[c] = mg->colcap[c] == 0 ? 4 : 2 * mg->colcap[c];
+		mg->colrows[c] = (uint32_t *) realloc (mg->colrows[c], mg->colcap[c] * sizeof (uint32_t));
+	}
+	mg->colrows[c][mg->collen[c] ++] = r;
+}
+
+/* Returns 0 (with nothing left allocated) if there isn't enough memory for the tables. */
+static int merger_init (merger_t *mg, nsieve_t *ns){
+	mg->nrows = ns->nrows;
+	mg->ncols = ns->ncols;
+	mg->rows = (mrow_t *) malloc ((mg->nrows + 1) * sizeof (mrow_t));
+	mg->weight = (uint32_t *) calloc (mg->ncols, sizeof (uint32_t));
+	mg->colrows = (uint32_t **) calloc (mg->ncols, sizeof (uint32_t *));
+	mg->collen = (uint32_t *) calloc (mg->ncols, sizeof (uint32_t));
+	mg->colcap = (uint32_t *) calloc (mg->ncols, sizeof (uint32_t));
+	if (mg->rows == NULL || mg->weight == NULL || mg->colrows == NULL || mg->collen == NULL || mg->colcap == NULL){
+		free (mg->rows);
+		free (mg->weight);
+		free (mg->colrows);
+		free (mg->collen);
+		free (mg->colcap);
+		return 0;
+	}
+	mg->nalive = mg->nrows;
+	mg->nnz = 0;
+
+	for (uint32_t i=0; i < mg->nrows; i++){
+		mrow_t *r = &mg->rows[i];
+		r->ncols = ns->relns[i].weight;
+		r->cols = (uint32_t *) malloc ((r->ncols + 1) * sizeof (uint32_t));
+		memcpy (r->cols, ns->relns[i].cols, r->ncols * sizeof (uint32_t));
+		for (uint32_t j=0; j < r->ncols; j++){
+			mg->weight[r->cols[j]] ++;
+			col_add_row (mg, r->cols[j], i);
+		}
+		r->hist = (uint32_t *) malloc (sizeof (uint32_t));
+		r->hist[0] = i;
+		r->nhist = 1;
+		r->alive = 1;
+		mg->nnz += r->ncols;
+	}
+	return 1;
+}
+
+static void merger_free (merger_t *mg){
+	for (uint32_t i=0; i < mg->nrows; i++){
+		free (mg->rows[i].cols);
+		free (mg->rows[i].hist);
+	}
+	for (uint32_t j=0; j < mg->ncols; j++){
+		free (mg->colrows[j]);
+	}
+	free (mg->rows);
+	free (mg->weight);
+	free (mg->colrows);
+	free (mg->collen);
+	free (mg->colcap);
+}
+
+static int row_has_col (mrow_t *r, uint32_t c){
+	uint32_t lo = 0, hi = r->ncols;
+	while (lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if (r->cols[mid] < c){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < r->ncols && r->cols[lo] == c;
+}
+
+static void kill_row (merger_t *mg, uint32_t i){
+	mrow_t *r = &mg->rows[i];
+	for (uint32_t j=0; j < r->ncols; j++){
+		mg->weight[r->cols[j]] --;
+	}
+	mg->nnz -= r->ncols;
+	mg->nalive --;
+	r->alive = 0;
+}
+
+/* Add row p into row i, updating the column weights and indexes. */
+static void add_row (merger_t *mg, uint32_t i, uint32_t p){
+	mrow_t *r = &mg->rows[i];
+	mrow_t *piv = &mg->rows[p];
+	for (uint32_t j=0; j < piv->ncols; j++){
+		uint32_t c = piv->cols[j];
+		if (row_has_col (r, c)){
+			mg->weight[c] --;
+		} else {
+			mg->weight[c] ++;
+			col_add_row (mg, c, i);
+		}
+	}
+	uint32_t *cols = (uint32_t *) malloc ((r->ncols + piv->ncols + 1) * sizeof (uint32_t));
+	uint32_t ncols = sparse_row_xor (cols, r->cols, r->ncols, piv->cols, piv->ncols);
+	mg->nnz += ncols;
+	mg->nnz -= r->ncols;
+	free (r->cols);
+	r->cols = cols;
+	r->ncols = ncols;
+
+	uint32_t *hist = (uint32_t *) malloc ((r->nhist + piv->nhist + 1) * sizeof (uint32_t));
+	r->nhist = sparse_row_xor (hist, r->hist, r->nhist, piv->hist, piv->nhist);
+	free (r->hist);
+	r->hist = hist;
+}
+
+static int by_value (const void *a, const void *b){
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return x < y ? -1 : (x > y);
+}
+
+/* Eliminate column c. A column of weight 1 is a singleton, and its row is simply dropped. */
+static void eliminate_col (merger_t *mg, uint32_t c){
+	// collect the live rows that still have this column, dropping the stale entries as we go
+	uint32_t *list = mg->colrows[c];
+	uint32_t n = 0;
+	for (uint32_t j=0; j < mg->collen[c]; j++){
+		uint32_t i = list[j];
+		if (mg->rows[i].alive && row_has_col (&mg->rows[i], c)){
+			list[n++] = i;
+		}
+	}
+	qsort (list, n, sizeof (uint32_t), by_value);	// a row can be listed twice if it lost c and got it back.
+	uint32_t m = 0;
+	for (uint32_t j=0; j < n; j++){
+		if (m == 0 || list[m-1] != list[j]) list[m++] = list[j];
+	}
+	mg->collen[c] = m;
+
+	uint32_t pivot = list[0];
+	for (uint32_t j=1; j < m; j++){
+		if (mg->rows[list[j]].ncols < mg->rows[pivot].ncols) pivot = list[j];
+	}
+	for (uint32_t j=0; j < m; j++){
+		if (list[j] != pivot) add_row (mg, list[j], pivot);
+	}
+	kill_row (mg, pivot);
+	mg->collen[c] = 0;
+}
+
+static double density (merger_t *mg){
+	return mg->nalive == 0 ? 0 : (double) mg->nnz / mg->nalive;
+}
+
+/* Replace ns->relns with the live rows, renumbering the columns to skip the empty ones. The old matrix
+ * relations become ns->base. Returns 0, with the matrix as it was before merging, if there isn't enough
+ * memory for the new one. */
+static int merger_compact (merger_t *mg, nsieve_t *ns){
+	uint32_t *colmap = (uint32_t *) malloc ((mg->ncols + 1) * sizeof (uint32_t));
+	matrel_t *relns = (matrel_t *) calloc (mg->nalive + 1, sizeof (matrel_t));
+	if (colmap == NULL || relns == NULL){
+		free (colmap);
+		free (relns);
+		return 0;
+	}
+	uint32_t ncols = 0;
+	for (uint32_t j=0; j < mg->ncols; j++){
+		colmap[j] = ncols;
+		if (mg->weight[j] > 0) ncols ++;
+	}
+	for (uint32_t i=0; i < mg->nrows; i++){
+		free (ns->relns[i].cols);
+		ns->relns[i].cols = NULL;
+	}
+	ns->base = ns->relns;
+	ns->nbase = ns->nrows;
+	ns->ncols = ncols;
+
+	ns->relns = relns;
+	uint32_t w = 0;
+	for (uint32_t i=0; i < mg->nrows; i++){
+		mrow_t *r = &mg->rows[i];
+		if (!r->alive) continue;
+		matrel_t *m = &ns->relns[w++];
+		for (uint32_t j=0; j < r->ncols; j++){
+			r->cols[j] = colmap[r->cols[j]];
+		}
+		m->cols = r->cols;	// hand the row and its history over to the matrix relation
+		m->weight = r->ncols;
+		m->hist = r->hist;
+		m->nhist = r->nhist;
+		r->cols = NULL;
+		r->hist = NULL;
+	}
+	ns->nrows = w;
+	free (colmap);
+	return 1;
+}
+
+/* Merge columns of weight 1, 2, 3, ... up to MERGE_MAX_WEIGHT, going back to the lightest ones whenever a
+ * pass changed anything, until the target density is reached. */
+void merge (nsieve_t *ns){
+	if (ns->merge_density <= 0 || ns->error != 0) return;
+	long start = clock();
+	merger_t mg;
+	if (!merger_init (&mg, ns)){
+		ns_printf (ns, "Not enough memory to merge the matrix; solving it as it is.\n");
+		return;
+	}
+	uint32_t rows0 = ns->nrows;
+	uint32_t cols0 = ns->ncols;
+	double density0 = density (&mg);
+
+	int w = 1;
+	while (w <= MERGE_MAX_WEIGHT && density (&mg) < ns->merge_density){
+		uint32_t pass = 0;
+		for (uint32_t c=0; c < mg.ncols && density (&mg) < ns->merge_density; c++){
+			if (mg.weight[c] == w){
+				eliminate_col (&mg, c);
+				pass ++;
+			}
+		}
+		w = pass > 0 ? 1 : w + 1;
+	}
+	if (!merger_compact (&mg, ns)){
+		ns_printf (ns, "Not enough memory to merge the matrix; solving it as it is.\n");
+		merger_free (&mg);
+		return;
+	}
+	merger_free (&mg);
+	ns_printf (ns, "Merging: %u x %u matrix (%.1f nonzeros per row) down to %u x %u (%.1f nonzeros per row).\n", rows0, cols0, density0, ns->nrows, ns->ncols, ns->nrows == 0 ? 0.0 : (double) mg.nnz / ns->nrows);
+	ns->timing.filter_time += clock() - start;
+}
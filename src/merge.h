@@ -0,0 +1,13 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include "common.h"
+
+/* Structured Gaussian elimination ('merging') on the filtered matrix. See merge.c. */
+
+#define MERGE_TARGET_DENSITY 70	// default for ns->merge_density
+#define MERGE_MAX_WEIGHT     32	// never eliminate a column that occurs in more rows than this
+
+void merge (nsieve_t *);
+
+#endif
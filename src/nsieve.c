@@ -4,97 +4,166 @@
  * also does some initialization work */
 
 
-/* First some, routines for generating the factor base */
-
-/* The familiar sieve of Eratosthenes */
-void era_sieve (nsieve_t *ns, char *vals){
-	// assumes vals has been allocated and cleared with sufficient space for fb_bound chars.
-	// 0 is prime, 1 is composite.
-	for (int skip=2; skip < (int) (sqrt(ns->fb_bound) + 1); skip++){
-		if (vals[skip-2] == 1){
-			continue;
-		}
-		for (int pos=2*skip; pos < ns->fb_bound; pos += skip){
-			vals[pos-2] = 1;
+/* First some, routines for generating the factor base. For small N, this used to take longer than the
+ * sieving, so it is all done in native arithmetic: a segmented, bit-packed sieve of Eratosthenes (over odd
+ * numbers only, a segment at a time so it stays in the L1 cache) finds the primes below fb_bound, each
+ * one is kept if N is a quadratic residue mod p (which only takes N mod p from GMP), and the square roots
+ * are then found with sqrt_mod, split up between the threads if there are a lot of them. */
+
+typedef struct {
+	nsieve_t *ns;
+	const uint32_t *nmodp;	// N mod each prime of the factor base
+	uint32_t first;
+	uint32_t count;
+} fb_roots_t;
+
+/* Find the roots of N mod fb[first .. first+count), and the logs of those primes. */
+static void *fb_roots (void *args){
+	fb_roots_t *r = (fb_roots_t *) args;
+	nsieve_t *ns = r->ns;
+	for (uint32_t i = r->first; i < r->first + r->count; i++){
+		if (ns->multiplier % ns->fb[i] == 0){	// the primes of the multiplier divide kN; there is just the one root.
+			ns->roots[i] = 0;
+		} else {
+			ns->roots[i] = sqrt_mod (r->nmodp[i], ns->fb[i]);	// see common.c for the implementation of this method.
+			if (ns->roots[i] > ns->fb[i]/2){
+				ns->roots[i] = ns->fb[i] - ns->roots[i];	// normalize these to be the smaller of the two roots.
+			}
+			// note that there are actually 2 square roots; however, the second may be 
+			// obtained readily as p - sqrt#1, so only one is stored.
 		}
+		ns->fb_logs[i] = fast_log (ns->fb[i]);
 	}
+	return NULL;
 }
 
-/* Extract the values of the primes from the sieve. Only extract those primes for which N is a
- * quadratic residue (mod p). This test was conveniently provided by the gmp routine 
- * mpz_kronecker_ui. */
-void extract (nsieve_t *ns, char *vals){
-	// first count the number of primes found such that (n/p) = 1. (n/p) is the Legendre symbol.
-	int count = 0;
-	for (int i=0; i < ns->fb_bound-2; i++){
-		if (vals[i] == 0){
-			if (i == 0 || i+2 == ns->multiplier || mpz_kronecker_ui(ns->N, i+2) == 1){	// we must admit 2, since N is always a QR mod 2, but there's something wierd about the kronecker symbol for 2  because it's not odd.
-				count++;
-			}
-		}
+/* Add p to the factor base if N is a quadratic residue mod p (or p divides the multiplier). */
+static void fb_consider (nsieve_t *ns, uint32_t p, uint32_t *cap, uint32_t **nmodp){
+	uint32_t a = mpz_fdiv_ui (ns->N, p);
+	if (p != 2 && ns->multiplier % p != 0 && jacobi32 (a, p) != 1){	// we must admit 2, since N is always a QR mod 2.
+		return;
 	}
-	// now we know how much space to allocate for our list
-	ns->fb_len = count;
-	ns->rels_needed = ns->fb_len + ns->extra_rels;
-	ns->fb = (uint32_t *)(malloc(count * sizeof(uint32_t)));
-	int w = 0;
-	for (int i=0; i < ns->fb_bound-2; i++){
-		if (vals[i] == 0 && (i == 0 || i+2 == ns->multiplier || mpz_kronecker_ui(ns->N, i+2) == 1)){
-			ns->fb[w] = i+2;
-			w++;
-		}
+	if (ns->fb_len == *cap){
+		*cap *= 2;
+		ns->fb = (uint32_t *) realloc (ns->fb, *cap * sizeof (uint32_t));
+		*nmodp = (uint32_t *) realloc (*nmodp, *cap * sizeof (uint32_t));
 	}
+	ns->fb[ns->fb_len] = p;
+	(*nmodp)[ns->fb_len] = a;
+	ns->fb_len ++;
 }
 
-/* Generates the factor base, given the bound fb_bound; will also compute the roots of N mod each p. */
+/* Generates the factor base: the primes p < fb_bound such that (N/p) = 1, and the roots of N mod each p. */
 void generate_fb (nsieve_t *ns){
-	// first we use the sieve of Eratosthenes and the mpz_kronecker function to find a list of primes p < fb_bound such that (n/p) = 1.
-	char *erasieve_vals = (char *)(calloc(ns->fb_bound, sizeof(char)));
-	era_sieve (ns, erasieve_vals);
-	extract (ns, erasieve_vals);
-	free (erasieve_vals);
+	uint32_t cap = 1024;
+	uint32_t *nmodp = (uint32_t *) malloc (cap * sizeof (uint32_t));
+	ns->fb = (uint32_t *) malloc (cap * sizeof (uint32_t));
+	ns->fb_len = 0;
+	if (ns->fb_bound > 2) fb_consider (ns, 2, &cap, &nmodp);
+
+	/* The odd primes up to sqrt(fb_bound), to sieve the segments with */
+	uint32_t sqrt_bound = (uint32_t) sqrt (ns->fb_bound) + 1;
+	char *composite = (char *) calloc (sqrt_bound + 1, 1);
+	uint32_t *sp = (uint32_t *) malloc ((sqrt_bound / 2 + 1) * sizeof (uint32_t));
+	uint32_t nsp = 0;
+	for (uint32_t i=3; i <= sqrt_bound; i += 2){
+		if (composite[i]) continue;
+		sp[nsp++] = i;
+		for (uint32_t j = i*i; j <= sqrt_bound; j += 2*i){
+			composite[j] = 1;
+		}
+	}
+	free (composite);
+
+	/* Bit j of a segment starting at lo stands for lo + 2j. */
+	uint64_t seg[FB_SEGMENT / 8];
+	const uint64_t segbits = FB_SEGMENT * 8;
+	for (uint64_t lo = 3; lo < ns->fb_bound; lo += 2 * segbits){
+		uint64_t hi = lo + 2 * segbits;	// exclusive
+		memset (seg, 0, sizeof (seg));
+		for (uint32_t k=0; k < nsp && (uint64_t) sp[k] * sp[k] < hi; k++){
+			uint64_t q = sp[k];
+			uint64_t m = q * q;
+			if (m < lo){
+				m = (lo + q - 1) / q * q;
+				if (m % 2 == 0) m += q;
+			}
+			for (; m < hi; m += 2*q){
+				uint64_t j = (m - lo) / 2;
+				seg[j / 64] |= 1ull << (j % 64);
+			}
+		}
+		for (uint64_t w=0; w < segbits / 64; w++){
+			uint64_t primes = ~seg[w];
+			while (primes != 0){
+				uint64_t p = lo + 2 * (64 * w + __builtin_ctzll (primes));
+				primes &= primes - 1;
+				if (p >= ns->fb_bound) break;
+				fb_consider (ns, (uint32_t) p, &cap, &nmodp);
+			}
+		}
+	}
+	free (sp);
+	ns->rels_needed = ns->fb_len + ns->extra_rels;
 
 	// now we compute the modular square roots of n mod each p, and approximations to log_2(p).
 	ns->roots = (uint32_t *)(malloc(ns->fb_len * sizeof(uint32_t)));
 	ns->fb_logs = (uint8_t *)(malloc(ns->fb_len * sizeof(uint8_t)));
-	for (int i=0; i<ns->fb_len; i++){
-		if (ns->fb[i] == ns->multiplier){
-			ns->roots[i] = 0;
-		} else {
-			ns->roots[i] = find_root (ns->N, ns->fb[i]);	// see common.c for the implementation of this method.
-			if (ns->roots[i] > ns->fb[i]/2){
-				ns->roots[i] = ns->fb[i] - ns->roots[i];	// normalize these to be the smaller of the two roots.
-			}
-			// note that there are actually 2 square roots; however, the second may be 
-			// obtained readily as p - sqrt#1, so only one is stored.
-		}
-		ns->fb_logs[i] = fast_log (ns->fb[i]);
+	int nthreads = ns->nthreads > 1 && ns->fb_len >= FB_PARALLEL_MIN ? ns->nthreads : 1;
+	fb_roots_t r[nthreads];
+	pthread_t threads[nthreads];
+	for (int t=0; t < nthreads; t++){
+		r[t].ns = ns;
+		r[t].nmodp = nmodp;
+		r[t].first = (uint64_t) ns->fb_len * t / nthreads;
+		r[t].count = (uint64_t) ns->fb_len * (t+1) / nthreads - r[t].first;
+		if (t > 0) pthread_create (&threads[t], NULL, fb_roots, &r[t]);
+	}
+	fb_roots (&r[0]);
+	for (int t=1; t < nthreads; t++){
+		pthread_join (threads[t], NULL);
 	}
+	free (nmodp);
 }
 
 /* Now some things for automatic selection of parameters. By 'automatic' this is more of a reflection
  * of my twiddling the parameters for various sizes of N and recording what worked best rather than
  * anything more mathematically motivated. 
 */
-const int PARAM_FBBOUND = 1;
-const int PARAM_LPBOUND = 2;
-const int PARAM_M = 3;
-const int PARAM_T = 4;
-
-#define NPLEVELS  10	// number of entries in the params table
-#define  NPARAMS  5
-//						bits   FBB    LPB  M   T
-const double params[NPLEVELS][NPARAMS] =   { 	{ 80,  1600,  50,  1 , 1.4},
-						{100,  5000,  70,  1 , 1.45},
-						{120,  8000,  90,  1 , 1.5},
-						{140, 18000,  120, 1 , 1.5},
-					    	{160, 36000,  120, 1 , 1.45},
-						{180, 66000,  120, 1 , 1.45},
-						{200, 120000, 150, 2 , 1.5}, 
-						{220, 200000, 180, 2 , 1.55},/* beyond this point these are guesses. */ 	
-						{230, 280000, 195, 2 , 1.55},
-						{240, 360000, 210, 2 , 1.57}
-					   };
+/* The table starts out with these, and any rows from a parameter file (see tune.c) are merged in by
+ * add_params, replacing the rows for the same sizes. */
+static int nplevels = 10;	// number of entries in the params table
+//							bits   FBB    LPB  M   T     smallp
+static double params[PARAMS_MAX][NPARAMS] =   { 	{ 80,  1600,  50,  1 , 1.4,  25},
+							{100,  5000,  70,  1 , 1.45, 25},
+							{120,  8000,  90,  1 , 1.5,  25},
+							{140, 18000,  120, 1 , 1.5,  25},
+						    	{160, 36000,  120, 1 , 1.45, 25},
+							{180, 66000,  120, 1 , 1.45, 25},
+							{200, 120000, 150, 2 , 1.5,  25}, 
+							{220, 200000, 180, 2 , 1.55, 25},/* beyond this point these are guesses. */ 	
+							{230, 280000, 195, 2 , 1.55, 25},
+							{240, 360000, 210, 2 , 1.57, 25}
+						   };
+
+/* Put a row into the params table, in order of size; a row for a size that is already there replaces it.
+ * Returns 0 if the table is full. The table is shared by everything in the process, so this is only for
+ * before any factoring starts. */
+int add_params (const double *row){
+	int i = 0;
+	while (i < nplevels && params[i][0] < row[0]){
+		i++;
+	}
+	if (i == nplevels || params[i][0] != row[0]){
+		if (nplevels == PARAMS_MAX){
+			return 0;
+		}
+		memmove (params[i+1], params[i], (nplevels - i) * sizeof (params[0]));
+		nplevels ++;
+	}
+	memcpy (params[i], row, sizeof (params[0]));
+	return 1;
+}
 
 /* Linearly interpolate parameters that were not manually overriden by the user between the adjacent
  * values in the parameter list. This should be called by select_parameters. 
@@ -109,98 +178,160 @@ void set_params (nsieve_t *ns, int p1, int p2, double fac){
 	}
 	if (ns->M == -1) ns -> M        = (uint32_t) (params[p1][PARAM_M] * fac + params[p2][PARAM_M] * (1 - fac));
 	if (ns->T == -1) ns -> T        = (float)    (params[p1][PARAM_T] * fac + params[p2][PARAM_T] * (1 - fac));
-	printf("Selected parameters: \n\tfb_bound = %d \n\tlp_bound = %d \n\tM = %d\n\tT - %f\n", ns->fb_bound, ns->lp_bound, ns->M, ns->T);
+	if (ns->sieve_start == -1) ns -> sieve_start = (int) (params[p1][PARAM_SMALLP] * fac + params[p2][PARAM_SMALLP] * (1 - fac) + 0.5);
+	ns_printf (ns, "Selected parameters: \n\tfb_bound = %d \n\tlp_bound = %d \n\tM = %d\n\tT - %f\n\tsmallp = %d\n", ns->fb_bound, ns->lp_bound, ns->M, ns->T, ns->sieve_start);
 }
 
 /* Perform automatic parameter selection. Only parameters not specified by the user will be chosen automatically */
 void select_parameters (nsieve_t *ns){
 	/* All of the choices are dependent solely on the number of bits in N */
 	int bits = mpz_sizeinbase (ns->N, 2);
-	printf("Choosing parameters for %d bit number... \n", bits);
+	ns_printf (ns, "Choosing parameters for %d bit number... \n", bits);
 	if (bits <= params[0][0]){	// smaller than the bottom of the table
 		set_params(ns, 0, 0, 0);
-	} else if (bits >= params[NPLEVELS-1][0]){	// above the end of the table
+	} else if (bits >= params[nplevels-1][0]){	// above the end of the table
 							// this will probably result in a very bad choice of 
 							// parameters if you're much beyond the end.
-		set_params(ns, NPLEVELS - 1, NPLEVELS - 1, 0);
+		set_params(ns, nplevels - 1, nplevels - 1, 0);
 	} else {
 		int i = 0;
-		while (i < NPLEVELS && params[i][0] < bits){
+		while (i < nplevels && params[i][0] < bits){
 			i++;
 		}
 		set_params (ns, i, i-1, (bits - params[i-1][0]) / (params[i][0] - params[i-1][0]));
 	}
 }
 
-const int nsmall_primes = 18;
-uint32_t small_primes[] = {2,3,5,7,11,13,17,19,23,29,31,37,41,43,47,53,59,61};
-
 /* In many instances it is actually better to try to factor tN for some small squarefree (usually prime)
  * t. The reasoning behind this is that if one can find a value of t for which tN is a quadratic residue
  * mod many small primes, the chances of a particular sieve value being smooth go up, since there are 
  * more small values in the factor base. This effect can be surprisingly large; the difference between
  * selecting a particularly bad multiplier and a particularly good one can amount to a factor of almost
  * 3 in the sieving time. It is therefore worthwhile to select wisely.
+ *
+ * So we score every odd squarefree t up to ns->mult_bound with the Knuth-Schroeppel function below, and for
+ * big enough N (where a second more is small change), trial sieve with the best few for a moment each and
+ * go with the one that actually finds relations fastest (see tune.c for the trials). The function is only
+ * an estimate of the average contribution of the small primes to a sieve value; it knows nothing about
+ * the primes we don't sieve with, the size of the factor base, or how the large primes will combine.
 */
 
+/* The primes up to the bound, and N mod each of them; shared by all of the multipliers being scored */
+typedef struct {
+	uint32_t *p;
+	uint32_t *nmodp;
+	int np;
+	uint32_t nmod8;
+} ks_primes_t;
+
 /* This function rates a multiplier, giving it a score. The multiplier with the highest score is selected */
-double get_multiplier_score (uint32_t mult, nsieve_t *ns){
+static double get_multiplier_score (uint32_t mult, const ks_primes_t *ks){
 	/* The modifier score is based on the 'Knuth-Schroeppel function,' defined as:
 	 *
 	 * f(t, N) = SUM_i g(p_i, tN) * log(p) - 0.5 log(t)	for all p_i in the factor base.
 	 * 
-	 * where	g(p, tN) = 2/p   if p does not divide t
-	 * 			 = 1/p	 if p divides t
-	 * 		g(2, tN) = 2	 if N ~= 1 (mod 8)
-	 * 			 = 0	 otherwise
+	 * where	g(p, tN) = 2/(p-1) if p does not divide t and (tN/p) = 1
+	 * 			 = 1/p	   if p divides t
+	 * 		g(2, tN) = 2	   if tN ~= 1 (mod 8)
+	 * 			 = 1	   if tN ~= 5 (mod 8)
+	 * 			 = 1/2	   otherwise
 	 *
 	 * The components of this function make a lot of intuitive sense when one considers it as an 
 	 * approximation to the average amount the prime 'p' will contribute to a sieve bucket.
 	 *
-	 * In practice, we only sum over the smallest elements of the factor base (the ones in small_primes),
-	 * since the 1/p factors quickly diminsh towards 0 as p increases. 
+	 * The 1/p factors diminish towards 0 as p increases, but slowly enough that summing over only the
+	 * first 18 primes (as we used to) can rank multipliers wrongly; we go up to MULT_KS_PRIMES.
 	*/
-	mpz_t temp;
-	mpz_init (temp);
-	mpz_mul_ui (ns->N, ns->N, mult);
 	double res = -0.5 * log(mult);
-	if (mpz_mod_ui (temp, ns->N, 8) == 1){
+	uint32_t tn8 = (mult * ks->nmod8) & 7;
+	if (tn8 == 1){
 		res += 2 * log(2.0);
+	} else if (tn8 == 5){
+		res += log(2.0);
+	} else {
+		res += 0.5 * log(2.0);
 	}
-	mpz_clear (temp);
-	for (int i=1; i < nsmall_primes; i++){
-		if (small_primes[i] == mult){
-			res += (1.0/small_primes[i]) * log(small_primes[i]);
-		} else {
-			if (mpz_kronecker_ui(ns->N, small_primes[i]) == 1){
-				res += (2.0/small_primes[i]) * log(small_primes[i]);
-			}
+	for (int i=0; i < ks->np; i++){
+		uint32_t p = ks->p[i];
+		if (mult % p == 0){
+			res += (1.0/p) * log(p);
+		} else if (jacobi32 ((uint32_t) (((uint64_t) mult * ks->nmodp[i]) % p), p) == 1){
+			res += (2.0/(p-1)) * log(p);
 		}
 	}
-	mpz_divexact_ui (ns->N, ns->N, mult);
 	return res;
 }
 
-/* Try multipliers up to about 60; pick the one with the highest score */
+static int is_squarefree (uint32_t t){
+	for (uint32_t d=2; d*d <= t; d++){
+		if (t % (d*d) == 0) return 0;
+	}
+	return 1;
+}
+
+/* Score all of the odd squarefree multipliers up to ns->mult_bound, trial sieve the best few if N is big
+ * enough, and multiply N by the winner. */
 void select_multiplier (nsieve_t *ns){
-	int idx = -1;
-	double best = get_multiplier_score (1, ns);
-//	printf("\tmultiplier %d has score %f\n", 1, best);
-	for (int i=0; i < nsmall_primes; i++){
-		double score = get_multiplier_score (small_primes[i], ns);
-//		printf("\tmultiplier %d has score %f\n", small_primes[i], score);
-		if (score > best){
-			best = score;
-			idx = i;
+	/* The odd primes up to MULT_KS_PRIMES (or the factor base bound, if that's smaller) */
+	uint32_t bound = ns->fb_bound < MULT_KS_PRIMES ? ns->fb_bound : MULT_KS_PRIMES;
+	char *composite = (char *) calloc (bound + 1, 1);
+	ks_primes_t ks;
+	ks.p = (uint32_t *) malloc ((bound + 1) * sizeof (uint32_t));
+	ks.nmodp = (uint32_t *) malloc ((bound + 1) * sizeof (uint32_t));
+	ks.np = 0;
+	for (uint32_t i=3; i <= bound; i += 2){
+		if (composite[i]) continue;
+		for (uint32_t j=3*i; j <= bound; j += 2*i){
+			composite[j] = 1;
 		}
+		ks.p[ks.np] = i;
+		ks.nmodp[ks.np] = mpz_fdiv_ui (ns->N, i);
+		ks.np ++;
 	}
-	if (idx == -1){
-		ns->multiplier = 1;
-	} else {
-		ns->multiplier = small_primes[idx];
-		mpz_mul_ui (ns->N, ns->N, small_primes[idx]);
+	ks.nmod8 = mpz_fdiv_ui (ns->N, 8);
+	free (composite);
+
+	/* Keep the best mult_trials (at least one) in order */
+	int ncand = ns->mult_trials > 1 ? ns->mult_trials : 1;
+	uint32_t cand[ncand];
+	double cscore[ncand];
+	int have = 0;
+	for (uint32_t t=1; t <= ns->mult_bound || t == 1; t += 2){	// kN must stay odd
+		if (!is_squarefree (t)) continue;
+		double score = get_multiplier_score (t, &ks);
+		int i = have < ncand ? have++ : ncand;
+		while (i > 0 && cscore[i-1] < score){
+			if (i < ncand){
+				cand[i] = cand[i-1];
+				cscore[i] = cscore[i-1];
+			}
+			i--;
+		}
+		if (i < ncand){
+			cand[i] = t;
+			cscore[i] = score;
+		}
+	}
+	free (ks.p);
+	free (ks.nmodp);
+
+	ns->multiplier = cand[0];
+	if (ns->mult_trials > 1 && have > 1 && mpz_sizeinbase (ns->N, 2) >= MULT_TRIAL_BITS){
+		double row[NPARAMS] = {mpz_sizeinbase (ns->N, 2), ns->fb_bound, ns->lp_bound / ns->fb_bound, ns->M, ns->T, ns->sieve_start};
+		double best = HUGE_VAL;
+		ns_printf (ns, "Trial sieving with multipliers");
+		for (int i=0; i < have; i++){
+			double t = trial_sieve (ns->N, row, cand[i], MULT_TRIAL_TIME, 1);
+			ns_printf (ns, " %u (%.1fs)", cand[i], t);
+			if (t < best){
+				best = t;
+				ns->multiplier = cand[i];
+			}
+		}
+		ns_printf (ns, ".\n");
 	}
-	printf("Selected multiplier %d.\n", ns->multiplier);
+	mpz_mul_ui (ns->N, ns->N, ns->multiplier);
+	ns_printf (ns, "Selected multiplier %d.\n", ns->multiplier);
 }
 	
 /* Initialization and selection of the parameters for the factorization. This will fill allocate space 
@@ -218,7 +349,13 @@ void nsieve_init (nsieve_t *ns, mpz_t n){
 		mpz_mul_ui (ns->N, ns->N, ns->multiplier);
 	}
 
-	ns->nthreads = 1;
+	if (ns->nthreads < 1) ns->nthreads = 1;	// the caller sets this; generate_fb may use the threads already.
+	ns->gpool_stride = 1;
+	ns->worker = NULL;
+	ns->online = NULL;
+	ns->deadline = 0;
+	ns->error = 0;
+	ns->stop_sieving = 0;
 	pthread_mutex_init (&ns->lock, NULL);
 	ns->info_npoly = 0;
 	ns->info_npg = 0;
@@ -228,27 +365,41 @@ void nsieve_init (nsieve_t *ns, mpz_t n){
 	ns->tdiv_ct = 0;
 	ns->sieve_locs = 0;
 	ns->extra_rels = 120;
+	ns->target_excess = FILTER_TARGET_EXCESS;
+	if (ns->merge_density < 0) ns->merge_density = MERGE_TARGET_DENSITY;	// -1 if not given with -density
+	ns->nrows = 0;
+	ns->base = NULL;
+	ns->nbase = 0;
+	ns->factors = NULL;
+	ns->nfactors = 0;
+	ns->groups = NULL;
+	ns->ngroups = ns->groupcap = 0;
+	ns->threads = NULL;
 
 	generate_fb (ns);
 
 	/* Allocate space for the matrix relations; note that the actual rows of the matrix containing
 	 * the packed bits are not allocated until the matrix building phase. */
-	ns->relns = (matrel_t *)(malloc((ns->fb_len + ns->extra_rels) * sizeof(matrel_t)));
+	ns->relns = (matrel_t *)(calloc(ns->fb_len + ns->extra_rels, sizeof(matrel_t)));
 	ns->row_len = (ns->fb_len)/(8*sizeof(uint64_t)) + 1;	// we would need that to be ns->fb_len - 1, except we need to throw in the factor -1 into the FB. 
-	if (ns->row_len % 2 == 1) ns->row_len ++;	// to take advantage of SSE instructions, we want to chunk by 128 bits.
+	ns->row_len = (ns->row_len + ROWOPS_PAD - 1) / ROWOPS_PAD * ROWOPS_PAD;	// whole vectors for the row kernels
 
-	printf("There are %d primes in the factor base, so we will search for %d relations. The matrix rows will have %d 8-byte chunks in them.\n", ns->fb_len, ns->rels_needed, ns->row_len);
+	rowops_init ();
+	ns_printf (ns, "There are %d primes in the factor base, so we will search for %d relations. The matrix rows will have %d 8-byte chunks in them (%s row kernels).\n", ns->fb_len, ns->rels_needed, ns->row_len, rowops.name);
 
 	ht_init (ns);
+	if (!relset_init (&ns->seen, ns->rels_needed)){	// it doubles as the partials come in, so only pay for them if they do.
+		ns_error (ns, NSIEVE_ENOMEM);
+	}
+	ns->ndups = 0;
 	ns->timing.init_time = clock() - start;
 }
 
-/* Run the SIQS with nthreads sieving threads. All other phases are single-threaded. Must have called 
- * nsieve_init prior to calling this, so that everything is set up. */
-void multithreaded_factor (nsieve_t *ns, int nthreads){
-	long start = clock ();
-	
-	/* Set up the threads; most of this code is in getting the various copies of the gpool set up. */
+/* Set up the per-thread data for nthreads sieving threads; most of this is in getting the various copies
+ * of the gpool set up. Thread i is advanced first_slot + i times, so that when several processes sieve the
+ * same number (see dist.c), each can be given its own range of slots. ns->gpool_stride must already be
+ * the total number of slots. */
+thread_data_t *init_thread_data (nsieve_t *ns, int nthreads, int first_slot){
 	ns->nthreads = nthreads;
 	ns->threads = (pthread_t *) malloc(nthreads * sizeof (pthread_t));
 
@@ -256,7 +407,7 @@ void multithreaded_factor (nsieve_t *ns, int nthreads){
 
 	poly_gpool_t gpool;
 	gpool_init (&gpool, ns);
-	printf("Using k = %d; gvals range from %d to %d.\n", ns->k, gpool.gpool[0], gpool.gpool[gpool.ng-1]);
+	ns_printf (ns, "Using k = %d; gvals range from %d to %d.\n", ns->k, gpool.gpool[0], gpool.gpool[gpool.ng-1]);
 
 	for (int i=0; i<nthreads; i++){
 		td[i].ns = ns;
@@ -265,13 +416,33 @@ void multithreaded_factor (nsieve_t *ns, int nthreads){
 		for (int k=0; k<ns->k; k++){
 			td[i].gpool.frogs[k] = gpool.frogs[k];
 		}
-		for (int j=0; j < i; j++){
+		for (int j=0; j < first_slot + i; j++){
 			advance_gpool (&td[i].gpool, NULL);
 		}
 	}
+	free (gpool.frogs);	// the threads have their own copies; they share gpool.gpool.
+	return td;
+}
+
+/* Free what init_thread_data allocated. */
+void free_thread_data (thread_data_t *td, int nthreads){
+	for (int i=0; i < nthreads; i++){
+		free (td[i].gpool.frogs);
+	}
+	free (td[0].gpool.gpool);
+	free (td);
+}
+
+/* Sieve with nthreads threads until there are enough relations (or ns->deadline passes). The matrix is
+ * built as the relations come in, by one more thread, which is still there afterwards for build_matrix
+ * to collect the rows from. */
+void multithreaded_sieve (nsieve_t *ns, int nthreads){
+	ns->gpool_stride = nthreads;
+	thread_data_t *td = init_thread_data (ns, nthreads, 0);
 	long sievestart = clock();
 
-	/* Set things in motion */
+	/* Set things in motion, starting with the thread that builds the matrix */
+	online_start (ns);
 	for (int i=0; i<nthreads; i++){
 		pthread_create (&ns->threads[i], NULL, run_sieve_thread, &td[i]);
 	}
@@ -280,15 +451,100 @@ void multithreaded_factor (nsieve_t *ns, int nthreads){
 	for (int i=0; i<nthreads; i++){
 		pthread_join (ns->threads[i], NULL);
 	}
+	free_thread_data (td, nthreads);
 	ns->timing.sieve_time = clock() - sievestart;
-	printf("\n");
+	ns_printf (ns, "\n");
+}
+
+/* Free everything nsieve_init and the factorization allocated, so that one process can factor number after
+ * number (see factor.c); ns->factors is left to the caller. The relations belong to the poly groups they came
+ * from. Fulls and partials have had the victim's factor list joined on to the end of their own (see
+ * add_polygroup_relations), so each frees only its own entries, up to where the victim's begin. */
+void nsieve_free (nsieve_t *ns){
+	for (uint32_t g=0; g < ns->ngroups; g++){
+		poly_group_t *pg = ns->groups[g];
+		fl_entry_t *shared = pg->victim != NULL ? pg->victim->factors : NULL;
+		poly_t *polys[ns->bvals];
+		memset (polys, 0, sizeof (polys));
+		for (uint32_t i=0; i < pg->nrels; i++){
+			rel_t *rel = pg->relns[i];
+			polys[rel->poly->bidx] = rel->poly;
+			if (rel == pg->victim) continue;
+			fl_entry_t *entry = rel->factors;
+			while (entry != NULL && entry != shared){
+				fl_entry_t *next = entry->next;
+				free (entry);
+				entry = next;
+			}
+			free (rel);
+		}
+		if (pg->victim != NULL) rel_free (pg->victim);
+		for (int i=0; i < ns->bvals; i++){
+			if (polys[i] != NULL){
+				poly_free (polys[i]);
+				free (polys[i]);
+			}
+		}
+		polygroup_free (pg, ns);
+		free (pg);
+	}
+	free (ns->groups);
+	ns->groups = NULL;
+	ns->ngroups = ns->groupcap = 0;
 
-	/* Now proceed with the rest of the factorization in this thread */
+	for (uint32_t i=0; i < ns->nrows; i++){	// the rows past nrows were freed or moved by filtering.
+		free (ns->relns[i].cols);
+		free (ns->relns[i].hist);
+	}
+	free (ns->relns);
+	free (ns->base);
+	for (uint32_t b=0; b < ns->partials.nbuckets; b++){
+		ht_entry_t *h = ns->partials.buckets[b];
+		while (h != NULL){
+			ht_entry_t *next = h->next;
+			free (h);
+			h = next;
+		}
+	}
+	free (ns->partials.buckets);
+	relset_free (&ns->seen);
+	free (ns->fb);
+	free (ns->roots);
+	free (ns->fb_logs);
+	free (ns->threads);
+	pthread_mutex_destroy (&ns->lock);
+	mpz_clear (ns->N);
+}
+
+/* Run the SIQS with nthreads sieving threads; the gaussian elimination uses as many. Must have called 
+ * nsieve_init prior to calling this, so that everything is set up. */
+void multithreaded_factor (nsieve_t *ns, int nthreads){
+	long start = clock () - ns->timing.init_time;	// the total counts nsieve_init (and its multiplier trials) too.
+	multithreaded_sieve (ns, nthreads);
+
+	/* Now proceed with the rest of the factorization in this thread. If the sieve stopped on an error, there
+	 * is nothing to solve, but build_matrix still collects the online thread. */
+	out_progress (&ns->out, NSIEVE_PHASE_MATRIX, -1);
 	build_matrix (ns);
+	if (ns->error != 0){
+		ns->timing.total_time = clock() - start;
+		return;
+	}
+	filter (ns);
+	merge (ns);
 	solve_matrix (ns);
 	ns->timing.total_time = clock() - start;
 }
 
+/* Whether the sieve threads should go on. Whoever decides there are enough relations (or hits an error) sets
+ * ns->stop_sieving under the lock, and this is all the threads look at. */
+static int keep_sieving (nsieve_t *ns){
+	pthread_mutex_lock (&ns->lock);
+	int stop = ns->stop_sieving;
+	pthread_mutex_unlock (&ns->lock);
+	return !stop && (ns->deadline == 0 || time (NULL) < ns->deadline);
+}
+
 /* Each sieve thread runs this method as its task. When it returns, the thread dies. This method
  * performs sieving until enough relations have been collected. The odd return and parameter types
  * are mandated by the pthreads specification. */
@@ -297,116 +553,70 @@ void *run_sieve_thread (void *args){
 	nsieve_t *ns = td->ns;
 	
 	block_data_t sievedata;		// allocate a sieve block.
-	while (ns->nfull + ns->npartial < ns->rels_needed){	// while we don't have enough relations
+	while (keep_sieving (ns)){	// while we don't have enough relations
 		/* Allocate, initialize, and generate a new poly group */
 		poly_group_t *curr_polygroup = (poly_group_t *) malloc (sizeof (poly_group_t));
 		polygroup_init (curr_polygroup, ns);
-		generate_polygroup (&td->gpool, curr_polygroup, ns);
+		if (!generate_polygroup (&td->gpool, curr_polygroup, ns)){	// every thread stops with it
+			ns_error (ns, NSIEVE_EPOLYS);
+			polygroup_free (curr_polygroup, ns);
+			free (curr_polygroup);
+			break;
+		}
 		
 		/* Loop over the polynomials our group can generate, and sieve them */
+		poly_t *polys[ns->bvals];
 		for (int i=0; i < ns->bvals; i++){
-			poly_t *curr_poly = (poly_t *) malloc (sizeof (poly_t));
-			poly_init (curr_poly);
-			generate_poly (curr_poly, curr_polygroup, ns, i);
+			polys[i] = (poly_t *) malloc (sizeof (poly_t));
+			poly_init (polys[i]);
+			generate_poly (polys[i], curr_polygroup, ns, i);
 
-			sieve_poly (&sievedata, curr_polygroup, curr_poly, ns);
+			sieve_poly (&sievedata, curr_polygroup, polys[i], ns);
+		}
+		/* The polys that none of the relations point to can go now; the rest go with the group. */
+		char used[ns->bvals];
+		memset (used, 0, ns->bvals);
+		for (int i=0; i < curr_polygroup->nrels; i++){
+			used[curr_polygroup->relns[i]->poly->bidx] = 1;
+		}
+		for (int i=0; i < ns->bvals; i++){
+			if (!used[i]){
+				poly_free (polys[i]);
+				free (polys[i]);
+			}
 		}
+		free (curr_polygroup->ainverses);	// free our precomputed values, we don't need them anymore.
+		curr_polygroup->ainverses = NULL;
+
 		/* Once our group is done, we can add the relations to the main repository for them inside
 		 * the nsieve_t. This method will acquire the lock on the mutex stored in the nsieve_t, so
 		 * two threads don't try to do this at the same time */
 		add_polygroup_relations (curr_polygroup, ns);
 
-		free (curr_polygroup->ainverses);	// free our precomputed values, we don't need them anymore.
-
 		/* Get the lock, count the partials in the hashtable, and print our status */
 		pthread_mutex_lock (&ns->lock);	
-		ns->npartial = ht_count (&ns->partials);
-		printf("Have %d of %d relations (%d full + %d combined from %d partial); sieved %d polynomials from %d groups. \r", ns->nfull + ns->npartial, ns->rels_needed, ns->nfull, ns->npartial, ns->partials.nentries, ns->info_npoly, ns->info_npg);
-		fflush(stdout);
+		if (ns->online != NULL){	// the consumer keeps npartial up to date, and knows better when we're done.
+			online_t *o = ns->online;
+			ns_printf (ns, "Have %d relations (%d full + %d combined from %d partial), %lld more than the columns they use; about %u more needed after filtering; sieved %d polynomials from %d groups. \r", ns->nfull + ns->npartial, ns->nfull, ns->npartial, o->seen_partials, (long long) o->excess, o->still_needed, ns->info_npoly, ns->info_npg);
+			uint32_t have = ns->nfull + ns->npartial;
+			out_progress (&ns->out, NSIEVE_PHASE_SIEVE, (double) have / (have + o->still_needed));
+		} else {
+			ns->npartial = ht_count (&ns->partials);
+			ns_printf (ns, "Have %d of %d relations (%d full + %d combined from %d partial); sieved %d polynomials from %d groups. \r", ns->nfull + ns->npartial, ns->rels_needed, ns->nfull, ns->npartial, ns->partials.nentries, ns->info_npoly, ns->info_npg);
+			out_progress (&ns->out, NSIEVE_PHASE_SIEVE, (double) (ns->nfull + ns->npartial) / ns->rels_needed);
+		}
+		if (ns->nfull + ns->npartial >= ns->rels_needed) ns->stop_sieving = 1;	// the online consumer may stop us sooner.
 		pthread_mutex_unlock (&ns->lock);
 	}
 	return NULL;
 }
 
-/* Behold - the main method. You knew it was here somewhere. */
-int main (int argc, const char *argv[]){
-	nsieve_t ns;
-	mpz_t n;
-	mpz_init (n);
-
-	int pos = 1;
-	int nspecd = 0;
-
-	ns.T = -1;
-	ns.fb_bound = -1;
-	ns.lp_bound = -1;
-	ns.M = -1;
-	ns.multiplier = -1;
-	int nthreads = 1;
-	/* Parse command line arguments that override parameters or specify N */
-	while (pos < argc){
-		if (!strcmp(argv[pos], "-T")){
-			ns.T = atof (argv[pos+1]);
-			pos ++;
-		} else if (!strcmp(argv[pos], "-fbb")){
-			ns.fb_bound = atoi (argv[pos+1]);
-			pos ++;
-		} else if (!strcmp(argv[pos], "-lpb")){
-			ns.lp_bound = atoi (argv[pos+1]);
-			pos++;
-		} else if (!strcmp(argv[pos], "-M")){
-			ns.M = atoi (argv[pos+1]);
-			pos++;
-		} else if (!strcmp(argv[pos], "-np")){
-			ns.lp_bound = 1;
-		} else if (!strcmp(argv[pos], "-mult")){
-			ns.multiplier = atoi (argv[pos+1]);
-			pos++;
-		} else if (!strcmp(argv[pos], "-threads")){
-			nthreads = atoi (argv[pos+1]);
-			pos++;
-		} else {
-			mpz_set_str (n, argv[pos], 10);
-			nspecd = 1;
-		}
-		pos ++;
-	}
-	if (!nspecd){
-		mpz_inp_str (n, stdin, 10);
-	}
-
-	printf ("Removing small factors of N by trial division and pollard rho... \n");
-	tdiv (n, 32768);
-	rho  (n, 65536, 0);
-	
-	/* If we found all of the factors by trial division or rho, or the cofactor after doing that
-	 * is prime, then we're done and we don't need to start the quadratic sieve. */
-	printf("Will factor N = ");
-	mpz_out_str (stdout, 10, n);
-	printf("\n");
-	if (mpz_cmp_ui (n, 1) == 0){
-		return 0;
-	} else if (mpz_probab_prime_p (n, 15)){
-		mpz_out_str(stdout, 10, n);
-		printf("\n");
-		return 0;
-	}
-
-	/* Otherwise, start the sieving */
-	printf ("Starting the quadratic sieve... \n");
-	long start = clock();
-	nsieve_init (&ns, n);
-
-	multithreaded_factor (&ns, nthreads);
-
-	ns.timing.total_time = clock() - start;
-
-	printf ("\nTiming summary: \
+void print_timing (nsieve_t *ns){
+	ns_printf (ns, "\nTiming summary: \
 		 \n\tInitialization:    %ldms \
 		 \n\tSieving:           %ldms \
 		 \n\tMatbuild + Filter: %ldms \
 		 \n\tMatrix solving:    %ldms \
 		 \n\tFactor deduction:  %ldms \
-		 \n\tTOTAL:             %ldms\n", ns.timing.init_time/1000, ns.timing.sieve_time/1000, ns.timing.filter_time/1000, ns.timing.matsolve_time/1000, ns.timing.facdeduct_time/1000, ns.timing.total_time/1000);
-
+		 \n\tTOTAL:             %ldms\n", ns->timing.init_time/1000, ns->timing.sieve_time/1000, ns->timing.filter_time/1000, ns->timing.matsolve_time/1000, ns->timing.facdeduct_time/1000, ns->timing.total_time/1000);
 }
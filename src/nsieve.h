@@ -5,14 +5,42 @@
 #include "sieve.h"
 #include "poly.h"
 #include "filter.h"
+#include "merge.h"
 #include "matrix.h"
+#include "rowops.h"
 #include "rho.h"
+#include "ecm.h"
+#include "pm1.h"
+#include "small.h"
+#include "relfile.h"
+#include "dist.h"
+#include "postproc.h"
+#include "matfile.h"
+#include "online.h"
+#include "tune.h"
+#include "factor.h"
+
+#define MULT_BOUND      100	// default for ns->mult_bound: the biggest multiplier tried (see select_multiplier)
+#define MULT_KS_PRIMES  5000	// the Knuth-Schroeppel score sums over the primes up to this
+#define MULT_TRIALS     3	// default for ns->mult_trials: how many of the best scoring multipliers to trial sieve with
+#define MULT_TRIAL_BITS 200	// smaller numbers don't take long enough to sieve for the trials to be worth it
+#define MULT_TRIAL_TIME 1	// seconds of sieving per trial
+
+#define FB_SEGMENT      32768	// bytes per segment of the sieve for the factor base primes
+#define FB_PARALLEL_MIN 20000	// factor bases at least this big have their roots found by ns->nthreads threads
 
 void generate_fb (nsieve_t *);	// fills in 'fb' and 'roots'
+int  add_params (const double *row);	// merge a row (NPARAMS values) into the parameter table; 0 if it's full
+void select_parameters (nsieve_t *);
 
-void nsieve_init (nsieve_t *, mpz_t n);		// initialize all of the other parameters, given only N. 
+void nsieve_init (nsieve_t *, mpz_t n);		// initialize all of the other parameters, given only N (and nthreads). 
+thread_data_t *init_thread_data (nsieve_t *, int nthreads, int first_slot);
+void free_thread_data (thread_data_t *, int nthreads);
+void nsieve_free (nsieve_t *);		// everything but ns->factors
+void multithreaded_sieve (nsieve_t *, int nthreads);	// just the sieve; leaves the matrix being built (see online.c)
 void multithreaded_factor (nsieve_t *, int nthreads);
 void *run_sieve_thread (void *);
-void factor (nsieve_t *);		// the main top-level routine.
+void factor (nsieve_t *);
+void print_timing (nsieve_t *);		// the main top-level routine.
 
 #endif
@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <gmp.h>
 
+/* Without options, prints the product of one random prime for each of the bit lengths given. With -count,
+ * it makes a corpus instead: that many numbers of each of the bit lengths given, each the product of -k
+ * primes of (nearly) equal size, one per line. -seed makes the random numbers differ from the default
+ * ones, and -o writes them to a file. The same options always give the same numbers. */
+
 void getprime (mpz_t res, gmp_randstate_t rand, int bits){
 	mpz_urandomb (res, rand, bits);
 	while (mpz_sizeinbase (res, 2) != bits){
@@ -10,24 +16,88 @@ void getprime (mpz_t res, gmp_randstate_t rand, int bits){
 	mpz_nextprime (res, res);
 }
 
+/* A product of k primes with exactly 'bits' bits, the sizes of the primes differing by at most a bit */
+void getcomposite (mpz_t res, gmp_randstate_t rand, int bits, int k){
+	mpz_t p;
+	mpz_init (p);
+	do {
+		mpz_set_ui (res, 1);
+		for (int i=0; i < k; i++){
+			getprime (p, rand, bits / k + (i < bits % k));
+			mpz_mul (res, res, p);
+		}
+	} while (mpz_sizeinbase (res, 2) != bits);
+	mpz_clear (p);
+}
+
 int main (int argc, const char *argv[]){
-	if (argc == 1){
+	unsigned long seed = 0;
+	int seeded = 0;
+	int count = 0;
+	int k = 2;
+	const char *outname = NULL;
+	int bits[argc];
+	int nbits = 0;
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-seed") && pos+1 < argc){
+			seed = strtoul (argv[++pos], NULL, 10);
+			seeded = 1;
+		} else if (!strcmp (argv[pos], "-count") && pos+1 < argc){
+			count = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-k") && pos+1 < argc){
+			k = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-o") && pos+1 < argc){
+			outname = argv[++pos];
+		} else {
+			bits[nbits++] = atoi (argv[pos]);
+		}
+	}
+	if (nbits == 0){
 		printf("! Error: expecting command line options (list of integers representing bit lengths of the primes to multiply together)\n");
 		return 1;
 	}
+	if (k < 1 || k > 64){
+		printf("! Error: -k must be from 1 to 64\n");
+		return 1;
+	}
+	for (int i=0; i < nbits; i++){
+		if (bits[i] < 2 || (count > 0 && bits[i] < 2 * k)){	// each prime needs at least 2 bits
+			printf("! Error: %d bits is too small\n", bits[i]);
+			return 1;
+		}
+	}
+	FILE *out = stdout;
+	if (outname != NULL && (out = fopen (outname, "w")) == NULL){
+		printf("! Error: could not open %s\n", outname);
+		return 1;
+	}
+
 	mpz_t res, temp;
 	mpz_inits (res, temp, NULL);
 	mpz_set_ui (res, 1);
 
 	gmp_randstate_t rand;
 	gmp_randinit_default (rand);
+	if (seeded) gmp_randseed_ui (rand, seed);
 
-	int arg =1;
-	while (arg < argc){
-		getprime (temp, rand, atoi(argv[arg]));
-		mpz_mul (res, res, temp);
-		arg++;
+	if (count > 0){
+		for (int i=0; i < nbits; i++){
+			for (int j=0; j < count; j++){
+				getcomposite (res, rand, bits[i], k);
+				mpz_out_str (out, 10, res);
+				fprintf(out, "\n");
+			}
+		}
+	} else {
+		for (int i=0; i < nbits; i++){
+			getprime (temp, rand, bits[i]);
+			mpz_mul (res, res, temp);
+		}
+		mpz_out_str (out, 10, res);
+		fprintf(out, "\n");
 	}
-	mpz_out_str (stdout, 10, res);
-	printf("\n");
+	if (out != stdout) fclose (out);
+	mpz_clears (res, temp, NULL);
+	gmp_randclear (rand);
+	return 0;
 }
@@ -0,0 +1,248 @@
+#include "online.h"
+
+/* Online matrix building. Without this, the relations just pile up in the matrix (fulls) and the partials
+ * hashtable until the sieve is done, and then build_matrix fills in every row and combine_partials walks
+ * every bucket, all in one thread while every other one sits idle. Instead, the sieve threads hand each
+ * relation they keep to a consumer thread, which makes its sparse row right away, combines each partial
+ * with the first one seen with the same cofactor, and keeps count of how often each column occurs. By the
+ * time the sieve stops, the matrix only needs to be filtered.
+ *
+ * The column counts also tell us when to stop. Singleton removal can only ever increase the excess (each
+ * singleton row takes at least its own column with it), so rows - (nonempty columns) is a safe estimate of
+ * the excess the filter will have to work with, and once that is target_excess + ONLINE_EXCESS_MARGIN,
+ * there is no point sieving on until we have fb_len + extra_rels rows. From how fast the excess has been
+ * growing lately, we also estimate how many more relations that will take, for the status line.
+*/
+
+static void *online_thread (void *);
+
+/* Without the memory for it, ns->online stays NULL (and the error stops the sieve threads). */
+void online_start (nsieve_t *ns){
+	online_t *o = (online_t *) calloc (1, sizeof (online_t));
+	if (o == NULL){
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	o->colcount = (uint32_t *) calloc (ns->fb_len + 1, sizeof (uint32_t));
+	o->tmask = 1023;
+	o->cofactors = (uint32_t *) calloc (o->tmask + 1, sizeof (uint32_t));
+	o->firsts = (rel_t **) malloc ((o->tmask + 1) * sizeof (rel_t *));
+	o->firstcols = (uint32_t **) malloc ((o->tmask + 1) * sizeof (uint32_t *));
+	o->firstweight = (uint32_t *) malloc ((o->tmask + 1) * sizeof (uint32_t));
+	if (o->colcount == NULL || o->cofactors == NULL || o->firsts == NULL || o->firstcols == NULL || o->firstweight == NULL){
+		free (o->colcount);
+		free (o->cofactors);
+		free (o->firsts);
+		free (o->firstcols);
+		free (o->firstweight);
+		free (o);
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	pthread_mutex_init (&o->lock, NULL);
+	pthread_cond_init (&o->wake, NULL);
+	o->excess = -(int64_t) ns->rels_needed;
+	o->still_needed = ns->rels_needed;
+	ns->online = o;
+	pthread_create (&o->thread, NULL, online_thread, ns);
+}
+
+void online_add (nsieve_t *ns, rel_t *rel){
+	online_t *o = ns->online;
+	pthread_mutex_lock (&o->lock);
+	if (o->qlen == o->qcap){
+		uint32_t qcap = o->qcap == 0 ? 1024 : 2 * o->qcap;
+		rel_t **queue = (rel_t **) realloc (o->queue, qcap * sizeof (rel_t *));
+		if (queue == NULL){	// the relation stays with its poly group, and the sieve stops.
+			pthread_mutex_unlock (&o->lock);
+			ns_error_locked (ns, NSIEVE_ENOMEM);
+			return;
+		}
+		o->queue = queue;
+		o->qcap = qcap;
+	}
+	o->queue[o->qlen ++] = rel;
+	pthread_cond_signal (&o->wake);
+	pthread_mutex_unlock (&o->lock);
+}
+
+/* The slot for a cofactor in the table of first partials */
+static uint32_t online_slot (online_t *o, uint32_t cofactor){
+	uint32_t h = hash_partial (cofactor) & o->tmask;
+	while (o->cofactors[h] != 0 && o->cofactors[h] != cofactor){
+		h = (h + 1) & o->tmask;
+	}
+	return h;
+}
+
+/* If it can't grow, the table stays as it is, and online_consume stops adding to it once it is full. */
+static void online_table_grow (nsieve_t *ns, online_t *o){
+	uint32_t oldsize = o->tmask + 1;
+	uint32_t *cofactors = o->cofactors;
+	rel_t **firsts = o->firsts;
+	uint32_t **firstcols = o->firstcols;
+	uint32_t *firstweight = o->firstweight;
+	o->cofactors = (uint32_t *) calloc (2 * oldsize, sizeof (uint32_t));
+	o->firsts = (rel_t **) malloc (2 * oldsize * sizeof (rel_t *));
+	o->firstcols = (uint32_t **) malloc (2 * oldsize * sizeof (uint32_t *));
+	o->firstweight = (uint32_t *) malloc (2 * oldsize * sizeof (uint32_t));
+	if (o->cofactors == NULL || o->firsts == NULL || o->firstcols == NULL || o->firstweight == NULL){
+		free (o->cofactors);
+		free (o->firsts);
+		free (o->firstcols);
+		free (o->firstweight);
+		o->cofactors = cofactors;
+		o->firsts = firsts;
+		o->firstcols = firstcols;
+		o->firstweight = firstweight;
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
+	}
+	o->tmask = 2 * oldsize - 1;
+	for (uint32_t i=0; i < oldsize; i++){
+		if (cofactors[i] == 0) continue;
+		uint32_t h = online_slot (o, cofactors[i]);
+		o->cofactors[h] = cofactors[i];
+		o->firsts[h] = firsts[i];
+		o->firstcols[h] = firstcols[i];
+		o->firstweight[h] = firstweight[i];
+	}
+	free (cofactors);
+	free (firsts);
+	free (firstcols);
+	free (firstweight);
+}
+
+/* Count the columns of the row just added */
+static void online_count_row (online_t *o, matrel_t *m){
+	for (uint32_t j=0; j < m->weight; j++){
+		uint32_t c = ++ o->colcount[m->cols[j]];
+		if (c == 1){
+			o->ncols_used ++;
+			o->nsingletons ++;
+		} else if (c == 2){
+			o->nsingletons --;
+		}
+	}
+	o->nrows ++;
+	int64_t excess = (int64_t) o->nrows - o->ncols_used;
+	if (o->nrows >= o->snap_rows + ONLINE_SNAPSHOT){
+		o->rate = (double) (excess - o->snap_excess) / (o->nrows - o->snap_rows);
+		o->snap_rows = o->nrows;
+		o->snap_excess = excess;
+	}
+}
+
+/* Make a row (or nothing, for the first partial with its cofactor) out of one relation */
+static void online_consume (nsieve_t *ns, online_t *o, rel_t *rel){
+	if (o->nrows >= ns->rels_needed) return;	// the matrix is full; the sieve threads will notice soon.
+	matrel_t *m = &ns->relns[o->nrows];
+	if (rel->cofactor == 1){
+		m->r1 = rel;
+		m->r2 = NULL;
+		m->weight = fl_fillcols (rel, &m->cols, ns);
+		online_count_row (o, m);
+		return;
+	}
+
+	o->npartials ++;
+	fl_concat (rel, rel->poly->group->victim);
+	uint32_t *cols;
+	uint32_t weight = fl_fillcols (rel, &cols, ns);
+	if (o->tcount >= o->tmask){	// the table couldn't grow (see online_table_grow)
+		free (cols);
+		return;
+	}
+	uint32_t h = online_slot (o, rel->cofactor);
+	if (o->cofactors[h] == 0){	// the first one with this cofactor; later ones will be combined with it.
+		o->cofactors[h] = rel->cofactor;
+		o->firsts[h] = rel;
+		o->firstcols[h] = cols;
+		o->firstweight[h] = weight;
+		if (++ o->tcount > o->tmask / 2) online_table_grow (ns, o);
+		return;
+	}
+	m->r1 = rel;
+	m->r2 = o->firsts[h];
+	m->cols = (uint32_t *) malloc ((weight + o->firstweight[h] + 1) * sizeof (uint32_t));
+	m->weight = sparse_row_xor (m->cols, cols, weight, o->firstcols[h], o->firstweight[h]);	// multiply the factorizations together.
+	free (cols);
+	o->ncombined ++;
+	online_count_row (o, m);
+}
+
+static void *online_thread (void *args){
+	nsieve_t *ns = (nsieve_t *) args;
+	online_t *o = ns->online;
+	rel_t **batch = NULL;	// the queue is swapped out for this buffer, so the sieve threads never wait on us
+	uint32_t batchcap = 0;
+	while (1){
+		pthread_mutex_lock (&o->lock);
+		while (o->qlen == 0 && !o->stopping){
+			pthread_cond_wait (&o->wake, &o->lock);
+		}
+		if (o->qlen == 0){	// stopping, and nothing left to do
+			pthread_mutex_unlock (&o->lock);
+			break;
+		}
+		rel_t **q = o->queue;
+		uint32_t n = o->qlen;
+		uint32_t qcap = o->qcap;
+		o->queue = batch;
+		o->qcap = batchcap;
+		o->qlen = 0;
+		batch = q;
+		batchcap = qcap;
+		pthread_mutex_unlock (&o->lock);
+
+		for (uint32_t i=0; i < n; i++){
+			online_consume (ns, o, batch[i]);
+		}
+
+		int64_t excess = (int64_t) o->nrows - o->ncols_used;
+		int64_t deficit = ns->target_excess + ONLINE_EXCESS_MARGIN - excess;
+		uint32_t still_needed = o->nrows < ns->rels_needed ? ns->rels_needed - o->nrows : 0;	// the old stopping point is still a hard limit
+		if (deficit <= 0){
+			still_needed = 0;
+		} else if (o->rate > 0 && deficit / o->rate < still_needed){
+			still_needed = deficit / o->rate;
+		}
+		pthread_mutex_lock (&ns->lock);
+		o->excess = excess;
+		o->still_needed = still_needed;
+		o->seen_partials = o->npartials;
+		ns->npartial = o->ncombined;
+		if (still_needed == 0) ns->stop_sieving = 1;	// the sieve threads don't look at the excess themselves
+		pthread_mutex_unlock (&ns->lock);
+	}
+	free (batch);
+	return NULL;
+}
+
+/* Stop the consumer once it has emptied the queue, and hand the matrix over to the filter. */
+void online_finish (nsieve_t *ns){
+	online_t *o = ns->online;
+	pthread_mutex_lock (&o->lock);
+	o->stopping = 1;
+	pthread_cond_signal (&o->wake);
+	pthread_mutex_unlock (&o->lock);
+	pthread_join (o->thread, NULL);
+
+	ns_printf (ns, "Built %u rows while sieving (%u of them combined from partials); %u columns are used, %u of them singletons.\n", o->nrows, o->ncombined, o->ncols_used, o->nsingletons);
+	ns->nfull = o->nrows;
+	ns->nrows = o->nrows;
+	ns->ncols = ns->fb_len + 1;
+	for (uint32_t i=0; i <= o->tmask; i++){
+		if (o->cofactors[i] != 0) free (o->firstcols[i]);
+	}
+	free (o->cofactors);
+	free (o->firsts);
+	free (o->firstcols);
+	free (o->firstweight);
+	free (o->colcount);
+	free (o->queue);
+	pthread_mutex_destroy (&o->lock);
+	pthread_cond_destroy (&o->wake);
+	free (o);
+	ns->online = NULL;
+}
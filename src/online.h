@@ -0,0 +1,49 @@
+#ifndef ONLINE_H
+#define ONLINE_H
+
+#include "common.h"
+
+/* Building the matrix while the sieve runs. See online.c. */
+
+#define ONLINE_EXCESS_MARGIN 32	// stop sieving once the matrix has this many more rows than target_excess over its columns
+#define ONLINE_SNAPSHOT      256	// how often (in rows) the rate the excess grows at is re-measured
+
+typedef struct online {
+	pthread_t thread;
+	pthread_mutex_t lock;	// protects the queue and 'stopping'
+	pthread_cond_t wake;
+	rel_t **queue;		// relations from the sieve threads, waiting to be made into rows
+	uint32_t qlen;
+	uint32_t qcap;
+	int stopping;
+
+	/* Everything from here on belongs to the consumer thread */
+	uint32_t *colcount;	// number of rows each column is odd in
+	uint32_t ncols_used;	// columns that are odd in some row
+	uint32_t nsingletons;	// columns that are odd in exactly one row
+	uint32_t nrows;		// rows built so far, in ns->relns
+	uint32_t ncombined;	// how many of those came from pairs of partials
+	uint32_t npartials;	// partials seen, combined or not
+
+	uint32_t *cofactors;	// open addressing table of the first partial with each cofactor (0 for empty)
+	rel_t **firsts;
+	uint32_t **firstcols;	// and its sparse row, for combining later ones with
+	uint32_t *firstweight;
+	uint32_t tmask;
+	uint32_t tcount;
+
+	uint32_t snap_rows;	// rows and excess at the last snapshot
+	int64_t snap_excess;
+	double rate;		// excess gained per row between the last two snapshots
+
+	/* Published for the sieve threads, under ns->lock */
+	int64_t excess;		// rows - ncols_used: roughly what filtering will leave, before clique removal
+	uint32_t still_needed;	// estimated rows still to be found
+	uint32_t seen_partials;	// npartials, as of the last batch
+} online_t;
+
+void online_start  (nsieve_t *);
+void online_add    (nsieve_t *, rel_t *);	// hand over a checked, non-duplicate relation (fulls already multiplied by their victim), under ns->lock
+void online_finish (nsieve_t *);	// wait for the consumer to catch up, and leave the rows in ns->relns
+
+#endif
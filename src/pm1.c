@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pm1.h"
+#include "rho.h"
+
+int main (int argc, const char *argv[]){
+	mpz_t n;
+	mpz_init (n);
+	int nspecd = 0;
+	int nthreads = 1;
+	uint32_t B1 = 1000000;
+	uint64_t B2 = 0;	// PM1_B2_FACTOR * B1 unless given
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-threads") && pos+1 < argc){
+			nthreads = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-B1") && pos+1 < argc){
+			B1 = atoi (argv[++pos]);
+		} else if (!strcmp (argv[pos], "-B2") && pos+1 < argc){
+			B2 = strtoull (argv[++pos], NULL, 10);
+		} else {
+			mpz_set_str (n, argv[pos], 10);
+			nspecd = 1;
+		}
+	}
+	if (!nspecd){
+		mpz_inp_str (n, stdin, 10);
+	}
+	if (B2 == 0) B2 = (uint64_t) B1 * PM1_B2_FACTOR;
+	tdiv (n, 5000);
+	if (bpsw_prime_p (n)){
+		mpz_out_str (stdout, 10, n);
+		printf("\n");
+		return 0;
+	}
+	pm1 (n, B1, B2, 1, nthreads);
+	mpz_clear (n);
+}
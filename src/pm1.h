@@ -0,0 +1,18 @@
+#ifndef PM1_H
+#define PM1_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <gmp.h>
+#include "prime.h"
+
+/* Pollard's p-1 method. See pm1funcs.c. */
+
+#define PM1_B2_FACTOR 100	// B2 = 100 * B1 unless it's given
+#define PM1_MAX_B2    4000000000ULL	// stage 2 steps by prime gaps, which are small enough below 2^32
+
+void pm1 (mpz_t, uint32_t B1, uint64_t B2, int printrem, int nthreads);	// stage 2 is split over nthreads threads
+int  pm1_find (mpz_t factor, mpz_t n, uint32_t B1, uint64_t B2, int nthreads);	// one factor of n, without printing; 0 if none
+int  pm1_select (int bits, uint32_t *B1);	// the B1 to use on N of this size before the sieve; returns 0 for none
+
+#endif
@@ -0,0 +1,334 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pm1.h"
+
+/* Pollard's p-1 method. If p is a factor of n, then a^(p-1) = 1 mod p, and so a^E = 1 mod p for any multiple
+ * E of p-1; if p-1 divides E but q-1 doesn't for the other factors q of n, then gcd (a^E - 1, n) = p. With E
+ * the product of every prime power up to B1 (stage 1), that catches the p for which p-1 is B1-smooth, and
+ * stage 2 catches those for which it is B1-smooth but for one prime q up to B2. It finds far fewer factors
+ * than ECM does, but it costs about as much as a single curve, so it's always worth a try first.
+ *
+ * E is built once per B1 and kept (the prime power table): the prime powers are multiplied together into
+ * batches of about PM1_BATCH_BITS bits, and a is raised to each batch in turn with mpz_powm, which does its
+ * own sliding window exponentiation. Between batches we check gcd (a - 1, n); if that's n, every factor
+ * showed up in the same batch, so we go back to the start of it and go one prime power at a time.
+ *
+ * Stage 2 walks over the primes q in (B1, B2] in order: with b = a^E, b^(q') = b^q b^(q' - q), and the
+ * differences between consecutive primes are small and even, so a table of b^2, b^4, ... up to the biggest
+ * gap makes that one multiplication per prime, plus one more to multiply b^q - 1 into an accumulator. The
+ * range is split over the threads, each of which starts with its own mpz_powm.
+*/
+
+#define PM1_SEGMENT    262144	// numbers per segment of the prime sieve
+#define PM1_BATCH_BITS 8192	// the size of each batch of the stage 1 exponent
+#define PM1_MAX_GAP    336	// the biggest gap between consecutive primes below 2^32
+#define PM1_MAX_THREADS 64
+#define PM1_BASE 3		// the a in a^E
+
+/* How hard to try before the sieve, by the size of N in bits. Stage 1 to 10000 (and stage 2) takes about
+ * 0.03 s, which is still a few percent of the sieve at 160 bits; below that, it isn't worth it. */
+static const uint32_t pm1_table_bounds[][2] = {
+	// bits	B1
+	{160,	10000},
+	{200,	100000},
+	{250,	1000000},
+	{300,	5000000}
+};
+#define PM1_BOUNDS_LEN (sizeof (pm1_table_bounds) / sizeof (pm1_table_bounds[0]))
+
+/* Primes in order, from a segmented sieve */
+typedef struct {
+	uint32_t *base;		// the odd primes up to sqrt (limit)
+	uint32_t nbase;
+	uint64_t limit;
+	uint64_t lo;		// the segment covers the odd numbers in [lo, lo + PM1_SEGMENT); lo is even.
+	uint32_t pos;
+	int two;		// 2 is still to come
+	uint8_t seg[PM1_SEGMENT / 2];	// 1 for the composites
+} primegen_t;
+
+static void primegen_sieve (primegen_t *pg){
+	memset (pg->seg, 0, sizeof (pg->seg));
+	if (pg->lo == 0) pg->seg[0] = 1;	// 1 isn't prime
+	uint64_t hi = pg->lo + PM1_SEGMENT;
+	for (uint32_t i=0; i < pg->nbase; i++){
+		uint64_t p = pg->base[i];
+		if (p * p >= hi) break;
+		uint64_t m = (pg->lo + p - 1) / p * p;
+		if (m < p * p) m = p * p;
+		if (m % 2 == 0) m += p;
+		for (; m < hi; m += 2 * p){
+			pg->seg[(m - pg->lo) >> 1] = 1;
+		}
+	}
+	pg->pos = 0;
+}
+
+/* The primes from start up to limit */
+static primegen_t *primegen_init (uint64_t start, uint64_t limit){
+	primegen_t *pg = (primegen_t *) malloc (sizeof (primegen_t));
+	uint32_t root = 1;
+	while ((uint64_t) root * root <= limit) root++;
+	uint8_t *c = (uint8_t *) calloc (root + 1, 1);
+	pg->base = (uint32_t *) malloc ((root / 2 + 1) * sizeof (uint32_t));
+	pg->nbase = 0;
+	for (uint32_t i=3; i <= root; i += 2){
+		if (c[i]) continue;
+		pg->base[pg->nbase ++] = i;
+		for (uint64_t j = (uint64_t) i * i; j <= root; j += 2*i){
+			c[j] = 1;
+		}
+	}
+	free (c);
+	pg->limit = limit;
+	pg->two = start <= 2;
+	pg->lo = start & ~1ULL;
+	primegen_sieve (pg);
+	pg->pos = (start - pg->lo) >> 1;	// skip the odd numbers below start
+	return pg;
+}
+
+/* The next prime, or 0 once past the limit */
+static uint64_t primegen_next (primegen_t *pg){
+	if (pg->two){
+		pg->two = 0;
+		return pg->limit >= 2 ? 2 : 0;
+	}
+	while (1){
+		while (pg->pos < PM1_SEGMENT / 2 && pg->seg[pg->pos]) pg->pos++;
+		if (pg->pos < PM1_SEGMENT / 2) break;
+		pg->lo += PM1_SEGMENT;
+		if (pg->lo > pg->limit) return 0;
+		primegen_sieve (pg);
+	}
+	uint64_t p = pg->lo + 2 * pg->pos + 1;
+	pg->pos++;
+	return p <= pg->limit ? p : 0;
+}
+
+static void primegen_free (primegen_t *pg){
+	free (pg->base);
+	free (pg);
+}
+
+/* The stage 1 exponent for one B1, in batches */
+typedef struct pm1_table {
+	uint32_t B1;
+	int nbatches;
+	mpz_t *batches;
+	uint32_t *firsts;	// the first prime in each batch
+	struct pm1_table *next;
+} pm1_table_t;
+
+static pm1_table_t *pm1_tables = NULL;	// once built, a table never changes, so only the list needs the lock.
+static pthread_mutex_t pm1_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The largest power of p that is at most B1 */
+static uint64_t pm1_power (uint64_t p, uint32_t B1){
+	uint64_t pk = p;
+	while (pk * p <= B1){
+		pk *= p;
+	}
+	return pk;
+}
+
+static pm1_table_t *pm1_get_table (uint32_t B1){
+	pthread_mutex_lock (&pm1_tables_lock);
+	pm1_table_t *t = pm1_tables;
+	while (t != NULL && t->B1 != B1){
+		t = t->next;
+	}
+	if (t == NULL){
+		t = (pm1_table_t *) malloc (sizeof (pm1_table_t));
+		t->B1 = B1;
+		t->nbatches = 0;
+		int cap = 16;
+		t->batches = (mpz_t *) malloc (cap * sizeof (mpz_t));
+		t->firsts = (uint32_t *) malloc (cap * sizeof (uint32_t));
+		primegen_t *pg = primegen_init (2, B1);
+		uint64_t p;
+		while ((p = primegen_next (pg)) != 0){
+			if (t->nbatches == 0 || mpz_sizeinbase (t->batches[t->nbatches - 1], 2) >= PM1_BATCH_BITS){
+				if (t->nbatches == cap){
+					cap *= 2;
+					t->batches = (mpz_t *) realloc (t->batches, cap * sizeof (mpz_t));
+					t->firsts = (uint32_t *) realloc (t->firsts, cap * sizeof (uint32_t));
+				}
+				mpz_init_set_ui (t->batches[t->nbatches], 1);
+				t->firsts[t->nbatches] = p;
+				t->nbatches ++;
+			}
+			mpz_mul_ui (t->batches[t->nbatches - 1], t->batches[t->nbatches - 1], pm1_power (p, B1));
+		}
+		primegen_free (pg);
+		t->next = pm1_tables;
+		pm1_tables = t;
+	}
+	pthread_mutex_unlock (&pm1_tables_lock);
+	return t;
+}
+
+/* gcd (a - 1, n) */
+static void pm1_gcd (mpz_t g, mpz_t a, mpz_t n){
+	mpz_sub_ui (g, a, 1);
+	mpz_gcd (g, g, n);
+}
+
+/* Stage 1: a = a^E; returns 1 with g = gcd (a^E - 1, n) if that's a proper factor, 0 otherwise. */
+static int pm1_stage1 (mpz_t g, mpz_t a, mpz_t n, uint32_t B1){
+	pm1_table_t *t = pm1_get_table (B1);
+	mpz_t save;
+	mpz_init (save);
+	int found = 0;
+	for (int i=0; i < t->nbatches; i++){
+		mpz_set (save, a);
+		mpz_powm (a, a, t->batches[i], n);
+		pm1_gcd (g, a, n);
+		if (mpz_cmp_ui (g, 1) == 0) continue;
+		if (mpz_cmp (g, n) == 0){	// overshot; redo this batch a prime power at a time.
+			mpz_set (a, save);
+			uint64_t last = i + 1 < t->nbatches ? t->firsts[i+1] - 1 : B1;
+			primegen_t *pg = primegen_init (t->firsts[i], last);
+			uint64_t p;
+			while ((p = primegen_next (pg)) != 0){
+				mpz_powm_ui (a, a, pm1_power (p, B1), n);
+				pm1_gcd (g, a, n);
+				if (mpz_cmp_ui (g, 1) != 0) break;
+			}
+			primegen_free (pg);
+		}
+		found = mpz_cmp (g, n) != 0;
+		break;
+	}
+	mpz_clear (save);
+	return found;
+}
+
+typedef struct {
+	mpz_srcptr n;
+	mpz_srcptr b;		// a^E
+	mpz_t *steps;		// steps[i] = b^(2i)
+	uint64_t lo;		// this thread does the primes in (lo, hi]
+	uint64_t hi;
+	mpz_t acc;		// the product of the b^q - 1
+} pm1_stage2_t;
+
+static void *pm1_stage2_thread (void *args){
+	pm1_stage2_t *s = (pm1_stage2_t *) args;
+	mpz_set_ui (s->acc, 1);
+	primegen_t *pg = primegen_init (s->lo + 1, s->hi);
+	uint64_t q = primegen_next (pg);
+	if (q != 0){
+		mpz_t x, t;
+		mpz_inits (x, t, NULL);
+		mpz_set_ui (t, q);
+		mpz_powm (x, s->b, t, s->n);	// b^q
+		while (1){
+			mpz_sub_ui (t, x, 1);
+			mpz_mul (s->acc, s->acc, t);
+			mpz_mod (s->acc, s->acc, s->n);
+			uint64_t next = primegen_next (pg);
+			if (next == 0) break;
+			mpz_mul (x, x, s->steps[(next - q) / 2]);	// b^next = b^q b^(next - q)
+			mpz_mod (x, x, s->n);
+			q = next;
+		}
+		mpz_clears (x, t, NULL);
+	}
+	primegen_free (pg);
+	return NULL;
+}
+
+/* Stage 2: g = gcd (prod (b^q - 1), n) over the primes q in (B1, B2]; returns 1 if that's a proper factor. */
+static int pm1_stage2 (mpz_t g, mpz_t b, mpz_t n, uint32_t B1, uint64_t B2, int nthreads){
+	mpz_t steps[PM1_MAX_GAP / 2 + 1];
+	mpz_init_set_ui (steps[0], 1);
+	mpz_init (steps[1]);
+	mpz_mul (steps[1], b, b);
+	mpz_mod (steps[1], steps[1], n);
+	for (int i=2; i <= PM1_MAX_GAP / 2; i++){
+		mpz_init (steps[i]);
+		mpz_mul (steps[i], steps[i-1], steps[1]);
+		mpz_mod (steps[i], steps[i], n);
+	}
+
+	pm1_stage2_t s[nthreads];
+	pthread_t threads[nthreads];
+	for (int i=0; i < nthreads; i++){
+		s[i].n = n;
+		s[i].b = b;
+		s[i].steps = steps;
+		s[i].lo = B1 + (B2 - B1) * i / nthreads;
+		s[i].hi = B1 + (B2 - B1) * (i+1) / nthreads;
+		mpz_init (s[i].acc);
+	}
+	for (int i=1; i < nthreads; i++){
+		pthread_create (&threads[i], NULL, pm1_stage2_thread, &s[i]);
+	}
+	pm1_stage2_thread (&s[0]);
+	for (int i=1; i < nthreads; i++){
+		pthread_join (threads[i], NULL);
+		mpz_mul (s[0].acc, s[0].acc, s[i].acc);
+		mpz_mod (s[0].acc, s[0].acc, n);
+	}
+	mpz_gcd (g, s[0].acc, n);
+	for (int i=0; i < nthreads; i++){
+		mpz_clear (s[i].acc);
+	}
+	for (int i=0; i <= PM1_MAX_GAP / 2; i++){
+		mpz_clear (steps[i]);
+	}
+	return mpz_cmp_ui (g, 1) != 0 && mpz_cmp (g, n) != 0;
+}
+
+int pm1_find (mpz_t factor, mpz_t n, uint32_t B1, uint64_t B2, int nthreads){
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > PM1_MAX_THREADS) nthreads = PM1_MAX_THREADS;
+	if (B1 < 2) B1 = 2;
+	if (B2 > PM1_MAX_B2) B2 = PM1_MAX_B2;
+	if (mpz_cmp_ui (n, PM1_BASE) <= 0 || mpz_even_p (n)) return 0;
+
+	mpz_t a;
+	mpz_init_set_ui (a, PM1_BASE);
+	int found = pm1_stage1 (factor, a, n, B1);
+	if (!found && B2 > B1 && mpz_cmp_ui (factor, 1) == 0){
+		found = pm1_stage2 (factor, a, n, B1, B2, nthreads);
+	}
+	mpz_clear (a);
+	return found;
+}
+
+void pm1 (mpz_t n, uint32_t B1, uint64_t B2, int printrem, int nthreads){	// printrem controls whether a composite cofactor is printed.
+	if (mpz_cmp_ui (n, 1) <= 0 || bpsw_prime_p (n)) return;
+	mpz_t g;
+	mpz_init (g);
+	int found = pm1_find (g, n, B1, B2, nthreads);
+	if (found){
+		mpz_out_str (stdout, 10, g);
+		if (bpsw_prime_p (g)){	// a prime one!
+			printf("\n");
+		} else {
+			printf (" (composite)\n");
+		}
+		mpz_divexact (n, n, g);
+	}
+	if (found && bpsw_prime_p (n)){	// what's left after the factor we found
+		mpz_out_str (stdout, 10, n);
+		printf ("\n");
+	} else if (printrem){
+		mpz_out_str (stdout, 10, n);
+		printf (" (composite)\n");
+	}
+	mpz_clear (g);
+}
+
+int pm1_select (int bits, uint32_t *B1){
+	*B1 = 0;
+	for (int i=0; i < PM1_BOUNDS_LEN; i++){
+		if (bits >= pm1_table_bounds[i][0]){
+			*B1 = pm1_table_bounds[i][1];
+		}
+	}
+	return *B1 != 0;
+}
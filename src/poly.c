@@ -5,6 +5,7 @@ void polygroup_init (poly_group_t *pg, nsieve_t *ns){
 	mpz_init (pg->a);
 	pg->ainverses = (uint32_t *) malloc(ns->fb_len * sizeof(uint32_t));
 	pg->bvals = (mpz_t *) malloc( ns->bvals * sizeof (mpz_t));
+	pg->bmasks = (uint16_t *) malloc( ns->bvals * sizeof (uint16_t));
 	pg->relns = (rel_t **) calloc (PG_REL_STORAGE, sizeof (rel_t *));
 	pg->nrels = 0;
 	pg->victim = NULL;
@@ -21,6 +22,7 @@ void polygroup_free (poly_group_t *pg, nsieve_t *ns){
 		mpz_clear (pg->bvals[i]);
 	}
 	free (pg->bvals);
+	free (pg->bmasks);
 }
 
 void poly_init (poly_t *p){
@@ -46,12 +48,13 @@ uint32_t pi (uint32_t x){
 	return (uint32_t) (x / log(x));
 }
 
-/* Analogue of the mpz_nextprime function, but going backwards. */
+/* Analogue of the mpz_nextprime function, but going backwards. Only odd values are tested (res is far
+ * above 2 here). */
 void mpz_prevprime (mpz_t res){
 	mpz_sub_ui(res, res, 1);
-	while (!mpz_probab_prime_p(res, 10)){	// this will be fast for the even values, since 
-						// mpz_probab_prime_p does a little trial division first.
-		mpz_sub_ui(res, res, 1);
+	if (mpz_even_p(res)) mpz_sub_ui(res, res, 1);
+	while (!bpsw_prime_p(res)){
+		mpz_sub_ui(res, res, 2);
 	}
 }
 
@@ -119,11 +122,7 @@ void gpool_init (poly_gpool_t *gp, nsieve_t *ns){
 			break;
 		}
 		k--;
-	}
-	if (k == 0){
-		printf("Fatal error: no values of k were deemed viable.\n");
-		exit(1);
-	}
+	}	// if none of them are good, we go with k = 2 and hope for the best.
 	mpz_root (temp, aopt, k);	// temp contains the 'central' value for our range.
 	int ng = q[k-1];	// we must find this many g values.
 	gp->gpool = (uint32_t *) malloc (ng * sizeof (uint32_t));	// allocate the g pool
@@ -157,6 +156,7 @@ void gpool_init (poly_gpool_t *gp, nsieve_t *ns){
 	gp->k = k;
 	ns->k = k;
 	ns->bvals = 1 << (k-1);
+	mpz_clears (aopt, temp, g, NULL);
 }
 
 /* We need a way to sequentially generate unique values of A. We initialize k 'frogs' to be the last 
@@ -173,7 +173,7 @@ void gpool_init (poly_gpool_t *gp, nsieve_t *ns){
  * many times as there are sieve threads. This way all of the threads are guaranteed to produce distinct
  * A values, without resorting to random selection and the potential for duplication of work.
 */
-void advance_gpool (poly_gpool_t *gp, poly_group_t *group){	// advances the frogs, and sets the gvals field of 'group'
+int advance_gpool (poly_gpool_t *gp, poly_group_t *group){	// advances the frogs, and sets the gvals field of 'group'; 0 if we're out
 	int k = gp->k;
 	// update group->gvals
 	if (group != NULL){
@@ -187,8 +187,7 @@ void advance_gpool (poly_gpool_t *gp, poly_group_t *group){	// advances the frog
 	while (gp->frogs[j] == j){
 		j++;
 		if (j == k){	// then we ran out of polynomials.
-			printf("Fatal error: Out of polynomials!!!\n");
-			exit(1);
+			return 0;
 		}
 	}
 	// j is now the index of the first frog that is not jammed against the end of the pool. 
@@ -202,22 +201,47 @@ void advance_gpool (poly_gpool_t *gp, poly_group_t *group){	// advances the frog
 		gp->frogs[j] = gp->frogs[billy] + (j - billy);
 		j--;
 	}
+	return 1;
 }
 
+static void crt_terms (mpz_t terms[][2], mpz_t a, const uint32_t *gvals, nsieve_t *ns);
+
 /* This will perform all of the work to set up the polygroup so that we may pull out polynomials from it. It
- * does some precomputation (of A^-1 (mod p)) as well. */
-void generate_polygroup (poly_gpool_t *gp, poly_group_t *pg, nsieve_t *ns){
+ * does some precomputation (of A^-1 (mod p)) as well. Returns 0 if the gpool has run out of A values. */
+int generate_polygroup (poly_gpool_t *gp, poly_group_t *pg, nsieve_t *ns){
 	/* This is a tricky one. First we must choose A, by picking k primes g_i, and multiplying them together.
 	 * Then we need to find all of the values of B which satisfy  B^2 = N (mod a). There will be 2^(k-1) of them. 
 	 * Then we will compute the values of A^-1 (mod p) for each p in the factor base. This is really a precomputation
 	 * to speed up the computation of Q(x) = 0 (mod p). 
 	*/
 	
-	for (int i=0; i < ns->nthreads; i++){	// advance the gpool nthreads times to get our next set of gvals
-		advance_gpool (gp, pg);
+	for (int i=0; i < ns->gpool_stride; i++){	// advance the gpool once per sieving thread (in all processes) to get our next set of gvals
+		if (!advance_gpool (gp, pg)) return 0;
+	}
+	polygroup_compute_coeffs (pg, ns);
+
+	// Now that we've chosen A and determined the values of B, we compute A^-1 (mod p) for each prime in the factor base.
+	mpz_t p, temp;
+	mpz_inits (p, temp, NULL);
+	for (int i=0; i<ns->fb_len; i++){
+		mpz_set_ui (p, ns->fb[i]);
+		int invertable = mpz_invert (temp, pg->a, p);
+		if (invertable){	// good
+			pg -> ainverses[i] = mpz_get_ui (temp);
+		} else {
+			// hmmm. This is interesting. Does this ever occur? Maybe I should figure this out. 
+			// It seems to work fine, though.
+		}
 	}
+	mpz_clears (p, temp, NULL);
+	return 1;
+}
+
+/* Given the gvals of a group, compute A and all of the values of B. This is split out of generate_polygroup
+ * so that a group can be rebuilt from nothing but its gvals (which is all a relation file stores). */
+void polygroup_compute_coeffs (poly_group_t *pg, nsieve_t *ns){
 	mpz_set_ui (pg->a, pg->gvals[0]);	// multiply all of the g-values together to get A.
-	for (int i=1; i < gp->k; i++){
+	for (int i=1; i < ns->k; i++){
 		mpz_mul_ui(pg->a, pg->a, pg->gvals[i]);
 	}
 	
@@ -245,18 +269,9 @@ void generate_polygroup (poly_gpool_t *gp, poly_group_t *pg, nsieve_t *ns){
 	 * We disregard values of B > A/2, since these are the negations of other, smaller B. Hence, we end up with 2^(k-1) values for B.
 	*/
 	int k = ns->k;
+	mpz_t terms[KMAX][2];	// terms[i][j] = r_i_j * j_i * (A / g_i); each B is a sum of one term from each row.
+	crt_terms (terms, pg->a, pg->gvals, ns);
 
-	uint32_t r[k][2];
-
-	// first find r_i^2 ~= N (mod g_i)
-	for (int i=0; i<k; i++){
-		r[i][0] = find_root (ns->N, pg->gvals[i]);
-		r[i][1] = pg->gvals[i] - r[i][0];
-	}
-
-	// now do the main loop
-	mpz_t t1, t2;		// temps
-	mpz_inits (t1, t2, NULL);
 	int w = 0;
 	for (int z = 0; z < (1 << k); z++){	// the ith bit of z will control which root r_i_? is used for the current B computation.
 
@@ -264,39 +279,61 @@ void generate_polygroup (poly_gpool_t *gp, poly_group_t *pg, nsieve_t *ns){
 						// a safegard for us to not keep setting pg->bvals[w] when w is out of range.
 
 		mpz_set_ui (pg->bvals[w], 0);	// clear the B-value
-		for (int i=0; i < k; i++){	// for each G-value
-			mpz_set_ui (t2, pg->gvals[i]);			// t2 = g_i
-			mpz_divexact_ui (t1, pg->a, pg->gvals[i]);	// t1 = A / g_i
-			mpz_invert (t2, t1, t2);	// t2 = inverse of (A / g_i) (mod g_i) = j_i
-			mpz_mul (t2, t2, t1);		// t2 = j_i * (A / g_i)
-			// pick the root according to the i'th least siginificant bit of z.
-			int root = (z & (1 << i)) == 0 ? 0 : 1;
-			mpz_mul_ui (t2, t2, r[i][root]);
-			mpz_add (pg->bvals[w], pg->bvals[w], t2);
+		for (int i=0; i < k; i++){	// for each G-value, pick the root according to the i'th least siginificant bit of z.
+			mpz_add (pg->bvals[w], pg->bvals[w], terms[i][(z >> i) & 1]);
 		}
 		mpz_mod (pg->bvals[w], pg->bvals[w], pg->a);	// take the sum mod A.
 		// if it's over A/2, reject it as the negation of another square root.
 		mpz_mul_ui(pg->bvals[w], pg->bvals[w], 2);
 		if (mpz_cmp (pg->bvals[w], pg->a) < 1){	// it's good
 			mpz_divexact_ui (pg->bvals[w], pg->bvals[w], 2);
+			pg->bmasks[w] = z;
 			w ++;
 		}
 	}
+	for (int i=0; i < k; i++){
+		mpz_clears (terms[i][0], terms[i][1], NULL);
+	}
+}
 
-	// Now that we've chosen A and determined the values of B, we compute A^-1 (mod p) for each prime in the factor base.
-	mpz_t p, temp;
-	mpz_inits (p, temp, NULL);
-	for (int i=0; i<ns->fb_len; i++){
-		mpz_set_ui (p, ns->fb[i]);
-		int invertable = mpz_invert (temp, pg->a, p);
-		if (invertable){	// good
-			pg -> ainverses[i] = mpz_get_ui (temp);
-		} else {
-			// hmmm. This is interesting. Does this ever occur? Maybe I should figure this out. 
-			// It seems to work fine, though.
-		}
+/* Compute the CRT terms from which the B values of a group are summed (see the comment in
+ * polygroup_compute_coeffs). Initializes all of the mpz_t's in 'terms'; the caller clears them. */
+static void crt_terms (mpz_t terms[][2], mpz_t a, const uint32_t *gvals, nsieve_t *ns){
+	mpz_t t1, t2;		// temps
+	mpz_inits (t1, t2, NULL);
+	for (int i=0; i < ns->k; i++){
+		// first find r_i^2 ~= N (mod g_i)
+		uint32_t r0 = find_root (ns->N, gvals[i]);
+		uint32_t r1 = gvals[i] - r0;
+
+		mpz_set_ui (t2, gvals[i]);		// t2 = g_i
+		mpz_divexact_ui (t1, a, gvals[i]);	// t1 = A / g_i
+		mpz_invert (t2, t1, t2);		// t2 = inverse of (A / g_i) (mod g_i) = j_i
+		mpz_mul (t2, t2, t1);			// t2 = j_i * (A / g_i)
+		mpz_init (terms[i][0]);
+		mpz_init (terms[i][1]);
+		mpz_mul_ui (terms[i][0], t2, r0);
+		mpz_mul_ui (terms[i][1], t2, r1);
 	}
-	mpz_clears (p, temp, NULL);
+	mpz_clears (t1, t2, NULL);
+}
+
+/* Compute A and the single B value picked by 'mask' (bit i chooses the root mod g_i, as z does in
+ * polygroup_compute_coeffs) without building the whole group. This is all the factor deduction needs
+ * for a relation read straight out of a relation file. */
+void poly_coeffs_from_mask (mpz_t a, mpz_t b, const uint32_t *gvals, uint32_t mask, nsieve_t *ns){
+	mpz_set_ui (a, gvals[0]);
+	for (int i=1; i < ns->k; i++){
+		mpz_mul_ui (a, a, gvals[i]);
+	}
+	mpz_t terms[KMAX][2];
+	crt_terms (terms, a, gvals, ns);
+	mpz_set_ui (b, 0);
+	for (int i=0; i < ns->k; i++){
+		mpz_add (b, b, terms[i][(mask >> i) & 1]);
+		mpz_clears (terms[i][0], terms[i][1], NULL);
+	}
+	mpz_mod (b, b, a);
 }
 
 extern uint32_t get_offset (uint32_t, int, int, int, poly_t *, poly_group_t *, nsieve_t *);
@@ -304,20 +341,11 @@ extern uint32_t get_offset (uint32_t, int, int, int, poly_t *, poly_group_t *, n
 /* Generate a polynomial from a group. generate_polygroup should have been called on the group before
  * this method is called. It will get polynomial #i, corresponding to the i'th computed b value */
 void generate_poly (poly_t *p, poly_group_t *pg, nsieve_t *ns, int i){
-	p->group = pg;
-
-	mpz_set(p->a, pg->a);
-	mpz_set (p->b, pg->bvals[i]);
-	// compute C = (b^2 - n) / a
-	mpz_mul (p->c, p->b, p->b);	 // C = b^2
-	mpz_sub (p->c, p->c, ns->N);	 // C = b^2 - N
-	mpz_divexact (p->c, p->c, p->a); // C = (b^2 - N) / a
+	poly_set_coeffs (p, pg, ns, i);
 
 	mpz_t temp;
 	mpz_init (temp);
 
-	p->M = ns->M;
-
 	// compute -B % p for each prime in the factor base. This is another precomputation for get_offset.
 	p -> bmodp = (uint32_t *) malloc (ns->fb_len * sizeof(uint32_t));
 	for (int i=0; i < ns->fb_len; i++){
@@ -327,6 +355,21 @@ void generate_poly (poly_t *p, poly_group_t *pg, nsieve_t *ns, int i){
 	mpz_clear(temp);
 }
 
+/* Fill in A, B and C for polynomial #i of the group, without any of the sieving precomputation. */
+void poly_set_coeffs (poly_t *p, poly_group_t *pg, nsieve_t *ns, int i){
+	p->group = pg;
+	p->bidx = i;
+
+	mpz_set(p->a, pg->a);
+	mpz_set (p->b, pg->bvals[i]);
+	// compute C = (b^2 - n) / a
+	mpz_mul (p->c, p->b, p->b);	 // C = b^2
+	mpz_sub (p->c, p->c, ns->N);	 // C = b^2 - N
+	mpz_divexact (p->c, p->c, p->a); // C = (b^2 - N) / a
+
+	p->M = ns->M;
+}
+
 void poly (mpz_t res, poly_t *p, int32_t x){
 	// evaluate Ax^2 + 2Bx + C 
 	// = (((A * X) + 2B) * X) + C
@@ -354,14 +397,14 @@ int rel_check (rel_t *rel, nsieve_t *ns){
 			mpz_neg (facprod, facprod);
 		} else {
 			if (entry->fac < 0 || entry->fac > ns->fb_len){
-				printf ("fac out of bounds error: fac = %d\n", entry->fac);
+				ns_printf (ns, "fac out of bounds error: fac = %d\n", entry->fac);
 				mpz_clears (pol, temp, facprod, NULL);
 				return 0;
 			}
 			mpz_mul_ui (facprod, facprod, ns->fb[entry->fac - 1]);
 			if (!mpz_divisible_ui_p(pol, ns->fb[entry->fac - 1])){
-				mpz_clears (facprod, pol, NULL);
-				printf ("divisibility failed\n");
+				mpz_clears (facprod, pol, temp, NULL);
+				ns_printf (ns, "divisibility failed\n");
 				return 0;
 			}
 		}
@@ -370,6 +413,6 @@ int rel_check (rel_t *rel, nsieve_t *ns){
 //	mpz_mod (pol, pol, ns->N);
 //	mpz_mod (facprod, facprod, ns->N);
 	int res = (mpz_cmp (pol, facprod) == 0) ? 1 : 0;
-	mpz_clears (facprod, pol, NULL);
+	mpz_clears (facprod, pol, temp, NULL);
 	return res;
 }
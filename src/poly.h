@@ -7,11 +7,13 @@
 
 // the structures are defined in common.h
 
-void generate_polygroup (poly_gpool_t *, poly_group_t *, nsieve_t *);		// this will pick some G values, compute the b values, and also precompute the inverses.
+int  generate_polygroup (poly_gpool_t *, poly_group_t *, nsieve_t *);		// this will pick some G values, compute the b values, and also precompute the inverses. 0 if there are no more.
+void polygroup_compute_coeffs (poly_group_t *, nsieve_t *);	// compute A and the b values from the gvals already in the group.
+void poly_coeffs_from_mask (mpz_t a, mpz_t b, const uint32_t *gvals, uint32_t mask, nsieve_t *);	// A and one B, straight from the gvals.
 void generate_poly (poly_t *, poly_group_t *, nsieve_t *, int);	// generate the polynomial with the the i'th value of 'b' in the list in the poly_group_t. This will also compute the starting values (it needs the nsieve_t to get the square roots stored there).
 
 void gpool_init (poly_gpool_t *gpool, nsieve_t *);
-void advance_gpool (poly_gpool_t *, poly_group_t *);
+int  advance_gpool (poly_gpool_t *, poly_group_t *);	// 0 once every combination has been used
 
 void polygroup_init (poly_group_t *pg, nsieve_t *);
 void polygroup_free (poly_group_t *pg, nsieve_t *);
@@ -19,6 +21,7 @@ void poly_init (poly_t *);
 void poly_free (poly_t *);
 
 void poly_print (poly_t *);
+void poly_set_coeffs (poly_t *, poly_group_t *, nsieve_t *, int);	// just A, B and C for the i'th b value; no sieving precomputation.
 
 void poly (mpz_t res, poly_t *, int32_t offset);	// evaluate the polynomial at poly->istart + offset.
 
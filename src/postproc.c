@@ -0,0 +1,399 @@
+#define _POSIX_C_SOURCE 200809L	// for mmap and friends under -std=c99
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "nsieve.h"
+
+/* The relation files (see relfile.h for the format) are mapped read-only and walked once to build an index:
+ * one relref_t for each usable full and partial relation, pointing at its record, its batch and its batch's
+ * victim. The partials are sorted by cofactor, and the matrix relations are then made exactly as
+ * add_polygroup_relations and combine_partials would have made them, except that they point at relrefs.
+ * The matrix rows are filled in from the factor arrays in the mapping, and the factor deduction recomputes
+ * A and B for the few relations it needs from the gvals and bmask. No rel_t, poly_t or poly_group_t is ever
+ * allocated; the index costs 24 bytes per relation, and everything else scales with the matrix.
+*/
+
+static inline int32_t  rec_x     (const uint32_t *rec){ return (int32_t) rec[0]; }
+static inline uint32_t rec_bmask (const uint32_t *rec){ return ((const uint16_t *) (rec + 2))[0]; }
+static inline uint32_t rec_nfac  (const uint32_t *rec){ return ((const uint16_t *) (rec + 2))[1]; }
+static inline const uint32_t *rec_facs (const uint32_t *rec){ return rec + 3; }
+
+uint32_t relref_cofactor (const relref_t *r){
+	return r->rec[1];
+}
+
+void relref_get_id (const relref_t *r, rel_id_t *id, nsieve_t *ns){
+	id->gvals = r->batch + 1;
+	id->k = r->batch[0];
+	id->bmask = rec_bmask (r->rec);
+	id->x = rec_x (r->rec);
+}
+
+/* A growable array of relrefs */
+typedef struct {
+	relref_t *refs;
+	uint32_t n;
+	uint32_t cap;
+} reflist_t;
+
+static void reflist_add (reflist_t *l, const uint32_t *rec, const uint32_t *batch, const uint32_t *victim){
+	if (l->n == l->cap){
+		l->cap = l->cap == 0 ? 1024 : 2 * l->cap;
+		l->refs = (relref_t *) realloc (l->refs, l->cap * sizeof (relref_t));
+	}
+	l->refs[l->n].rec = rec;
+	l->refs[l->n].batch = batch;
+	l->refs[l->n].victim = victim;
+	l->n ++;
+}
+
+static int by_cofactor (const void *a, const void *b){
+	const relref_t *ra = (const relref_t *) a;
+	const relref_t *rb = (const relref_t *) b;
+	if (ra->rec[1] != rb->rec[1]) return ra->rec[1] < rb->rec[1] ? -1 : 1;
+	return ra->rec < rb->rec ? -1 : (ra->rec > rb->rec);
+}
+
+/* Relation files from resumed or overlapping runs can hold the same relation more than once. Since the
+ * whole index is in memory anyway, duplicates are dropped exactly here: sort by identity hash, compare the
+ * identities of equal hashes, and keep the first copy. Returns the number dropped. */
+typedef struct {
+	uint64_t key;
+	uint32_t idx;
+} keyed_ref_t;
+
+static int by_key (const void *a, const void *b){
+	const keyed_ref_t *ka = (const keyed_ref_t *) a;
+	const keyed_ref_t *kb = (const keyed_ref_t *) b;
+	if (ka->key != kb->key) return ka->key < kb->key ? -1 : 1;
+	return ka->idx < kb->idx ? -1 : (ka->idx > kb->idx);
+}
+
+static uint32_t drop_duplicates (reflist_t *l, nsieve_t *ns){
+	if (l->n == 0) return 0;
+	keyed_ref_t *keys = (keyed_ref_t *) malloc (l->n * sizeof (keyed_ref_t));
+	uint8_t *dup = (uint8_t *) calloc (l->n, 1);
+	rel_id_t id, other;
+	for (uint32_t i=0; i < l->n; i++){
+		relref_get_id (&l->refs[i], &id, ns);
+		keys[i].key = rel_id_hash (&id);
+		keys[i].idx = i;
+	}
+	qsort (keys, l->n, sizeof (keyed_ref_t), by_key);
+	for (uint32_t i=1; i < l->n; i++){
+		relref_get_id (&l->refs[keys[i].idx], &id, ns);
+		for (uint32_t j = i; j > 0 && keys[j-1].key == keys[i].key; j--){
+			relref_get_id (&l->refs[keys[j-1].idx], &other, ns);
+			if (!dup[keys[j-1].idx] && rel_id_equal (&id, &other)){
+				dup[keys[i].idx] = 1;
+				break;
+			}
+		}
+	}
+	uint32_t w = 0;
+	for (uint32_t i=0; i < l->n; i++){
+		if (!dup[i]) l->refs[w++] = l->refs[i];
+	}
+	uint32_t ndup = l->n - w;
+	l->n = w;
+	free (keys);
+	free (dup);
+	return ndup;
+}
+
+/* The same check fl_check does on a factor list. */
+static int rec_check (const uint32_t *rec, nsieve_t *ns){
+	const uint32_t *facs = rec_facs (rec);
+	for (int i=0; i < rec_nfac (rec); i++){
+		if (facs[i] > ns->fb_len) return 0;
+	}
+	return 1;
+}
+
+/* A mapped relation file */
+typedef struct {
+	void *base;
+	size_t len;
+} mapping_t;
+
+/* Map a file and check its header. Returns a pointer to the first batch, or NULL if it couldn't be mapped or
+ * isn't a relation file. The header and N are also returned. */
+static const uint32_t *map_relfile (const char *path, mapping_t *m, relfile_header_t *h, mpz_t n){
+	int fd = open (path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat (fd, &st) != 0 || st.st_size < sizeof (relfile_header_t)){
+		close (fd);
+		return NULL;
+	}
+	m->len = st.st_size;
+	m->base = mmap (NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (m->base == MAP_FAILED) return NULL;
+
+	memcpy (h, m->base, sizeof (relfile_header_t));
+	uint32_t padded = h->nlen + (4 - h->nlen % 4) % 4;
+	if (h->magic != RELFILE_MAGIC || h->version != RELFILE_VERSION || sizeof (relfile_header_t) + padded > m->len){
+		munmap (m->base, m->len);
+		return NULL;
+	}
+	char *digits = (char *) calloc (h->nlen + 1, 1);
+	memcpy (digits, (char *) m->base + sizeof (relfile_header_t), h->nlen);
+	int ok = (mpz_set_str (n, digits, 10) == 0);
+	free (digits);
+	if (!ok){
+		munmap (m->base, m->len);
+		return NULL;
+	}
+	return (const uint32_t *) ((char *) m->base + sizeof (relfile_header_t) + padded);
+}
+
+/* Walk all of the batches between p and end, adding the usable relations to the index. A truncated batch
+ * at the end (from a worker that was killed, say) is simply dropped. */
+static void index_relations (const uint32_t *p, const uint32_t *end, nsieve_t *ns, reflist_t *fulls, reflist_t *partials, uint32_t *orphans){
+	while (end - p > 0){
+		uint32_t k = p[0];
+		if (k != ns->k || end - p < k + 2) break;
+		const uint32_t *batch = p;
+		uint32_t nrels = p[k+1];
+
+		// first pass: make sure the whole batch is there, and pick the victim
+		const uint32_t *victim = NULL;
+		const uint32_t *rec = p + k + 2;
+		int complete = 1;
+		for (int i=0; i < nrels; i++){
+			if (end - rec < 3 || end - rec < 3 + rec_nfac (rec)){
+				complete = 0;
+				break;
+			}
+			if (victim == NULL && rec[1] == 1 && rec_check (rec, ns)){
+				victim = rec;
+			}
+			rec = rec_facs (rec) + rec_nfac (rec);
+		}
+		if (!complete) break;
+
+		// second pass: index everything else
+		rec = p + k + 2;
+		for (int i=0; i < nrels; i++){
+			if (victim == NULL){
+				if (rec[1] != 1) (*orphans) ++;
+			} else if (rec != victim && rec_check (rec, ns)){
+				reflist_add (rec[1] == 1 ? fulls : partials, rec, batch, victim);
+			}
+			rec = rec_facs (rec) + rec_nfac (rec);
+		}
+		p = rec;
+	}
+}
+
+/* The equivalent of fl_fillcols: the sparse matrix row for the relation times its victim. */
+uint32_t relref_fillcols (const relref_t *r, uint32_t **cols){
+	uint32_t n1 = rec_nfac (r->rec);
+	uint32_t n2 = rec_nfac (r->victim);
+	*cols = (uint32_t *) malloc ((n1 + n2 + 1) * sizeof (uint32_t));
+	memcpy (*cols, rec_facs (r->rec), n1 * sizeof (uint32_t));
+	memcpy (*cols + n1, rec_facs (r->victim), n2 * sizeof (uint32_t));
+	return sparse_row_normalize (*cols, n1 + n2);
+}
+
+/* The equivalent of multiply_in_lhs for a mapped relation; ainv is A^-1 (mod N) for its batch. */
+void relref_multiply_in (mpz_t lhs, const relref_t *r, const mpz_t ainv, nsieve_t *ns){
+	mpz_t a, b, temp;
+	mpz_inits (a, b, temp, NULL);
+	const uint32_t *gvals = r->batch + 1;
+
+	// (Ax_victim + B_victim)
+	poly_coeffs_from_mask (a, b, gvals, rec_bmask (r->victim), ns);
+	mpz_mul_si (temp, a, rec_x (r->victim));
+	mpz_add (temp, temp, b);
+	mpz_mul (lhs, lhs, temp);
+
+	// (Ax_i + B_i)
+	poly_coeffs_from_mask (a, b, gvals, rec_bmask (r->rec), ns);
+	mpz_mul_si (temp, a, rec_x (r->rec));
+	mpz_add (temp, temp, b);
+	mpz_mul (lhs, lhs, temp);
+
+	// and A^-1, for the A^2 on the other side
+	mpz_mul (lhs, lhs, ainv);
+	mpz_mod (lhs, lhs, ns->N);
+	mpz_clears (a, b, temp, NULL);
+}
+
+/* The equivalent of add_factors_to_table: the relation and its victim. */
+void relref_add_factors (uint16_t *table, const relref_t *r){
+	const uint32_t *facs = rec_facs (r->rec);
+	for (int i=0; i < rec_nfac (r->rec); i++){
+		table[facs[i]] ++;
+	}
+	facs = rec_facs (r->victim);
+	for (int i=0; i < rec_nfac (r->victim); i++){
+		table[facs[i]] ++;
+	}
+}
+
+/* The A of the relation's batch */
+void relref_get_a (mpz_t a, const relref_t *r, nsieve_t *ns){
+	mpz_t b;
+	mpz_init (b);
+	poly_coeffs_from_mask (a, b, r->batch + 1, rec_bmask (r->victim), ns);
+	mpz_clear (b);
+}
+
+/* Run everything after the sieve from a set of relation files: the parameters and N come from the first
+ * file's header, and every file must agree with it. nthreads is used for the linear algebra. If export_to
+ * is set, the filtered matrix is written out (see matfile.h) instead of solved; if import_from is set, the
+ * matrix is skipped altogether, and the dependencies some other solver found for it are read back in.
+ * Returns 0 if none of the files could be used, or the imported matrix couldn't be read; then ns->timing
+ * means nothing. */
+int postprocess_files (nsieve_t *ns, const char **files, int nfiles, int nthreads, const char *export_to, const char *import_from){
+	long start = clock();
+	mapping_t maps[nfiles];
+	const uint32_t *firsts[nfiles];
+	relfile_header_t h, h0;
+	memset (&h0, 0, sizeof (h0));
+	mpz_t n, n0;
+	mpz_inits (n, n0, NULL);
+
+	int nmapped = 0;
+	for (int i=0; i < nfiles; i++){
+		firsts[nmapped] = map_relfile (files[i], &maps[nmapped], &h, n);
+		if (firsts[nmapped] == NULL){
+			printf ("Skipping %s: could not map it, or it is not a relation file.\n", files[i]);
+			continue;
+		}
+		if (nmapped == 0){
+			h0 = h;
+			mpz_set (n0, n);
+		} else if (mpz_cmp (n, n0) != 0 || h.multiplier != h0.multiplier || h.fb_bound != h0.fb_bound || h.M != h0.M){
+			printf ("Skipping %s: it is from a different factorization.\n", files[i]);
+			munmap (maps[nmapped].base, maps[nmapped].len);
+			continue;
+		}
+		nmapped ++;
+	}
+	if (nmapped == 0){
+		printf ("No relation files to process.\n");
+		mpz_clears (n, n0, NULL);
+		return 0;
+	}
+
+	/* Set up the same factor base (and k) the relations were sieved with */
+	ns->multiplier = h0.multiplier;
+	ns->fb_bound = h0.fb_bound;
+	ns->lp_bound = h0.lp_bound / h0.fb_bound;	// set_params expects the multiple of fb_bound.
+	ns->M = h0.M;
+	ns->T = h0.T;
+	nsieve_init (ns, n0);
+	ns->nthreads = nthreads;
+	poly_gpool_t gpool;
+	gpool_init (&gpool, ns);
+	free (gpool.gpool);
+	free (gpool.frogs);
+
+	const uint32_t *bases[nmapped];
+	size_t lens[nmapped];
+	for (int i=0; i < nmapped; i++){
+		bases[i] = (const uint32_t *) maps[i].base;
+		lens[i] = maps[i].len;
+	}
+	matfile_maps_t mf = {bases, lens, nmapped};
+	if (import_from != NULL){
+		relref_t *refs;
+		long buildstart = clock();
+		int ok = matfile_import_index (ns, import_from, &mf, &refs);
+		ns->timing.sieve_time = 0;
+		ns->timing.filter_time = clock() - buildstart;	// rebuilding the rows; the solving was done elsewhere.
+		ns->timing.matsolve_time = 0;
+		if (ok){
+			uint64_t *deps = (uint64_t *) calloc (ns->nrows + 1, sizeof (uint64_t));
+			int ndeps = matfile_import_deps (ns, import_from, deps);
+			if (ndeps > 0) deduce_factors (ns, deps, ndeps);
+			free (deps);
+			for (uint32_t i=0; i < ns->nrows; i++){
+				free (ns->relns[i].cols);
+			}
+			free (refs);
+		}
+		for (int i=0; i < nmapped; i++){
+			munmap (maps[i].base, maps[i].len);
+		}
+		mpz_clears (n, n0, NULL);
+		ns->timing.total_time = clock() - start;
+		return ok;
+	}
+
+	long buildstart = clock();
+	reflist_t fulls = {NULL, 0, 0};
+	reflist_t partials = {NULL, 0, 0};
+	uint32_t orphans = 0;
+	for (int i=0; i < nmapped; i++){
+		index_relations (firsts[i], (const uint32_t *) ((char *) maps[i].base + maps[i].len), ns, &fulls, &partials, &orphans);
+	}
+	uint32_t ndups = drop_duplicates (&fulls, ns) + drop_duplicates (&partials, ns);
+	qsort (partials.refs, partials.n, sizeof (relref_t), by_cofactor);
+	printf ("Indexed %u full and %u partial relations from %d files (%u partials had no victim, %u duplicates were dropped).\n", fulls.n, partials.n, nmapped, orphans, ndups);
+
+	/* Make the matrix relations: the fulls first, then each partial combined with the first partial that
+	 * shares its cofactor, just like combine_bucket does. */
+	uint32_t nrows = 0;
+	for (uint32_t i=0; i < fulls.n && nrows < ns->rels_needed; i++){
+		ns->relns[nrows].f1 = &fulls.refs[i];
+		ns->relns[nrows].f2 = NULL;
+		nrows ++;
+	}
+	uint32_t base = 0;
+	for (uint32_t i=1; i < partials.n && nrows < ns->rels_needed; i++){
+		if (relref_cofactor (&partials.refs[i]) != relref_cofactor (&partials.refs[base])){
+			base = i;
+			continue;
+		}
+		ns->relns[nrows].f1 = &partials.refs[i];
+		ns->relns[nrows].f2 = &partials.refs[base];
+		nrows ++;
+	}
+	if (nrows < ns->rels_needed){
+		printf ("Only %u of the %u relations we wanted are available; trying anyway.\n", nrows, ns->rels_needed);
+	}
+	ns->nfull = nrows;
+	ns->nrows = nrows;
+	ns->ncols = ns->fb_len + 1;
+	for (uint32_t i=0; i < nrows; i++){
+		matrel_t *m = &ns->relns[i];
+		m->r1 = m->r2 = NULL;
+		m->weight = relref_fillcols (m->f1, &m->cols);
+		if (m->f2 != NULL){
+			uint32_t *c1 = m->cols;
+			uint32_t *c2;
+			uint32_t w2 = relref_fillcols (m->f2, &c2);
+			m->cols = (uint32_t *) malloc ((m->weight + w2 + 1) * sizeof (uint32_t));
+			m->weight = sparse_row_xor (m->cols, c1, m->weight, c2, w2);
+			free (c1);
+			free (c2);
+		}
+	}
+	filter (ns);
+	if (export_to != NULL){
+		matfile_export (ns, export_to, &mf);
+	} else {
+		merge (ns);
+	}
+	ns->timing.filter_time = clock() - buildstart;
+	ns->timing.sieve_time = 0;
+
+	if (export_to == NULL) solve_matrix (ns);
+
+	for (uint32_t i=0; i < ns->nrows; i++){
+		free (ns->relns[i].cols);
+	}
+	for (int i=0; i < nmapped; i++){
+		munmap (maps[i].base, maps[i].len);
+	}
+	free (fulls.refs);
+	free (partials.refs);
+	mpz_clears (n, n0, NULL);
+	ns->timing.total_time = clock() - start;
+	return 1;
+}
@@ -0,0 +1,26 @@
+#ifndef POSTPROC_H
+#define POSTPROC_H
+
+#include "common.h"
+#include "poly.h"
+
+/* Post-processing straight from relation files. The files are mapped into memory, and the matrix relations
+ * point into the mappings instead of at rel_t's, so nothing but the matrix itself (and a small index) needs
+ * to be allocated, however many relations the files hold. */
+
+typedef struct relref {
+	const uint32_t *rec;	// the relation's record in the mapping (see relfile.h for the layout)
+	const uint32_t *batch;	// the start of the batch it is in: k, then the gvals
+	const uint32_t *victim;	// the record of that batch's victim
+} relref_t;
+
+int  postprocess_files (nsieve_t *, const char **files, int nfiles, int nthreads, const char *export_to, const char *import_from);	// 0 if there was nothing to process
+
+uint32_t relref_fillcols    (const relref_t *, uint32_t **cols);	// the sparse row for the relation (and its victim)
+void     relref_multiply_in (mpz_t lhs, const relref_t *, const mpz_t ainv, nsieve_t *);	// ainv: A^-1 mod N
+void     relref_add_factors (uint16_t *table, const relref_t *);
+void     relref_get_a       (mpz_t a, const relref_t *, nsieve_t *);
+uint32_t relref_cofactor    (const relref_t *);
+void     relref_get_id      (const relref_t *, rel_id_t *, nsieve_t *);
+
+#endif
@@ -1,20 +1,56 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <gmp.h>
+#include "prime.h"
 
+/* Tests each number with BPSW (see prime.c). With a single number, prints a sentence, as before; with
+ * several (on the command line, or one per line on standard input), there's one line per number: the
+ * number, and prime, prp or composite. */
 int main (int argc, const char *argv[]){
-	mpz_t n;
-	mpz_init(n);
-	if (argc >= 2){
-		mpz_set_str(n, argv[1], 10);
-	} else {
-		mpz_inp_str(n, stdin, 10);
+	int nthreads = 1;
+	int count = 0;
+	int cap = 16;
+	mpz_t *n = (mpz_t *) malloc (cap * sizeof (mpz_t));
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-threads") && pos+1 < argc){
+			nthreads = atoi (argv[++pos]);
+			continue;
+		}
+		if (count == cap){
+			cap *= 2;
+			n = (mpz_t *) realloc (n, cap * sizeof (mpz_t));
+		}
+		mpz_init_set_str (n[count++], argv[pos], 10);
 	}
+	if (count == 0){
+		while (1){
+			if (count == cap){
+				cap *= 2;
+				n = (mpz_t *) realloc (n, cap * sizeof (mpz_t));
+			}
+			mpz_init (n[count]);
+			if (mpz_inp_str (n[count], stdin, 10) == 0){
+				mpz_clear (n[count]);
+				break;
+			}
+			count++;
+		}
+	}
+
+	char *prime = (char *) malloc (count + 1);
+	bpsw_batch (n, count, prime, nthreads);
 
-	if (mpz_probab_prime_p (n, 30)){
-		printf("N is probably prime\n");
-	} else {
-		printf("N is composite\n");
+	for (int i=0; i < count; i++){
+		if (count == 1){
+			printf (prime[i] == 2 ? "N is prime\n" : prime[i] ? "N is probably prime\n" : "N is composite\n");
+		} else {
+			mpz_out_str (stdout, 10, n[i]);
+			printf (prime[i] == 2 ? " prime\n" : prime[i] ? " prp\n" : " composite\n");
+		}
+		mpz_clear (n[i]);
 	}
-	mpz_clear(n);
+	free (prime);
+	free (n);
+	return 0;
 }
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "prime.h"
+
+/* The Baillie-PSW test: trial division by a few small primes, a strong probable prime test to base 2, and a
+ * strong Lucas probable prime test with Selfridge's parameters (the first D of 5, -7, 9, -11, ... with
+ * (D/n) = -1, P = 1 and Q = (1 - D) / 4). No composite passes both below 2^64 (it's been checked), so there
+ * it is exact, and none is known above. Below 2^64 it runs on native words with the Montgomery arithmetic
+ * of prime.h, which is about five times faster than mpz_probab_prime_p at that size. Above 2^64, GMP 6.2
+ * and later do this same test in mpz_probab_prime_p, as long as reps is at most 24 (beyond that, it adds
+ * reps - 24 rounds of Miller-Rabin), and faster than it can be done here with the mpz functions, so that's
+ * what is used. With an older GMP, which only does Miller-Rabin, the test is done here instead.
+ *
+ * For the Lucas part, only V is computed: V_{2k} = V_k^2 - 2 Q^k and V_{2k+1} = V_k V_{k+1} - P Q^k give
+ * V_d and V_{d+1} together, and D U_d = 2 V_{d+1} - P V_d, so with (D/n) = -1, U_d = 0 mod n exactly when
+ * 2 V_{d+1} = V_d. That saves the halvings mod n that the U, V ladder needs.
+*/
+
+#define PRIME_TDIV_MAX 97	// trial division by the odd primes up to this
+
+static const uint32_t small_primes[] = {3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67,
+	71, 73, 79, 83, 89, 97};
+#define NSMALL_PRIMES (int) (sizeof (small_primes) / sizeof (small_primes[0]))
+
+/* The Jacobi symbol (a/n), for odd n */
+static int jacobi64 (int64_t a, uint64_t n){
+	int t = 1;
+	uint64_t x = (a < 0 ? (uint64_t) -a : (uint64_t) a) % n;
+	if (a < 0 && n % 4 == 3) t = -t;	// (-1/n)
+	while (x != 0){
+		while (x % 2 == 0){
+			x /= 2;
+			if (n % 8 == 3 || n % 8 == 5) t = -t;
+		}
+		uint64_t tmp = x;
+		x = n;
+		n = tmp;
+		if (x % 4 == 3 && n % 4 == 3) t = -t;
+		x %= n;
+	}
+	return n == 1 ? t : 0;
+}
+
+static int square64 (uint64_t n){
+	uint64_t r = (uint64_t) 1 << ((65 - __builtin_clzll (n)) / 2);	// at least sqrt (n); Newton goes down from there
+	while (1){
+		uint64_t y = (r + n / r) / 2;
+		if (y >= r) break;
+		r = y;
+	}
+	return r * r == n;
+}
+
+static inline uint64_t addmod (uint64_t a, uint64_t b, uint64_t n){
+	return a >= n - b ? a - (n - b) : a + b;
+}
+
+static inline uint64_t submod (uint64_t a, uint64_t b, uint64_t n){
+	return a >= b ? a - b : a - b + n;
+}
+
+#define MUL(a, b) redc ((u128) (a) * (b), n, ninv)
+
+/* n odd, above PRIME_TDIV_MAX and free of the small primes */
+static int bpsw64 (uint64_t n){
+	uint64_t ninv = inv64 (n);
+	uint64_t one = -n % n;		// R mod n
+	uint64_t mone = n - one;	// -1
+
+	// strong base 2: 2^d = 1, or 2^(d 2^r) = -1 for some r < s
+	uint64_t d = n - 1;
+	int s = __builtin_ctzll (d);
+	d >>= s;
+	uint64_t x = one;
+	uint64_t b = addmod (one, one, n);
+	for (uint64_t e = d; e != 0; e >>= 1){
+		if (e & 1) x = MUL (x, b);
+		b = MUL (b, b);
+	}
+	if (x != one && x != mone){
+		int r;
+		for (r=1; r < s; r++){
+			x = MUL (x, x);
+			if (x == mone) break;
+		}
+		if (r >= s) return 0;
+	}
+
+	// strong Lucas
+	if (square64 (n)) return 0;	// (D/n) is never -1 for a square.
+	int64_t D = 5;
+	while (1){
+		int j = jacobi64 (D, n);
+		if (j == -1) break;
+		if (j == 0 && (uint64_t) (D < 0 ? -D : D) != n) return 0;
+		D = D < 0 ? -D + 2 : -D - 2;
+	}
+	int64_t Q = (1 - D) / 4;
+	uint64_t q = Q < 0 ? n - (uint64_t) -Q % n : (uint64_t) Q % n;
+	q = ((u128) q << 64) % n;	// to Montgomery form
+	d = n + 1;		// n < 2^64 - 1, since that's divisible by 3
+	s = __builtin_ctzll (d);
+	d >>= s;
+	uint64_t v = addmod (one, one, n), v1 = one, qk = one;	// V_0 = 2, V_1 = P = 1, Q^0
+	for (int bit = 63 - __builtin_clzll (d); bit >= 0; bit--){
+		uint64_t vv1 = submod (MUL (v, v1), qk, n);	// V_{2k+1}
+		if ((d >> bit) & 1){
+			uint64_t qk1 = MUL (qk, q);
+			v1 = submod (MUL (v1, v1), addmod (qk1, qk1, n), n);
+			v = vv1;
+			qk = MUL (qk1, qk);
+		} else {
+			v = submod (MUL (v, v), addmod (qk, qk, n), n);
+			v1 = vv1;
+			qk = MUL (qk, qk);
+		}
+	}
+	if (addmod (v1, v1, n) == v || v == 0) return 1;	// U_d = 0, or V_d = 0
+	for (int r=1; r < s; r++){
+		v = submod (MUL (v, v), addmod (qk, qk, n), n);
+		if (v == 0) return 1;
+		qk = MUL (qk, qk);
+	}
+	return 0;
+}
+
+int prime64_p (uint64_t n){
+	if (n < 2) return 0;
+	if (n % 2 == 0) return n == 2;
+	for (int i=0; i < NSMALL_PRIMES; i++){
+		if (n % small_primes[i] == 0) return n == small_primes[i];
+	}
+	if (n < PRIME_TDIV_MAX * PRIME_TDIV_MAX) return 1;
+	return bpsw64 (n);
+}
+
+#if __GNU_MP_RELEASE < 60200
+/* v = v w - c mod n */
+static void lucas_step (mpz_t v, mpz_t w, mpz_t c, mpz_srcptr n){
+	mpz_mul (v, v, w);
+	mpz_sub (v, v, c);
+	mpz_mod (v, v, n);
+}
+
+static int bpsw_mpz (mpz_srcptr n){
+	if (mpz_even_p (n)) return 0;
+	for (int i=0; i < NSMALL_PRIMES; i++){
+		if (mpz_divisible_ui_p (n, small_primes[i])) return 0;
+	}
+
+	mpz_t d, x, nm1, v, v1, qk, t;
+	mpz_inits (d, x, nm1, v, v1, qk, t, NULL);
+	int res = 0;
+
+	// strong base 2
+	mpz_sub_ui (nm1, n, 1);
+	mp_bitcnt_t s = mpz_scan1 (nm1, 0);
+	mpz_tdiv_q_2exp (d, nm1, s);
+	mpz_set_ui (x, 2);
+	mpz_powm (x, x, d, n);
+	if (mpz_cmp_ui (x, 1) != 0 && mpz_cmp (x, nm1) != 0){
+		mp_bitcnt_t r;
+		for (r=1; r < s; r++){
+			mpz_powm_ui (x, x, 2, n);
+			if (mpz_cmp (x, nm1) == 0) break;
+		}
+		if (r >= s) goto done;
+	}
+
+	// strong Lucas, as in bpsw64
+	if (mpz_perfect_square_p (n)) goto done;
+	long D = 5;
+	while (1){
+		int j = mpz_si_kronecker (D, n);
+		if (j == -1) break;
+		if (j == 0) goto done;	// n is too big to be |D|.
+		D = D < 0 ? -D + 2 : -D - 2;
+	}
+	long Q = (1 - D) / 4;
+	mpz_add_ui (d, n, 1);
+	s = mpz_scan1 (d, 0);
+	mpz_tdiv_q_2exp (d, d, s);
+	mpz_set_ui (v, 2);
+	mpz_set_ui (v1, 1);
+	mpz_set_ui (qk, 1);
+	for (long bit = mpz_sizeinbase (d, 2) - 1; bit >= 0; bit--){
+		if (mpz_tstbit (d, bit)){
+			lucas_step (v, v1, qk, n);	// V_{2k+1}
+			mpz_mul_si (t, qk, Q);
+			mpz_mod (t, t, n);		// Q^(k+1)
+			mpz_mul (qk, qk, t);
+			mpz_mod (qk, qk, n);
+			mpz_mul_2exp (t, t, 1);
+			lucas_step (v1, v1, t, n);	// V_{2k+2}
+		} else {
+			lucas_step (v1, v, qk, n);
+			mpz_mul_2exp (t, qk, 1);
+			lucas_step (v, v, t, n);
+			mpz_mul (qk, qk, qk);
+			mpz_mod (qk, qk, n);
+		}
+	}
+	mpz_mul_2exp (t, v1, 1);
+	mpz_sub (t, t, v);
+	if (mpz_divisible_p (t, n) || mpz_sgn (v) == 0){
+		res = 1;
+		goto done;
+	}
+	for (mp_bitcnt_t r=1; r < s; r++){
+		mpz_mul_2exp (t, qk, 1);
+		lucas_step (v, v, t, n);
+		if (mpz_sgn (v) == 0){
+			res = 1;
+			break;
+		}
+		mpz_mul (qk, qk, qk);
+		mpz_mod (qk, qk, n);
+	}
+
+done:
+	mpz_clears (d, x, nm1, v, v1, qk, t, NULL);
+	return res;
+}
+#else
+#define bpsw_mpz(n) (mpz_probab_prime_p ((mpz_ptr) n, 24) != 0)
+#endif
+
+int bpsw_prime_p (mpz_srcptr n){
+	if (mpz_sgn (n) <= 0) return 0;
+	if (mpz_sizeinbase (n, 2) <= 64){
+		uint64_t n64 = 0;
+		mpz_export (&n64, NULL, -1, sizeof (uint64_t), 0, 0, n);
+		return 2 * prime64_p (n64);
+	}
+	return bpsw_mpz (n);
+}
+
+typedef struct {
+	mpz_t *n;
+	char *prime;
+	int count;
+	int first;
+	int step;
+} prime_batch_t;
+
+static void *bpsw_thread (void *arg){
+	prime_batch_t *b = (prime_batch_t *) arg;
+	for (int i = b->first; i < b->count; i += b->step){
+		b->prime[i] = bpsw_prime_p (b->n[i]);
+	}
+	return NULL;
+}
+
+void bpsw_batch (mpz_t *n, int count, char *prime, int nthreads){
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > count) nthreads = count;
+	if (nthreads <= 1){
+		for (int i=0; i < count; i++){
+			prime[i] = bpsw_prime_p (n[i]);
+		}
+		return;
+	}
+	pthread_t threads[nthreads];
+	prime_batch_t b[nthreads];
+	for (int t=0; t < nthreads; t++){
+		b[t] = (prime_batch_t) {n, prime, count, t, nthreads};
+		pthread_create (&threads[t], NULL, bpsw_thread, &b[t]);
+	}
+	for (int t=0; t < nthreads; t++){
+		pthread_join (threads[t], NULL);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef PRIME_H
+#define PRIME_H
+
+#include <stdint.h>
+#include <gmp.h>
+
+/* Primality testing with BPSW, natively below 2^64. See prime.c. */
+
+int prime64_p (uint64_t n);	// 1 if n is prime, 0 if not; exact for all n
+int bpsw_prime_p (mpz_srcptr n);	// as mpz_probab_prime_p: 2 if n is prime, 1 if it's probably prime, 0 if not
+void bpsw_batch (mpz_t *n, int count, char *prime, int nthreads);	// prime[i] = bpsw_prime_p (n[i]), on nthreads threads
+
+/* Montgomery arithmetic on 64-bit words (here and in small.c): numbers mod an odd n are kept as x R mod n,
+ * with R = 2^64. */
+
+__extension__ typedef unsigned __int128 u128;
+
+/* n^-1 mod 2^64, for odd n */
+static inline uint64_t inv64 (uint64_t n){
+	uint64_t x = n;		// right to 3 bits; each step doubles that
+	for (int i=0; i < 5; i++){
+		x *= 2 - n * x;
+	}
+	return x;
+}
+
+/* t R^-1 mod n, for t < n R. This is the subtractive REDC, with n^-1 rather than -n^-1: t - m n has a low
+ * word of zero, so its high word is t_hi - (m n)_hi, adding n back if that went negative, and that can't
+ * overflow for any odd n. */
+static inline uint64_t redc (u128 t, uint64_t n, uint64_t ninv){
+	uint64_t m = (uint64_t) t * ninv;
+	uint64_t mh = ((u128) m * n) >> 64;
+	uint64_t th = t >> 64;
+	return th >= mh ? th - mh : th - mh + n;
+}
+
+#endif
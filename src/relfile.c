@@ -0,0 +1,141 @@
+#include "relfile.h"
+
+/* Write the header of a relation file. The N stored is the one the user asked us to factor; the
+ * multiplier is recorded separately, so a reader can reproduce the same factor base. */
+void relfile_write_header (FILE *f, nsieve_t *ns){
+	mpz_t n;
+	mpz_init (n);
+	mpz_divexact_ui (n, ns->N, ns->multiplier);
+	char *digits = mpz_get_str (NULL, 10, n);
+
+	relfile_header_t h;
+	h.magic = RELFILE_MAGIC;
+	h.version = RELFILE_VERSION;
+	h.multiplier = ns->multiplier;
+	h.fb_bound = ns->fb_bound;
+	h.lp_bound = ns->lp_bound;
+	h.M = ns->M;
+	h.T = ns->T;
+	h.nlen = strlen (digits);
+	fwrite (&h, sizeof(h), 1, f);
+	fwrite (digits, 1, h.nlen, f);
+	const char pad[4] = {0, 0, 0, 0};
+	fwrite (pad, 1, (4 - h.nlen % 4) % 4, f);
+
+	free (digits);
+	mpz_clear (n);
+}
+
+int relfile_read_header (FILE *f, relfile_header_t *h, mpz_t n){
+	if (fread (h, sizeof(relfile_header_t), 1, f) != 1) return 0;
+	if (h->magic != RELFILE_MAGIC || h->version != RELFILE_VERSION) return 0;
+	uint32_t padded = h->nlen + (4 - h->nlen % 4) % 4;
+	char *digits = (char *) calloc (padded + 1, 1);
+	if (fread (digits, 1, padded, f) != padded){
+		free (digits);
+		return 0;
+	}
+	int ok = (mpz_set_str (n, digits, 10) == 0);
+	free (digits);
+	return ok;
+}
+
+/* Write out all of the relations stored in a polygroup. This must happen before add_polygroup_relations,
+ * which glues the victim's factors onto the end of everyone else's list. */
+void relfile_write_batch (FILE *f, poly_group_t *pg, nsieve_t *ns){
+	uint32_t k = ns->k;
+	fwrite (&k, 4, 1, f);
+	fwrite (pg->gvals, 4, k, f);
+	fwrite (&pg->nrels, 4, 1, f);
+	for (int i=0; i < pg->nrels; i++){
+		rel_t *rel = pg->relns[i];
+		uint16_t rec[2];
+		rec[0] = pg->bmasks[rel->poly->bidx];
+		rec[1] = 0;
+		for (fl_entry_t *e = rel->factors; e != NULL; e = e->next){
+			rec[1] ++;
+		}
+		fwrite (&rel->x, 4, 1, f);
+		fwrite (&rel->cofactor, 4, 1, f);
+		fwrite (rec, 2, 2, f);
+		for (fl_entry_t *e = rel->factors; e != NULL; e = e->next){
+			fwrite (&e->fac, 4, 1, f);
+		}
+	}
+}
+
+/* Free what relfile_read_batch had read of a batch before it turned out to be bad. */
+static void free_partial_batch (poly_group_t *pg, poly_t **polys, int nbvals){
+	for (int i=0; i < pg->nrels; i++){
+		rel_free (pg->relns[i]);
+	}
+	pg->nrels = 0;
+	for (int i=0; i < nbvals; i++){
+		if (polys[i] != NULL){
+			poly_free (polys[i]);
+			free (polys[i]);
+		}
+	}
+}
+
+/* Read the next batch into 'pg', which must have been initialized with polygroup_init. A and the b values
+ * are recomputed from the gvals; a poly_t is made for each b value that has relations. The relations
+ * are put in pg->relns exactly as the sieve would have left them, ready for add_polygroup_relations. On a
+ * bad batch, returns 0 with nothing of it left allocated but what polygroup_free frees. */
+int relfile_read_batch (FILE *f, poly_group_t *pg, nsieve_t *ns){
+	uint32_t k, nrels;
+	if (fread (&k, 4, 1, f) != 1) return 0;
+	if (k != ns->k || k > KMAX){
+		printf ("Relation file batch has k = %d, but we are using k = %d.\n", k, ns->k);
+		return 0;
+	}
+	if (fread (pg->gvals, 4, k, f) != k || fread (&nrels, 4, 1, f) != 1 || nrels > PG_REL_STORAGE){
+		printf ("Truncated or corrupt relation file batch.\n");
+		return 0;
+	}
+	polygroup_compute_coeffs (pg, ns);
+	int bidx[1 << k];	// maps each bmask back to the index of its b value
+	for (int i=0; i < (1 << k); i++){
+		bidx[i] = -1;
+	}
+	for (int i=0; i < ns->bvals; i++){
+		bidx[pg->bmasks[i]] = i;
+	}
+
+	poly_t *polys[ns->bvals];
+	memset (polys, 0, sizeof(polys));
+	pg->nrels = 0;
+	for (int i=0; i < nrels; i++){
+		int32_t x;
+		uint32_t cofactor;
+		uint16_t rec[2];
+		if (fread (&x, 4, 1, f) != 1 || fread (&cofactor, 4, 1, f) != 1 || fread (rec, 2, 2, f) != 2 || rec[0] >= (1 << k) || bidx[rec[0]] < 0){
+			printf ("Truncated or corrupt relation file batch.\n");
+			free_partial_batch (pg, polys, ns->bvals);
+			return 0;
+		}
+		int b = bidx[rec[0]];
+		if (polys[b] == NULL){
+			polys[b] = (poly_t *) malloc (sizeof (poly_t));
+			poly_init (polys[b]);
+			poly_set_coeffs (polys[b], pg, ns, b);
+		}
+		rel_t *rel = (rel_t *) malloc (sizeof (rel_t));
+		rel->poly = polys[b];
+		rel->x = x;
+		rel->cofactor = cofactor;
+		rel->factors = NULL;
+		for (int j=0; j < rec[1]; j++){
+			uint32_t fac;
+			if (fread (&fac, 4, 1, f) != 1){
+				printf ("Truncated or corrupt relation file batch.\n");
+				rel_free (rel);
+				free_partial_batch (pg, polys, ns->bvals);
+				return 0;
+			}
+			fl_add (rel, fac);
+		}
+		pg->relns[pg->nrels ++] = rel;
+	}
+	return 1;
+}
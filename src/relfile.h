@@ -0,0 +1,41 @@
+#ifndef RELFILE_H
+#define RELFILE_H
+
+#include "common.h"
+#include "poly.h"
+
+/* Relation files hold the output of the sieve in a compact binary form, so that relations can be shipped
+ * between processes (see dist.c) or kept on disk for later processing. A file is a header followed by any
+ * number of polygroup batches:
+ *
+ * 	header:	relfile_header_t, then the decimal digits of N (without the multiplier), zero-padded to a
+ * 		multiple of 4 bytes.
+ * 	batch:	uint32 k, uint32 gvals[k], uint32 nrels, then nrels relation records.
+ * 	record:	int32 x, uint32 cofactor, uint16 bmask, uint16 nfac, uint32 fac[nfac].
+ *
+ * Everything is 4-byte aligned and in host byte order. 'fac' holds matrix positions (factor base index + 1,
+ * and 0 for -1), exactly as in the factor list of a rel_t. 'bmask' identifies the polynomial's B by which
+ * square root of N was used mod each g (see poly_group_t), so B can be recomputed from the gvals alone.
+ * The victim is not marked; whoever reads a batch picks it the same way add_polygroup_relations does.
+*/
+
+#define RELFILE_MAGIC   0x4c52534e	// "NSRL"
+#define RELFILE_VERSION 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t multiplier;
+	uint32_t fb_bound;
+	uint32_t lp_bound;	// the actual bound, not the multiple of fb_bound given with -lpb.
+	uint32_t M;
+	float    T;
+	uint32_t nlen;		// number of digits of N that follow the header (before padding).
+} relfile_header_t;
+
+void relfile_write_header (FILE *, nsieve_t *);
+int  relfile_read_header  (FILE *, relfile_header_t *, mpz_t n);	// returns 0 if this is not a relation file.
+void relfile_write_batch  (FILE *, poly_group_t *, nsieve_t *);
+int  relfile_read_batch   (FILE *, poly_group_t *, nsieve_t *);	// returns 0 at the end of the file.
+
+#endif
@@ -1,20 +1,30 @@
+#include <stdlib.h>
+#include <string.h>
 #include "rho.h"
 
 int main (int argc, const char *argv[]){
 	mpz_t n;
 	mpz_init (n);
-	if (argc >= 2){
-		mpz_set_str (n, argv[1], 10);
-	} else {
+	int nspecd = 0;
+	int nthreads = 1;
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-threads") && pos+1 < argc){
+			nthreads = atoi (argv[++pos]);
+		} else {
+			mpz_set_str (n, argv[pos], 10);
+			nspecd = 1;
+		}
+	}
+	if (!nspecd){
 		mpz_inp_str (n, stdin, 10);
 	}
 	tdiv (n, 5000);
-	if (mpz_probab_prime_p (n, 14)){
+	if (bpsw_prime_p (n)){
 		mpz_out_str (stdout, 10, n);
 		printf("\n");
 		return 0;
 	}
-	rho  (n, 0xffffffff, 1);
+	rho  (n, 0xffffffff, 1, nthreads);
 	mpz_clear (n);
 }
 
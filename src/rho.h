@@ -3,8 +3,11 @@
 
 #include <stdio.h>
 #include <gmp.h>
+#include "prime.h"
 
-void tdiv (mpz_t, int);
-void rho  (mpz_t, unsigned int, int);
+void tdiv (mpz_t, int bound);	// divides out and prints the prime factors up to bound
+void tdiv_batch (mpz_t *n, int count, int bound, unsigned long **factors, int *nfactors);	// divides them out of each n[i], and returns them in malloc'd factors[i]
+void rho  (mpz_t, unsigned int steps, int printrem, int nthreads);	// several walks at once on nthreads threads
+int  rho_find (mpz_t factor, mpz_t n, unsigned int steps, int nthreads);	// one factor of the odd composite n, without printing; 0 if none
 
 #endif
@@ -1,69 +1,502 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "rho.h"
 
-void tdiv (mpz_t n, int bound){
-	while (mpz_divisible_ui_p (n, 2)){
-		mpz_divexact_ui (n, n, 2);
-		printf("2\n");
-	}
-	long t = 3;
-	while (t < bound){
-		while (mpz_divisible_ui_p (n, t)){
-			mpz_divexact_ui (n, n, t);
-			printf("%ld\n", t);
+/* Trial division, all at once. Rather than trying every prime up to the bound in turn, we keep the product P
+ * of all of them (in a product tree: the primes at the bottom, and the products of pairs of nodes on each
+ * level above, up to P at the top), and take g = gcd (n, P), which is the product of the primes that divide n.
+ * Usually that's 1 and we're done; otherwise we go down the tree from the top, splitting g into gcd (g, left)
+ * and g / gcd (g, left) at each node, only into the subtrees where that isn't 1, which gets us to the
+ * primes that divide n without looking at any of the others. Then we divide each one out as often as it goes.
+ *
+ * The tree for each bound is built once and kept. With a batch of numbers, we multiply them together into
+ * another product tree, reduce P mod the product at the top of that one and then down the tree (a remainder
+ * tree), which gives P mod n for every n for about the cost of doing it for one big number, and the gcds
+ * are then with those small remainders instead of with P itself.
+*/
+
+/* A product tree: level 0 has the leaves, and each level above has the products of pairs from the one below
+ * (the last of an odd number of them goes up as it is), up to the product of all of them. */
+typedef struct {
+	int nlevels;
+	uint32_t *len;
+	mpz_t **level;
+} ptree_t;
+
+static void ptree_build (ptree_t *t, mpz_t *leaves, uint32_t count){
+	t->nlevels = 1;
+	while ((1u << (t->nlevels - 1)) < count) t->nlevels++;
+	t->len = (uint32_t *) malloc (t->nlevels * sizeof (uint32_t));
+	t->level = (mpz_t **) malloc (t->nlevels * sizeof (mpz_t *));
+	t->len[0] = count;
+	t->level[0] = (mpz_t *) malloc (count * sizeof (mpz_t));
+	for (uint32_t i=0; i < count; i++){
+		mpz_init_set (t->level[0][i], leaves[i]);
+	}
+	for (int l=1; l < t->nlevels; l++){
+		uint32_t len = (t->len[l-1] + 1) / 2;
+		t->len[l] = len;
+		t->level[l] = (mpz_t *) malloc (len * sizeof (mpz_t));
+		for (uint32_t i=0; i < len; i++){
+			mpz_init_set (t->level[l][i], t->level[l-1][2*i]);
+			if (2*i + 1 < t->len[l-1]) mpz_mul (t->level[l][i], t->level[l][i], t->level[l-1][2*i + 1]);
 		}
-		t += 2;
 	}
 }
 
-#define GCD_BLOCK_SIZE 128
+static void ptree_free (ptree_t *t){
+	for (int l=0; l < t->nlevels; l++){
+		for (uint32_t i=0; i < t->len[l]; i++){
+			mpz_clear (t->level[l][i]);
+		}
+		free (t->level[l]);
+	}
+	free (t->level);
+	free (t->len);
+}
 
-void rho (mpz_t n, unsigned int steps, int printrem){	// printrem controls whether a composite cofactor is printed.
-	mpz_t x, y, g, temp;
-	mpz_inits (x, y, g, temp, NULL);
-	mpz_set_ui (x, 2);
-	mpz_set_ui (y, 2);
+/* rem[i] = x mod (leaf i) for every leaf, going down the tree */
+static void ptree_mod (ptree_t *t, mpz_t x, mpz_t *rem){
+	uint32_t n = t->len[0];
+	mpz_t *up = (mpz_t *) malloc (n * sizeof (mpz_t));
+	for (uint32_t i=0; i < n; i++){
+		mpz_init (up[i]);
+	}
+	mpz_mod (up[0], x, t->level[t->nlevels - 1][0]);
+	for (int l = t->nlevels - 2; l >= 0; l--){
+		for (uint32_t i = t->len[l]; i-- > 0; ){	// from the end, so that up[i/2] is still the parent's
+			mpz_mod (rem[i], up[i/2], t->level[l][i]);
+		}
+		for (uint32_t i=0; i < t->len[l]; i++){
+			mpz_swap (up[i], rem[i]);
+		}
+	}
+	for (uint32_t i=0; i < n; i++){
+		mpz_swap (rem[i], up[i]);
+		mpz_clear (up[i]);
+	}
+	free (up);
+}
 
-	int ct = 0;
-	while (ct < steps){
-		mpz_set_ui (g, 1);
-		for (int i=0; i < GCD_BLOCK_SIZE; i++){
-			mpz_mul    (temp, x, x);
-			mpz_add_ui (temp, temp, 1);
-			mpz_mod    (x, temp, n);
+/* The primes up to each bound used so far, in a product tree */
+typedef struct tdiv_table {
+	int bound;
+	ptree_t tree;
+	struct tdiv_table *next;
+} tdiv_table_t;
 
-			mpz_mul	   (temp, y, y);
-			mpz_add_ui (temp, temp, 1);
-			mpz_mul    (y, temp, temp);
-			mpz_add_ui (temp, y, 1);
-			mpz_mod    (y, temp, n);
+static tdiv_table_t *tdiv_tables = NULL;	// once built, a table never changes, so only the list needs the lock.
+static pthread_mutex_t tdiv_tables_lock = PTHREAD_MUTEX_INITIALIZER;
 
-			mpz_sub    (temp, x, y);
-			mpz_mul    (g, g, temp);
-			mpz_mod    (g, g, n);
+static tdiv_table_t *tdiv_get_table (int bound){
+	pthread_mutex_lock (&tdiv_tables_lock);
+	tdiv_table_t *t = tdiv_tables;
+	while (t != NULL && t->bound != bound){
+		t = t->next;
+	}
+	if (t == NULL){
+		uint8_t *composite = (uint8_t *) calloc (bound + 1, 1);
+		mpz_t *primes = (mpz_t *) malloc ((bound / 2 + 1) * sizeof (mpz_t));
+		uint32_t nprimes = 0;
+		for (uint64_t i=2; i <= bound; i++){
+			if (composite[i]) continue;
+			mpz_init_set_ui (primes[nprimes++], i);
+			for (uint64_t j = i*i; j <= bound; j += i){
+				composite[j] = 1;
+			}
 		}
-		mpz_gcd (g, g, n);
-		if (mpz_cmp_ui (g, 1) != 0){
-			// found a factor
-			if (mpz_probab_prime_p (g, 12)){	// a prime one!
-				mpz_out_str (stdout, 10, g);
-				printf("\n");
-				mpz_divexact (n, n, g);
-			} else {
-				mpz_out_str (stdout, 10, g);
-				printf (" (composite)\n");
-				mpz_divexact (n, n, g);
+		t = (tdiv_table_t *) malloc (sizeof (tdiv_table_t));
+		t->bound = bound;
+		ptree_build (&t->tree, primes, nprimes);
+		for (uint32_t i=0; i < nprimes; i++){
+			mpz_clear (primes[i]);
+		}
+		free (primes);
+		free (composite);
+		t->next = tdiv_tables;
+		tdiv_tables = t;
+	}
+	pthread_mutex_unlock (&tdiv_tables_lock);
+	return t;
+}
+
+typedef struct {
+	unsigned long *f;
+	int len;
+	int cap;
+} tdiv_list_t;
+
+/* g divides the node j of level l of the primes' tree and is squarefree; divide the primes in it out of n. */
+static void tdiv_descend (ptree_t *t, int l, uint32_t j, mpz_t g, mpz_t n, tdiv_list_t *out){
+	if (mpz_cmp_ui (g, 1) == 0) return;
+	if (l == 0){
+		unsigned long p = mpz_get_ui (t->level[0][j]);
+		while (mpz_divisible_ui_p (n, p)){
+			mpz_divexact_ui (n, n, p);
+			if (out->len == out->cap){
+				out->cap = out->cap == 0 ? 16 : 2 * out->cap;
+				out->f = (unsigned long *) realloc (out->f, out->cap * sizeof (unsigned long));
 			}
-			if (mpz_cmp_ui (n, 1) == 0){
-				mpz_clears (x, y, g, temp, NULL);
-				return;
+			out->f[out->len ++] = p;
+		}
+		return;
+	}
+	if (2*j + 1 >= t->len[l-1]){	// carried up from the level below as it is
+		tdiv_descend (t, l-1, 2*j, g, n, out);
+		return;
+	}
+	mpz_t gl, gr;
+	mpz_init (gl);
+	mpz_init (gr);
+	mpz_gcd (gl, g, t->level[l-1][2*j]);
+	mpz_divexact (gr, g, gl);
+	tdiv_descend (t, l-1, 2*j, gl, n, out);
+	tdiv_descend (t, l-1, 2*j + 1, gr, n, out);
+	mpz_clear (gl);
+	mpz_clear (gr);
+}
+
+void tdiv_batch (mpz_t *n, int count, int bound, unsigned long **factors, int *nfactors){
+	for (int i=0; i < count; i++){
+		factors[i] = NULL;
+		nfactors[i] = 0;
+	}
+	if (bound < 2 || count < 1) return;
+	ptree_t *primes = &tdiv_get_table (bound)->tree;
+	mpz_t *root = &primes->level[primes->nlevels - 1][0];
+
+	/* P mod each n, by the remainder tree over the n's */
+	mpz_t *rem = (mpz_t *) malloc (count * sizeof (mpz_t));
+	for (int i=0; i < count; i++){
+		mpz_init (rem[i]);
+		mpz_abs (rem[i], n[i]);
+		if (mpz_sgn (rem[i]) == 0) mpz_set_ui (rem[i], 1);	// every prime divides 0; leave it be.
+	}
+	ptree_t nt;
+	ptree_build (&nt, rem, count);
+	ptree_mod (&nt, *root, rem);
+	ptree_free (&nt);
+
+	for (int i=0; i < count; i++){
+		if (mpz_sgn (n[i]) != 0){
+			tdiv_list_t out = {NULL, 0, 0};
+			mpz_gcd (rem[i], rem[i], n[i]);	// the product of the primes that divide n
+			tdiv_descend (primes, primes->nlevels - 1, 0, rem[i], n[i], &out);
+			factors[i] = out.f;
+			nfactors[i] = out.len;
+		}
+		mpz_clear (rem[i]);
+	}
+	free (rem);
+}
+
+void tdiv (mpz_t n, int bound){
+	mpz_t one[1];
+	unsigned long *f;
+	int nf;
+	mpz_init (one[0]);
+	mpz_swap (one[0], n);
+	tdiv_batch (one, 1, bound, &f, &nf);
+	mpz_swap (one[0], n);
+	mpz_clear (one[0]);
+	for (int i=0; i < nf; i++){
+		printf ("%lu\n", f[i]);
+	}
+	free (f);
+}
+
+/* Pollard rho, with Brent's cycle finding: instead of walking x and y = f(f(x)) side by side (three
+ * multiplications per step, plus the one for the product), y walks ahead in stretches of r = 1, 2, 4, ...
+ * steps while x waits at the start of each stretch, which takes one squaring per step and finds the
+ * cycle just as surely. The differences x - y are multiplied together and only every GCD_BLOCK_SIZE steps
+ * is there a gcd with n; if that overshoots (the product is 0 mod n, because both factors turned up in
+ * the same block), we go back to the start of the block and take the gcds one step at a time.
+ *
+ * All of the arithmetic is Montgomery's: with R = 2^(64 * limbs of n), each squaring is done on x*R mod n,
+ * and the reduction by n is a multiplication instead of a division. We never convert back, since the walk
+ * only needs to be a pseudo-random map mod n, and R is prime to n, so it doesn't change any gcd. Numbers
+ * below 2^63 get a version on native words; bigger ones work on GMP's limbs directly (the mpn layer).
+ *
+ * Several walks with different constants c in f(x) = x^2 + c can run at once on different threads; the
+ * first one to find a factor stops all of the others.
+*/
+
+#define GCD_BLOCK_SIZE 128	// steps between gcds
+#define RHO_MAX_THREADS 64
+
+__extension__ typedef unsigned __int128 u128;
+
+/* Shared between the walks */
+typedef struct {
+	mpz_srcptr n;
+	uint64_t steps;		// how far each thread's walks may go, together
+	pthread_mutex_t lock;
+	volatile int stop;	// set once a factor is found
+	mpz_t factor;
+	int next_c;		// the constant for the next walk to start
+} rho_job_t;
+
+/* A walk found g; keep it if it is the first. */
+static void rho_found (rho_job_t *job, mpz_t g){
+	pthread_mutex_lock (&job->lock);
+	if (!job->stop){
+		mpz_set (job->factor, g);
+		job->stop = 1;
+	}
+	pthread_mutex_unlock (&job->lock);
+}
+
+/* -1/n mod 2^64, for odd n */
+static uint64_t neg_inv64 (uint64_t n){
+	uint64_t x = n;		// right to 3 bits; each step doubles that
+	for (int i=0; i < 5; i++){
+		x *= 2 - n * x;
+	}
+	return -x;
+}
+
+/* t * R^-1 (mod n), for t < n^2 and n < 2^63 */
+static inline uint64_t redc64 (u128 t, uint64_t n, uint64_t ninv){
+	uint64_t m = (uint64_t) t * ninv;
+	uint64_t r = (t + (u128) m * n) >> 64;
+	return r >= n ? r - n : r;
+}
+
+static uint64_t gcd64 (uint64_t a, uint64_t b){
+	while (b != 0){
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+#define F64(y) do { y = redc64 ((u128) y * y, n, ninv) + c; if (y >= n) y -= n; } while (0)
+#define ABSDIFF(a, b) ((a) > (b) ? (a) - (b) : (b) - (a))
+
+static uint64_t rho_walk_64 (rho_job_t *job, uint64_t c, uint64_t steps){
+	uint64_t n = mpz_getlimbn (job->n, 0);
+	uint64_t ninv = neg_inv64 (n);
+	uint64_t y = 2 % n, x = y, ys = y, q = 1, g = 1;
+	uint64_t r = 1, done = 0;
+	c %= n;
+	do {
+		x = y;
+		for (uint64_t i=0; i < r; i++){
+			F64 (y);
+		}
+		done += r;
+		uint64_t k = 0;
+		do {
+			ys = y;
+			uint64_t lim = r - k < GCD_BLOCK_SIZE ? r - k : GCD_BLOCK_SIZE;
+			for (uint64_t i=0; i < lim; i++){
+				F64 (y);
+				q = redc64 ((u128) q * ABSDIFF (x, y), n, ninv);
 			}
-			if (mpz_probab_prime_p (n, 12)){
-				mpz_out_str (stdout, 10, n);
-				printf ("\n");
-				mpz_clears (x, y, g, temp, NULL);
-				return;
+			g = gcd64 (q, n);
+			k += lim;
+			done += lim;
+		} while (k < r && g == 1 && !job->stop);
+		r *= 2;
+	} while (g == 1 && done < steps && !job->stop);
+
+	if (g == n){	// overshot; redo the last block a step at a time.
+		do {
+			F64 (ys);
+			g = gcd64 (ABSDIFF (x, ys), n);
+		} while (g == 1);
+	}
+	if (g != 1 && g != n){
+		mpz_t f;
+		mpz_init_set_ui (f, g);
+		rho_found (job, f);
+		mpz_clear (f);
+	}
+	return done;
+}
+
+/* Montgomery arithmetic on nn limbs */
+typedef struct {
+	mp_size_t nn;
+	const mp_limb_t *n;
+	mp_limb_t ninv;		// -1/n mod 2^GMP_NUMB_BITS
+	mp_limb_t *t;		// 2nn limbs of scratch
+} mont_t;
+
+/* r = a * b * R^-1 (mod n), for a, b < n */
+static void mont_mul (mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, mont_t *m){
+	mp_size_t nn = m->nn;
+	mp_limb_t *t = m->t;
+	if (a == b){
+		mpn_sqr (t, a, nn);
+	} else {
+		mpn_mul_n (t, a, b, nn);
+	}
+	mp_limb_t hi = 0;
+	for (mp_size_t i=0; i < nn; i++){	// add multiples of n that clear the bottom limbs one by one
+		mp_limb_t u = t[i] * m->ninv;
+		mp_limb_t cy = mpn_addmul_1 (t + i, m->n, nn, u);
+		hi += mpn_add_1 (t + i + nn, t + i + nn, nn - i, cy);
+	}
+	if (hi != 0 || mpn_cmp (t + nn, m->n, nn) >= 0){	// the result is below 2n
+		mpn_sub_n (r, t + nn, m->n, nn);
+	} else {
+		mpn_copyi (r, t + nn, nn);
+	}
+}
+
+/* y = y^2 R^-1 + c (mod n) */
+static void mont_f (mp_limb_t *y, const mp_limb_t *c, mont_t *m){
+	mont_mul (y, y, y, m);
+	if (mpn_add_n (y, y, c, m->nn) != 0 || mpn_cmp (y, m->n, m->nn) >= 0){
+		mpn_sub_n (y, y, m->n, m->nn);
+	}
+}
+
+static void mont_absdiff (mp_limb_t *d, const mp_limb_t *a, const mp_limb_t *b, mp_size_t nn){
+	if (mpn_cmp (a, b, nn) >= 0){
+		mpn_sub_n (d, a, b, nn);
+	} else {
+		mpn_sub_n (d, b, a, nn);
+	}
+}
+
+/* g = gcd (a, n) */
+static void mont_gcd (mpz_t g, const mp_limb_t *a, mpz_t tmp, mpz_srcptr n, mp_size_t nn){
+	mpn_copyi (mpz_limbs_write (tmp, nn), a, nn);
+	mpz_limbs_finish (tmp, nn);
+	mpz_gcd (g, tmp, n);
+}
+
+static uint64_t rho_walk_mpn (rho_job_t *job, uint64_t c, uint64_t steps){
+	mont_t m;
+	m.nn = mpz_size (job->n);
+	m.n = mpz_limbs_read (job->n);
+	m.ninv = neg_inv64 (m.n[0]);
+	m.t = (mp_limb_t *) malloc (2 * m.nn * sizeof (mp_limb_t));
+	mp_size_t nn = m.nn;
+	mp_limb_t *v = (mp_limb_t *) calloc (6 * nn, sizeof (mp_limb_t));
+	mp_limb_t *x = v, *y = v + nn, *ys = v + 2*nn, *q = v + 3*nn, *d = v + 4*nn, *cc = v + 5*nn;
+	y[0] = 2;
+	q[0] = 1;
+	cc[0] = c;
+	mpz_t g, tmp;
+	mpz_init_set_ui (g, 1);
+	mpz_init (tmp);
+
+	uint64_t r = 1, done = 0;
+	do {
+		mpn_copyi (x, y, nn);
+		for (uint64_t i=0; i < r; i++){
+			mont_f (y, cc, &m);
+		}
+		done += r;
+		uint64_t k = 0;
+		do {
+			mpn_copyi (ys, y, nn);
+			uint64_t lim = r - k < GCD_BLOCK_SIZE ? r - k : GCD_BLOCK_SIZE;
+			for (uint64_t i=0; i < lim; i++){
+				mont_f (y, cc, &m);
+				mont_absdiff (d, x, y, nn);
+				mont_mul (q, q, d, &m);
 			}
+			mont_gcd (g, q, tmp, job->n, nn);
+			k += lim;
+			done += lim;
+		} while (k < r && mpz_cmp_ui (g, 1) == 0 && !job->stop);
+		r *= 2;
+	} while (mpz_cmp_ui (g, 1) == 0 && done < steps && !job->stop);
+
+	if (mpz_cmp (g, job->n) == 0){	// overshot; redo the last block a step at a time.
+		do {
+			mont_f (ys, cc, &m);
+			mont_absdiff (d, x, ys, nn);
+			mont_gcd (g, d, tmp, job->n, nn);
+		} while (mpz_cmp_ui (g, 1) == 0);
+	}
+	if (mpz_cmp_ui (g, 1) != 0 && mpz_cmp (g, job->n) != 0){
+		rho_found (job, g);
+	}
+	mpz_clears (g, tmp, NULL);
+	free (v);
+	free (m.t);
+	return done;
+}
+
+/* Each thread runs a walk, and if that one fails (x and y met mod n itself, before either factor showed
+ * up), another with the next constant, until one of them (here or in another thread) finds a factor or
+ * they have taken the steps they were given. Walks rarely fail, so this is usually the one walk. */
+static void *rho_thread (void *args){
+	rho_job_t *job = (rho_job_t *) args;
+	int small = GMP_NUMB_BITS == 64 && mpz_sizeinbase (job->n, 2) < 63;
+	uint64_t done = 0;
+	while (done < job->steps && !job->stop){
+		pthread_mutex_lock (&job->lock);
+		uint64_t c = job->next_c ++;
+		pthread_mutex_unlock (&job->lock);
+		if (small){
+			done += rho_walk_64 (job, c, job->steps - done);
+		} else {
+			done += rho_walk_mpn (job, c, job->steps - done);
+		}
+	}
+	return NULL;
+}
+
+/* Look for a factor of the odd composite n with nthreads walks at once. Returns 0 if none was found. */
+int rho_find (mpz_t factor, mpz_t n, unsigned int steps, int nthreads){
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > RHO_MAX_THREADS) nthreads = RHO_MAX_THREADS;
+	rho_job_t job;
+	job.n = n;
+	job.steps = steps;
+	job.stop = 0;
+	job.next_c = 1;
+	pthread_mutex_init (&job.lock, NULL);
+	mpz_init (job.factor);
+	pthread_t threads[nthreads];
+	for (int i=1; i < nthreads; i++){
+		pthread_create (&threads[i], NULL, rho_thread, &job);
+	}
+	rho_thread (&job);
+	for (int i=1; i < nthreads; i++){
+		pthread_join (threads[i], NULL);
+	}
+	int found = job.stop;
+	if (found) mpz_set (factor, job.factor);
+	mpz_clear (job.factor);
+	pthread_mutex_destroy (&job.lock);
+	return found;
+}
+
+void rho (mpz_t n, unsigned int steps, int printrem, int nthreads){	// printrem controls whether a composite cofactor is printed.
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > RHO_MAX_THREADS) nthreads = RHO_MAX_THREADS;
+	mpz_t g;
+	mpz_init (g);
+	int found = 0;
+	while (mpz_cmp_ui (n, 1) > 0 && mpz_odd_p (n) && !bpsw_prime_p (n)){
+		if (!rho_find (g, n, steps, nthreads)) break;
+		found = 1;
+		// found a factor
+		mpz_out_str (stdout, 10, g);
+		if (bpsw_prime_p (g)){	// a prime one!
+			printf("\n");
+		} else {
+			printf (" (composite)\n");
+		}
+		mpz_divexact (n, n, g);
+	}
+	if (mpz_cmp_ui (n, 1) > 0){
+		if (found && bpsw_prime_p (n)){	// what's left after the factors we found
+			mpz_out_str (stdout, 10, n);
+			printf ("\n");
+		} else if (printrem){
+			mpz_out_str (stdout, 10, n);
+			printf (" (composite)\n");
 		}
-		ct += GCD_BLOCK_SIZE;
 	}
+	mpz_clear (g);
 }
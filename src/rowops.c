@@ -0,0 +1,269 @@
+#include "rowops.h"
+
+/* Dense row kernels. The dense solvers spend nearly all of their time xoring one row into another and
+ * looking for the highest set bit of a row, so these are written with SSE2, AVX2 and AVX-512 intrinsics, and
+ * rowops_init picks the widest set the CPU supports (asking CPUID through gcc's __builtin_cpu_supports).
+ * Every kernel is compiled for its own instruction set with a target attribute, so no special build flags
+ * are needed, and the binary still runs on machines without AVX. The vector loops use unaligned loads and
+ * stores, and finish off whatever doesn't fill a vector one word at a time; rows padded to ROWOPS_PAD words
+ * never have such a tail. Popcount uses the popcnt instruction when there is one (AVX-512 machines without
+ * VPOPCNTQ are still common, and popcnt on each word is about as fast as the memory anyway).
+*/
+
+/* Plain C, for anything that isn't x86, and until rowops_init has been called. */
+
+static void xor_row_scalar (uint64_t *res, const uint64_t *op, int len){
+	for (int i=0; i < len; i++){
+		res[i] ^= op[i];
+	}
+}
+
+static void xor_rows_scalar (uint64_t *res, const uint64_t **ops, int nops, int len){
+	for (int i=0; i < len; i++){
+		uint64_t x = res[i];
+		for (int k=0; k < nops; k++){
+			x ^= ops[k][i];
+		}
+		res[i] = x;
+	}
+}
+
+static int is_zero_scalar (const uint64_t *m, int len){
+	for (int i=0; i < len; i++){
+		if (m[i] != 0) return 0;
+	}
+	return 1;
+}
+
+static int highest_bit_scalar (const uint64_t *m, int len){
+	for (int i = len - 1; i >= 0; i--){
+		if (m[i] != 0) return 64 * i + 63 - __builtin_clzll (m[i]);
+	}
+	return -1;
+}
+
+static int popcount_scalar (const uint64_t *m, int len){
+	int c = 0;
+	for (int i=0; i < len; i++){
+		c += __builtin_popcountll (m[i]);
+	}
+	return c;
+}
+
+rowops_t rowops = {"scalar", xor_row_scalar, xor_rows_scalar, is_zero_scalar, highest_bit_scalar, popcount_scalar};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("popcnt")))
+static int popcount_popcnt (const uint64_t *m, int len){
+	int c = 0;
+	for (int i=0; i < len; i++){
+		c += __builtin_popcountll (m[i]);
+	}
+	return c;
+}
+
+/* SSE2 */
+
+__attribute__((target("sse2")))
+static void xor_row_sse2 (uint64_t *res, const uint64_t *op, int len){
+	int i = 0;
+	for (; i + 2 <= len; i += 2){
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (res + i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (op + i));
+		_mm_storeu_si128 ((__m128i *) (res + i), _mm_xor_si128 (a, b));
+	}
+	for (; i < len; i++){
+		res[i] ^= op[i];
+	}
+}
+
+__attribute__((target("sse2")))
+static void xor_rows_sse2 (uint64_t *res, const uint64_t **ops, int nops, int len){
+	int i = 0;
+	for (; i + 2 <= len; i += 2){
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (res + i));
+		for (int k=0; k < nops; k++){
+			a = _mm_xor_si128 (a, _mm_loadu_si128 ((const __m128i *) (ops[k] + i)));
+		}
+		_mm_storeu_si128 ((__m128i *) (res + i), a);
+	}
+	for (; i < len; i++){
+		for (int k=0; k < nops; k++){
+			res[i] ^= ops[k][i];
+		}
+	}
+}
+
+__attribute__((target("sse2")))
+static inline int zero_sse2 (const uint64_t *m){
+	__m128i a = _mm_loadu_si128 ((const __m128i *) m);
+	return _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, _mm_setzero_si128 ())) == 0xffff;
+}
+
+__attribute__((target("sse2")))
+static int is_zero_sse2 (const uint64_t *m, int len){
+	int i = 0;
+	for (; i + 2 <= len; i += 2){
+		if (!zero_sse2 (m + i)) return 0;
+	}
+	return i == len || m[i] == 0;
+}
+
+__attribute__((target("sse2")))
+static int highest_bit_sse2 (const uint64_t *m, int len){
+	int i = len;
+	while (i % 2 != 0){	// the odd word at the top first, then whole vectors going down
+		i--;
+		if (m[i] != 0) return 64 * i + 63 - __builtin_clzll (m[i]);
+	}
+	while (i > 0 && zero_sse2 (m + i - 2)) i -= 2;
+	return highest_bit_scalar (m, i);
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void xor_row_avx2 (uint64_t *res, const uint64_t *op, int len){
+	int i = 0;
+	for (; i + 4 <= len; i += 4){
+		__m256i a = _mm256_loadu_si256 ((const __m256i *) (res + i));
+		__m256i b = _mm256_loadu_si256 ((const __m256i *) (op + i));
+		_mm256_storeu_si256 ((__m256i *) (res + i), _mm256_xor_si256 (a, b));
+	}
+	for (; i < len; i++){
+		res[i] ^= op[i];
+	}
+}
+
+__attribute__((target("avx2")))
+static void xor_rows_avx2 (uint64_t *res, const uint64_t **ops, int nops, int len){
+	int i = 0;
+	for (; i + 4 <= len; i += 4){
+		__m256i a = _mm256_loadu_si256 ((const __m256i *) (res + i));
+		for (int k=0; k < nops; k++){
+			a = _mm256_xor_si256 (a, _mm256_loadu_si256 ((const __m256i *) (ops[k] + i)));
+		}
+		_mm256_storeu_si256 ((__m256i *) (res + i), a);
+	}
+	for (; i < len; i++){
+		for (int k=0; k < nops; k++){
+			res[i] ^= ops[k][i];
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static inline int zero_avx2 (const uint64_t *m){
+	__m256i a = _mm256_loadu_si256 ((const __m256i *) m);
+	return _mm256_testz_si256 (a, a);
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2 (const uint64_t *m, int len){
+	int i = 0;
+	for (; i + 4 <= len; i += 4){
+		if (!zero_avx2 (m + i)) return 0;
+	}
+	for (; i < len; i++){
+		if (m[i] != 0) return 0;
+	}
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static int highest_bit_avx2 (const uint64_t *m, int len){
+	int i = len;
+	while (i % 4 != 0){
+		i--;
+		if (m[i] != 0) return 64 * i + 63 - __builtin_clzll (m[i]);
+	}
+	while (i > 0 && zero_avx2 (m + i - 4)) i -= 4;
+	return highest_bit_scalar (m, i);
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f")))
+static void xor_row_avx512 (uint64_t *res, const uint64_t *op, int len){
+	int i = 0;
+	for (; i + 8 <= len; i += 8){
+		__m512i a = _mm512_loadu_si512 ((const void *) (res + i));
+		__m512i b = _mm512_loadu_si512 ((const void *) (op + i));
+		_mm512_storeu_si512 ((void *) (res + i), _mm512_xor_si512 (a, b));
+	}
+	for (; i < len; i++){
+		res[i] ^= op[i];
+	}
+}
+
+__attribute__((target("avx512f")))
+static void xor_rows_avx512 (uint64_t *res, const uint64_t **ops, int nops, int len){
+	int i = 0;
+	for (; i + 8 <= len; i += 8){
+		__m512i a = _mm512_loadu_si512 ((const void *) (res + i));
+		for (int k=0; k < nops; k++){
+			a = _mm512_xor_si512 (a, _mm512_loadu_si512 ((const void *) (ops[k] + i)));
+		}
+		_mm512_storeu_si512 ((void *) (res + i), a);
+	}
+	for (; i < len; i++){
+		for (int k=0; k < nops; k++){
+			res[i] ^= ops[k][i];
+		}
+	}
+}
+
+__attribute__((target("avx512f")))
+static inline int zero_avx512 (const uint64_t *m){
+	__m512i a = _mm512_loadu_si512 ((const void *) m);
+	return _mm512_test_epi64_mask (a, a) == 0;
+}
+
+__attribute__((target("avx512f")))
+static int is_zero_avx512 (const uint64_t *m, int len){
+	int i = 0;
+	for (; i + 8 <= len; i += 8){
+		if (!zero_avx512 (m + i)) return 0;
+	}
+	for (; i < len; i++){
+		if (m[i] != 0) return 0;
+	}
+	return 1;
+}
+
+__attribute__((target("avx512f")))
+static int highest_bit_avx512 (const uint64_t *m, int len){
+	int i = len;
+	while (i % 8 != 0){
+		i--;
+		if (m[i] != 0) return 64 * i + 63 - __builtin_clzll (m[i]);
+	}
+	while (i > 0 && zero_avx512 (m + i - 8)) i -= 8;
+	return highest_bit_scalar (m, i);
+}
+
+static void rowops_select (void){
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx512f")){
+		rowops = (rowops_t) {"AVX-512", xor_row_avx512, xor_rows_avx512, is_zero_avx512, highest_bit_avx512, popcount_popcnt};
+	} else if (__builtin_cpu_supports ("avx2")){
+		rowops = (rowops_t) {"AVX2", xor_row_avx2, xor_rows_avx2, is_zero_avx2, highest_bit_avx2, popcount_popcnt};
+	} else if (__builtin_cpu_supports ("sse2")){
+		rowops = (rowops_t) {"SSE2", xor_row_sse2, xor_rows_sse2, is_zero_sse2, highest_bit_sse2, popcount_scalar};
+		if (__builtin_cpu_supports ("popcnt")) rowops.popcount = popcount_popcnt;
+	}
+}
+
+void rowops_init (void){	// every factorization calls this, and several can be starting at once (see libnsieve.c)
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once (&once, rowops_select);
+}
+
+#else
+
+void rowops_init (void){
+}
+
+#endif
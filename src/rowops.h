@@ -0,0 +1,23 @@
+#ifndef ROWOPS_H
+#define ROWOPS_H
+
+#include "common.h"
+
+/* Kernels for dense GF(2) matrix rows, picked at run time for the CPU we're on. See rowops.c. */
+
+#define ROWOPS_PAD 8		// dense rows should be a multiple of this many words (one 512-bit vector)
+
+typedef struct {
+	const char *name;
+	void (*xor_row) (uint64_t *res, const uint64_t *op, int len);		// res ^= op
+	void (*xor_rows) (uint64_t *res, const uint64_t **ops, int nops, int len);	// res ^= ops[0] ^ ops[1] ^ ...
+	int  (*is_zero) (const uint64_t *m, int len);
+	int  (*highest_bit) (const uint64_t *m, int len);	// -1 for the zero row
+	int  (*popcount) (const uint64_t *m, int len);
+} rowops_t;
+
+extern rowops_t rowops;
+
+void rowops_init (void);	// select the best kernels for this CPU; until it is called, the scalar ones are used.
+
+#endif
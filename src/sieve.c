@@ -13,6 +13,13 @@ void sieve_poly (block_data_t *data, poly_group_t *pg, poly_t *p, nsieve_t *ns){
 }
 
 
+/* Has this relation already been added, by another thread, another worker, or an earlier run? ns->seen has
+ * every relation that got past here, full or partial, so this never looks at the matrix rows, which the
+ * consumer thread (see online.c) is filling in without the lock. Caller holds ns->lock. */
+static int is_duplicate (rel_t *rel, nsieve_t *ns){
+	return relset_add (&ns->seen, rel, ns);
+}
+
 /* This gets called after all of the polynomials in a block have been sieved to collect the relations 
  * together and do the multiplying through by the victim. */
 
@@ -38,10 +45,15 @@ void add_polygroup_relations (poly_group_t *pg, nsieve_t *ns){
 	 * we need to acquire the lock first to make sure we don't have multiple threads writing
 	 * all over each other. */
 	pthread_mutex_lock (&ns->lock);
+	if (ns->ngroups == ns->groupcap){	// keep the group, and with it all of its relations, until nsieve_free.
+		ns->groupcap = ns->groupcap == 0 ? 256 : 2 * ns->groupcap;
+		ns->groups = (poly_group_t **) realloc (ns->groups, ns->groupcap * sizeof (poly_group_t *));
+	}
+	ns->groups[ns->ngroups ++] = pg;
 
 	if (pg->victim != NULL){	// we found a full relation
 		for (int i=0; i < pg->nrels; i++){
-			if (ns->nfull >= ns->rels_needed) {	// we're done sieving.
+			if (ns->stop_sieving || ns->nfull + ns->npartial >= ns->rels_needed) {	// we're done sieving.
 				ns->info_npg ++;
 				ns->info_npoly += ns->bvals;
 				pthread_mutex_unlock (&ns->lock);
@@ -49,7 +61,17 @@ void add_polygroup_relations (poly_group_t *pg, nsieve_t *ns){
 			}
 			if (pg->relns[i] == pg->victim) continue;	// we don't want to add the victim to the list.
 			if (!fl_check (pg->relns[i], ns)) continue;	// don't add bad relations
-			if (pg->relns[i]->cofactor == 1){		// full relation
+			if (is_duplicate (pg->relns[i], ns)){
+				ns->ndups ++;
+				continue;
+			}
+			if (ns->online != NULL){	// the consumer thread makes the rows (see online.c)
+				if (pg->relns[i]->cofactor == 1){
+					fl_concat (pg->relns[i], pg->victim);
+					ns->nfull ++;
+				}
+				online_add (ns, pg->relns[i]);
+			} else if (pg->relns[i]->cofactor == 1){		// full relation
 				matrel_t *m = &ns->relns[ns->nfull];
 				m -> r1 = pg->relns[i];
 				m -> r2 = NULL;
@@ -62,7 +84,7 @@ void add_polygroup_relations (poly_group_t *pg, nsieve_t *ns){
 	} else {
 		// we did not find one. This is not good, but not an error either - we were just unlucky. 
 		// However, we should probably be doing either larger sieve intervals or a larger k or something. 
-		printf("There are no full relations for this polygroup! We must throw away the partials.\n");
+		ns_printf (ns, "There are no full relations for this polygroup! We must throw away the partials.\n");
 	}
 	ns->info_npg ++;
 	ns->info_npoly += ns->bvals;
@@ -121,7 +143,8 @@ void sieve_block (block_data_t *data, poly_group_t *pg, poly_t *q, nsieve_t *ns,
 	memset (data->sieve, 0, sizeof(uint8_t) * BLOCKSIZE);	// initialize the sieve
 
 	/* Notice that we don't start sieving with the first prime in the FB; instead with start
-	 * with the 25th (a somewhat arbitrary choice). This is because sieving takes time on the 
+	 * with the sieve_start'th (25 by default, a somewhat arbitrary choice; nsieve -tune will find a
+	 * better one for the machine). This is because sieving takes time on the 
 	 * order of 1/p, since only 2/p sieve locations will be divisible by p. Hence, the loop will
 	 * run on average BLOCKSIZE/p times for each block. Thus the smallest few primes will take the
 	 * majority of the time. However, they also contribute the least to the sieve values, so it
@@ -130,7 +153,7 @@ void sieve_block (block_data_t *data, poly_group_t *pg, poly_t *q, nsieve_t *ns,
 	 * Do we lose relations this way? Absolutely, but fewer than you might expect. It turns out 
 	 * that the greatly increased sieving speed more than makes up for it. 
 	*/
-	for (int i = 25; i < ns->fb_len; i++){
+	for (int i = ns->sieve_start; i < ns->fb_len; i++){
 		/* This checks to see whether we would be trying to sieve with the primes g that make up A.
 		 * If we are, skip until we're beyond that range. */
 		if (ns->fb[i] <= pg->gvals[ns->k-1] && ns->fb[i] >= pg->gvals[0]){
@@ -224,9 +247,9 @@ void extract_relations (block_data_t *data, poly_group_t *pg, poly_t *p, nsieve_
 void construct_relation (mpz_t qx, int32_t x, poly_t *p, nsieve_t *ns){
 	ns->tdiv_ct ++;
 	rel_t *rel = (rel_t *)(malloc(sizeof(rel_t)));
-	if (rel == NULL){
-		printf ("Malloc failed\n");
-		exit(1);
+	if (rel == NULL){	// the sieve threads will stop once they see this.
+		ns_error (ns, NSIEVE_ENOMEM);
+		return;
 	}
 	rel->poly = p;
 	rel->x = x;
@@ -289,7 +312,7 @@ fixedprec_tdiv:
 		i++;
 	}
 	// if we're here, we weren't able to do anything with this relation.
-//	rel_free (rel);
+	rel_free (rel);
 	return;
 
 add_rel:	// add the relation to the list in the poly_group_t we're working with.
@@ -298,7 +321,7 @@ add_rel:	// add the relation to the list in the poly_group_t we're working with.
 		p->group->nrels ++;
 		return;
 	} else {	// if we ran out of space, just let it go. 
-//		rel_free(rel);
+		rel_free(rel);
 		return;
 	}
 }
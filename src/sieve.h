@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "poly.h"
+#include "online.h"
 
 
 typedef struct {
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "small.h"
+
+/* Factoring small pieces without GMP. rho_find (rhofuncs.c) already walks on native words below 2^63, but
+ * it starts threads, allocates GMP numbers and takes its constants from a shared job, which costs more than
+ * the walk itself when the factor is only 20 or 30 bits. Here is just the walk: Brent's version of rho
+ * with Montgomery multiplication (see prime.h), on any odd n below 2^64.
+ *
+ * Lehman's method and SQUFOF are the usual choices below 64 bits, so they were tried too (Lehman below 40
+ * bits, SQUFOF with 16 multipliers below 62), but rho was faster than both at every size from 32 to 62
+ * bits once the trial division has left no factors below 2^15, by 1.5 to 2.5 times. From SMALL_RHO_BITS
+ * up, the quadratic sieve in tinyqs.c is faster than rho, and small_find sends those pieces there.
+*/
+
+#define RHO_BLOCK 128	// steps between gcds
+
+static uint64_t gcd64 (uint64_t a, uint64_t b){
+	while (b != 0){
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+#define F(y) do { y = redc ((u128) y * y, n, ninv); y = y >= n - c ? y - (n - c) : y + c; } while (0)
+
+static uint64_t rho64 (uint64_t n){
+	uint64_t ninv = inv64 (n);
+	for (uint64_t c = 1; c < 100 && c < n; c++){
+		uint64_t y = 2, x = y, ys = y, q = 1, g = 1;
+		for (uint64_t r = 1; g == 1; r *= 2){
+			x = y;
+			for (uint64_t i=0; i < r; i++){
+				F (y);
+			}
+			for (uint64_t k = 0; k < r && g == 1; k += RHO_BLOCK){
+				ys = y;
+				uint64_t lim = r - k < RHO_BLOCK ? r - k : RHO_BLOCK;
+				for (uint64_t i=0; i < lim; i++){
+					F (y);
+					q = redc ((u128) q * (x > y ? x - y : y - x), n, ninv);
+				}
+				g = gcd64 (q, n);
+			}
+		}
+		if (g == n){	// overshot; redo the last block a step at a time.
+			do {
+				F (ys);
+				g = gcd64 (x > ys ? x - ys : ys - x, n);
+			} while (g == 1);
+		}
+		if (g != n) return g;	// otherwise, try again with the next c
+	}
+	return 0;
+}
+
+uint64_t small_factor64 (uint64_t n){
+	if (n % 2 == 0) return 2;
+	return rho64 (n);
+}
+
+int small_find (mpz_t factor, mpz_t n){
+	if (mpz_sizeinbase (n, 2) > SMALL_RHO_BITS) return tinyqs_find (factor, n);
+	uint64_t n64 = 0;
+	mpz_export (&n64, NULL, -1, sizeof (uint64_t), 0, 0, n);
+	uint64_t g = small_factor64 (n64);
+	if (g == 0) return 0;
+	mpz_import (factor, 1, -1, sizeof (uint64_t), 0, 0, &g);
+	return 1;
+}
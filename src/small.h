@@ -0,0 +1,18 @@
+#ifndef SMALL_H
+#define SMALL_H
+
+#include <stdint.h>
+#include <gmp.h>
+#include "prime.h"
+
+/* Factoring small pieces in native integers: rho on 64-bit words, and a tiny quadratic sieve on 128-bit
+ * ones. See small.c and tinyqs.c. */
+
+#define SMALL_MAX_BITS 128	// small_find takes pieces up to this size: ...
+#define SMALL_RHO_BITS 62	// ... rho up to this, and the quadratic sieve above it
+
+uint64_t small_factor64 (uint64_t n);	// a factor of the composite n; 0 if none was found
+int  small_find (mpz_t factor, mpz_t n);	// a factor of the composite n of up to SMALL_MAX_BITS bits; 0 if none
+int  tinyqs_find (mpz_t factor, mpz_t n);	// the same, with the quadratic sieve, for n of 40 to 128 bits
+
+#endif
@@ -1,35 +1,76 @@
-#include <stdio.h>
-#include <gmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rho.h"
 
+#define TDIV_BOUND 1000000	// the default bound
+
+/* Prints the prime factors of each number up to the bound, and what's left. With a single number, there's
+ * one factor per line, as before; with several (on the command line, or one per line on standard input),
+ * there's one line per number: the number, a colon, and its factors. */
 int main (int argc, const char *argv[]){
-	mpz_t n;
-	mpz_init(n);
-	if (argc >= 2){
-		mpz_set_str(n, argv[1], 10);
-	} else {
-		mpz_inp_str(n, stdin, 10);
+	int bound = TDIV_BOUND;
+	int count = 0;
+	int cap = 16;
+	mpz_t *n = (mpz_t *) malloc (cap * sizeof (mpz_t));
+	for (int pos=1; pos < argc; pos++){
+		if (!strcmp (argv[pos], "-bound") && pos+1 < argc){
+			bound = atoi (argv[++pos]);
+			continue;
+		}
+		if (count == cap){
+			cap *= 2;
+			n = (mpz_t *) realloc (n, cap * sizeof (mpz_t));
+		}
+		mpz_init_set_str (n[count++], argv[pos], 10);
 	}
-	while (mpz_divisible_ui_p(n, 2)){
-		mpz_divexact_ui(n, n, 2);
-		printf("2\n");
+	if (count == 0){
+		while (1){
+			if (count == cap){
+				cap *= 2;
+				n = (mpz_t *) realloc (n, cap * sizeof (mpz_t));
+			}
+			mpz_init (n[count]);
+			if (mpz_inp_str (n[count], stdin, 10) == 0){
+				mpz_clear (n[count]);
+				break;
+			}
+			count++;
+		}
 	}
-	long int t = 3;
-	if (mpz_probab_prime_p(n, 12)){
-		mpz_out_str(stdout, 10, n);
-		printf("\n");
-		return 0;
+
+	char **orig = (char **) malloc (count * sizeof (char *));
+	for (int i=0; i < count; i++){
+		orig[i] = mpz_get_str (NULL, 10, n[i]);
 	}
-	while (mpz_cmp_ui(n, 1) != 0){
-		while (mpz_divisible_ui_p(n, t)){
-			mpz_divexact_ui(n, n, t);
-			printf("%ld\n", t);
-			if (mpz_probab_prime_p(n, 12)){
-				mpz_out_str(stdout, 10, n);
-				printf("\n");
-				return 0;
+	unsigned long **factors = (unsigned long **) malloc (count * sizeof (unsigned long *));
+	int *nfactors = (int *) malloc (count * sizeof (int));
+	tdiv_batch (n, count, bound, factors, nfactors);
+
+	for (int i=0; i < count; i++){
+		if (count == 1){
+			for (int j=0; j < nfactors[i]; j++){
+				printf ("%lu\n", factors[i][j]);
+			}
+		} else {
+			printf ("%s:", orig[i]);
+			for (int j=0; j < nfactors[i]; j++){
+				printf (" %lu", factors[i][j]);
 			}
+			if (mpz_cmp_ui (n[i], 1) > 0) printf (" ");
 		}
-		t += 2;
+		if (mpz_cmp_ui (n[i], 1) > 0){	// what's left
+			mpz_out_str (stdout, 10, n[i]);
+			printf (bpsw_prime_p (n[i]) ? "" : " (composite)");
+			if (count == 1) printf ("\n");
+		}
+		if (count > 1) printf ("\n");
+		free (factors[i]);
+		free (orig[i]);
+		mpz_clear (n[i]);
 	}
+	free (factors);
+	free (nfactors);
+	free (orig);
+	free (n);
+	return 0;
 }
-
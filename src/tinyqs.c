@@ -0,0 +1,630 @@
+#include "rowops.h"
+#include "small.h"
+
+/* A quadratic sieve for numbers of up to 128 bits. The main sieve (nsieve.c) is built for big numbers: its
+ * factor base, polynomials and relations are all GMP numbers, the sieve block is far bigger than the whole
+ * interval a small number needs, and setting up its tables alone takes milliseconds. Here everything is
+ * sized for the job instead: kN fits in an unsigned __int128, the A and B of each polynomial in 64 bits, and
+ * Q(x) = A x^2 + 2 B x + C in a signed __int128 for every x in the interval, so the trial division runs on
+ * native integers (on 64-bit words as soon as what's left fits in one).
+ *
+ * It is SIQS (see README.technical) cut down to the basics. A multiplier k is chosen by its Knuth-Schroeppel
+ * score alone, the factor base is a few dozen to a few hundred primes, and A is a product of s of them,
+ * picked at random near (sqrt (2kN) / M)^(1/s) with the last one chosen to bring A closest to that, and each
+ * A gives 2^(s-1) polynomials in Gray code order. The interval [-M, M) is one block, small enough to stay
+ * in the L1 cache, and the primes below TQS_SIEVE_MIN aren't sieved (the threshold allows for them). Each
+ * candidate is trial divided by the factor base, using the roots to skip the primes that can't divide it.
+ * A cofactor below TQS_LP_MULT times the largest prime is a large prime: two relations with the same one
+ * make a row of the matrix together, which is matched up at once through a small hashtable. The matrix is
+ * a dense bit matrix with an identity matrix beside it, eliminated with the row kernels of rowops.c, and
+ * the square roots are done with GMP, since they are only needed for a dependency or two.
+*/
+
+__extension__ typedef __int128 s128;
+
+#define TQS_SIEVE_MIN 16	// primes below this aren't sieved
+#define TQS_SMALL_BITS 4	// ... which the threshold makes up for with this many bits
+#define TQS_LP_MULT   128	// large primes go up to this times the biggest prime in the factor base
+#define TQS_EXTRA     32	// rows beyond the number of columns
+#define TQS_MAX_S     8		// primes in A
+#define TQS_MAX_A     512	// how many A values to try before giving up
+#define TQS_MAX_FACTORS 128	// factor base primes (with repeats) dividing one Q(x)
+#define TQS_NPRIMES   6542	// the primes below 2^16
+#define TQS_KS_PRIMES 64	// primes for scoring the multipliers
+
+/* bits of kN, factor base size, M */
+static const int tqs_params[][3] = {
+	{ 40,  30,  2048},
+	{ 48,  40,  2048},
+	{ 56,  50,  4096},
+	{ 64,  64,  4096},
+	{ 72,  80,  8192},
+	{ 80, 100,  8192},
+	{ 88, 130, 16384},
+	{ 96, 170, 16384},
+	{104, 220, 16384},
+	{112, 300, 16384},
+	{120, 400, 16384},
+	{128, 600, 16384},
+};
+#define TQS_NPARAMS (sizeof (tqs_params) / sizeof (tqs_params[0]))
+
+static const uint8_t tqs_mults[] = {1, 3, 5, 7, 11, 13, 15, 17, 19, 21, 23, 29, 31, 33, 35, 37, 39, 41, 43, 47,
+	51, 53, 55, 57, 59, 61, 65, 67, 69, 71, 73};
+#define TQS_NMULTS sizeof (tqs_mults)
+
+/* Made once: the primes, and for scoring the multipliers, (k/p) for each of them and the small primes, and
+ * what the small primes add to the score when they divide k or kN is a residue */
+static uint16_t tqs_primes[TQS_NPRIMES];
+static int8_t tqs_ks_jacobi[TQS_NMULTS][TQS_KS_PRIMES];
+static double tqs_ks_div[TQS_KS_PRIMES], tqs_ks_res[TQS_KS_PRIMES];
+static pthread_once_t tqs_tables_once = PTHREAD_ONCE_INIT;
+
+static void tqs_tables_init (void){
+	uint8_t *composite = (uint8_t *) calloc (65536, 1);
+	int n = 0;
+	for (uint32_t i=2; i < 65536; i++){
+		if (composite[i]) continue;
+		tqs_primes[n++] = i;
+		for (uint32_t j = i * i; j < 65536; j += i){
+			composite[j] = 1;
+		}
+	}
+	free (composite);
+	for (int i=1; i < TQS_KS_PRIMES; i++){
+		uint32_t p = tqs_primes[i];
+		tqs_ks_div[i] = log (p) / p;
+		tqs_ks_res[i] = 2 * log (p) / (p - 1);
+		for (int m=0; m < (int) TQS_NMULTS; m++){
+			tqs_ks_jacobi[m][i] = jacobi32 (tqs_mults[m], p);
+		}
+	}
+}
+
+typedef struct {
+	u128 kn;
+	uint32_t k;
+	int fb_len;		// column 0 is -1, column 1 is 2, and the rest are the odd primes p[i]
+	uint32_t *p;
+	uint32_t *t;		// sqrt (kN) mod p; 0 for the primes dividing k
+	uint8_t *logp;
+	int M;
+	uint64_t lp_bound;
+	int cutoff;		// the sieve threshold, in bits
+
+	/* The current polynomial */
+	uint64_t a;
+	int s;
+	int qi[TQS_MAX_S];	// the factor base indices of the primes of A
+	int64_t b;
+	int64_t bl[TQS_MAX_S];	// B = the sum of +-bl[l]
+	int sign[TQS_MAX_S];
+	s128 c;
+	uint8_t *ina;		// whether each prime divides A
+	uint32_t *r1, *r2;	// where the roots of Q mod p are in the sieve (x = j - M), for the current B
+	uint32_t *bainv;	// 2 bl[l] / A mod p, for each l and p: for moving the roots on to the next B
+	uint64_t *used;		// the A values used so far
+	int nused;
+	uint64_t rng;
+	uint8_t *sieve;
+
+	/* The relations: (A x + B)^2 = A Q(x) mod kN, which is the product of their factor base primes times lp */
+	s128 *y;
+	uint32_t *lp;		// 1 for a full relation
+	uint32_t *fstart;	// where the factor base indices of each one start in fidx (and end, at fstart[i+1])
+	uint16_t *fidx;
+	uint32_t nfidx, fidxcap;
+	int nrels, relcap;
+	int (*rows)[2];		// the relations each row is made of: one full one, or two with the same large prime
+	int nrows, maxrows;
+	uint32_t *hash_lp;	// the large primes seen once so far, and the relation each was in
+	int *hash_rel;
+	uint32_t hash_mask;
+	int npartials;
+} tqs_t;
+
+static uint32_t invmod32 (uint32_t a, uint32_t p){	// a^-1 mod the prime p, for a prime to p
+	int64_t r0 = p, r1 = a % p, s0 = 0, s1 = 1;
+	while (r1 != 0){
+		int64_t q = r0 / r1, t = r0 - q * r1;
+		r0 = r1; r1 = t;
+		t = s0 - q * s1;
+		s0 = s1; s1 = t;
+	}
+	return s0 < 0 ? s0 + p : s0;
+}
+
+static uint32_t mod128 (u128 n, uint32_t p){
+	if ((uint64_t) (n >> 64) == 0) return (uint64_t) n % p;
+	return n % p;
+}
+
+static u128 mpz_get_u128 (mpz_srcptr n){
+	uint64_t w[2] = {0, 0};
+	mpz_export (w, NULL, -1, sizeof (uint64_t), 0, 0, n);
+	return ((u128) w[1] << 64) | w[0];
+}
+
+static void mpz_set_s128 (mpz_t r, s128 x){
+	u128 u = x < 0 ? -(u128) x : (u128) x;
+	uint64_t w[2] = {(uint64_t) u, (uint64_t) (u >> 64)};
+	mpz_import (r, 2, -1, sizeof (uint64_t), 0, 0, w);
+	if (x < 0) mpz_neg (r, r);
+}
+
+/* The Knuth-Schroeppel score of each multiplier: how much, on average, the small primes contribute to Q(x)
+ * with it, less half of its own size (see select_multiplier in nsieve.c, which also trial sieves). kN has
+ * to fit in 128 bits. */
+static uint32_t tqs_multiplier (u128 n){
+	int jn[TQS_KS_PRIMES];	// (N/p)
+	for (int i=1; i < TQS_KS_PRIMES; i++){
+		jn[i] = jacobi32 (mod128 (n, tqs_primes[i]), tqs_primes[i]);
+	}
+	double best = -1e9;
+	uint32_t bestk = 1;
+	for (int m=0; m < (int) TQS_NMULTS; m++){
+		uint32_t k = tqs_mults[m];
+		if (n > ~(u128) 0 / k) break;
+		double score = -0.5 * log (k);
+		uint32_t r8 = (uint64_t) n * k & 7;
+		score += (r8 == 1 ? 2 : r8 == 5 ? 1 : 0.5) * log (2);
+		for (int i=1; i < TQS_KS_PRIMES; i++){
+			if (tqs_ks_jacobi[m][i] == 0){
+				score += tqs_ks_div[i];
+			} else if (tqs_ks_jacobi[m][i] * jn[i] == 1){
+				score += tqs_ks_res[i];
+			}
+		}
+		if (score > best){
+			best = score;
+			bestk = k;
+		}
+	}
+	return bestk;
+}
+
+/* Fills in the factor base; returns a prime that divides N if it comes across one, and 0 otherwise. */
+static uint32_t tqs_factor_base (tqs_t *q, mpz_srcptr n){
+	q->p[0] = 1;	// -1
+	q->p[1] = 2;
+	q->t[0] = q->t[1] = 0;
+	q->logp[0] = 0;
+	q->logp[1] = 1;
+	int i = 2;
+	for (int j=1; j < TQS_NPRIMES && i < q->fb_len; j++){
+		uint32_t p = tqs_primes[j];
+		uint32_t r = mod128 (q->kn, p);
+		if (q->k % p == 0){
+			q->t[i] = 0;
+		} else if (r == 0){
+			return p;
+		} else if (jacobi32 (r, p) == 1){
+			q->t[i] = sqrt_mod (r, p);
+		} else {
+			continue;
+		}
+		q->p[i] = p;
+		q->logp[i] = (uint8_t) (log2 (p) + 0.5);
+		i++;
+	}
+	q->fb_len = i;
+	return 0;
+}
+
+static uint64_t tqs_random (tqs_t *q){	// xorshift64
+	q->rng ^= q->rng << 13;
+	q->rng ^= q->rng >> 7;
+	q->rng ^= q->rng << 17;
+	return q->rng;
+}
+
+/* Pick a new A, with s-1 random primes from around the ideal size, and the last one the prime that brings
+ * A closest to sqrt (2kN) / M. Returns 0 once too many tries have only found A values already used. */
+static int tqs_new_a (tqs_t *q){
+	double target = sqrt (2 * (double) q->kn) / q->M;
+	int s = 2;
+	while (s < TQS_MAX_S && pow (target, 1.0 / s) > q->p[q->fb_len - 1] / 2) s++;
+	double ideal = pow (target, 1.0 / s);
+	int lo = 2, hi = q->fb_len;
+	while (lo < q->fb_len - 1 && q->p[lo] < ideal / 2) lo++;
+	while (hi > lo + 2 * s && q->p[hi-1] > ideal * 2) hi--;
+	int usable = 0;
+	for (int i = lo; i < hi; i++){
+		usable += q->t[i] != 0;
+	}
+	if (usable < s) return 0;
+
+	for (int tries = 0; tries < 64; tries++){
+		memset (q->ina, 0, q->fb_len);
+		double a = 1;
+		int l = 0;
+		while (l < s - 1){
+			int i = lo + tqs_random (q) % (hi - lo);
+			if (q->ina[i] || q->t[i] == 0) continue;
+			q->ina[i] = 1;
+			q->qi[l++] = i;
+			a *= q->p[i];
+		}
+		double rest = target / a;
+		int besti = -1;
+		double bestoff = 0;
+		for (int i=2; i < q->fb_len; i++){
+			if (q->ina[i] || q->t[i] == 0) continue;
+			double off = q->p[i] > rest ? q->p[i] / rest : rest / q->p[i];	// how far off, as a ratio
+			if (besti < 0 || off < bestoff){
+				besti = i;
+				bestoff = off;
+			}
+		}
+		if (besti < 0) continue;
+		q->ina[besti] = 1;
+		q->qi[l++] = besti;
+		uint64_t A = 1;
+		for (l=0; l < s; l++){
+			A *= q->p[q->qi[l]];
+		}
+		int dup = 0;
+		for (int i=0; i < q->nused && !dup; i++){
+			dup = q->used[i] == A;
+		}
+		if (dup) continue;
+		q->used[q->nused++] = A;
+		q->a = A;
+		q->s = s;
+		return 1;
+	}
+	return 0;
+}
+
+/* C = (B^2 - kN) / A, which is exact */
+static void tqs_set_c (tqs_t *q){
+	uint64_t babs = q->b < 0 ? -(uint64_t) q->b : (uint64_t) q->b;
+	u128 d = q->kn - (u128) babs * babs;
+	q->c = -(s128) (d / q->a);
+}
+
+/* The B values for A, and the roots for the first B */
+static void tqs_first_poly (tqs_t *q){
+	q->b = 0;
+	for (int l=0; l < q->s; l++){
+		uint32_t p = q->p[q->qi[l]];
+		uint64_t aq = q->a / p;
+		uint64_t g = (uint64_t) q->t[q->qi[l]] * invmod32 (aq % p, p) % p;
+		if (g > p / 2) g = p - g;
+		q->bl[l] = aq * g;
+		q->sign[l] = 1;
+		q->b += q->bl[l];
+	}
+	tqs_set_c (q);
+
+	for (int i=2; i < q->fb_len; i++){
+		uint32_t p = q->p[i];
+		if (q->t[i] == 0 || q->ina[i]) continue;
+		uint64_t ainv = invmod32 (q->a % p, p);
+		for (int l=0; l < q->s; l++){
+			q->bainv[l * q->fb_len + i] = 2 * (q->bl[l] % p) * ainv % p;
+		}
+		uint64_t bm = q->b % p;
+		uint64_t mm = q->M % p;
+		q->r1[i] = ((q->t[i] + p - bm) * ainv + mm) % p;
+		q->r2[i] = ((2 * (uint64_t) p - q->t[i] - bm) * ainv + mm) % p;
+	}
+}
+
+/* Move on to the i'th B (Gray code order), for i from 1 to 2^(s-1) - 1 */
+static void tqs_next_poly (tqs_t *q, int i){
+	int v = __builtin_ctz (i);
+	q->sign[v] = -q->sign[v];
+	q->b += 2 * q->sign[v] * q->bl[v];
+	tqs_set_c (q);
+	const uint32_t *delta = q->bainv + v * q->fb_len;
+	for (int j=2; j < q->fb_len; j++){
+		uint32_t p = q->p[j];
+		if (q->t[j] == 0 || q->ina[j]) continue;
+		if (q->sign[v] < 0){	// B went down, so the roots go up
+			q->r1[j] += delta[j];
+			if (q->r1[j] >= p) q->r1[j] -= p;
+			q->r2[j] += delta[j];
+			if (q->r2[j] >= p) q->r2[j] -= p;
+		} else {
+			q->r1[j] = q->r1[j] >= delta[j] ? q->r1[j] - delta[j] : q->r1[j] + p - delta[j];
+			q->r2[j] = q->r2[j] >= delta[j] ? q->r2[j] - delta[j] : q->r2[j] + p - delta[j];
+		}
+	}
+}
+
+static void tqs_sieve (tqs_t *q){
+	uint32_t len = 2 * q->M;
+	memset (q->sieve, 0x80 - q->cutoff, len);
+	for (int i=2; i < q->fb_len; i++){
+		uint32_t p = q->p[i];
+		if (p < TQS_SIEVE_MIN || q->t[i] == 0 || q->ina[i]) continue;
+		uint8_t lg = q->logp[i];
+		uint8_t *s = q->sieve;
+		for (uint32_t j = q->r1[i]; j < len; j += p){
+			s[j] += lg;
+		}
+		for (uint32_t j = q->r2[i]; j < len; j += p){
+			s[j] += lg;
+		}
+	}
+}
+
+/* Divide p out of v as often as it goes, noting column i each time */
+static int tqs_divide (u128 *v, uint32_t p, int i, uint16_t *f, int nf){
+	if ((uint64_t) (*v >> 64) == 0){
+		uint64_t w = *v;
+		while (w % p == 0 && nf < TQS_MAX_FACTORS){
+			w /= p;
+			f[nf++] = i;
+		}
+		*v = w;
+	} else {
+		while (*v % p == 0 && nf < TQS_MAX_FACTORS){
+			*v /= p;
+			f[nf++] = i;
+		}
+	}
+	return nf;
+}
+
+static void tqs_add_row (tqs_t *q, int r1, int r2){
+	if (q->nrows == q->maxrows) return;
+	q->rows[q->nrows][0] = r1;
+	q->rows[q->nrows][1] = r2;
+	q->nrows++;
+}
+
+/* Trial divide Q(x) for the sieve location j, and keep it if it's a relation */
+static void tqs_check (tqs_t *q, uint32_t j){
+	int64_t x = (int64_t) j - q->M;
+	s128 qx = (s128) q->a * x * x + (s128) 2 * q->b * x + q->c;
+	if (qx == 0) return;
+	uint16_t f[TQS_MAX_FACTORS];
+	int nf = 0;
+	if (qx < 0){
+		f[nf++] = 0;
+		qx = -qx;
+	}
+	u128 v = qx;
+	while (((uint64_t) v & 1) == 0 && nf < TQS_MAX_FACTORS){
+		v >>= 1;
+		f[nf++] = 1;
+	}
+	for (int i=2; i < q->fb_len; i++){
+		uint32_t p = q->p[i];
+		if (q->t[i] != 0 && !q->ina[i]){
+			uint32_t jm = j % p;
+			if (jm != q->r1[i] && jm != q->r2[i]) continue;
+		}
+		nf = tqs_divide (&v, p, i, f, nf);
+	}
+	for (int l=0; l < q->s && nf < TQS_MAX_FACTORS; l++){	// for A Q(x)
+		f[nf++] = q->qi[l];
+	}
+	if (nf == TQS_MAX_FACTORS || v >= q->lp_bound) return;
+
+	/* Keep it */
+	if (q->nrels == q->relcap){
+		q->relcap *= 2;
+		q->y = (s128 *) realloc (q->y, q->relcap * sizeof (s128));
+		q->lp = (uint32_t *) realloc (q->lp, q->relcap * sizeof (uint32_t));
+		q->fstart = (uint32_t *) realloc (q->fstart, (q->relcap + 1) * sizeof (uint32_t));
+	}
+	if (q->nfidx + nf > q->fidxcap){
+		q->fidxcap = 2 * (q->nfidx + nf);
+		q->fidx = (uint16_t *) realloc (q->fidx, q->fidxcap * sizeof (uint16_t));
+	}
+	int r = q->nrels;
+	q->y[r] = (s128) q->a * x + q->b;
+	q->lp[r] = (uint32_t) v;
+	memcpy (q->fidx + q->nfidx, f, nf * sizeof (uint16_t));
+	q->nfidx += nf;
+	q->fstart[r+1] = q->nfidx;
+
+	if (v == 1){
+		q->nrels++;
+		tqs_add_row (q, r, -1);
+		return;
+	}
+	uint32_t h = ((uint32_t) v * 2654435761u) & q->hash_mask;
+	while (q->hash_lp[h] != 0 && q->hash_lp[h] != v){
+		h = (h + 1) & q->hash_mask;
+	}
+	if (q->hash_lp[h] == v){
+		q->nrels++;
+		tqs_add_row (q, r, q->hash_rel[h]);
+	} else if (q->npartials < (int) (q->hash_mask / 2)){	// keep the table at most half full
+		q->hash_lp[h] = v;
+		q->hash_rel[h] = r;
+		q->npartials++;
+		q->nrels++;
+	} else {
+		q->nfidx = q->fstart[r];
+	}
+}
+
+/* Try the dependency in row 'dep' (of the eliminated matrix): the product of y over its relations is X, and the
+ * square root of the product of A Q(x) is Y, both mod N. Returns 1 if gcd (X - Y, N) splits N. */
+static int tqs_sqrt (tqs_t *q, uint64_t **rows, int nrows, int dep, mpz_t factor, mpz_srcptr n){
+	int *e = (int *) calloc (q->fb_len, sizeof (int));
+	mpz_t x, y, t;
+	mpz_init_set_ui (x, 1);
+	mpz_init_set_ui (y, 1);
+	mpz_init (t);
+	for (int r=0; r < nrows; r++){
+		if ((rows[dep][(q->fb_len + r) / 64] >> ((q->fb_len + r) % 64) & 1) == 0) continue;
+		for (int h=0; h < 2; h++){
+			int rel = q->rows[r][h];
+			if (rel < 0) continue;
+			mpz_set_s128 (t, q->y[rel]);
+			mpz_mul (x, x, t);
+			mpz_mod (x, x, n);
+			for (uint32_t i = q->fstart[rel]; i < q->fstart[rel+1]; i++){
+				e[q->fidx[i]]++;
+			}
+		}
+		if (q->rows[r][1] >= 0){	// the large prime, squared
+			mpz_mul_ui (y, y, q->lp[q->rows[r][0]]);
+			mpz_mod (y, y, n);
+		}
+	}
+	int ok = 1;
+	for (int i=1; i < q->fb_len && ok; i++){
+		if (e[i] % 2 != 0) ok = 0;	// a bug, if it ever happens
+		if (e[i] == 0) continue;
+		for (int j=0; j < e[i] / 2; j++){
+			mpz_mul_ui (y, y, q->p[i]);
+		}
+		mpz_mod (y, y, n);
+	}
+	mpz_sub (t, x, y);
+	mpz_gcd (t, t, n);
+	ok = ok && mpz_cmp_ui (t, 1) > 0 && mpz_cmp (t, n) < 0;
+	if (ok) mpz_set (factor, t);
+	mpz_clears (x, y, t, NULL);
+	free (e);
+	return ok;
+}
+
+/* Gaussian elimination on the rows, each with the identity matrix beside it, and then the square root of each
+ * dependency until one of them splits N */
+static int tqs_solve (tqs_t *q, mpz_t factor, mpz_srcptr n){
+	int ncols = q->fb_len, nrows = q->nrows;
+	int width = (ncols + nrows + 63) / 64;
+	uint64_t *mat = (uint64_t *) calloc ((size_t) nrows * width, sizeof (uint64_t));
+	uint64_t **rows = (uint64_t **) malloc (nrows * sizeof (uint64_t *));
+	for (int r=0; r < nrows; r++){
+		rows[r] = mat + (size_t) r * width;
+		for (int h=0; h < 2; h++){
+			int rel = q->rows[r][h];
+			if (rel < 0) continue;
+			for (uint32_t i = q->fstart[rel]; i < q->fstart[rel+1]; i++){
+				rows[r][q->fidx[i] / 64] ^= 1ULL << (q->fidx[i] % 64);
+			}
+		}
+		rows[r][(ncols + r) / 64] |= 1ULL << ((ncols + r) % 64);
+	}
+
+	int rank = 0;
+	for (int c=0; c < ncols && rank < nrows; c++){
+		int piv = rank;
+		while (piv < nrows && (rows[piv][c / 64] >> (c % 64) & 1) == 0) piv++;
+		if (piv == nrows) continue;
+		uint64_t *t = rows[piv];
+		rows[piv] = rows[rank];
+		rows[rank] = t;
+		for (int r = rank + 1; r < nrows; r++){
+			if (rows[r][c / 64] >> (c % 64) & 1) rowops.xor_row (rows[r] + c / 64, t + c / 64, width - c / 64);
+		}
+		rank++;
+	}
+
+	/* The rows from rank on are zero in the matrix part now; the identity part says what they're made of. */
+	int found = 0;
+	for (int r = rank; r < nrows && !found; r++){
+		found = tqs_sqrt (q, rows, nrows, r, factor, n);
+	}
+	free (rows);
+	free (mat);
+	return found;
+}
+
+int tinyqs_find (mpz_t factor, mpz_t n){
+	int bits = mpz_sizeinbase (n, 2);
+	if (bits > SMALL_MAX_BITS || mpz_perfect_square_p (n)) return 0;
+	if (mpz_even_p (n)){
+		mpz_set_ui (factor, 2);
+		return 1;
+	}
+	pthread_once (&tqs_tables_once, tqs_tables_init);
+	rowops_init ();
+
+	tqs_t q;
+	u128 n128 = mpz_get_u128 (n);
+	q.k = tqs_multiplier (n128);
+	q.kn = n128 * q.k;
+	int knbits = 128 - (q.kn >> 64 != 0 ? __builtin_clzll (q.kn >> 64) : 64 + __builtin_clzll (q.kn));
+	int row = 0;
+	while (row + 1 < (int) TQS_NPARAMS && tqs_params[row][0] < knbits) row++;
+	q.fb_len = tqs_params[row][1];
+	q.M = tqs_params[row][2];
+
+	q.p = (uint32_t *) malloc (q.fb_len * sizeof (uint32_t));
+	q.t = (uint32_t *) malloc (q.fb_len * sizeof (uint32_t));
+	q.logp = (uint8_t *) malloc (q.fb_len);
+	uint32_t d = tqs_factor_base (&q, n);
+	if (d != 0){
+		mpz_set_ui (factor, d);
+		free (q.p);
+		free (q.t);
+		free (q.logp);
+		return 1;
+	}
+	uint32_t pmax = q.p[q.fb_len - 1];
+	q.lp_bound = (uint64_t) pmax * TQS_LP_MULT;
+	q.cutoff = (int) (log2 (q.M) + knbits / 2.0 - 0.5 - log2 (q.lp_bound) - TQS_SMALL_BITS);
+	if (q.cutoff < 1) q.cutoff = 1;
+
+	q.ina = (uint8_t *) calloc (q.fb_len, 1);
+	q.r1 = (uint32_t *) calloc (q.fb_len, sizeof (uint32_t));
+	q.r2 = (uint32_t *) calloc (q.fb_len, sizeof (uint32_t));
+	q.bainv = (uint32_t *) calloc (TQS_MAX_S * q.fb_len, sizeof (uint32_t));
+	q.used = (uint64_t *) malloc (TQS_MAX_A * sizeof (uint64_t));
+	q.nused = 0;
+	q.rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t) n128;
+	q.sieve = (uint8_t *) malloc (2 * q.M);
+	q.relcap = 4 * q.fb_len;
+	q.y = (s128 *) malloc (q.relcap * sizeof (s128));
+	q.lp = (uint32_t *) malloc (q.relcap * sizeof (uint32_t));
+	q.fstart = (uint32_t *) malloc ((q.relcap + 1) * sizeof (uint32_t));
+	q.fstart[0] = 0;
+	q.fidxcap = 16 * q.relcap;
+	q.fidx = (uint16_t *) malloc (q.fidxcap * sizeof (uint16_t));
+	q.nfidx = 0;
+	q.nrels = 0;
+	q.maxrows = q.fb_len + TQS_EXTRA;
+	q.rows = (int (*)[2]) malloc (q.maxrows * sizeof (q.rows[0]));
+	q.nrows = 0;
+	uint32_t hsize = 1;
+	while (hsize < 16 * (uint32_t) q.fb_len) hsize *= 2;
+	q.hash_mask = hsize - 1;
+	q.hash_lp = (uint32_t *) calloc (hsize, sizeof (uint32_t));
+	q.hash_rel = (int *) malloc (hsize * sizeof (int));
+	q.npartials = 0;
+
+	/* Sieve until there are enough rows */
+	while (q.nrows < q.maxrows && q.nused < TQS_MAX_A && tqs_new_a (&q)){
+		tqs_first_poly (&q);
+		for (int i=0; i < 1 << (q.s - 1) && q.nrows < q.maxrows; i++){
+			if (i > 0) tqs_next_poly (&q, i);
+			tqs_sieve (&q);
+			const uint64_t *w = (const uint64_t *) q.sieve;
+			for (int j=0; j < 2 * q.M / 8 && q.nrows < q.maxrows; j++){
+				if ((w[j] & 0x8080808080808080ULL) == 0) continue;
+				for (int b=0; b < 8; b++){
+					if (q.sieve[8*j + b] & 0x80) tqs_check (&q, 8*j + b);
+				}
+			}
+		}
+	}
+	int found = q.nrows == q.maxrows && tqs_solve (&q, factor, n);
+
+	free (q.p);
+	free (q.t);
+	free (q.logp);
+	free (q.ina);
+	free (q.r1);
+	free (q.r2);
+	free (q.bainv);
+	free (q.used);
+	free (q.sieve);
+	free (q.y);
+	free (q.lp);
+	free (q.fstart);
+	free (q.fidx);
+	free (q.rows);
+	free (q.hash_lp);
+	free (q.hash_rel);
+	return found;
+}
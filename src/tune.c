@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L	// for fork, pipe and clock_gettime under -std=c99
+#include <unistd.h>
+#include <sys/wait.h>
+#include "nsieve.h"
+
+/* Parameter tuning. The table in nsieve.c was put together by trying things on one machine, and the best
+ * factor base bound, sieve length and so on depend a lot on the caches of the machine doing the sieving.
+ * nsieve -tune BITS tries to do better: it makes a few test numbers of that size, and for a given setting
+ * of the parameters sieves each of them for a few seconds (-tunetime), and extrapolates from how fast the
+ * relations come in to how long the whole sieve would take. Starting from what select_parameters would
+ * pick, it then changes one parameter at a time for as long as that helps (fb_bound, lp_bound, M, T and
+ * the small prime cutoff, in that order, TUNE_PASSES times over), and writes the best setting it found to
+ * the parameter file, where select_parameters will find it from then on.
+ *
+ * The extrapolation uses the online matrix's estimate (see online.c) of how many more relations are still
+ * needed, so the partials are accounted for, but only as well as a few seconds' worth of them predict how
+ * they will combine later on; since the number of combined partials grows faster than linearly, a short
+ * trial tends to favour a smaller lp_bound than is really best. The matrix is not counted at all.
+ *
+ * Each trial of -tune runs in a child process, so that nothing it allocates (and nothing it sets, in the way
+ * of static state) carries over to the next one. select_multiplier's trials can't do that: it runs inside
+ * libnsieve and -batch, where other threads may hold locks (or be in malloc) when we fork, so it calls
+ * trial_sieve, which does the same in this process, on an nsieve_t of its own that it frees again.
+*/
+
+typedef struct {
+	int col;		// which parameter (PARAM_*)
+	double factor;		// the step, as a factor (if not 1) ...
+	double step;		// ... or as an amount to add
+	double min;
+	double max;
+} knob_t;
+
+static const knob_t knobs[] = {
+	{PARAM_FBBOUND, 1.3, 0,    300, 10000000},
+	{PARAM_LPBOUND, 1.4, 0,    1,   5000},
+	{PARAM_M,       1,   1,    1,   16},
+	{PARAM_T,       1,   0.05, 1.0, 2.5},
+	{PARAM_SMALLP,  1,   5,    1,   100}
+};
+#define NKNOBS (sizeof (knobs) / sizeof (knobs[0]))
+#define TUNE_MAX_MOVES 4	// how many steps in one direction a parameter may take in one pass
+
+static double now (void){
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A product of two primes of about half the size each, with exactly 'bits' bits */
+static void test_number (mpz_t n, int bits, gmp_randstate_t rs){
+	mpz_t p, q;
+	mpz_init (p);
+	mpz_init (q);
+	do {
+		mpz_urandomb (p, rs, bits / 2);
+		mpz_setbit (p, bits / 2 - 1);
+		mpz_nextprime (p, p);
+		mpz_urandomb (q, rs, bits - bits / 2);
+		mpz_setbit (q, bits - bits / 2 - 1);
+		mpz_nextprime (q, q);
+		mpz_mul (n, p, q);
+	} while (mpz_sizeinbase (n, 2) != bits);
+	mpz_clear (p);
+	mpz_clear (q);
+}
+
+static void discard (void *arg, const char *msg){
+}
+
+/* Sieve n with the parameters p (a row of the parameter table) and the multiplier (-1 to pick one by its
+ * score) for about the given time, and return the estimated time for the whole sieve in seconds; HUGE_VAL
+ * if the trial failed. Also used by select_multiplier. Its messages go nowhere. */
+double trial_sieve (mpz_t n, const double *p, int multiplier, int seconds, int nthreads){
+	nsieve_t ns;
+	memset (&ns, 0, sizeof (ns));
+	ns.fb_bound = (uint32_t) p[PARAM_FBBOUND];
+	ns.lp_bound = (uint32_t) p[PARAM_LPBOUND];
+	ns.M = (uint32_t) p[PARAM_M];
+	ns.T = p[PARAM_T];
+	ns.sieve_start = (int) p[PARAM_SMALLP];
+	ns.multiplier = multiplier;
+	ns.mult_bound = MULT_BOUND;
+	ns.mult_trials = 0;	// no trials within trials
+	ns.merge_density = -1;
+	ns.solver = SOLVER_AUTO;
+	ns.verify = 1;
+	ns.nthreads = nthreads;
+	ns.out = (ns_output_t) {discard, NULL, NULL, NULL};
+
+	double start = now ();
+	nsieve_init (&ns, n);
+	double sievestart = now ();
+	ns.deadline = time (NULL) + seconds;
+	multithreaded_sieve (&ns, nthreads);
+	double elapsed = now () - sievestart;
+
+	pthread_mutex_lock (&ns.lock);
+	uint32_t found = ns.error != 0 ? 0 : ns.nfull + ns.npartial;
+	uint32_t still_needed = ns.online != NULL ? ns.online->still_needed : 0;
+	pthread_mutex_unlock (&ns.lock);
+	if (ns.online != NULL) online_finish (&ns);	// the matrix rows go with the rest of it.
+	nsieve_free (&ns);
+	return found == 0 ? HUGE_VAL : (sievestart - start) + elapsed * (found + still_needed) / found;
+}
+
+/* trial_sieve in a child process, for -tune */
+static double trial_sieve_child (mpz_t n, const double *p, int seconds, int nthreads){
+	int fd[2];
+	if (pipe (fd) != 0) return HUGE_VAL;
+	fflush (stdout);
+	pid_t pid = fork ();
+	if (pid < 0){
+		close (fd[0]);
+		close (fd[1]);
+		return HUGE_VAL;
+	}
+	if (pid == 0){
+		close (fd[0]);
+		double est = trial_sieve (n, p, -1, seconds, nthreads);
+		_exit (write (fd[1], &est, sizeof (est)) == sizeof (est) ? 0 : 1);
+	}
+	close (fd[1]);
+	double est;
+	if (read (fd[0], &est, sizeof (est)) != sizeof (est)) est = HUGE_VAL;	// the child died
+	close (fd[0]);
+	waitpid (pid, NULL, 0);
+	return est;
+}
+
+/* The average estimated time over the test numbers */
+static double score (mpz_t *nums, int nnums, const double *p, int seconds, int nthreads){
+	double total = 0;
+	for (int i=0; i < nnums; i++){
+		total += trial_sieve_child (nums[i], p, seconds, nthreads);
+	}
+	total /= nnums;
+	printf ("\tfb_bound %7d  lp_bound %4d  M %2d  T %.2f  smallp %3d:  ", (int) p[PARAM_FBBOUND], (int) p[PARAM_LPBOUND], (int) p[PARAM_M], p[PARAM_T], (int) p[PARAM_SMALLP]);
+	if (total == HUGE_VAL){
+		printf ("failed\n");
+	} else {
+		printf ("about %.2fs\n", total);
+	}
+	fflush (stdout);
+	return total;
+}
+
+/* One step of knob k away from p, into q; returns 0 if that would leave its range */
+static int step (const double *p, double *q, const knob_t *k, int dir){
+	memcpy (q, p, NPARAMS * sizeof (double));
+	double v = p[k->col];
+	if (k->factor != 1){
+		v = dir > 0 ? v * k->factor : v / k->factor;
+	} else {
+		v += dir * k->step;
+	}
+	if (k->col != PARAM_T) v = floor (v + 0.5);	// everything else is an integer
+	if (v < k->min || v > k->max || v == p[k->col]) return 0;
+	q[k->col] = v;
+	return 1;
+}
+
+void tune (int bits, int nthreads, int seconds, const char *path){
+	if (bits < 40){
+		printf ("Can't tune for numbers of %d bits; the smallest is 40.\n", bits);
+		return;
+	}
+	printf ("Tuning the parameters for %d bit numbers with %d thread(s), %d seconds per trial.\n", bits, nthreads, seconds);
+	gmp_randstate_t rs;
+	gmp_randinit_default (rs);
+	gmp_randseed_ui (rs, bits);	// the same numbers every time, so that runs can be compared
+	mpz_t nums[TUNE_NUMBERS];
+	for (int i=0; i < TUNE_NUMBERS; i++){
+		mpz_init (nums[i]);
+		test_number (nums[i], bits, rs);
+	}
+	gmp_randclear (rs);
+
+	/* Start from what we would use now */
+	nsieve_t ns;
+	mpz_init_set (ns.N, nums[0]);
+	ns.fb_bound = -1;
+	ns.lp_bound = -1;
+	ns.M = -1;
+	ns.T = -1;
+	ns.sieve_start = -1;
+	ns.out = (ns_output_t) {NULL, NULL, NULL, NULL};
+	select_parameters (&ns);
+	mpz_clear (ns.N);
+	double best[NPARAMS] = {bits, ns.fb_bound, ns.lp_bound / ns.fb_bound, ns.M, ns.T, ns.sieve_start};
+	best[PARAM_T] = floor (best[PARAM_T] * 100 + 0.5) / 100;
+	double best_time = score (nums, TUNE_NUMBERS, best, seconds, nthreads);
+
+	for (int pass=0; pass < TUNE_PASSES; pass++){
+		for (int k=0; k < NKNOBS; k++){
+			for (int dir = 1; dir >= -1; dir -= 2){
+				int moved = 0;
+				double q[NPARAMS];
+				while (moved < TUNE_MAX_MOVES && step (best, q, &knobs[k], dir)){
+					double t = score (nums, TUNE_NUMBERS, q, seconds, nthreads);
+					if (t >= best_time) break;
+					memcpy (best, q, sizeof (best));
+					best_time = t;
+					moved ++;
+				}
+				if (moved > 0) break;	// no need to try the other way
+			}
+		}
+	}
+	for (int i=0; i < TUNE_NUMBERS; i++){
+		mpz_clear (nums[i]);
+	}
+	if (best_time == HUGE_VAL){
+		printf ("Every trial failed; not writing anything.\n");
+		return;
+	}
+	printf ("Best: fb_bound %d, lp_bound %d, M %d, T %.2f, smallp %d; the sieve should take about %.2fs.\n", (int) best[PARAM_FBBOUND], (int) best[PARAM_LPBOUND], (int) best[PARAM_M], best[PARAM_T], (int) best[PARAM_SMALLP], best_time);
+
+	/* Merge it into whatever the file has already */
+	double rows[PARAMS_MAX][NPARAMS];
+	int nrows = read_param_file (path, rows, PARAMS_MAX - 1);
+	if (nrows < 0) nrows = 0;
+	int i = 0;
+	while (i < nrows && rows[i][0] < bits){
+		i++;
+	}
+	if (i == nrows || rows[i][0] != bits){
+		memmove (rows[i+1], rows[i], (nrows - i) * sizeof (rows[0]));
+		nrows ++;
+	}
+	memcpy (rows[i], best, sizeof (best));
+	if (write_param_file (path, rows, nrows)){
+		printf ("Wrote the parameters for %d bits to %s.\n", bits, path);
+	}
+}
+
+int read_param_file (const char *path, double rows[][NPARAMS], int max){
+	FILE *f = fopen (path, "r");
+	if (f == NULL) return -1;
+	char line[256];
+	int n = 0;
+	int lineno = 0;
+	while (fgets (line, sizeof (line), f) != NULL){
+		lineno ++;
+		char *s = line;
+		while (isspace (*s)) s++;
+		if (*s == '#' || *s == '\0') continue;
+		if (n == max){
+			printf ("Only using the first %d rows of %s.\n", max, path);
+			break;
+		}
+		double *r = rows[n];
+		if (sscanf (s, "%lf %lf %lf %lf %lf %lf", &r[0], &r[1], &r[2], &r[3], &r[4], &r[5]) != NPARAMS || r[0] < 1 || r[PARAM_FBBOUND] < 100 || r[PARAM_LPBOUND] < 1 || r[PARAM_M] < 1 || r[PARAM_SMALLP] < 1){
+			printf ("Skipping line %d of %s; it should be: bits fb_bound lp_bound M T smallp\n", lineno, path);
+			continue;
+		}
+		n++;
+	}
+	fclose (f);
+	return n;
+}
+
+int write_param_file (const char *path, double rows[][NPARAMS], int nrows){
+	FILE *f = fopen (path, "w");
+	if (f == NULL){
+		printf ("Could not open %s.\n", path);
+		return 0;
+	}
+	fprintf (f, "# nsieve parameters (see nsieve -tune)\n# bits fb_bound lp_bound M T smallp\n");
+	for (int i=0; i < nrows; i++){
+		fprintf (f, "%d %d %d %d %.2f %d\n", (int) rows[i][0], (int) rows[i][PARAM_FBBOUND], (int) rows[i][PARAM_LPBOUND], (int) rows[i][PARAM_M], rows[i][PARAM_T], (int) rows[i][PARAM_SMALLP]);
+	}
+	if (fclose (f) != 0){
+		printf ("Could not write %s.\n", path);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include "common.h"
+
+/* Tuning the sieve parameters for this machine, and the parameter file the results are kept in. See tune.c.
+ *
+ * The parameter file is text: one line per size of N, as
+ * 	bits fb_bound lp_bound M T smallp
+ * with lp_bound a multiple of fb_bound (as with -lpb) and smallp the index of the first factor base prime
+ * that is sieved with. Lines starting with '#' are skipped. */
+
+/* The columns of the parameter table (see nsieve.c), and of the parameter file; column 0 is the size of N in bits */
+#define PARAM_FBBOUND 1
+#define PARAM_LPBOUND 2
+#define PARAM_M       3
+#define PARAM_T       4
+#define PARAM_SMALLP  5
+#define NPARAMS       6
+#define PARAMS_MAX    64	// the most rows the table can have, counting those read from a parameter file
+
+#define TUNE_PARAM_FILE  "nsieve.params"	// where the parameters are looked for (and written) by default
+#define TUNE_TRIAL_TIME  5	// seconds of sieving per trial
+#define TUNE_NUMBERS     2	// how many test numbers each setting is tried on
+#define TUNE_PASSES      2	// how many times to go over all of the parameters
+
+int read_param_file (const char *path, double rows[][NPARAMS], int max);	// returns the number of rows, or -1 if it can't be opened
+int write_param_file (const char *path, double rows[][NPARAMS], int nrows);	// returns 0 on failure
+void tune (int bits, int nthreads, int seconds, const char *path);
+double trial_sieve (mpz_t n, const double *params, int multiplier, int seconds, int nthreads);	// estimated sieve time in seconds; HUGE_VAL on failure
+
+#endif